@@ -5,26 +5,81 @@ uniform vec4 u_params;
 #define pixOffset           floatBitsToUint(u_params.x)
 #define workCount           floatBitsToUint(u_params.y)
 #define bvhCount            floatBitsToUint(u_params.z)
+#define geometryFlags       floatBitsToUint(u_params.w)
+#define bvhOrdered          (geometryFlags & GEOMETRY_BVH_ORDERED)
+#define geometryIndexed     ((geometryFlags & GEOMETRY_INDEXED) != 0u)
+
+// Bits of geometryFlags, same values as MeshMapping::k_gpuBVHOrdered and k_gpuGeometryIndexed
+#define GEOMETRY_BVH_ORDERED 1u
+#define GEOMETRY_INDEXED 2u
 
 #define FLT_MAX 3.402823466e+38
 #define BARY_MIN -1e-5
 #define BARY_MAX 1.0
+#define BVH_INNER_NODE 2147483648u
+#define BVH_REVERSED_SPLIT 4u
+#define BVH_STACK_SIZE 64 // Ordered traversals are only used with trees up to this deep
 
+// Same layout as Pix_GPUData in src/meshmapping.h
 struct Pix
 {
 	vec3 p;
+	float maxFront; // Distance the mapping rays search along d
 	vec3 d;
+	float maxRear; // Distance the mapping rays search along -d
 };
 
+// Same layout as BVHNode in src/bvh.h
 struct BVH
 {
 	float aabbMinX; float aabbMinY; float aabbMinZ;
+	uint offset; // Leaf: first triangle. Inner node: index to the next BVH if we skip this subtree
 	float aabbMaxX; float aabbMaxY; float aabbMaxZ;
-	uint start;
-	uint end;
-	uint jump; // Index to the next BVH if we skip this subtree
+	uint count; // Leaf: triangle count. Inner node: BVH_INNER_NODE with the split axis, or 0
 };
 
+bool bvhIsLeaf(BVH bvh) { return bvh.count > 0 && bvh.count < BVH_INNER_NODE; }
+uint bvhStart(BVH bvh) { return bvh.offset * 3; }
+uint bvhEnd(BVH bvh) { return bvhIsLeaf(bvh) ? (bvh.offset + bvh.count) * 3 : 0; }
+uint bvhJump(BVH bvh, uint i) { return bvhIsLeaf(bvh) ? i + 1 : bvh.offset; }
+
+// Children of inner node i in the order a ray along d reaches them (BVHNode::secondChildFirst)
+void bvhOrderedChildren(BVH bvh, uint i, vec3 d, out uint o_near, out uint o_far)
+{
+	uint first = i + 1;
+	uint second = bvhJump(bvhs[first], first);
+	bool secondFirst = (d[bvh.count & 3u] < 0) != ((bvh.count & BVH_REVERSED_SPLIT) != 0);
+	o_near = secondFirst ? second : first;
+	o_far = secondFirst ? first : second;
+}
+
+// Unindexed geometry keeps three entries per triangle in the positions and normals buffers.
+// Indexed geometry keeps the vertices shared by the triangles there instead, and three
+// indices to them per triangle in the indices buffer. Both are in BVH leaf order and
+// triangles (tidx) are numbered the same way.
+uint triangleVertex(uint tidx, uint corner)
+{
+	return geometryIndexed ? indices[tidx + corner] : tidx + corner;
+}
+
+// Triangle as v0, e1 = v1 - v0, e2 = v2 - v0, the edges of indexed triangles are
+// computed with the same float operations as the unindexed ones
+void fetchTriangle(uint tidx, out vec3 o_v0, out vec3 o_e1, out vec3 o_e2)
+{
+	if (geometryIndexed)
+	{
+		o_v0 = positions[indices[tidx + 0]];
+		o_e1 = positions[indices[tidx + 1]] - o_v0;
+		o_e2 = positions[indices[tidx + 2]] - o_v0;
+	}
+	else
+	{
+		o_v0 = positions[tidx + 0];
+		o_e1 = positions[tidx + 1];
+		o_e2 = positions[tidx + 2];
+	}
+}
+
 float RayAABB(vec3 o, vec3 d, vec3 mins, vec3 maxs)
 {
 	//vec3 dabs = abs(d);
@@ -37,53 +92,54 @@ float RayAABB(vec3 o, vec3 d, vec3 mins, vec3 maxs)
 	return (b >= 0 && a <= b) ? a : FLT_MAX;
 }
 
-vec3 barycentric(dvec3 p, dvec3 a, dvec3 b, dvec3 c)
-{
-	dvec3 v0 = b - a;
-	dvec3 v1 = c - a;
-	dvec3 v2 = p - a;
-	double d00 = dot(v0, v0);
-	double d01 = dot(v0, v1);
-	double d11 = dot(v1, v1);
-	double d20 = dot(v2, v0);
-	double d21 = dot(v2, v1);
-	double denom = d00 * d11 - d01 * d01;
-	double y = (d11 * d20 - d01 * d21) / denom;
-	double z = (d00 * d21 - d01 * d20) / denom;
-	return vec3(dvec3(1.0 - y - z, y, z));
+// RayAABB() clipped to [mindist, maxdist): boxes entered after maxdist or exited before mindist are missed
+bool RayAABBRange(vec3 o, vec3 d, vec3 mins, vec3 maxs, float mindist, float maxdist)
+{
+	vec3 t1 = (mins - o) / d;
+	vec3 t2 = (maxs - o) / d;
+	vec3 tmin = min(t1, t2);
+	vec3 tmax = max(t1, t2);
+	float a = max(tmin.x, max(tmin.y, tmin.z));
+	float b = min(tmax.x, min(tmax.y, tmax.z));
+	return b >= 0 && b >= mindist && a <= b && a < maxdist;
 }
 
+// Triangles are intersected as v0, e1 = v1 - v0, e2 = v2 - v0, see fetchTriangle()
+// Moller-Trumbore with float math only, det = dot(e1, cross(d, e2)) is negative when the triangle faces away
 // Returns distance (x) + barycentric coordinates (yzw)
-vec4 raycast(vec3 o, vec3 d, vec3 a, vec3 b, vec3 c)
+vec4 intersectTriangle(vec3 o, vec3 d, vec3 v0, vec3 e1, vec3 e2, float baryMin, out float o_det)
 {
-	vec3 n = normalize(cross(b - a, c - a));
-	float nd = dot(d, n);
-	if (abs(nd) > 0)
+	vec3 h = cross(d, e2);
+	o_det = dot(e1, h);
+	float f = 1.0 / o_det;
+	vec3 s = o - v0;
+	vec3 q = cross(s, e1);
+	float u = dot(s, h) * f;
+	float v = dot(d, q) * f;
+	float t = dot(e2, q) * f;
+	float w = 1.0 - u - v;
+	if (o_det != 0 && t >= 0 && w >= baryMin && u >= baryMin && u <= BARY_MAX && v >= baryMin && v <= BARY_MAX)
 	{
-		float pn = dot(o, n);
-		float t = (dot(a, n) - pn) / nd;
-		if (t >= 0)
-		{
-			vec3 p = o + d * t;
-			vec3 b = barycentric(p, a, b, c);
-			if (b.x >= BARY_MIN && b.y >= BARY_MIN && b.y <= BARY_MAX && b.z >= BARY_MIN && b.z <= BARY_MAX)
-			{
-				return vec4(t, b.x, b.y, b.z);
-			}
-		}
+		return vec4(t, w, u, v);
 	}
 	return vec4(FLT_MAX, 0, 0, 0);
 }
 
+// Returns distance (x) + barycentric coordinates (yzw)
+vec4 raycast(vec3 o, vec3 d, vec3 v0, vec3 e1, vec3 e2)
+{
+	float det;
+	return intersectTriangle(o, d, v0, e1, e2, BARY_MIN, det);
+}
+
 float raycastRange(vec3 o, vec3 d, uint start, uint end, float mindist, out uint o_idx, out vec3 o_bcoord)
 {
 	float mint = FLT_MAX;
 	for (uint tidx = start; tidx < end; tidx += 3)
 	{
-		vec3 v0 = positions[tidx + 0];
-		vec3 v1 = positions[tidx + 1];
-		vec3 v2 = positions[tidx + 2];
-		vec4 r = raycast(o, d, v0, v1, v2);
+		vec3 v0, e1, e2;
+		fetchTriangle(tidx, v0, e1, e2);
+		vec4 r = raycast(o, d, v0, e1, e2);
 		if (r.x >= mindist && r.x < mint)
 		{
 			mint = r.x;
@@ -94,8 +150,51 @@ float raycastRange(vec3 o, vec3 d, uint start, uint end, float mindist, out uint
 	return mint;
 }
 
+// raycastBVH() descending into the near child first, the far ones are kept in a stack
+float raycastBVH_ordered(vec3 o, vec3 d, float mint, in out uint o_idx, in out vec3 o_bcoord)
+{
+	uint stack[BVH_STACK_SIZE];
+	uint stackCount = 0;
+	uint i = 0;
+	while (i < bvhCount)
+	{
+		BVH bvh = bvhs[i];
+		vec3 aabbMin = vec3(bvh.aabbMinX, bvh.aabbMinY, bvh.aabbMinZ);
+		vec3 aabbMax = vec3(bvh.aabbMaxX, bvh.aabbMaxY, bvh.aabbMaxZ);
+		float distAABB = RayAABB(o, d, aabbMin, aabbMax);
+		if (distAABB < mint)
+		{
+			if (!bvhIsLeaf(bvh))
+			{
+				uint near, far;
+				bvhOrderedChildren(bvh, i, d, near, far);
+				stack[stackCount++] = far;
+				i = near;
+				continue;
+			}
+			uint ridx = 0;
+			vec3 rbcoord = vec3(0, 0, 0);
+			float t = raycastRange(o, d, bvhStart(bvh), bvhEnd(bvh), 0, ridx, rbcoord);
+			if (t < mint)
+			{
+				mint = t;
+				o_idx = ridx;
+				o_bcoord = rbcoord;
+			}
+		}
+		i = stackCount > 0 ? stack[--stackCount] : bvhCount;
+	}
+
+	return mint;
+}
+
 float raycastBVH(vec3 o, vec3 d, float mint, in out uint o_idx, in out vec3 o_bcoord)
 {
+	if (bvhOrdered != 0)
+	{
+		return raycastBVH_ordered(o, d, mint, o_idx, o_bcoord);
+	}
+
 	uint i = 0;
 	while (i < bvhCount)
 	{
@@ -108,7 +207,7 @@ float raycastBVH(vec3 o, vec3 d, float mint, in out uint o_idx, in out vec3 o_bc
 		{
 			uint ridx = 0;
 			vec3 rbcoord = vec3(0, 0, 0);
-			float t = raycastRange(o, d, bvh.start, bvh.end, 0, ridx, rbcoord);
+			float t = raycastRange(o, d, bvhStart(bvh), bvhEnd(bvh), 0, ridx, rbcoord);
 			if (t < mint)
 			{
 				mint = t;
@@ -119,7 +218,7 @@ float raycastBVH(vec3 o, vec3 d, float mint, in out uint o_idx, in out vec3 o_bc
 		}
 		else
 		{
-			i = bvh.jump;
+			i = bvhJump(bvh, i);
 		}
 	}
 
@@ -127,27 +226,10 @@ float raycastBVH(vec3 o, vec3 d, float mint, in out uint o_idx, in out vec3 o_bc
 }
 
 // Returns distance only
-float raycast_dist(vec3 o, vec3 d, vec3 a, vec3 b, vec3 c)
+float raycast_dist(vec3 o, vec3 d, vec3 v0, vec3 e1, vec3 e2)
 {
-	vec3 n = normalize(cross(b - a, c - a));
-	float nd = dot(d, n);
-	if (abs(nd) > 0)
-	{
-		float pn = dot(o, n);
-		float t = (dot(a, n) - pn) / nd;
-		if (t >= 0)
-		{
-			vec3 p = o + d * t;
-			vec3 b = barycentric(p, a, b, c);
-			if (b.x >= 0 && //b.x <= 1 &&
-				b.y >= 0 && b.y <= 1 &&
-				b.z >= 0 && b.z <= 1)
-			{
-				return t;
-			}
-		}
-	}
-	return FLT_MAX;
+	float det;
+	return intersectTriangle(o, d, v0, e1, e2, 0, det).x;
 }
 
 float raycastRange_dist(vec3 o, vec3 d, uint start, uint end, float mindist)
@@ -155,10 +237,9 @@ float raycastRange_dist(vec3 o, vec3 d, uint start, uint end, float mindist)
 	float mint = FLT_MAX;
 	for (uint tidx = start; tidx < end; tidx += 3)
 	{
-		vec3 v0 = positions[tidx + 0];
-		vec3 v1 = positions[tidx + 1];
-		vec3 v2 = positions[tidx + 2];
-		float t = raycast_dist(o, d, v0, v1, v2);
+		vec3 v0, e1, e2;
+		fetchTriangle(tidx, v0, e1, e2);
+		float t = raycast_dist(o, d, v0, e1, e2);
 		if (t >= mindist && t < mint)
 		{
 			mint = t;
@@ -180,7 +261,7 @@ float raycastBVH_dist(vec3 o, vec3 d, float mindist, float maxdist)
 		if (distAABB < mint && distAABB < maxdist)
 		//if (distAABB != FLT_MAX)
 		{
-			float t = raycastRange_dist(o, d, bvh.start, bvh.end, mindist);
+			float t = raycastRange_dist(o, d, bvhStart(bvh), bvhEnd(bvh), mindist);
 			if (t < mint)
 			{
 				mint = t;
@@ -189,9 +270,50 @@ float raycastBVH_dist(vec3 o, vec3 d, float mindist, float maxdist)
 		}
 		else
 		{
-			i = bvh.jump;
+			i = bvhJump(bvh, i);
 		}
 	}
 
 	return mint;
 }
+
+bool occludedRange(vec3 o, vec3 d, uint start, uint end, float mindist, float maxdist)
+{
+	for (uint tidx = start; tidx < end; tidx += 3)
+	{
+		vec3 v0, e1, e2;
+		fetchTriangle(tidx, v0, e1, e2);
+		float t = raycast_dist(o, d, v0, e1, e2);
+		if (t >= mindist && t < maxdist)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Any-hit query: true as soon as something is hit in [mindist, maxdist)
+bool occludedBVH(vec3 o, vec3 d, float mindist, float maxdist)
+{
+	uint i = 0;
+	while (i < bvhCount)
+	{
+		BVH bvh = bvhs[i];
+		vec3 aabbMin = vec3(bvh.aabbMinX, bvh.aabbMinY, bvh.aabbMinZ);
+		vec3 aabbMax = vec3(bvh.aabbMaxX, bvh.aabbMaxY, bvh.aabbMaxZ);
+		if (RayAABBRange(o, d, aabbMin, aabbMax, mindist, maxdist))
+		{
+			if (occludedRange(o, d, bvhStart(bvh), bvhEnd(bvh), mindist, maxdist))
+			{
+				return true;
+			}
+			++i;
+		}
+		else
+		{
+			i = bvhJump(bvh, i);
+		}
+	}
+
+	return false;
+}
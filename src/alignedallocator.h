@@ -0,0 +1,81 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#if _WIN32
+#include <malloc.h>
+#endif
+
+inline void* alignedAlloc(size_t size, size_t alignment)
+{
+#if _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void *ptr = nullptr;
+	return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+#endif
+}
+
+inline void alignedFree(void *ptr)
+{
+#if _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+/// STL allocator returning memory aligned to Alignment bytes
+/// Used to keep hot arrays (BVH nodes) aligned to cache lines.
+template <typename T, size_t Alignment>
+class AlignedAllocator
+{
+public:
+	typedef T value_type;
+	template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+	AlignedAllocator() {}
+	template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	T* allocate(size_t count)
+	{
+		if (count == 0) return nullptr;
+		void *ptr = alignedAlloc(count * sizeof(T), Alignment);
+		if (!ptr) throw std::bad_alloc();
+		return static_cast<T*>(ptr);
+	}
+
+	void deallocate(T *ptr, size_t)
+	{
+		alignedFree(ptr);
+	}
+};
+
+template <typename T, typename U, size_t Alignment>
+inline bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) { return true; }
+
+template <typename T, typename U, size_t Alignment>
+inline bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) { return false; }
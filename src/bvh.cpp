@@ -21,294 +21,1740 @@ SOFTWARE.
 */
 
 #include "bvh.h"
+#include "bvhstats.h"
 #include "logging.h"
+#include "mappedfile.h"
 #include "mesh.h"
+#include "quantizedgeometry.h"
+#include "radixsort.h"
+#include "threadpool.h"
 #include "timing.h"
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
 
-enum class Axis { X, Y, Z };
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
-struct SplitResult
+namespace
 {
-	Axis axis;
-	float split;
-};
+	const size_t k_maxBucketCount = 64;
+	// Ranges with fewer triangles are built by a single task
+	const size_t k_taskTriangleCount = 16 * 1024;
+	// Ranges with more triangles are binned by several threads
+	const size_t k_parallelBinningCount = 256 * 1024;
+	// Subtrees with more nodes are refitted by separate tasks
+	const size_t k_taskNodeCount = 16 * 1024;
+	// Linear builds of more triangles use 63-bit Morton codes instead of 30-bit ones
+	const size_t k_shortMortonCount = 1024 * 1024;
 
-struct BucketSplit
-{
-	size_t splitIdx;
-	float cost;
-};
+	inline float axisValue(const Vector3 &v, const int axis)
+	{
+		return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+	}
 
-struct BucketAABB
-{
-	Vector3 minv = Vector3(FLT_MAX);
-	Vector3 maxv = Vector3(-FLT_MAX);
+	// Binning runs these several times per triangle and tree level. Unlike
+	// fminf/fmaxf they ignore NaNs, so they compile to single instructions.
+	inline Vector3 fastMin(const Vector3 &v0, const Vector3 &v1)
+	{
+		return Vector3(v0.x < v1.x ? v0.x : v1.x, v0.y < v1.y ? v0.y : v1.y, v0.z < v1.z ? v0.z : v1.z);
+	}
 
-	void addPoint(const Vector3 &p)
+	inline Vector3 fastMax(const Vector3 &v0, const Vector3 &v1)
 	{
-		minv = min(p, minv);
-		maxv = max(p, maxv);
+		return Vector3(v0.x > v1.x ? v0.x : v1.x, v0.y > v1.y ? v0.y : v1.y, v0.z > v1.z ? v0.z : v1.z);
 	}
-};
 
-BucketAABB combine(const BucketAABB &aabb0, const BucketAABB &aabb1)
-{
-	BucketAABB r = aabb0;
-	r.minv = min(aabb1.minv, r.minv);
-	r.maxv = max(aabb1.maxv, r.maxv);
-	return r;
-}
+	struct Bounds
+	{
+		Vector3 minv = Vector3(FLT_MAX);
+		Vector3 maxv = Vector3(-FLT_MAX);
 
-inline float computeCost(const BucketAABB &aabb, const int triangleCount)
-{
-	const Vector3 size = aabb.maxv - aabb.minv;
-	const float surfaceArea = 2.0f * (size.x * size.y + size.x * size.z + size.x * size.y);
-	return float(triangleCount) * surfaceArea;
-}
+		inline void grow(const Vector3 &p)
+		{
+			minv = fastMin(p, minv);
+			maxv = fastMax(p, maxv);
+		}
 
-inline BucketSplit selectSplitFromBuckets(const uint32_t buckets[16], const BucketAABB bucketsAABB[16], size_t triangleCount)
-{
-#if 0
-	int l = 0;
-	int r = (int)tricount;
-	int diff = INT_MAX;
-	size_t best = 0;
-	for (size_t i = 0; i < 16; ++i)
-	{
-		const uint32_t c = buckets[i];
-		l += c;
-		r -= c;
-		int d = abs(l - r);
-		if (d > diff)
-		{
-			break;
-		}
-		diff = d;
-		best = i;
-	}
-	const float quality = 1.0f - float(diff) / float(tricount);
-	return BucketSplit{ best, quality };
-#else
-	// Pass to compute AABB on the right side of the split
-	BucketAABB aabbRightSide[15];
-	aabbRightSide[14] = bucketsAABB[15];
-	for (int i = 13; i >= 0; --i)
+		inline void grow(const Bounds &b)
+		{
+			minv = fastMin(b.minv, minv);
+			maxv = fastMax(b.maxv, maxv);
+		}
+
+		inline bool empty() const
+		{
+			return minv.x > maxv.x || minv.y > maxv.y || minv.z > maxv.z;
+		}
+
+		inline Bounds intersection(const Bounds &b) const
+		{
+			Bounds r;
+			r.minv = fastMax(minv, b.minv);
+			r.maxv = fastMin(maxv, b.maxv);
+			return r;
+		}
+
+		/// Half of the surface area, zero if empty
+		inline float halfArea() const
+		{
+			if (minv.x > maxv.x) return 0.0f;
+			const Vector3 size = maxv - minv;
+			return size.x * size.y + size.y * size.z + size.z * size.x;
+		}
+	};
+
+	/// Triangle reference with its bounds precomputed
+	struct PrimRef
+	{
+		Bounds bounds;
+		uint32_t tidx;
+
+		inline Vector3 centroid() const { return (bounds.minv + bounds.maxv) * 0.5f; }
+	};
+
+	struct Bucket
+	{
+		Bounds bounds;
+		Bounds centroids;
+		uint32_t count = 0;
+
+		inline void add(const PrimRef &prim, const Vector3 &centroid)
+		{
+			bounds.grow(prim.bounds);
+			centroids.grow(centroid);
+			++count;
+		}
+
+		inline void add(const Bucket &b)
+		{
+			bounds.grow(b.bounds);
+			centroids.grow(b.centroids);
+			count += b.count;
+		}
+	};
+
+	/// Range of references of a node, with its bounds
+	struct NodeInfo
+	{
+		size_t begin;
+		size_t end;
+		Bounds bounds;
+		Bounds centroids;
+	};
+
+	/// Maps centroids to buckets along the three axes
+	struct BucketMapping
+	{
+		Vector3 origin;
+		Vector3 scale; // Zero on axes where all the centroids are equal
+		size_t count;
+
+		BucketMapping(const Bounds &centroids, size_t bucketCount)
+			: origin(centroids.minv)
+			, count(bucketCount)
+		{
+			const Vector3 extent = centroids.maxv - centroids.minv;
+			const float n = float(bucketCount);
+			scale.x = extent.x > 0.0f ? n / extent.x : 0.0f;
+			scale.y = extent.y > 0.0f ? n / extent.y : 0.0f;
+			scale.z = extent.z > 0.0f ? n / extent.z : 0.0f;
+		}
+
+		inline size_t bucket(const Vector3 &centroid, const int axis) const
+		{
+			const float v = (axisValue(centroid, axis) - axisValue(origin, axis)) * axisValue(scale, axis);
+			return std::min(size_t(std::max(v, 0.0f)), count - 1);
+		}
+	};
+
+	struct Split
+	{
+		int axis = -1; // No valid split
+		size_t bucket = 0; // Last bucket on the left side
+		float cost = FLT_MAX;
+		Bucket left;
+		Bucket right;
+	};
+
+	struct BuildContext
+	{
+		const BVHBuildParams &params;
+		std::vector<PrimRef> &prims;
+		ThreadPool &pool;
+	};
+
+	/// Part of the tree in depth-first order, built by a single task
+	/// Large ranges keep their children as separate subtrees that are built
+	/// in parallel and stitched together when the whole tree is done.
+	struct Subtree
 	{
-		aabbRightSide[i] = combine(aabbRightSide[i + 1], bucketsAABB[i + 1]);
+		BVH::NodeArray nodes; // Inner node offsets relative to nodes[0]
+		BVHNode node; // Root of the subtree when it has children
+		std::unique_ptr<Subtree> children[2];
+		size_t nodeCount = 0;
+	};
+
+	void binPrims(const PrimRef *prims, size_t begin, size_t end, const BucketMapping &mapping, Bucket *buckets)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			const PrimRef &prim = prims[i];
+			const Vector3 c = prim.centroid();
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				buckets[axis * mapping.count + mapping.bucket(c, axis)].add(prim, c);
+			}
+		}
 	}
 
-	float bestCost = FLT_MAX;
-	int bestSplitIdx = 0;
+	/// Sweeps the buckets along every axis for the split with the lowest SAH cost
+	/// The cost is relative to intersecting one triangle.
+	Split findBestSplit(const BuildContext &ctx, const NodeInfo &node)
+	{
+		const size_t bucketCount = ctx.params.bucketCount;
+		const BucketMapping mapping(node.centroids, bucketCount);
+		const size_t count = node.end - node.begin;
+
+		// Buckets of the three axes, bucketCount per axis
+		std::vector<Bucket> buckets(3 * bucketCount);
+		if (count >= k_parallelBinningCount && ctx.pool.threadCount() > 1)
+		{
+			const size_t chunkCount = ctx.pool.threadCount() * 2;
+			const size_t grainSize = (count + chunkCount - 1) / chunkCount;
+			std::vector<Bucket> partial(chunkCount * 3 * bucketCount);
+			ctx.pool.parallelFor(node.begin, node.end, grainSize, [&](size_t begin, size_t end)
+			{
+				Bucket *chunk = &partial[(begin - node.begin) / grainSize * 3 * bucketCount];
+				binPrims(ctx.prims.data(), begin, end, mapping, chunk);
+			});
+			for (size_t c = 0; c < chunkCount; ++c)
+			{
+				for (size_t b = 0; b < 3 * bucketCount; ++b)
+				{
+					buckets[b].add(partial[c * 3 * bucketCount + b]);
+				}
+			}
+		}
+		else
+		{
+			binPrims(ctx.prims.data(), node.begin, node.end, mapping, buckets.data());
+		}
+
+		const float invArea = node.bounds.halfArea() > 0.0f ? 1.0f / node.bounds.halfArea() : 0.0f;
 
-	BucketAABB aabbLeft;
-	int countLeft = 0;
-	int countRight = int(triangleCount);
-	for (int i = 0; i < 16; ++i)
+		Split best;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			if (axisValue(mapping.scale, axis) == 0.0f) continue;
+			const Bucket *axisBuckets = &buckets[axis * bucketCount];
+
+			// Area times count of the right side, accumulated from the last bucket
+			float rightCost[k_maxBucketCount];
+			Bounds right;
+			uint32_t rightCount = 0;
+			for (size_t b = bucketCount - 1; b > 0; --b)
+			{
+				right.grow(axisBuckets[b].bounds);
+				rightCount += axisBuckets[b].count;
+				rightCost[b] = right.halfArea() * float(rightCount);
+			}
+
+			Bounds left;
+			uint32_t leftCount = 0;
+			for (size_t b = 0; b + 1 < bucketCount; ++b)
+			{
+				left.grow(axisBuckets[b].bounds);
+				leftCount += axisBuckets[b].count;
+				if (leftCount == 0 || leftCount == count) continue;
+				const float cost = ctx.params.traversalCost + invArea * (left.halfArea() * float(leftCount) + rightCost[b + 1]);
+				if (cost < best.cost)
+				{
+					best.axis = axis;
+					best.bucket = b;
+					best.cost = cost;
+				}
+			}
+		}
+
+		if (best.axis >= 0)
+		{
+			const Bucket *axisBuckets = &buckets[best.axis * bucketCount];
+			for (size_t b = 0; b < bucketCount; ++b)
+			{
+				(b <= best.bucket ? best.left : best.right).add(axisBuckets[b]);
+			}
+		}
+
+		return best;
+	}
+
+	/// Partitions the references of a node in place along a split from findBestSplit()
+	/// @return False if the node has to be a leaf
+	bool applySplit(const BuildContext &ctx, const NodeInfo &node, const Split &split, NodeInfo &o_left, NodeInfo &o_right)
 	{
-		const auto c = buckets[i];
-		countLeft += c;
-		countRight -= c;
-		aabbLeft = combine(aabbLeft, bucketsAABB[i]);
-		BucketAABB aabbRight = aabbRightSide[i];
-		const float costLeft = computeCost(aabbLeft, countLeft);
-		const float costRight = computeCost(aabbRight, countRight);
-		const float cost = costLeft + costRight;
-		if (cost < bestCost)
+		const size_t count = node.end - node.begin;
+		auto first = ctx.prims.begin() + node.begin;
+		auto last = ctx.prims.begin() + node.end;
+
+		if (split.axis < 0)
 		{
-			bestCost = cost;
-			bestSplitIdx = i;
+			// All the centroids are in the same place, any split is as good
+			if (count <= ctx.params.maxTrianglesPerNode) return false;
+			const size_t mid = node.begin + count / 2;
+			o_left.begin = node.begin;
+			o_left.end = mid;
+			o_right.begin = mid;
+			o_right.end = node.end;
+			for (NodeInfo *child : { &o_left, &o_right })
+			{
+				for (size_t i = child->begin; i < child->end; ++i)
+				{
+					child->bounds.grow(ctx.prims[i].bounds);
+					child->centroids.grow(ctx.prims[i].centroid());
+				}
+			}
+			return true;
 		}
+
+		// Leaves are intersected at a cost of one per triangle
+		if (count <= ctx.params.maxTrianglesPerNode && split.cost >= float(count)) return false;
+
+		const BucketMapping mapping(node.centroids, ctx.params.bucketCount);
+		auto mid = std::partition(first, last, [&](const PrimRef &prim)
+		{
+			return mapping.bucket(prim.centroid(), split.axis) <= split.bucket;
+		});
+		assert(size_t(mid - first) == split.left.count);
+
+		o_left.begin = node.begin;
+		o_left.end = size_t(mid - ctx.prims.begin());
+		o_left.bounds = split.left.bounds;
+		o_left.centroids = split.left.centroids;
+		o_right.begin = o_left.end;
+		o_right.end = node.end;
+		o_right.bounds = split.right.bounds;
+		o_right.centroids = split.right.centroids;
+		return true;
 	}
 
-	return BucketSplit{ size_t(bestSplitIdx), bestCost };
-#endif
+	/// Splits a node in two, partitioning its references in place
+	/// @return False if the node has to be a leaf
+	bool splitNode(const BuildContext &ctx, const NodeInfo &node, const size_t depth, NodeInfo &o_left, NodeInfo &o_right)
+	{
+		const size_t count = node.end - node.begin;
+		if (count <= 1 || depth >= ctx.params.maxTreeDepth) return false;
+		return applySplit(ctx, node, findBestSplit(ctx, node), o_left, o_right);
+	}
+
+	inline BVHNode makeNode(const NodeInfo &node)
+	{
+		BVHNode n;
+		n.aabbMin = node.bounds.minv;
+		n.aabbMax = node.bounds.maxv;
+		n.offset = (uint32_t)node.begin;
+		n.count = (uint32_t)(node.end - node.begin);
+		return n;
+	}
+
+	/// Count of the inner node over two children, see BVHNode::innerCount()
+	inline uint32_t innerCount(const NodeInfo &left, const NodeInfo &right)
+	{
+		return BVHNode::innerCount(left.bounds.minv + left.bounds.maxv, right.bounds.minv + right.bounds.maxv);
+	}
+
+	/// Builds a subtree in the calling thread, appending its nodes in depth-first order
+	void buildNodes(const BuildContext &ctx, const NodeInfo &node, const size_t depth, BVH::NodeArray &nodes)
+	{
+		const size_t nodeIdx = nodes.size();
+		nodes.push_back(makeNode(node));
+
+		NodeInfo left, right;
+		if (!splitNode(ctx, node, depth, left, right)) return;
+
+		buildNodes(ctx, left, depth + 1, nodes);
+		buildNodes(ctx, right, depth + 1, nodes);
+
+		nodes[nodeIdx].offset = (uint32_t)nodes.size();
+		nodes[nodeIdx].count = innerCount(left, right);
+	}
+
+	std::unique_ptr<Subtree> buildSubtree(const BuildContext &ctx, const NodeInfo &node, const size_t depth)
+	{
+		std::unique_ptr<Subtree> subtree(new Subtree());
+
+		NodeInfo left, right;
+		if (node.end - node.begin <= k_taskTriangleCount ||
+			!splitNode(ctx, node, depth, left, right))
+		{
+			buildNodes(ctx, node, depth, subtree->nodes);
+			subtree->nodeCount = subtree->nodes.size();
+			return subtree;
+		}
+
+		subtree->node = makeNode(node);
+		subtree->node.count = innerCount(left, right);
+		TaskGroup group(ctx.pool);
+		group.run([&]() { subtree->children[0] = buildSubtree(ctx, left, depth + 1); });
+		subtree->children[1] = buildSubtree(ctx, right, depth + 1);
+		group.wait();
+		subtree->nodeCount = 1 + subtree->children[0]->nodeCount + subtree->children[1]->nodeCount;
+		return subtree;
+	}
+
+	/// Copies a subtree to its final place in the node array
+	void writeSubtree(const Subtree &subtree, BVHNode *dst, const uint32_t base, TaskGroup &group)
+	{
+		if (!subtree.children[0])
+		{
+			group.run([&subtree, dst, base]()
+			{
+				for (size_t i = 0; i < subtree.nodes.size(); ++i)
+				{
+					BVHNode node = subtree.nodes[i];
+					if (!node.isLeaf()) node.offset += base;
+					dst[i] = node;
+				}
+			});
+			return;
+		}
+
+		const size_t leftCount = subtree.children[0]->nodeCount;
+		dst[0] = subtree.node;
+		dst[0].offset = base + (uint32_t)subtree.nodeCount;
+		writeSubtree(*subtree.children[0], dst + 1, base + 1, group);
+		writeSubtree(*subtree.children[1], dst + 1 + leftCount, base + 1 + (uint32_t)leftCount, group);
+	}
 }
 
-SplitResult findBestSplit(const Mesh *mesh, const BVH &parent)
+namespace
 {
-	SplitResult ret;
+	// Spatial splits (SBVH, Stich et al. 2009). Splitting the references
+	// that straddle a plane, instead of moving whole triangles to one side,
+	// keeps long triangles from stretching the boxes of their siblings.
+	// Nodes are only tried when the children of their best object split
+	// overlap by more than this fraction of the root area.
+	const float k_spatialSplitOverlap = 1e-5f;
+	// Relative rounding error allowed in the clipped triangle bounds
+	const float k_clipPadding = 1e-6f;
+
+	struct SpatialContext
+	{
+		const BVHBuildParams &params;
+		const Mesh *mesh;
+		ThreadPool &pool;
+		float rootHalfArea;
+	};
+
+	struct SpatialBin
+	{
+		Bounds bounds;
+		uint32_t entries = 0; // References starting in the bin
+		uint32_t exits = 0; // References ending in the bin
+	};
 
-	BucketAABB centroiddsAABB;
-	for (uint32_t tidx : parent.triangles)
+	struct SpatialSplit
+	{
+		int axis = -1; // No valid split
+		float position = 0.0f;
+		float cost = FLT_MAX;
+		Bounds left;
+		Bounds right;
+		size_t leftCount = 0;
+		size_t rightCount = 0;
+	};
+
+	/// Subtree of a spatial split build, which owns its leaf references
+	struct SpatialSubtree
+	{
+		BVH::NodeArray nodes; // Inner node offsets relative to nodes[0], leaf offsets relative to triangles[0]
+		std::vector<uint32_t> triangles;
+		BVHNode node; // Root of the subtree when it has children
+		std::unique_ptr<SpatialSubtree> children[2];
+		size_t nodeCount = 0;
+		size_t triangleCount = 0;
+	};
+
+	inline void setAxisValue(Vector3 &v, const int axis, const float value)
+	{
+		(axis == 0 ? v.x : (axis == 1 ? v.y : v.z)) = value;
+	}
+
+	inline void trianglePositions(const Mesh *mesh, const uint32_t tidx, Vector3 *o_positions)
 	{
 		const Mesh::Triangle &tri = mesh->triangles[tidx];
-		const Vector3 p0 = mesh->positions[mesh->vertices[tri.vertexIndex0].positionIndex];
-		const Vector3 p1 = mesh->positions[mesh->vertices[tri.vertexIndex1].positionIndex];
-		const Vector3 p2 = mesh->positions[mesh->vertices[tri.vertexIndex2].positionIndex];
-		const Vector3 centroid = (p0 + p1 + p2) / 3.0f;
-		centroiddsAABB.addPoint(centroid);
+		for (size_t k = 0; k < 3; ++k)
+		{
+			o_positions[k] = mesh->positions[mesh->vertices[(&tri.vertexIndex0)[k]].positionIndex];
+		}
 	}
 
-	uint32_t bucketsX[16] = { 0 };
-	uint32_t bucketsY[16] = { 0 };
-	uint32_t bucketsZ[16] = { 0 };
-	BucketAABB bucketsAABBX[16];
-	BucketAABB bucketsAABBY[16];
-	BucketAABB bucketsAABBZ[16];
+	/// Bounds of the part of a triangle between two planes along an axis,
+	/// limited to the bounds of the reference being split
+	/// The bounds are padded by the rounding of the clipped vertices, so rays
+	/// never slip between the boxes of the two parts of a triangle.
+	Bounds clipTriangle(const Vector3 *v, const int axis, const float lo, const float hi, const Bounds &refBounds)
+	{
+		Bounds b;
+		float scale = 0.0f;
+		for (size_t i = 0; i < 3; ++i)
+		{
+			const Vector3 &p0 = v[i];
+			const Vector3 &p1 = v[(i + 1) % 3];
+			const float a0 = axisValue(p0, axis);
+			const float a1 = axisValue(p1, axis);
+			scale = std::max(scale, std::max(std::fabs(p0.x), std::max(std::fabs(p0.y), std::fabs(p0.z))));
+			if (a0 >= lo && a0 <= hi) b.grow(p0);
+			for (const float plane : { lo, hi })
+			{
+				if ((a0 < plane && a1 > plane) || (a0 > plane && a1 < plane))
+				{
+					Vector3 p = p0 + (p1 - p0) * ((plane - a0) / (a1 - a0));
+					setAxisValue(p, axis, plane);
+					b.grow(p);
+				}
+			}
+		}
+		if (b.empty()) return b;
+		const Vector3 pad(scale * k_clipPadding);
+		b.minv = b.minv - pad;
+		b.maxv = b.maxv + pad;
+		return b.intersection(refBounds);
+	}
 
-	for (uint32_t tidx : parent.triangles)
+	/// Bins the references of a node in slabs of its bounds along every axis,
+	/// clipping the triangles to each slab they cross, and sweeps them as findBestSplit()
+	SpatialSplit findSpatialSplit(const SpatialContext &ctx, const std::vector<PrimRef> &refs, const Bounds &bounds)
 	{
-		const Mesh::Triangle &tri = mesh->triangles[tidx];
-		const Vector3 p0 = mesh->positions[mesh->vertices[tri.vertexIndex0].positionIndex];
-		const Vector3 p1 = mesh->positions[mesh->vertices[tri.vertexIndex1].positionIndex];
-		const Vector3 p2 = mesh->positions[mesh->vertices[tri.vertexIndex2].positionIndex];
-		const Vector3 centroid = (p0 + p1 + p2) / 3.0f;
+		const size_t binCount = ctx.params.bucketCount;
+		const float invArea = bounds.halfArea() > 0.0f ? 1.0f / bounds.halfArea() : 0.0f;
+		const size_t count = refs.size();
+
+		SpatialSplit best;
+		SpatialBin bins[k_maxBucketCount];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const float lo = axisValue(bounds.minv, axis);
+			const float extent = axisValue(bounds.maxv, axis) - lo;
+			if (!(extent > 0.0f)) continue;
+			const float binWidth = extent / float(binCount);
+			const float invWidth = float(binCount) / extent;
+			auto binOf = [&](float v) { return std::min(size_t(std::max((v - lo) * invWidth, 0.0f)), binCount - 1); };
+
+			std::fill(bins, bins + binCount, SpatialBin());
+			for (const PrimRef &ref : refs)
+			{
+				const size_t first = binOf(axisValue(ref.bounds.minv, axis));
+				const size_t last = binOf(axisValue(ref.bounds.maxv, axis));
+				++bins[first].entries;
+				++bins[last].exits;
+				if (first == last)
+				{
+					bins[first].bounds.grow(ref.bounds);
+					continue;
+				}
+
+				Vector3 v[3];
+				trianglePositions(ctx.mesh, ref.tidx, v);
+				for (size_t b = first; b <= last; ++b)
+				{
+					const Bounds clipped = clipTriangle(v, axis, lo + float(b) * binWidth, lo + float(b + 1) * binWidth, ref.bounds);
+					if (!clipped.empty()) bins[b].bounds.grow(clipped);
+				}
+			}
+
+			float rightCost[k_maxBucketCount];
+			Bounds rightBounds[k_maxBucketCount];
+			Bounds right;
+			size_t rightCount = 0;
+			for (size_t b = binCount - 1; b > 0; --b)
+			{
+				right.grow(bins[b].bounds);
+				rightCount += bins[b].exits;
+				rightCost[b] = right.halfArea() * float(rightCount);
+				rightBounds[b] = right;
+			}
+
+			Bounds left;
+			size_t leftCount = 0;
+			rightCount = count;
+			for (size_t b = 0; b + 1 < binCount; ++b)
+			{
+				left.grow(bins[b].bounds);
+				leftCount += bins[b].entries;
+				rightCount -= bins[b].exits;
+				if (leftCount == 0 || rightCount == 0) continue;
+				const float cost = ctx.params.traversalCost + invArea * (left.halfArea() * float(leftCount) + rightCost[b + 1]);
+				if (cost < best.cost)
+				{
+					best.axis = axis;
+					best.position = lo + float(b + 1) * binWidth;
+					best.cost = cost;
+					best.left = left;
+					best.right = rightBounds[b + 1];
+					best.leftCount = leftCount;
+					best.rightCount = rightCount;
+				}
+			}
+		}
+		return best;
+	}
+
+	inline void growNode(NodeInfo &node, const PrimRef &ref)
+	{
+		node.bounds.grow(ref.bounds);
+		node.centroids.grow(ref.centroid());
+	}
+
+	/// Sorts the references of a node to the sides of a spatial split
+	/// Straddling references are split in two, unless moving them whole to
+	/// one side is cheaper.
+	void applySpatialSplit(const SpatialContext &ctx, const std::vector<PrimRef> &refs, const SpatialSplit &split,
+		std::vector<PrimRef> &o_left, NodeInfo &o_leftInfo, std::vector<PrimRef> &o_right, NodeInfo &o_rightInfo)
+	{
+		const int axis = split.axis;
+		const float leftArea = split.left.halfArea();
+		const float rightArea = split.right.halfArea();
+		const float leftCount = float(split.leftCount);
+		const float rightCount = float(split.rightCount);
+		for (const PrimRef &ref : refs)
+		{
+			PrimRef sides[2] = { ref, ref };
+			bool inSide[2] = { false, false };
+			if (axisValue(ref.bounds.maxv, axis) <= split.position)
+			{
+				inSide[0] = true;
+			}
+			else if (axisValue(ref.bounds.minv, axis) >= split.position)
+			{
+				inSide[1] = true;
+			}
+			else
+			{
+				Bounds leftGrown = split.left;
+				leftGrown.grow(ref.bounds);
+				Bounds rightGrown = split.right;
+				rightGrown.grow(ref.bounds);
+				const float splitCost = leftArea * leftCount + rightArea * rightCount;
+				const float leftCost = leftGrown.halfArea() * leftCount + rightArea * (rightCount - 1.0f);
+				const float rightCost = leftArea * (leftCount - 1.0f) + rightGrown.halfArea() * rightCount;
+				if (leftCost < splitCost && leftCost <= rightCost)
+				{
+					inSide[0] = true;
+				}
+				else if (rightCost < splitCost)
+				{
+					inSide[1] = true;
+				}
+				else
+				{
+					Vector3 v[3];
+					trianglePositions(ctx.mesh, ref.tidx, v);
+					sides[0].bounds = clipTriangle(v, axis, -FLT_MAX, split.position, ref.bounds);
+					sides[1].bounds = clipTriangle(v, axis, split.position, FLT_MAX, ref.bounds);
+					inSide[0] = !sides[0].bounds.empty();
+					inSide[1] = !sides[1].bounds.empty();
+					if (!inSide[0] && !inSide[1]) inSide[0] = true; // Degenerate clip, keep the reference whole
+				}
+			}
+
+			if (inSide[0])
+			{
+				o_left.push_back(sides[0]);
+				growNode(o_leftInfo, sides[0]);
+			}
+			if (inSide[1])
+			{
+				o_right.push_back(sides[1]);
+				growNode(o_rightInfo, sides[1]);
+			}
+		}
+		o_leftInfo.begin = 0;
+		o_leftInfo.end = o_left.size();
+		o_rightInfo.begin = 0;
+		o_rightInfo.end = o_right.size();
+	}
+
+	/// Splits a node of a spatial split build in two, with a spatial split
+	/// when it is cheaper than the best object split and fits in the budget
+	/// @param budget References the subtree may still add, reduced by the references the split adds
+	/// @return False if the node has to be a leaf
+	bool splitSpatialNode(const SpatialContext &ctx, std::vector<PrimRef> &refs, const NodeInfo &node, const size_t depth, size_t &budget,
+		std::vector<PrimRef> &o_left, NodeInfo &o_leftInfo, std::vector<PrimRef> &o_right, NodeInfo &o_rightInfo)
+	{
+		const size_t count = refs.size();
+		if (count <= 1 || depth >= ctx.params.maxTreeDepth) return false;
+
+		const BuildContext objectCtx = { ctx.params, refs, ctx.pool };
+		const Split objectSplit = findBestSplit(objectCtx, node);
+
+		SpatialSplit spatialSplit;
+		const float overlap = objectSplit.axis < 0 ? FLT_MAX : objectSplit.left.bounds.intersection(objectSplit.right.bounds).halfArea();
+		if (budget > 0 && overlap > k_spatialSplitOverlap * ctx.rootHalfArea)
+		{
+			spatialSplit = findSpatialSplit(ctx, refs, node.bounds);
+		}
 
-		const Vector3 ijk = (centroid - centroiddsAABB.minv) / (centroiddsAABB.maxv - centroiddsAABB.minv) * 15.99f;
-		const size_t i = isnan(ijk.x) ? 0 : size_t(ijk.x);
-		const size_t j = isnan(ijk.y) ? 0 : size_t(ijk.y);
-		const size_t k = isnan(ijk.z) ? 0 : size_t(ijk.z);
-		assert(i < 16 && j < 16 && k < 16);
+		if (spatialSplit.axis >= 0 && spatialSplit.cost < objectSplit.cost)
+		{
+			if (count <= ctx.params.maxTrianglesPerNode && spatialSplit.cost >= float(count)) return false;
 
-		++bucketsX[i];
-		++bucketsY[j];
-		++bucketsZ[k];
+			o_leftInfo = NodeInfo();
+			o_rightInfo = NodeInfo();
+			applySpatialSplit(ctx, refs, spatialSplit, o_left, o_leftInfo, o_right, o_rightInfo);
+			const size_t added = o_left.size() + o_right.size() - count;
+			if (!o_left.empty() && !o_right.empty() && added <= budget)
+			{
+				budget -= added;
+				return true;
+			}
+			o_left.clear();
+			o_right.clear();
+		}
 
-		bucketsAABBX[i].addPoint(p0);
-		bucketsAABBX[i].addPoint(p1);
-		bucketsAABBX[i].addPoint(p2);
-		bucketsAABBY[j].addPoint(p0);
-		bucketsAABBY[j].addPoint(p1);
-		bucketsAABBY[j].addPoint(p2);
-		bucketsAABBZ[k].addPoint(p0);
-		bucketsAABBZ[k].addPoint(p1);
-		bucketsAABBZ[k].addPoint(p2);
+		NodeInfo left, right;
+		if (!applySplit(objectCtx, node, objectSplit, left, right)) return false;
+		o_left.assign(refs.begin() + left.begin, refs.begin() + left.end);
+		o_right.assign(refs.begin() + right.begin, refs.begin() + right.end);
+		o_leftInfo = left;
+		o_leftInfo.begin = 0;
+		o_leftInfo.end = o_left.size();
+		o_rightInfo = right;
+		o_rightInfo.begin = 0;
+		o_rightInfo.end = o_right.size();
+		return true;
 	}
 
-	const uint32_t tricount = uint32_t(parent.triangles.size());
-	const BucketSplit splitX = selectSplitFromBuckets(bucketsX, bucketsAABBX, tricount);
-	const BucketSplit splitY = selectSplitFromBuckets(bucketsY, bucketsAABBY, tricount);
-	const BucketSplit splitZ = selectSplitFromBuckets(bucketsZ, bucketsAABBZ, tricount);
+	/// Builds a spatial split subtree in the calling thread, as buildNodes()
+	/// The budget is used depth-first, so the nodes closer to the root split first.
+	void buildSpatialNodes(const SpatialContext &ctx, std::vector<PrimRef> &refs, const NodeInfo &node, const size_t depth, size_t &budget,
+		SpatialSubtree &subtree)
+	{
+		const size_t nodeIdx = subtree.nodes.size();
+		subtree.nodes.push_back(makeNode(node));
+
+		std::vector<PrimRef> left, right;
+		NodeInfo leftInfo, rightInfo;
+		if (!splitSpatialNode(ctx, refs, node, depth, budget, left, leftInfo, right, rightInfo))
+		{
+			subtree.nodes[nodeIdx].offset = (uint32_t)subtree.triangles.size();
+			for (const PrimRef &ref : refs) subtree.triangles.push_back(ref.tidx);
+			return;
+		}
+		std::vector<PrimRef>().swap(refs);
+
+		buildSpatialNodes(ctx, left, leftInfo, depth + 1, budget, subtree);
+		buildSpatialNodes(ctx, right, rightInfo, depth + 1, budget, subtree);
 
-	if (splitX.cost <= splitY.cost && splitX.cost <= splitZ.cost)
-	//if (parent.aabb.size.x >= parent.aabb.size.y && parent.aabb.size.x >= parent.aabb.size.z)
+		subtree.nodes[nodeIdx].offset = (uint32_t)subtree.nodes.size();
+		subtree.nodes[nodeIdx].count = innerCount(leftInfo, rightInfo);
+	}
+
+	/// Builds the children of large nodes in parallel, as buildSubtree()
+	/// Their budget is split in proportion to their references, so the tree
+	/// does not depend on the thread count.
+	std::unique_ptr<SpatialSubtree> buildSpatialSubtree(const SpatialContext &ctx, std::vector<PrimRef> &refs, const NodeInfo &node,
+		const size_t depth, size_t budget)
 	{
-		ret.axis = Axis::X;
-		ret.split = centroiddsAABB.minv.x + (centroiddsAABB.maxv.x - centroiddsAABB.minv.x) / 16.0f * float(splitX.splitIdx + 1);
+		std::unique_ptr<SpatialSubtree> subtree(new SpatialSubtree());
+
+		std::vector<PrimRef> left, right;
+		NodeInfo leftInfo, rightInfo;
+		size_t splitBudget = budget;
+		if (refs.size() <= k_taskTriangleCount ||
+			!splitSpatialNode(ctx, refs, node, depth, splitBudget, left, leftInfo, right, rightInfo))
+		{
+			buildSpatialNodes(ctx, refs, node, depth, budget, *subtree);
+			subtree->nodeCount = subtree->nodes.size();
+			subtree->triangleCount = subtree->triangles.size();
+			return subtree;
+		}
+		std::vector<PrimRef>().swap(refs);
+
+		const size_t leftBudget = splitBudget * left.size() / (left.size() + right.size());
+		const size_t rightBudget = splitBudget - leftBudget;
+		subtree->node = makeNode(node);
+		subtree->node.count = innerCount(leftInfo, rightInfo);
+		TaskGroup group(ctx.pool);
+		group.run([&]() { subtree->children[0] = buildSpatialSubtree(ctx, left, leftInfo, depth + 1, leftBudget); });
+		subtree->children[1] = buildSpatialSubtree(ctx, right, rightInfo, depth + 1, rightBudget);
+		group.wait();
+		subtree->nodeCount = 1 + subtree->children[0]->nodeCount + subtree->children[1]->nodeCount;
+		subtree->triangleCount = subtree->children[0]->triangleCount + subtree->children[1]->triangleCount;
+		return subtree;
 	}
-	else if (splitY.cost <= splitX.cost && splitY.cost <= splitZ.cost)
-	//else if (parent.aabb.size.y >= parent.aabb.size.x && parent.aabb.size.y >= parent.aabb.size.z)
+
+	/// Copies a spatial split subtree to its final place in the node and triangle arrays
+	void writeSpatialSubtree(const SpatialSubtree &subtree, BVHNode *dst, const uint32_t base,
+		uint32_t *triangles, const uint32_t triangleBase, TaskGroup &group)
 	{
-		ret.axis = Axis::Y;
-		ret.split = centroiddsAABB.minv.y + (centroiddsAABB.maxv.y - centroiddsAABB.minv.y) / 16.0f * float(splitY.splitIdx + 1);
+		if (!subtree.children[0])
+		{
+			group.run([&subtree, dst, base, triangles, triangleBase]()
+			{
+				for (size_t i = 0; i < subtree.nodes.size(); ++i)
+				{
+					BVHNode node = subtree.nodes[i];
+					node.offset += node.isLeaf() ? triangleBase : base;
+					dst[i] = node;
+				}
+				std::copy(subtree.triangles.begin(), subtree.triangles.end(), triangles + triangleBase);
+			});
+			return;
+		}
+
+		const size_t leftCount = subtree.children[0]->nodeCount;
+		const size_t leftTriangles = subtree.children[0]->triangleCount;
+		dst[0] = subtree.node;
+		dst[0].offset = base + (uint32_t)subtree.nodeCount;
+		writeSpatialSubtree(*subtree.children[0], dst + 1, base + 1, triangles, triangleBase, group);
+		writeSpatialSubtree(*subtree.children[1], dst + 1 + leftCount, base + 1 + (uint32_t)leftCount,
+			triangles, triangleBase + (uint32_t)leftTriangles, group);
 	}
-	else
+
+	BVHBuildParams clampParams(const BVHBuildParams &params)
 	{
-		ret.axis = Axis::Z;
-		ret.split = centroiddsAABB.minv.z + (centroiddsAABB.maxv.z - centroiddsAABB.minv.z) / 16.0f * float(splitZ.splitIdx + 1);
+		BVHBuildParams p = params;
+		p.maxTrianglesPerNode = std::max<size_t>(p.maxTrianglesPerNode, 1);
+		p.bucketCount = std::min(std::max<size_t>(p.bucketCount, 2), k_maxBucketCount);
+		p.spatialSplitBudget = std::max(p.spatialSplitBudget, 0.0f);
+		return p;
 	}
 
-	return ret;
-}
+	/// Builds a tree with spatial splits over the triangle references of a mesh
+	BVH* buildSpatial(const Mesh *mesh, std::vector<PrimRef> &prims, const NodeInfo &root, const BVHBuildParams &params)
+	{
+		const BVHBuildParams p = clampParams(params);
+		BVH *bvh = new BVH();
+		ThreadPool &pool = ThreadPool::global();
+		const size_t count = prims.size();
+		if (count == 0) return bvh;
 
-void binaryDivisionBVH(const Mesh *mesh, const size_t maxTriangleCount, const size_t maxTreeDepth, BVH &parent, const size_t currentDepth)
-{
-	if (parent.triangles.size() <= maxTriangleCount ||
-		currentDepth >= maxTreeDepth)
+		const SpatialContext ctx = { p, mesh, pool, root.bounds.halfArea() };
+		const size_t budget = size_t(double(count) * double(p.spatialSplitBudget));
+		std::unique_ptr<SpatialSubtree> tree = buildSpatialSubtree(ctx, prims, root, 0, budget);
+
+		bvh->nodes.resize(tree->nodeCount);
+		bvh->triangles.resize(tree->triangleCount);
+		TaskGroup group(pool);
+		writeSpatialSubtree(*tree, bvh->nodes.data(), 0, bvh->triangles.data(), 0, group);
+		group.wait();
+
+		logDebug("BVH", "Spatial splits added " + std::to_string(bvh->triangles.size() - count) + " references to " +
+			std::to_string(count) + " triangles.");
+		return bvh;
+	}
+
+	/// Spreads the lowest 10 bits of v to every third bit
+	inline uint64_t expandBits10(uint64_t v)
 	{
-		parent.subtreeTriangleCount = parent.triangles.size();
-		return;
+		v &= 0x3ff;
+		v = (v | (v << 16)) & 0x30000ff;
+		v = (v | (v << 8)) & 0x300f00f;
+		v = (v | (v << 4)) & 0x30c30c3;
+		v = (v | (v << 2)) & 0x9249249;
+		return v;
 	}
 
-	parent.children.resize(2);
+	/// Spreads the lowest 21 bits of v to every third bit
+	inline uint64_t expandBits21(uint64_t v)
+	{
+		v &= 0x1fffff;
+		v = (v | (v << 32)) & 0x1f00000000ffffull;
+		v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+		v = (v | (v << 8)) & 0x100f00f00f00f00full;
+		v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+		v = (v | (v << 2)) & 0x1249249249249249ull;
+		return v;
+	}
 
-	Vector3 aabbMinL(FLT_MAX); Vector3 aabbMaxL(-FLT_MAX);
-	Vector3 aabbMinR(FLT_MAX); Vector3 aabbMaxR(-FLT_MAX);
+	inline uint32_t highestBit(uint64_t v)
+	{
+#if defined(_MSC_VER)
+		unsigned long idx;
+		_BitScanReverse64(&idx, v);
+		return uint32_t(idx);
+#else
+		return uint32_t(63 - __builtin_clzll(v));
+#endif
+	}
 
-	const SplitResult split = findBestSplit(mesh, parent);
+	struct LinearContext
+	{
+		const BVHBuildParams &params;
+		const std::vector<uint64_t> &codes; // Sorted Morton codes
+		const std::vector<Bounds> &bounds; // Triangle bounds in code order
+		ThreadPool &pool;
+	};
 
-	for (uint32_t tidx : parent.triangles)
+	/// Splits a range of sorted codes where the highest bit they do not share changes
+	/// Ranges of equal codes are split in half.
+	size_t mortonSplit(const std::vector<uint64_t> &codes, size_t begin, size_t end)
 	{
-		const Mesh::Triangle &tri = mesh->triangles[tidx];
-		const Vector3 p0 = mesh->positions[mesh->vertices[tri.vertexIndex0].positionIndex];
-		const Vector3 p1 = mesh->positions[mesh->vertices[tri.vertexIndex1].positionIndex];
-		const Vector3 p2 = mesh->positions[mesh->vertices[tri.vertexIndex2].positionIndex];
-		const Vector3 c = (p0 + p1 + p2) * (1.0f / 3.0f);
+		const uint64_t first = codes[begin];
+		const uint64_t last = codes[end - 1];
+		if (first == last) return begin + (end - begin) / 2;
 
-		const bool left =
-			((split.axis == Axis::X) & (c.x <= split.split)) |
-			((split.axis == Axis::Y) & (c.y <= split.split)) |
-			((split.axis == Axis::Z) & (c.z <= split.split));
+		// First code with the differing bit set, the codes before it have it cleared
+		const uint32_t bit = highestBit(first ^ last);
+		const uint64_t splitCode = ((first >> bit) | 1) << bit;
+		return size_t(std::lower_bound(codes.begin() + begin, codes.begin() + end, splitCode) - codes.begin());
+	}
+
+	inline BVHNode makeLinearNode(const Bounds &bounds, uint32_t offset, uint32_t count)
+	{
+		BVHNode n;
+		n.aabbMin = bounds.minv;
+		n.aabbMax = bounds.maxv;
+		n.offset = offset;
+		n.count = count;
+		return n;
+	}
+
+	/// Appends the nodes of a range of codes in depth-first order, as buildNodes()
+	/// @return Bounds of the range
+	Bounds buildLinearNodes(const LinearContext &ctx, const size_t begin, const size_t end, const size_t depth, BVH::NodeArray &nodes)
+	{
+		const size_t nodeIdx = nodes.size();
+		nodes.push_back(BVHNode());
 
-		if (left)
+		Bounds bounds;
+		if (end - begin <= ctx.params.maxTrianglesPerNode || depth >= ctx.params.maxTreeDepth)
 		{
-			parent.children[0].triangles.push_back(tidx);
-			aabbMinL = min(aabbMinL, min(p0, min(p1, p2)));
-			aabbMaxL = max(aabbMaxL, max(p0, max(p1, p2)));
+			for (size_t i = begin; i < end; ++i) bounds.grow(ctx.bounds[i]);
+			nodes[nodeIdx] = makeLinearNode(bounds, uint32_t(begin), uint32_t(end - begin));
+			return bounds;
 		}
-		else
+
+		const size_t mid = mortonSplit(ctx.codes, begin, end);
+		const Bounds left = buildLinearNodes(ctx, begin, mid, depth + 1, nodes);
+		const Bounds right = buildLinearNodes(ctx, mid, end, depth + 1, nodes);
+		bounds = left;
+		bounds.grow(right);
+		nodes[nodeIdx] = makeLinearNode(bounds, uint32_t(nodes.size()),
+			BVHNode::innerCount(left.minv + left.maxv, right.minv + right.maxv));
+		return bounds;
+	}
+
+	/// Builds the children of large ranges in parallel, as buildSubtree()
+	std::unique_ptr<Subtree> buildLinearSubtree(const LinearContext &ctx, const size_t begin, const size_t end, const size_t depth,
+		Bounds &o_bounds)
+	{
+		std::unique_ptr<Subtree> subtree(new Subtree());
+		const size_t count = end - begin;
+		if (count <= k_taskTriangleCount || count <= ctx.params.maxTrianglesPerNode || depth >= ctx.params.maxTreeDepth)
 		{
-			parent.children[1].triangles.push_back(tidx);
-			aabbMinR = min(aabbMinR, min(p0, min(p1, p2)));
-			aabbMaxR = max(aabbMaxR, max(p0, max(p1, p2)));
+			o_bounds = buildLinearNodes(ctx, begin, end, depth, subtree->nodes);
+			subtree->nodeCount = subtree->nodes.size();
+			return subtree;
 		}
+
+		const size_t mid = mortonSplit(ctx.codes, begin, end);
+		Bounds left, right;
+		TaskGroup group(ctx.pool);
+		group.run([&]() { subtree->children[0] = buildLinearSubtree(ctx, begin, mid, depth + 1, left); });
+		subtree->children[1] = buildLinearSubtree(ctx, mid, end, depth + 1, right);
+		group.wait();
+
+		o_bounds = left;
+		o_bounds.grow(right);
+		subtree->node = makeLinearNode(o_bounds, 0, BVHNode::innerCount(left.minv + left.maxv, right.minv + right.maxv));
+		subtree->nodeCount = 1 + subtree->children[0]->nodeCount + subtree->children[1]->nodeCount;
+		return subtree;
+	}
+
+	/// Builds a linear BVH (LBVH): references are sorted along a Morton curve
+	/// over their centroids and split where the highest differing bit of
+	/// their codes changes. Much faster than binning, the tree is worse.
+	BVH* buildLinear(const std::vector<PrimRef> &prims, const NodeInfo &root, const BVHBuildParams &params)
+	{
+		const BVHBuildParams p = clampParams(params);
+		BVH *bvh = new BVH();
+		ThreadPool &pool = ThreadPool::global();
+		const size_t count = prims.size();
+		if (count == 0) return bvh;
+
+		// 30-bit codes sort in half the passes, finer ones keep large meshes apart
+		const uint64_t axisBits = count > k_shortMortonCount ? 21 : 10;
+		const float gridMax = float((1u << axisBits) - 1);
+		// Cubic cells, so flat meshes do not spend code bits on their thin axis
+		const Vector3 origin = root.centroids.minv;
+		const Vector3 extent = root.centroids.maxv - root.centroids.minv;
+		const float maxExtent = std::max(std::max(extent.x, extent.y), extent.z);
+		const Vector3 scale(maxExtent > 0.0f ? gridMax / maxExtent : 0.0f);
+
+		std::vector<uint64_t> codes(count);
+		std::vector<uint32_t> order(count);
+		pool.parallelFor(0, count, 0, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				const Vector3 c = (prims[i].centroid() - origin) * scale;
+				const uint64_t x = uint64_t(std::min(std::max(c.x, 0.0f), gridMax));
+				const uint64_t y = uint64_t(std::min(std::max(c.y, 0.0f), gridMax));
+				const uint64_t z = uint64_t(std::min(std::max(c.z, 0.0f), gridMax));
+				codes[i] = axisBits == 21 ?
+					(expandBits21(x) << 2) | (expandBits21(y) << 1) | expandBits21(z) :
+					(expandBits10(x) << 2) | (expandBits10(y) << 1) | expandBits10(z);
+				order[i] = uint32_t(i);
+			}
+		});
+		radixSort(codes, order, unsigned(axisBits * 3));
+
+		std::vector<Bounds> bounds(count);
+		bvh->triangles.resize(count);
+		pool.parallelFor(0, count, 0, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				bounds[i] = prims[order[i]].bounds;
+				bvh->triangles[i] = prims[order[i]].tidx;
+			}
+		});
+
+		const LinearContext ctx = { p, codes, bounds, pool };
+		Bounds rootBounds;
+		std::unique_ptr<Subtree> tree = buildLinearSubtree(ctx, 0, count, 0, rootBounds);
+		bvh->nodes.resize(tree->nodeCount);
+		TaskGroup group(pool);
+		writeSubtree(*tree, bvh->nodes.data(), 0, group);
+		group.wait();
+		return bvh;
 	}
 
-	if (parent.children[0].triangles.empty() ||
-		parent.children[1].triangles.empty())
+	/// Builds the tree over references with their bounds computed
+	BVH* buildFromPrims(std::vector<PrimRef> &prims, const NodeInfo &root, const BVHBuildParams &params)
 	{
-		// Unable to subdivide... We brake here
-		// TODO: Check if there is a way to improve this
-		parent.children.clear();
-		parent.subtreeTriangleCount = parent.triangles.size();
-		return;
+		const BVHBuildParams p = clampParams(params);
+
+		BVH *bvh = new BVH();
+		ThreadPool &pool = ThreadPool::global();
+		const size_t count = prims.size();
+
+		if (count > 0)
+		{
+			const BuildContext ctx = { p, prims, pool };
+			std::unique_ptr<Subtree> tree = buildSubtree(ctx, root, 0);
+
+			bvh->nodes.resize(tree->nodeCount);
+			TaskGroup group(pool);
+			writeSubtree(*tree, bvh->nodes.data(), 0, group);
+			group.wait();
+		}
+
+		bvh->triangles.resize(count);
+		pool.parallelFor(0, count, 0, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				bvh->triangles[i] = prims[i].tidx;
+			}
+		});
+		return bvh;
 	}
+}
 
-	parent.triangles.clear();
+namespace
+{
+	// Treelet optimizer (TRBVH, Karras and Aila 2013): every inner node is the
+	// root of a treelet made of the nodes below it, expanded through the child
+	// with the largest area until it has k_treeletLeafCount leaves. The
+	// treelet is then rebuilt with the topology of lowest SAH cost, found by
+	// dynamic programming over every subset of its leaves.
+
+	const size_t k_treeletLeafCount = 7;
+	const uint32_t k_treeletSubsetCount = 1u << k_treeletLeafCount;
+	const uint32_t k_noChild = UINT32_MAX;
+
+	/// Node of the tree being optimized, with its children linked instead of in depth-first order
+	struct LinkedNode
+	{
+		Bounds bounds;
+		float cost; // SAH cost of the subtree, not divided by the root area
+		uint32_t children[2]; // k_noChild for leaves
+		uint32_t offset; // Leaves: first triangle in BVH::triangles
+		uint32_t count; // Leaves: triangle count
+		uint32_t leafCount; // Leaves in the subtree
+		uint32_t triangleCount; // Triangle references in the subtree
+	};
+
+	struct TreeletContext
+	{
+		std::vector<LinkedNode> &nodes;
+		float traversalCost;
+		ThreadPool &pool;
+	};
+
+	/// Rebuilds the treelet rooted at a node if another topology of it costs less
+	void restructureTreelet(const TreeletContext &ctx, const uint32_t root)
+	{
+		std::vector<LinkedNode> &nodes = ctx.nodes;
+		uint32_t leaves[k_treeletLeafCount];
+		uint32_t inner[k_treeletLeafCount - 1];
+		size_t leafCount = 2;
+		size_t innerCount = 1;
+		leaves[0] = nodes[root].children[0];
+		leaves[1] = nodes[root].children[1];
+		inner[0] = root;
+		while (leafCount < k_treeletLeafCount)
+		{
+			size_t largest = leafCount;
+			float largestArea = -1.0f;
+			for (size_t l = 0; l < leafCount; ++l)
+			{
+				const LinkedNode &node = nodes[leaves[l]];
+				const float area = node.bounds.halfArea();
+				if (node.children[0] != k_noChild && area > largestArea)
+				{
+					largest = l;
+					largestArea = area;
+				}
+			}
+			if (largest == leafCount) break;
+
+			const uint32_t expanded = leaves[largest];
+			inner[innerCount++] = expanded;
+			leaves[largest] = nodes[expanded].children[0];
+			leaves[leafCount++] = nodes[expanded].children[1];
+		}
+		if (leafCount < 3) return;
+
+		// Subsets of the treelet leaves, by their bit masks. Proper subsets of
+		// a mask are smaller than it, so a single sweep visits them first.
+		const uint32_t fullSet = (1u << leafCount) - 1;
+		Bounds bounds[k_treeletSubsetCount];
+		float costs[k_treeletSubsetCount];
+		uint32_t partitions[k_treeletSubsetCount];
+		for (uint32_t s = 1; s <= fullSet; ++s)
+		{
+			const uint32_t lowest = s & (~s + 1);
+			const uint32_t rest = s ^ lowest;
+			if (rest == 0)
+			{
+				size_t l = 0;
+				while ((1u << l) != s) ++l;
+				bounds[s] = nodes[leaves[l]].bounds;
+				costs[s] = nodes[leaves[l]].cost;
+				continue;
+			}
+
+			bounds[s] = bounds[rest];
+			bounds[s].grow(bounds[lowest]);
+
+			// Each partition once, with the lowest leaf on the first side
+			float bestCost = FLT_MAX;
+			uint32_t bestPartition = lowest;
+			for (uint32_t q = (rest - 1) & rest; ; q = (q - 1) & rest)
+			{
+				const uint32_t p = lowest | q;
+				const float cost = costs[p] + costs[s ^ p];
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestPartition = p;
+				}
+				if (q == 0) break;
+			}
+			costs[s] = ctx.traversalCost * bounds[s].halfArea() + bestCost;
+			partitions[s] = bestPartition;
+		}
+		if (!(costs[fullSet] < nodes[root].cost * 0.9999f)) return;
+
+		// The inner nodes of the treelet are reused in the new topology, the root keeps its index
+		struct Pending { uint32_t set; uint32_t node; };
+		Pending stack[k_treeletLeafCount];
+		Pending order[k_treeletLeafCount];
+		size_t stackSize = 0;
+		size_t orderSize = 0;
+		size_t nextInner = 1;
+		stack[stackSize++] = { fullSet, root };
+		while (stackSize > 0)
+		{
+			const Pending pending = stack[--stackSize];
+			order[orderSize++] = pending;
+			LinkedNode &node = nodes[pending.node];
+			const uint32_t sides[2] = { partitions[pending.set], pending.set ^ partitions[pending.set] };
+			for (size_t c = 0; c < 2; ++c)
+			{
+				if ((sides[c] & (sides[c] - 1)) == 0)
+				{
+					size_t l = 0;
+					while ((1u << l) != sides[c]) ++l;
+					node.children[c] = leaves[l];
+				}
+				else
+				{
+					node.children[c] = inner[nextInner++];
+					stack[stackSize++] = { sides[c], node.children[c] };
+				}
+			}
+		}
+
+		// Children before their parents
+		for (size_t i = orderSize; i-- > 0;)
+		{
+			LinkedNode &node = nodes[order[i].node];
+			const LinkedNode &first = nodes[node.children[0]];
+			const LinkedNode &second = nodes[node.children[1]];
+			node.bounds = bounds[order[i].set];
+			node.cost = costs[order[i].set];
+			node.leafCount = first.leafCount + second.leafCount;
+			node.triangleCount = first.triangleCount + second.triangleCount;
+		}
+	}
 
-	parent.children[0].aabb = AABB((aabbMinL + aabbMaxL) * 0.5f, (aabbMaxL - aabbMinL) * 0.5f);
-	parent.children[1].aabb = AABB((aabbMinR + aabbMaxR) * 0.5f, (aabbMaxR - aabbMinR) * 0.5f);
+	/// Restructures the treelets of a subtree bottom-up, large subtrees in parallel
+	void optimizeSubtree(const TreeletContext &ctx, const uint32_t index)
+	{
+		const LinkedNode &node = ctx.nodes[index];
+		if (node.children[0] == k_noChild) return;
 
-	binaryDivisionBVH(mesh, maxTriangleCount, maxTreeDepth, parent.children[0], currentDepth + 1);
-	binaryDivisionBVH(mesh, maxTriangleCount, maxTreeDepth, parent.children[1], currentDepth + 1);
+		if (node.triangleCount > k_taskTriangleCount)
+		{
+			TaskGroup group(ctx.pool);
+			const uint32_t first = node.children[0];
+			group.run([&ctx, first]() { optimizeSubtree(ctx, first); });
+			optimizeSubtree(ctx, node.children[1]);
+			group.wait();
+		}
+		else
+		{
+			optimizeSubtree(ctx, node.children[0]);
+			optimizeSubtree(ctx, node.children[1]);
+		}
+		restructureTreelet(ctx, index);
+	}
 
-	// Update AABB
+	/// Writes a linked subtree in depth-first order, with its triangles in leaf order
+	void writeLinkedSubtree(const std::vector<LinkedNode> &nodes, const uint32_t index, const uint32_t dst,
+		const uint32_t triangleBase, const std::vector<uint32_t> &triangles, BVH &bvh, TaskGroup &group)
 	{
-		aabbMinL = parent.children[0].aabb.center - parent.children[0].aabb.size;
-		aabbMaxL = parent.children[0].aabb.center + parent.children[0].aabb.size;
-		aabbMinR = parent.children[1].aabb.center - parent.children[1].aabb.size;
-		aabbMaxR = parent.children[1].aabb.center + parent.children[1].aabb.size;
-		const Vector3 aabbMin = min(aabbMinL, aabbMinR);
-		const Vector3 aabbMax = max(aabbMaxL, aabbMaxR);
-		parent.aabb.center = (aabbMax + aabbMin) * 0.5f;
-		parent.aabb.size = (aabbMax - aabbMin) * 0.5f;
+		const LinkedNode &node = nodes[index];
+		BVHNode &out = bvh.nodes[dst];
+		out.aabbMin = node.bounds.minv;
+		out.aabbMax = node.bounds.maxv;
+		if (node.children[0] == k_noChild)
+		{
+			out.offset = triangleBase;
+			out.count = node.count;
+			std::copy(triangles.begin() + node.offset, triangles.begin() + node.offset + node.count,
+				bvh.triangles.begin() + triangleBase);
+			return;
+		}
+
+		// Full binary trees have one inner node less than leaves
+		const LinkedNode &first = nodes[node.children[0]];
+		const LinkedNode &second = nodes[node.children[1]];
+		out.offset = dst + 2 * node.leafCount - 1;
+		out.count = BVHNode::innerCount(first.bounds.minv + first.bounds.maxv, second.bounds.minv + second.bounds.maxv);
+
+		const uint32_t secondDst = dst + 2 * first.leafCount;
+		const uint32_t secondTriangleBase = triangleBase + first.triangleCount;
+		if (node.triangleCount > k_taskTriangleCount)
+		{
+			const uint32_t firstIndex = node.children[0];
+			group.run([&nodes, firstIndex, dst, triangleBase, &triangles, &bvh, &group]()
+			{
+				writeLinkedSubtree(nodes, firstIndex, dst + 1, triangleBase, triangles, bvh, group);
+			});
+		}
+		else
+		{
+			writeLinkedSubtree(nodes, node.children[0], dst + 1, triangleBase, triangles, bvh, group);
+		}
+		writeLinkedSubtree(nodes, node.children[1], secondDst, secondTriangleBase, triangles, bvh, group);
 	}
 
-	parent.subtreeTriangleCount =
-		parent.children[0].subtreeTriangleCount +
-		parent.children[1].subtreeTriangleCount;
+	/// Runs treelet restructuring passes over a tree and logs how much they lowered its SAH cost
+	void optimizeTreelets(BVH &bvh, const BVHBuildParams &params)
+	{
+		const size_t nodeCount = bvh.nodes.size();
+		if (params.optimizationPasses == 0 || nodeCount < 3) return;
+
+		Timing timing;
+		timing.begin();
+
+		// Children always follow their parent, so a reverse sweep sees them first
+		std::vector<LinkedNode> nodes(nodeCount);
+		for (uint32_t i = uint32_t(nodeCount); i-- > 0;)
+		{
+			const BVHNode &src = bvh.nodes[i];
+			LinkedNode &node = nodes[i];
+			node.bounds.minv = src.aabbMin;
+			node.bounds.maxv = src.aabbMax;
+			if (src.isLeaf())
+			{
+				node.children[0] = node.children[1] = k_noChild;
+				node.offset = src.offset;
+				node.count = src.count;
+				node.leafCount = 1;
+				node.triangleCount = src.count;
+				node.cost = node.bounds.halfArea() * float(src.count);
+			}
+			else
+			{
+				node.children[0] = i + 1;
+				node.children[1] = bvh.nodes[i + 1].skipIndex(i + 1);
+				const LinkedNode &first = nodes[node.children[0]];
+				const LinkedNode &second = nodes[node.children[1]];
+				node.offset = node.count = 0;
+				node.leafCount = first.leafCount + second.leafCount;
+				node.triangleCount = first.triangleCount + second.triangleCount;
+				node.cost = params.traversalCost * node.bounds.halfArea() + first.cost + second.cost;
+			}
+		}
+
+		const float rootArea = std::max(nodes[0].bounds.halfArea(), FLT_MIN);
+		const float initialCost = nodes[0].cost / rootArea;
+		const TreeletContext ctx = { nodes, params.traversalCost, ThreadPool::global() };
+		for (size_t pass = 0; pass < params.optimizationPasses; ++pass)
+		{
+			optimizeSubtree(ctx, 0);
+		}
+
+		const std::vector<uint32_t> triangles(bvh.triangles);
+		{
+			TaskGroup group(ctx.pool);
+			writeLinkedSubtree(nodes, 0, 0, 0, triangles, bvh, group);
+			group.wait();
+		}
+
+		timing.end();
+		char line[160];
+		snprintf(line, sizeof(line), "Treelet optimization lowered the SAH cost from %.3f to %.3f in %.3f seconds.",
+			initialCost, nodes[0].cost / rootArea, timing.elapsedSeconds());
+		logDebug("BVH", line);
+	}
 }
 
-BVH* BVH::createBinary(const Mesh *mesh, const size_t maxTriangleCount, const size_t maxTreeDepth)
+BVH* BVH::createBinary(const Mesh *mesh, const BVHBuildParams &params)
 {
 	Timing timing;
 	timing.begin();
 
-	Vector3 mins(FLT_MAX);
-	Vector3 maxs(-FLT_MAX);
-	for (size_t i = 0; i < mesh->positions.size(); ++i)
+	ThreadPool &pool = ThreadPool::global();
+	const size_t count = mesh->triangles.size();
+	std::vector<PrimRef> prims(count);
+	NodeInfo root;
+	root.begin = 0;
+	root.end = count;
+
+	std::mutex rootMutex;
+	pool.parallelFor(0, count, 0, [&](size_t begin, size_t end)
 	{
-		const Vector3 p = mesh->positions[i];
-		mins = min(mins, p);
-		maxs = max(maxs, p);
+		NodeInfo chunk;
+		for (size_t t = begin; t < end; ++t)
+		{
+			const Mesh::Triangle &tri = mesh->triangles[t];
+			PrimRef &prim = prims[t];
+			prim.bounds.grow(mesh->positions[mesh->vertices[tri.vertexIndex0].positionIndex]);
+			prim.bounds.grow(mesh->positions[mesh->vertices[tri.vertexIndex1].positionIndex]);
+			prim.bounds.grow(mesh->positions[mesh->vertices[tri.vertexIndex2].positionIndex]);
+			prim.tidx = (uint32_t)t;
+			chunk.bounds.grow(prim.bounds);
+			chunk.centroids.grow(prim.centroid());
+		}
+		std::lock_guard<std::mutex> lock(rootMutex);
+		root.bounds.grow(chunk.bounds);
+		root.centroids.grow(chunk.centroids);
+	});
+
+	BVH *bvh = params.linear ? buildLinear(prims, root, params) :
+		params.spatialSplitBudget > 0.0f ? buildSpatial(mesh, prims, root, params) :
+		buildFromPrims(prims, root, params);
+	optimizeTreelets(*bvh, params);
+
+	timing.end();
+	logDebug("BVH", "BHV Creation took " + std::to_string(timing.elapsedSeconds()) + " seconds for " + 
+		std::to_string(bvh->nodes.size()) + " nodes.");
+
+	return bvh;
+}
+
+size_t BVH::depth() const
+{
+	// Children always follow their parent
+	std::vector<uint32_t> depths(nodes.size(), 0);
+	uint32_t maxDepth = 0;
+	for (uint32_t i = 0; i < uint32_t(nodes.size()); ++i)
+	{
+		maxDepth = std::max(maxDepth, depths[i]);
+		if (nodes[i].isLeaf()) continue;
+		depths[i + 1] = depths[i] + 1;
+		depths[nodes[i + 1].skipIndex(i + 1)] = depths[i] + 1;
 	}
+	return maxDepth;
+}
 
-	BVH *bvh = new BVH();
-	bvh->aabb.center = (maxs + mins) * 0.5f;
-	bvh->aabb.size = (maxs - mins) * 0.5f;
+namespace
+{
+	/// Grows the bounds by the triangle at entry i of BVH::triangles
+	struct MeshTriangleBounds
+	{
+		const BVH &bvh;
+		const Mesh *mesh;
 
-	const size_t count = mesh->triangles.size();
-	bvh->triangles.resize(count);
+		void operator()(uint32_t i, Bounds &o_bounds) const
+		{
+			const Mesh::Triangle &tri = mesh->triangles[bvh.triangles[i]];
+			o_bounds.grow(mesh->positions[mesh->vertices[tri.vertexIndex0].positionIndex]);
+			o_bounds.grow(mesh->positions[mesh->vertices[tri.vertexIndex1].positionIndex]);
+			o_bounds.grow(mesh->positions[mesh->vertices[tri.vertexIndex2].positionIndex]);
+		}
+	};
+
+	/// Same for quantized geometry, which stores the triangles in BVH::triangles order
+	struct QuantizedTriangleBounds
+	{
+		const QuantizedGeometry &geometry;
+
+		void operator()(uint32_t i, Bounds &o_bounds) const
+		{
+			Vector3 positions[3];
+			geometry.positions(i * 3, positions);
+			o_bounds.grow(positions[0]);
+			o_bounds.grow(positions[1]);
+			o_bounds.grow(positions[2]);
+		}
+	};
+
+	/// Recomputes the bounds of a subtree from its triangles, large subtrees in parallel
+	template <typename TriangleBounds>
+	Bounds refitSubtree(BVH &bvh, const TriangleBounds &triangleBounds, const uint32_t index)
+	{
+		BVHNode &node = bvh.nodes[index];
+		Bounds bounds;
+		if (node.isLeaf())
+		{
+			for (uint32_t i = node.offset; i < node.offset + node.count; ++i)
+			{
+				triangleBounds(i, bounds);
+			}
+		}
+		else
+		{
+			const uint32_t first = index + 1;
+			const uint32_t second = bvh.nodes[first].skipIndex(first);
+			Bounds firstBounds, secondBounds;
+			if (node.offset - index > k_taskNodeCount)
+			{
+				TaskGroup group;
+				group.run([&]() { firstBounds = refitSubtree(bvh, triangleBounds, first); });
+				secondBounds = refitSubtree(bvh, triangleBounds, second);
+				group.wait();
+			}
+			else
+			{
+				firstBounds = refitSubtree(bvh, triangleBounds, first);
+				secondBounds = refitSubtree(bvh, triangleBounds, second);
+			}
+			node.count = BVHNode::innerCount(firstBounds.minv + firstBounds.maxv, secondBounds.minv + secondBounds.maxv);
+			bounds = firstBounds;
+			bounds.grow(secondBounds);
+		}
+		node.aabbMin = bounds.minv;
+		node.aabbMax = bounds.maxv;
+		return bounds;
+	}
+}
+
+void BVH::refit(const Mesh *mesh)
+{
+	if (!nodes.empty()) refitSubtree(*this, MeshTriangleBounds{ *this, mesh }, 0);
+}
+
+void BVH::refit(const QuantizedGeometry &geometry)
+{
+	assert(geometry.triangleCount() == triangles.size());
+	if (!nodes.empty()) refitSubtree(*this, QuantizedTriangleBounds{ geometry }, 0);
+}
+
+BVH* BVH::createFromBounds(const Vector3 *mins, const Vector3 *maxs, size_t count, const BVHBuildParams &params)
+{
+	std::vector<PrimRef> prims(count);
+	NodeInfo root;
+	root.begin = 0;
+	root.end = count;
 	for (size_t i = 0; i < count; ++i)
 	{
-		bvh->triangles[i] = (uint32_t)i;
+		PrimRef &prim = prims[i];
+		prim.bounds.grow(mins[i]);
+		prim.bounds.grow(maxs[i]);
+		prim.tidx = (uint32_t)i;
+		root.bounds.grow(prim.bounds);
+		root.centroids.grow(prim.centroid());
 	}
+	return buildFromPrims(prims, root, params);
+}
 
-	binaryDivisionBVH(mesh, maxTriangleCount, maxTreeDepth, *bvh, 0);
+namespace
+{
+	// BVH cache layout:
+	// BVHCacheHeader, then the nodes and the leaf triangle order at their
+	// offsets, aligned to k_bvhCacheAlignment. Data is stored as in memory.
 
-	timing.end();
-	logDebug("BVH", "BHV Creation took " + std::to_string(timing.elapsedSeconds()) + " seconds.");
+	const char k_bvhCacheMagic[8] = { 'B', 'A', 'K', 'E', 'C', 'B', 'V', 'H' };
+	const uint32_t k_bvhCacheVersion = 6;
+	const uint64_t k_bvhCacheAlignment = 64;
+	const size_t k_hashChunkTriangles = 64 * 1024;
 
-	return bvh;
-}
\ No newline at end of file
+	struct BVHCacheHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t maxTrianglesPerNode;
+		uint32_t bucketCount;
+		float traversalCost;
+		uint32_t maxTreeDepth;
+		uint32_t triangleCount; // Mesh triangles
+		float spatialSplitBudget;
+		uint32_t linear;
+		uint32_t optimizationPasses;
+		uint32_t referenceCount; // Entries of BVH::triangles
+		uint64_t topologyHash; // topologyHash() of the mesh the tree was built for
+		uint64_t contentHash; // geometryHash() of the mesh the tree was built or refitted for
+		float builtCost; // SAH cost of the tree when it was built, before any refit
+		uint32_t padding;
+		uint64_t nodeCount;
+		uint64_t nodesOffset;
+		uint64_t trianglesOffset;
+	};
+
+	static_assert(sizeof(BVHCacheHeader) == 96, "The BVH cache header must not have padding");
+
+	inline uint64_t mixHash(uint64_t h, uint64_t v)
+	{
+		h ^= v * 0x9e3779b97f4a7c15ull;
+		h = (h << 31) | (h >> 33);
+		return h * 0xbf58476d1ce4e5b9ull;
+	}
+
+	/// Hash of every triangle of a mesh, through hashTriangle(h, triangle)
+	/// Chunks are hashed in parallel and combined in order, so the hash does
+	/// not depend on the thread count.
+	template <typename HashTriangle>
+	uint64_t hashTriangles(const Mesh *mesh, const HashTriangle &hashTriangle)
+	{
+		const size_t count = mesh->triangles.size();
+		const size_t chunkCount = (count + k_hashChunkTriangles - 1) / k_hashChunkTriangles;
+		std::vector<uint64_t> chunkHashes(chunkCount);
+		ThreadPool::global().parallelFor(0, chunkCount, 1, [&](size_t begin, size_t end)
+		{
+			for (size_t c = begin; c < end; ++c)
+			{
+				uint64_t h = c + 1;
+				const size_t last = std::min(count, (c + 1) * k_hashChunkTriangles);
+				for (size_t t = c * k_hashChunkTriangles; t < last; ++t)
+				{
+					h = hashTriangle(h, mesh->triangles[t]);
+				}
+				chunkHashes[c] = h;
+			}
+		});
+
+		uint64_t h = count;
+		for (uint64_t chunkHash : chunkHashes) h = mixHash(h, chunkHash);
+		return h ^ (h >> 29);
+	}
+
+	/// Hash of the triangle corner positions, all the tree depends on
+	uint64_t geometryHash(const Mesh *mesh)
+	{
+		return hashTriangles(mesh, [mesh](uint64_t h, const Mesh::Triangle &tri)
+		{
+			for (size_t k = 0; k < 3; ++k)
+			{
+				const Vector3 &p = mesh->positions[mesh->vertices[(&tri.vertexIndex0)[k]].positionIndex];
+				uint32_t bits[3];
+				memcpy(bits, &p, sizeof(bits));
+				h = mixHash(h, bits[0] | (uint64_t(bits[1]) << 32));
+				h = mixHash(h, bits[2]);
+			}
+			return h;
+		});
+	}
+
+	/// Hash of the position indices of the triangle corners
+	/// Meshes with the same topology keep it when their vertices move, so
+	/// their cached trees can be refitted.
+	uint64_t topologyHash(const Mesh *mesh)
+	{
+		return mixHash(hashTriangles(mesh, [mesh](uint64_t h, const Mesh::Triangle &tri)
+		{
+			for (size_t k = 0; k < 3; ++k)
+			{
+				h = mixHash(h, mesh->vertices[(&tri.vertexIndex0)[k]].positionIndex);
+			}
+			return h;
+		}), mesh->positions.size());
+	}
+
+	BVHCacheHeader cacheHeader(const BVHBuildParams &params, uint64_t topologyHash, uint64_t contentHash, size_t triangleCount)
+	{
+		BVHCacheHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, k_bvhCacheMagic, sizeof(header.magic));
+		header.version = k_bvhCacheVersion;
+		header.maxTrianglesPerNode = uint32_t(params.maxTrianglesPerNode);
+		header.bucketCount = uint32_t(params.bucketCount);
+		header.traversalCost = params.traversalCost;
+		header.maxTreeDepth = uint32_t(params.maxTreeDepth);
+		header.triangleCount = uint32_t(triangleCount);
+		header.spatialSplitBudget = params.spatialSplitBudget;
+		header.linear = params.linear ? 1 : 0;
+		header.optimizationPasses = uint32_t(params.optimizationPasses);
+		header.topologyHash = topologyHash;
+		header.contentHash = contentHash;
+		return header;
+	}
+
+	/// Checks that the tree only points inside itself, so a damaged cache can not crash a bake
+	bool validTree(const BVH &bvh, size_t meshTriangleCount)
+	{
+		const size_t nodeCount = bvh.nodes.size();
+		const size_t triangleCount = bvh.triangles.size();
+		for (size_t i = 0; i < nodeCount; ++i)
+		{
+			const BVHNode &node = bvh.nodes[i];
+			// Inner nodes also need their second child inside their subtree, for ordered traversals
+			const bool valid = node.isLeaf() ?
+				uint64_t(node.offset) + node.count <= triangleCount :
+				node.offset > i + 2 && node.offset <= nodeCount && bvh.nodes[i + 1].skipIndex(uint32_t(i + 1)) < node.offset;
+			if (!valid) return false;
+		}
+		for (uint32_t t : bvh.triangles)
+		{
+			if (t >= meshTriangleCount) return false;
+		}
+		return true;
+	}
+
+	/// Loads a cached tree built with the same settings for a mesh of the same topology
+	/// o_header.contentHash tells whether the mesh vertices moved since.
+	BVH* loadBVHCache(const char *cachePath, const BVHCacheHeader &expected, BVHCacheHeader &o_header)
+	{
+		MappedFile file;
+		if (!file.open(cachePath) || file.size() < sizeof(BVHCacheHeader)) return nullptr;
+
+		BVHCacheHeader &header = o_header;
+		memcpy(&header, file.data(), sizeof(header));
+		if (memcmp(&header, &expected, offsetof(BVHCacheHeader, referenceCount)) != 0 ||
+			header.topologyHash != expected.topologyHash)
+		{
+			return nullptr;
+		}
+
+		const uint64_t nodesSize = header.nodeCount * sizeof(BVHNode);
+		const uint64_t trianglesSize = uint64_t(header.referenceCount) * sizeof(uint32_t);
+		if (header.nodeCount > file.size() / sizeof(BVHNode) ||
+			header.nodesOffset > file.size() || nodesSize > file.size() - header.nodesOffset ||
+			header.trianglesOffset > file.size() || trianglesSize > file.size() - header.trianglesOffset)
+		{
+			return nullptr;
+		}
+
+		// One bulk copy per section: the BVH owns its vectors and refit() writes to the nodes
+		std::unique_ptr<BVH> bvh(new BVH());
+		const BVHNode *nodes = reinterpret_cast<const BVHNode*>(file.data() + header.nodesOffset);
+		const uint32_t *triangles = reinterpret_cast<const uint32_t*>(file.data() + header.trianglesOffset);
+		bvh->nodes.assign(nodes, nodes + header.nodeCount);
+		bvh->triangles.assign(triangles, triangles + header.referenceCount);
+		return validTree(*bvh, header.triangleCount) ? bvh.release() : nullptr;
+	}
+
+	bool saveBVHCache(const BVH &bvh, const char *cachePath, BVHCacheHeader header)
+	{
+		header.referenceCount = uint32_t(bvh.triangles.size());
+		header.nodeCount = bvh.nodes.size();
+		header.nodesOffset = (sizeof(header) + k_bvhCacheAlignment - 1) / k_bvhCacheAlignment * k_bvhCacheAlignment;
+		header.trianglesOffset = header.nodesOffset + header.nodeCount * sizeof(BVHNode);
+		header.trianglesOffset = (header.trianglesOffset + k_bvhCacheAlignment - 1) / k_bvhCacheAlignment * k_bvhCacheAlignment;
+
+		// Written next to the cache and renamed, so a bake never maps a half written file
+		const std::string tmpPath = std::string(cachePath) + ".tmp";
+		{
+			std::ofstream ofs(tmpPath, std::ios::binary | std::ios::trunc);
+			if (!ofs) return false;
+			const char padding[k_bvhCacheAlignment] = {};
+			ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			ofs.write(padding, (std::streamsize)(header.nodesOffset - sizeof(header)));
+			ofs.write(reinterpret_cast<const char*>(bvh.nodes.data()), (std::streamsize)(bvh.nodes.size() * sizeof(BVHNode)));
+			ofs.write(padding, (std::streamsize)(header.trianglesOffset - header.nodesOffset - bvh.nodes.size() * sizeof(BVHNode)));
+			ofs.write(reinterpret_cast<const char*>(bvh.triangles.data()), (std::streamsize)(bvh.triangles.size() * sizeof(uint32_t)));
+			if (!ofs)
+			{
+				ofs.close();
+				std::remove(tmpPath.c_str());
+				return false;
+			}
+		}
+		std::remove(cachePath);
+		if (std::rename(tmpPath.c_str(), cachePath) != 0)
+		{
+			std::remove(tmpPath.c_str());
+			return false;
+		}
+		return true;
+	}
+}
+
+std::string BVH::cachePath(const char *meshPath)
+{
+	return std::string(meshPath) + ".bakecbvh";
+}
+
+BVH* BVH::createBinaryCached(const Mesh *mesh, const BVHBuildParams &params, const char *meshPath)
+{
+	Timing timing;
+	timing.begin();
+
+	const std::string path = cachePath(meshPath);
+	BVHCacheHeader header = cacheHeader(params, topologyHash(mesh), geometryHash(mesh), mesh->triangles.size());
+	BVHCacheHeader cached;
+	std::unique_ptr<BVH> bvh(loadBVHCache(path.c_str(), header, cached));
+	if (bvh && cached.contentHash == header.contentHash)
+	{
+		timing.end();
+		logDebug("BVH", "Loaded " + path + " in " + std::to_string(timing.elapsedSeconds()) + " seconds.");
+		return bvh.release();
+	}
+
+	// Same triangles with moved vertices: the cached tree is refitted while it stays close to a new build
+	if (bvh && params.refitThreshold > 0.0f)
+	{
+		bvh->refit(mesh);
+		const float cost = BVHStats::compute(*bvh, params.traversalCost).sahCost;
+		timing.end();
+		char line[256];
+		if (cost <= cached.builtCost * (1.0f + params.refitThreshold))
+		{
+			snprintf(line, sizeof(line), "Refitted %s in %.3f seconds, SAH cost %.3f (%.3f when built).",
+				path.c_str(), timing.elapsedSeconds(), cost, cached.builtCost);
+			logDebug("BVH", line);
+			header.builtCost = cached.builtCost;
+			if (!saveBVHCache(*bvh, path.c_str(), header))
+			{
+				logWarning("BVH", "Could not write the BVH cache " + path);
+			}
+			return bvh.release();
+		}
+		snprintf(line, sizeof(line), "Refitting %s raised the SAH cost from %.3f to %.3f, rebuilding it.",
+			path.c_str(), cached.builtCost, cost);
+		logDebug("BVH", line);
+	}
+
+	bvh.reset(createBinary(mesh, params));
+	header.builtCost = BVHStats::compute(*bvh, params.traversalCost).sahCost;
+	if (!saveBVHCache(*bvh, path.c_str(), header))
+	{
+		logWarning("BVH", "Could not write the BVH cache " + path);
+	}
+	return bvh.release();
+}
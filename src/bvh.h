@@ -22,26 +22,134 @@ SOFTWARE.
 
 #pragma once
 
+#include "alignedallocator.h"
 #include "math.h"
 #include <vector>
+#include <cmath>
 #include <cstdint>
+#include <string>
 
 class Mesh;
+class QuantizedGeometry;
 
-/// Bounding Volume Hierarchy node
+/// Flattened BVH node (32 bytes, two per cache line)
+/// Nodes are stored in depth-first order: the first child of an inner node
+/// is the next node, and the second child follows the first child subtree.
+/// The same layout is uploaded to the GPU (struct BVH in shaders/common.sh).
+struct BVHNode
+{
+	static const uint32_t k_innerNode = 0x80000000u; // Set in the count of inner nodes
+	static const uint32_t k_reversedSplit = 4u; // Inner nodes: the second child is below the first one along the split axis
+
+	Vector3 aabbMin;
+	uint32_t offset; // Leaf: first triangle in BVH::triangles. Inner node: index of the node after its subtree
+	Vector3 aabbMax;
+	uint32_t count; // Leaf: number of triangles. Inner node: k_innerNode with the split axis, or zero if it is not known
+
+	inline bool isLeaf() const { return count > 0 && count < k_innerNode; }
+
+	/// Index of the next node when the subtree of this node is skipped
+	inline uint32_t skipIndex(uint32_t nodeIndex) const { return isLeaf() ? nodeIndex + 1 : offset; }
+
+	/// Inner nodes: whether a ray along d reaches the second child first
+	/// Ordered traversals descend into that child first, so close hits cull the other one.
+	inline bool secondChildFirst(const Vector3 &d) const
+	{
+		const uint32_t axis = count & 3u;
+		const float dAxis = axis == 0 ? d.x : (axis == 1 ? d.y : d.z);
+		return (dAxis < 0.0f) != ((count & k_reversedSplit) != 0);
+	}
+
+	/// Count of an inner node, with the axis its children are furthest apart on
+	/// @param firstCenter, secondCenter Centers (or sums of the corners) of the child bounds
+	static inline uint32_t innerCount(const Vector3 &firstCenter, const Vector3 &secondCenter)
+	{
+		const Vector3 delta = secondCenter - firstCenter;
+		const Vector3 extent(std::fabs(delta.x), std::fabs(delta.y), std::fabs(delta.z));
+		const uint32_t axis = extent.x >= extent.y && extent.x >= extent.z ? 0u : (extent.y >= extent.z ? 1u : 2u);
+		const float dAxis = axis == 0 ? delta.x : (axis == 1 ? delta.y : delta.z);
+		return k_innerNode | axis | (dAxis < 0.0f ? k_reversedSplit : 0u);
+	}
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode must be 32 bytes");
+
+/// Settings of the binned SAH builder
+struct BVHBuildParams
+{
+	size_t maxTrianglesPerNode = 8; // Nodes with more triangles are always split
+	size_t maxTreeDepth = 8192;
+	size_t bucketCount = 16; // SAH buckets per axis, from 2 to 64
+	float traversalCost = 1.0f; // Cost of visiting a node relative to intersecting a triangle
+	/// Spatial splits (SBVH): references that split triangles may add, relative to the triangle count
+	/// Zero only splits the triangle lists. Triangles split by a plane are
+	/// referenced from several leaves, so BVH::triangles gets longer.
+	float spatialSplitBudget = 0.0f;
+	/// Linear builder (LBVH): sorts the triangles along a Morton curve and splits them by their codes
+	/// Builds several times faster than binned SAH but the tree is slower to
+	/// trace, for previews. Bucket count, traversal cost and spatial splits
+	/// are not used.
+	bool linear = false;
+	/// Treelet restructuring passes (TRBVH) run over the built tree, zero for none
+	/// Every pass rearranges the nodes below each inner node, up to seven
+	/// subtrees at a time, into the arrangement of lowest SAH cost.
+	size_t optimizationPasses = 0;
+	/// createBinaryCached(): SAH cost increase, relative to the cached build, up to which a tree is refitted
+	/// Applies when the mesh has the same triangles as the cached tree but its
+	/// vertices moved. Zero always rebuilds. Not part of the cache key.
+	float refitThreshold = 0.25f;
+};
+
+/// Bounding Volume Hierarchy
 class BVH
 {
 public:
-	AABB aabb;
-	size_t subtreeTriangleCount; // For optimizations
-	std::vector<BVH> children;
-	std::vector<uint32_t> triangles;
+	typedef std::vector<BVHNode, AlignedAllocator<BVHNode, 64> > NodeArray;
+
+	NodeArray nodes; // Depth-first order, root first
+	std::vector<uint32_t> triangles; // Mesh triangle indices in leaf order, repeated for triangles split by spatial splits
+
+	inline AABB aabb() const
+	{
+		return nodes.empty() ? AABB() :
+			AABB((nodes[0].aabbMin + nodes[0].aabbMax) * 0.5f, (nodes[0].aabbMax - nodes[0].aabbMin) * 0.5f);
+	}
 
-	BVH() : subtreeTriangleCount(0) {}
+	/// Recomputes the node bounds for moved vertices of the mesh the tree was built for
+	/// The nodes are refitted bottom-up, large subtrees in parallel. The tree
+	/// keeps its topology, so it gets slower to trace as the mesh deforms.
+	void refit(const Mesh *mesh);
+	/// Recomputes the node bounds for the decoded vertices of geometry quantized for this tree
+	/// Vertices snap to the nearest grid point, up to half a cell outside the bounds of the mesh.
+	void refit(const QuantizedGeometry &geometry);
 
-	/// Builds a bounding volume hierarchy for a mesh
+	/// Levels below the root of the deepest leaf
+	/// Ordered traversals keep at most this many nodes in their stack.
+	size_t depth() const;
+
+	/// Builds a bounding volume hierarchy for a mesh using binned SAH, or a linear BVH if params.linear is set
+	/// Large subtrees are built in parallel in the global thread pool.
+	/// Nodes under params.maxTrianglesPerNode become leaves when splitting
+	/// them does not lower the SAH cost. Linear trees split every node over it.
+	/// The SAH cost reached by params.optimizationPasses is logged.
 	/// @param mesh Mesh
-	/// @param maxTriangleCount Maximum number of triangles in a leaf node
-	/// @param maxTreeDepth Maximum depth of the tree (useful for stack based algorithms)
-	static BVH* createBinary(const Mesh *mesh, const size_t maxTriangleCount, const size_t maxTreeDepth);
-};
\ No newline at end of file
+	/// @param params Build settings
+	static BVH* createBinary(const Mesh *mesh, const BVHBuildParams &params);
+
+	/// createBinary() through a binary cache (cachePath(meshPath))
+	/// The cache is keyed by a hash of the triangle positions and the build
+	/// settings, so it is only rebuilt when the geometry or the settings
+	/// change. It is memory-mapped and checked before use, then its nodes and
+	/// triangle indices are copied out in bulk since the tree owns them and
+	/// may be refitted. Meshes with the same triangles as the cached tree but
+	/// moved vertices have the tree refitted, unless that raises its SAH cost
+	/// past params.refitThreshold.
+	static BVH* createBinaryCached(const Mesh *mesh, const BVHBuildParams &params, const char *meshPath);
+
+	/// BVH cache next to a mesh (path + ".bakecbvh")
+	static std::string cachePath(const char *meshPath);
+
+	/// Builds a bounding volume hierarchy over boxes, as the instances of a two-level tree
+	/// BVH::triangles holds box indices instead of triangles.
+	static BVH* createFromBounds(const Vector3 *mins, const Vector3 *maxs, size_t count, const BVHBuildParams &params);
+};
@@ -0,0 +1,502 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "bvhpages.h"
+#include "logging.h"
+#include "mesh.h"
+#include "raytracer.h"
+#include "threadpool.h"
+#include "timing.h"
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+namespace
+{
+	// Page file layout:
+	// PagesHeader, a PageInfo per page and the tree nodes, then the data of every
+	// page at its offset (aligned to k_pagesAlignment): BVH nodes, three vertex
+	// indices per triangle, vertex positions and vertex normals.
+	const char k_pagesMagic[8] = { 'B', 'A', 'K', 'E', 'C', 'P', 'G', 'S' };
+	const uint32_t k_pagesVersion = 3;
+	const uint64_t k_pagesAlignment = 64;
+
+	struct PagesHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t pageCount;
+		uint64_t sourceSize; // FileStamp of the source mesh when the pages were written
+		int64_t sourceModified;
+		uint32_t maxTrianglesPerNode; // BVHBuildParams of the page trees
+		uint32_t bucketCount;
+		float traversalCost;
+		uint32_t variant;
+		uint32_t treeNodeCount;
+		uint32_t triangleCount;
+		uint32_t optimizationPasses;
+		uint32_t padding;
+	};
+
+	static_assert(sizeof(PagesHeader) == 64, "The pages header must not have padding");
+	static_assert(sizeof(BVHPages::PageInfo) == 24, "The page table must not have padding");
+
+	struct PageRange
+	{
+		size_t begin;
+		size_t end;
+		uint32_t node; // Tree leaf of the page
+	};
+
+	/// Splits order[begin, end) at the median centroid along its longest axis until ranges fit in a page
+	/// The tree nodes are appended depth-first, as in the BVH, and the ranges in the same order.
+	/// @param keys Scratch of one float per mesh triangle
+	void splitPages(const Mesh *mesh, std::vector<uint32_t> &order, std::vector<float> &keys, size_t begin, size_t end,
+		size_t pageTriangles, std::vector<BVHNode> &o_tree, std::vector<PageRange> &o_pages)
+	{
+		const uint32_t nodeIndex = uint32_t(o_tree.size());
+		o_tree.push_back(BVHNode());
+		if (end - begin <= pageTriangles)
+		{
+			o_tree[nodeIndex].offset = uint32_t(o_pages.size());
+			o_tree[nodeIndex].count = 1;
+			o_pages.push_back(PageRange{ begin, end, nodeIndex });
+			return;
+		}
+
+		auto centroid = [&](uint32_t t)
+		{
+			const Mesh::Triangle &tri = mesh->triangles[t];
+			return (
+				mesh->positions[mesh->vertices[tri.vertexIndex0].positionIndex] +
+				mesh->positions[mesh->vertices[tri.vertexIndex1].positionIndex] +
+				mesh->positions[mesh->vertices[tri.vertexIndex2].positionIndex]) * (1.0f / 3.0f);
+		};
+
+		Vector3 mins(FLT_MAX, FLT_MAX, FLT_MAX);
+		Vector3 maxs(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		std::mutex boundsMutex;
+		ThreadPool::global().parallelFor(begin, end, 0, [&](size_t b, size_t e)
+		{
+			Vector3 localMins(FLT_MAX, FLT_MAX, FLT_MAX);
+			Vector3 localMaxs(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			for (size_t i = b; i < e; ++i)
+			{
+				const Vector3 c = centroid(order[i]);
+				localMins = min(localMins, c);
+				localMaxs = max(localMaxs, c);
+			}
+			std::lock_guard<std::mutex> lock(boundsMutex);
+			mins = min(mins, localMins);
+			maxs = max(maxs, localMaxs);
+		});
+		const Vector3 extent = maxs - mins;
+		const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+		ThreadPool::global().parallelFor(begin, end, 0, [&](size_t b, size_t e)
+		{
+			for (size_t i = b; i < e; ++i)
+			{
+				const Vector3 c = centroid(order[i]);
+				keys[order[i]] = axis == 0 ? c.x : (axis == 1 ? c.y : c.z);
+			}
+		});
+		const size_t mid = begin + (end - begin) / 2;
+		std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+			[&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+
+		splitPages(mesh, order, keys, begin, mid, pageTriangles, o_tree, o_pages);
+		splitPages(mesh, order, keys, mid, end, pageTriangles, o_tree, o_pages);
+		o_tree[nodeIndex].offset = uint32_t(o_tree.size());
+		o_tree[nodeIndex].count = 0;
+	}
+
+	/// Page data as written to the file, vertices numbered in the order the leaves use them
+	struct PageData
+	{
+		std::unique_ptr<BVH> bvh;
+		std::vector<uint32_t> indices;
+		std::vector<Vector3> positions;
+		std::vector<Vector3> normals;
+	};
+
+	void buildPage(const Mesh *mesh, const uint32_t *triangles, size_t count, const BVHBuildParams &params, PageData &o_page)
+	{
+		// Mesh of the page, with a vertex per position and normal pair
+		Mesh pageMesh;
+		pageMesh.triangles.resize(count);
+		std::unordered_map<uint64_t, uint32_t> localVertices;
+		localVertices.reserve(count);
+		for (size_t t = 0; t < count; ++t)
+		{
+			const Mesh::Triangle &tri = mesh->triangles[triangles[t]];
+			for (size_t k = 0; k < 3; ++k)
+			{
+				const Mesh::Vertex &v = mesh->vertices[(&tri.vertexIndex0)[k]];
+				const uint64_t key = (uint64_t(v.positionIndex) << 32) | v.normalIndex;
+				auto inserted = localVertices.insert(std::make_pair(key, uint32_t(pageMesh.vertices.size())));
+				if (inserted.second)
+				{
+					const uint32_t local = inserted.first->second;
+					pageMesh.positions.push_back(mesh->positions[v.positionIndex]);
+					pageMesh.normals.push_back(mesh->normals[v.normalIndex]);
+					pageMesh.vertices.push_back(Mesh::Vertex{ local, 0, local });
+				}
+				(&pageMesh.triangles[t].vertexIndex0)[k] = inserted.first->second;
+			}
+		}
+
+		// Pages number their triangles once each, so they are built without spatial splits.
+		// They are written once and traced by many bakes, so always with SAH.
+		BVHBuildParams pageParams = params;
+		pageParams.spatialSplitBudget = 0.0f;
+		pageParams.linear = false;
+		o_page.bvh.reset(BVH::createBinary(&pageMesh, pageParams));
+
+		std::vector<uint32_t> remap(pageMesh.vertices.size(), UINT32_MAX);
+		o_page.indices.resize(count * 3);
+		o_page.positions.clear();
+		o_page.normals.clear();
+		for (size_t t = 0; t < count; ++t)
+		{
+			const Mesh::Triangle &tri = pageMesh.triangles[o_page.bvh->triangles[t]];
+			for (size_t k = 0; k < 3; ++k)
+			{
+				const uint32_t v = (&tri.vertexIndex0)[k];
+				if (remap[v] == UINT32_MAX)
+				{
+					remap[v] = uint32_t(o_page.positions.size());
+					o_page.positions.push_back(pageMesh.positions[v]);
+					o_page.normals.push_back(pageMesh.normals[v]);
+				}
+				o_page.indices[t * 3 + k] = remap[v];
+			}
+		}
+	}
+
+	template <typename T>
+	void writeArray(std::ofstream &ofs, const T *data, size_t count)
+	{
+		ofs.write(reinterpret_cast<const char*>(data), (std::streamsize)(count * sizeof(T)));
+	}
+}
+
+std::string BVHPages::pagesPath(const char *meshPath)
+{
+	return std::string(meshPath) + ".bakecpages";
+}
+
+bool BVHPages::build(const Mesh *mesh, const BVHBuildParams &params, uint32_t variant, const FileStamp &source,
+	const char *path, size_t pageTriangles)
+{
+	const size_t triangleCount = mesh->triangles.size();
+	if (triangleCount == 0 || triangleCount > UINT32_MAX / 3 || pageTriangles == 0) return false;
+
+	Timing timing;
+	timing.begin();
+
+	std::vector<BVHNode> tree;
+	std::vector<PageRange> ranges;
+	std::vector<uint32_t> order(triangleCount);
+	{
+		std::vector<float> keys(triangleCount);
+		for (size_t i = 0; i < triangleCount; ++i) order[i] = uint32_t(i);
+		splitPages(mesh, order, keys, 0, triangleCount, pageTriangles, tree, ranges);
+	}
+
+	PagesHeader header;
+	memcpy(header.magic, k_pagesMagic, sizeof(header.magic));
+	header.version = k_pagesVersion;
+	header.pageCount = uint32_t(ranges.size());
+	header.sourceSize = source.size;
+	header.sourceModified = source.modified;
+	header.maxTrianglesPerNode = uint32_t(params.maxTrianglesPerNode);
+	header.bucketCount = uint32_t(params.bucketCount);
+	header.traversalCost = params.traversalCost;
+	header.variant = variant;
+	header.treeNodeCount = uint32_t(tree.size());
+	header.triangleCount = uint32_t(triangleCount);
+	header.optimizationPasses = uint32_t(params.optimizationPasses);
+	header.padding = 0;
+
+	// Written next to the file and renamed, so a bake never maps a half written file
+	const std::string tmpPath = std::string(path) + ".tmp";
+	std::vector<PageInfo> pages(ranges.size());
+	{
+		std::ofstream ofs(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!ofs) return false;
+
+		// The tables are written again once the pages are known
+		const uint64_t tablesSize = sizeof(header) + sizeof(PageInfo) * pages.size() + sizeof(BVHNode) * tree.size();
+		const char padding[k_pagesAlignment] = {};
+		std::vector<char> tables(tablesSize, 0);
+		writeArray(ofs, tables.data(), tables.size());
+
+		uint64_t pos = tablesSize;
+		uint32_t firstTriangle = 0;
+		PageData page;
+		for (size_t p = 0; p < ranges.size() && ofs; ++p)
+		{
+			const size_t count = ranges[p].end - ranges[p].begin;
+			buildPage(mesh, &order[ranges[p].begin], count, params, page);
+
+			const uint64_t offset = (pos + k_pagesAlignment - 1) / k_pagesAlignment * k_pagesAlignment;
+			ofs.write(padding, (std::streamsize)(offset - pos));
+			writeArray(ofs, page.bvh->nodes.data(), page.bvh->nodes.size());
+			writeArray(ofs, page.indices.data(), page.indices.size());
+			writeArray(ofs, page.positions.data(), page.positions.size());
+			writeArray(ofs, page.normals.data(), page.normals.size());
+
+			PageInfo &info = pages[p];
+			info.offset = offset;
+			info.firstTriangle = firstTriangle;
+			info.triangleCount = uint32_t(count);
+			info.nodeCount = uint32_t(page.bvh->nodes.size());
+			info.vertexCount = uint32_t(page.positions.size());
+			pos = offset +
+				page.bvh->nodes.size() * sizeof(BVHNode) +
+				page.indices.size() * sizeof(uint32_t) +
+				page.positions.size() * sizeof(Vector3) * 2;
+			firstTriangle += uint32_t(count);
+
+			// Page leaves are bound by the root of their tree
+			BVHNode &leaf = tree[ranges[p].node];
+			leaf.aabbMin = page.bvh->nodes[0].aabbMin;
+			leaf.aabbMax = page.bvh->nodes[0].aabbMax;
+		}
+
+		// Children are after their parent, so inner bounds are merged backwards
+		for (size_t i = tree.size(); i-- > 0;)
+		{
+			BVHNode &node = tree[i];
+			if (node.isLeaf()) continue;
+			const BVHNode &first = tree[i + 1];
+			const BVHNode &second = tree[first.skipIndex(uint32_t(i + 1))];
+			node.aabbMin = min(first.aabbMin, second.aabbMin);
+			node.aabbMax = max(first.aabbMax, second.aabbMax);
+		}
+
+		ofs.seekp(0);
+		writeArray(ofs, &header, 1);
+		writeArray(ofs, pages.data(), pages.size());
+		writeArray(ofs, tree.data(), tree.size());
+		if (!ofs)
+		{
+			ofs.close();
+			std::remove(tmpPath.c_str());
+			return false;
+		}
+	}
+	std::remove(path);
+	if (std::rename(tmpPath.c_str(), path) != 0)
+	{
+		std::remove(tmpPath.c_str());
+		return false;
+	}
+
+	timing.end();
+	logDebug("BVH", "Wrote " + std::to_string(pages.size()) + " BVH pages to " + path + " in " + std::to_string(timing.elapsedSeconds()) + " seconds.");
+	return true;
+}
+
+BVHPages* BVHPages::open(const char *path, const BVHBuildParams &params, uint32_t variant, const FileStamp &source,
+	size_t budget, size_t bvhWidth, bool compressedNodes)
+{
+	std::unique_ptr<BVHPages> pages(new BVHPages());
+	MappedFile &file = pages->_file;
+	if (!file.open(path) || file.size() < sizeof(PagesHeader)) return nullptr;
+
+	PagesHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	if (memcmp(header.magic, k_pagesMagic, sizeof(header.magic)) != 0 ||
+		header.version != k_pagesVersion ||
+		header.sourceSize != source.size ||
+		header.sourceModified != source.modified ||
+		header.maxTrianglesPerNode != uint32_t(params.maxTrianglesPerNode) ||
+		header.bucketCount != uint32_t(params.bucketCount) ||
+		header.traversalCost != params.traversalCost ||
+		header.optimizationPasses != uint32_t(params.optimizationPasses) ||
+		header.variant != variant ||
+		header.pageCount == 0)
+	{
+		return nullptr;
+	}
+
+	const uint64_t tablesSize = sizeof(header) + sizeof(PageInfo) * uint64_t(header.pageCount) + sizeof(BVHNode) * uint64_t(header.treeNodeCount);
+	if (tablesSize > file.size()) return nullptr;
+
+	const PageInfo *infos = reinterpret_cast<const PageInfo*>(file.data() + sizeof(header));
+	pages->_pages.assign(infos, infos + header.pageCount);
+	const BVHNode *nodes = reinterpret_cast<const BVHNode*>(infos + header.pageCount);
+	pages->_tree = std::make_shared<BVH>();
+	pages->_tree->nodes.assign(nodes, nodes + header.treeNodeCount);
+	pages->_tree->triangles.resize(header.pageCount);
+	for (uint32_t p = 0; p < header.pageCount; ++p) pages->_tree->triangles[p] = p;
+	pages->_triangleCount = header.triangleCount;
+
+	uint32_t firstTriangle = 0;
+	for (uint32_t p = 0; p < header.pageCount; ++p)
+	{
+		const PageInfo &info = pages->_pages[p];
+		if (info.firstTriangle != firstTriangle || info.offset > file.size() || pages->pageFileSize(p) > file.size() - info.offset) return nullptr;
+		firstTriangle += info.triangleCount;
+	}
+	if (firstTriangle != header.triangleCount) return nullptr;
+
+	pages->_budget = budget;
+	pages->_bvhWidth = bvhWidth;
+	pages->_compressedNodes = compressedNodes;
+	pages->_slots.reset(new Slot[header.pageCount]);
+	for (uint32_t p = 0; p < header.pageCount; ++p)
+	{
+		pages->_slots[p].lastUse = 0;
+		pages->_slots[p].users = 0;
+	}
+	return pages.release();
+}
+
+BVHPages::BVHPages()
+	: _clock(0)
+{
+}
+
+BVHPages::~BVHPages()
+{
+	if (_loadCount > 0)
+	{
+		logDebug("BVH", "Loaded " + std::to_string(_loadCount) + " BVH pages of " + std::to_string(_pages.size()) + ".");
+	}
+}
+
+uint32_t BVHPages::pageOfTriangle(uint32_t triangle) const
+{
+	auto it = std::upper_bound(_pages.begin(), _pages.end(), triangle,
+		[](uint32_t t, const PageInfo &info) { return t < info.firstTriangle; });
+	return uint32_t(it - _pages.begin()) - 1;
+}
+
+size_t BVHPages::pageFileSize(uint32_t index) const
+{
+	const PageInfo &info = _pages[index];
+	return
+		size_t(info.nodeCount) * sizeof(BVHNode) +
+		size_t(info.triangleCount) * 3 * sizeof(uint32_t) +
+		size_t(info.vertexCount) * sizeof(Vector3) * 2;
+}
+
+std::shared_ptr<const Raytracer> BVHPages::load(uint32_t index) const
+{
+	const PageInfo &info = _pages[index];
+	const uint8_t *data = _file.data() + info.offset;
+
+	std::shared_ptr<BVH> bvh = std::make_shared<BVH>();
+	const BVHNode *nodes = reinterpret_cast<const BVHNode*>(data);
+	bvh->nodes.assign(nodes, nodes + info.nodeCount);
+	data += size_t(info.nodeCount) * sizeof(BVHNode);
+
+	RaytracerGeometry geometry;
+	const uint32_t *indices = reinterpret_cast<const uint32_t*>(data);
+	geometry.indices.assign(indices, indices + size_t(info.triangleCount) * 3);
+	data += size_t(info.triangleCount) * 3 * sizeof(uint32_t);
+	const Vector3 *positions = reinterpret_cast<const Vector3*>(data);
+	geometry.vertexPositions.assign(positions, positions + info.vertexCount);
+	const Vector3 *normals = positions + info.vertexCount;
+	geometry.vertexNormals.assign(normals, normals + info.vertexCount);
+
+	return std::shared_ptr<const Raytracer>(new Raytracer(bvh, std::move(geometry), _bvhWidth, false, _compressedNodes));
+}
+
+BVHPages::PageRef::PageRef(std::shared_ptr<const Raytracer> &&raytracer, std::atomic<uint32_t> *users)
+	: _raytracer(std::move(raytracer))
+	, _users(users)
+{
+}
+
+BVHPages::PageRef::PageRef(PageRef &&other)
+	: _raytracer(std::move(other._raytracer))
+	, _users(other._users)
+{
+	other._users = nullptr;
+}
+
+BVHPages::PageRef::~PageRef()
+{
+	if (_users) _users->fetch_sub(1);
+}
+
+bool BVHPages::unload(uint32_t index) const
+{
+	// Threads count themselves in users before reading the slot, so either
+	// the page is seen in use here or they find the slot empty and load it again
+	Slot &slot = _slots[index];
+	if (slot.users.load() > 0) return false;
+	std::shared_ptr<const Raytracer> raytracer = std::atomic_exchange(&slot.raytracer, std::shared_ptr<const Raytracer>());
+	if (slot.users.load() > 0)
+	{
+		std::atomic_store(&slot.raytracer, raytracer);
+		return false;
+	}
+	_residentBytes -= slot.bytes;
+	_resident.erase(std::find(_resident.begin(), _resident.end(), index));
+	return true;
+}
+
+BVHPages::PageRef BVHPages::page(uint32_t index) const
+{
+	Slot &slot = _slots[index];
+	slot.lastUse.store(_clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	slot.users.fetch_add(1);
+	std::shared_ptr<const Raytracer> raytracer = std::atomic_load(&slot.raytracer);
+	if (raytracer) return PageRef(std::move(raytracer), &slot.users);
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	raytracer = std::atomic_load(&slot.raytracer);
+	if (raytracer) return PageRef(std::move(raytracer), &slot.users); // Loaded by another thread meanwhile
+
+	raytracer = load(index);
+	std::atomic_store(&slot.raytracer, raytracer);
+	slot.bytes = raytracer->memorySize();
+	_resident.push_back(index);
+	_residentBytes += slot.bytes;
+	++_loadCount;
+
+	if (_residentBytes > _budget)
+	{
+		// Least recently used first, pages held by a thread are skipped and
+		// stay counted until a later load unloads them
+		std::vector<uint32_t> victims(_resident);
+		std::sort(victims.begin(), victims.end(), [this](uint32_t a, uint32_t b)
+		{
+			return _slots[a].lastUse.load(std::memory_order_relaxed) < _slots[b].lastUse.load(std::memory_order_relaxed);
+		});
+		for (uint32_t victim : victims)
+		{
+			if (_residentBytes <= _budget) break;
+			if (victim != index) unload(victim);
+		}
+	}
+	return PageRef(std::move(raytracer), &slot.users);
+}
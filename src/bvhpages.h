@@ -0,0 +1,147 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "bvh.h"
+#include "mappedfile.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class Mesh;
+class Raytracer;
+
+/// High-poly mesh split in spatial pages on disk, for meshes that do not fit in memory
+/// Every page holds a contiguous range of triangles with its own BVH and
+/// indexed geometry. A small tree over the page bounds stays in memory and
+/// pages are loaded when a ray reaches them, keeping the least recently used
+/// ones under a memory budget.
+/// Triangles are numbered page after page, each page in its BVH leaf order,
+/// so the paged Raytracer returns tidx as an in-memory one.
+class BVHPages
+{
+public:
+	static const size_t k_pageTriangles = 1 << 20;
+
+	/// Page file next to a mesh (path + ".bakecpages")
+	static std::string pagesPath(const char *meshPath);
+
+	/// Splits the mesh in pages of up to pageTriangles and writes them to path
+	/// Only one page is built in memory at a time.
+	/// @param variant Caller settings that change the mesh data (as the normal import), stored to detect stale pages
+	/// @param source Stamp of the mesh file the pages are built from
+	static bool build(const Mesh *mesh, const BVHBuildParams &params, uint32_t variant, const FileStamp &source,
+		const char *path, size_t pageTriangles = k_pageTriangles);
+
+	/// Opens a page file written by build() with the same settings
+	/// @param budget Bytes of pages kept in memory, counting their collapsed
+	/// trees. Pages held by a thread are never unloaded, so the pages in use
+	/// may exceed it by up to one page per thread.
+	/// @param bvhWidth Children per node of the loaded page trees (2, 4 or 8)
+	/// @param compressedNodes Quantizes the child bounds of wide page trees to 8 bits
+	/// @return nullptr if the file is missing, stale or invalid
+	static BVHPages* open(const char *path, const BVHBuildParams &params, uint32_t variant, const FileStamp &source,
+		size_t budget, size_t bvhWidth, bool compressedNodes = false);
+
+	~BVHPages();
+
+	/// Tree over the pages, leaves hold one page (offset is the page index)
+	/// BVH::triangles maps the leaf offsets to the pages, as in the two-level trees of instanced scenes.
+	inline std::shared_ptr<const BVH> tree() const { return _tree; }
+	inline size_t pageCount() const { return _pages.size(); }
+	inline size_t triangleCount() const { return _triangleCount; }
+	/// First triangle of a page in the numbering of the whole mesh
+	inline uint32_t firstTriangle(uint32_t page) const { return _pages[page].firstTriangle; }
+	/// Page holding a triangle
+	uint32_t pageOfTriangle(uint32_t triangle) const;
+
+	/// Page held by a thread, which pins it in memory until released
+	class PageRef
+	{
+	public:
+		PageRef(PageRef &&other);
+		~PageRef();
+		inline const Raytracer* get() const { return _raytracer.get(); }
+		inline const Raytracer* operator->() const { return _raytracer.get(); }
+
+	private:
+		friend class BVHPages;
+		PageRef(std::shared_ptr<const Raytracer> &&raytracer, std::atomic<uint32_t> *users);
+		PageRef(const PageRef&) = delete;
+		PageRef& operator=(const PageRef&) = delete;
+
+		std::shared_ptr<const Raytracer> _raytracer;
+		std::atomic<uint32_t> *_users;
+	};
+
+	/// Ray tracer of a page, loaded from disk if needed
+	/// Thread-safe. The page stays in memory while the returned reference is held.
+	PageRef page(uint32_t index) const;
+
+	/// Pages loaded from disk so far, counting reloads
+	inline size_t loadCount() const { return _loadCount; }
+
+	struct PageInfo
+	{
+		uint64_t offset; // Position of the page data in the file
+		uint32_t firstTriangle;
+		uint32_t triangleCount;
+		uint32_t nodeCount;
+		uint32_t vertexCount;
+	};
+
+private:
+	BVHPages();
+
+	std::shared_ptr<const Raytracer> load(uint32_t index) const;
+	/// Bytes of the page data in the file
+	size_t pageFileSize(uint32_t index) const;
+	/// Unloads a resident page unless a thread holds it
+	bool unload(uint32_t index) const;
+
+	struct Slot
+	{
+		std::shared_ptr<const Raytracer> raytracer; // Read and written atomically
+		std::atomic<uint64_t> lastUse;
+		std::atomic<uint32_t> users; // Threads holding the page, which can not be unloaded
+		size_t bytes = 0; // Memory of the loaded ray tracer
+	};
+
+	MappedFile _file;
+	std::shared_ptr<BVH> _tree;
+	std::vector<PageInfo> _pages;
+	size_t _triangleCount = 0;
+	size_t _budget = 0;
+	size_t _bvhWidth = 2;
+	bool _compressedNodes = false;
+
+	mutable std::unique_ptr<Slot[]> _slots;
+	mutable std::mutex _mutex; // Loads and unloads
+	mutable std::vector<uint32_t> _resident;
+	mutable size_t _residentBytes = 0;
+	mutable size_t _loadCount = 0;
+	mutable std::atomic<uint64_t> _clock;
+};
@@ -0,0 +1,176 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "bvhstats.h"
+#include "bvh.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace
+{
+	inline float halfArea(const Vector3 &mins, const Vector3 &maxs)
+	{
+		const Vector3 size = maxs - mins;
+		return size.x * size.y + size.y * size.z + size.z * size.x;
+	}
+
+	inline float halfArea(const BVHNode &node)
+	{
+		return halfArea(node.aabbMin, node.aabbMax);
+	}
+
+	/// Half area of the intersection of two boxes, zero when they do not overlap
+	inline float overlapArea(const BVHNode &a, const BVHNode &b)
+	{
+		const Vector3 mins = max(a.aabbMin, b.aabbMin);
+		const Vector3 maxs = min(a.aabbMax, b.aabbMax);
+		if (mins.x > maxs.x || mins.y > maxs.y || mins.z > maxs.z) return 0.0f;
+		return halfArea(mins, maxs);
+	}
+
+	/// Depth of every node, children always follow their parent
+	std::vector<uint32_t> nodeDepths(const BVH &bvh)
+	{
+		std::vector<uint32_t> depths(bvh.nodes.size(), 0);
+		for (uint32_t i = 0; i < uint32_t(bvh.nodes.size()); ++i)
+		{
+			const BVHNode &node = bvh.nodes[i];
+			if (node.isLeaf()) continue;
+			depths[i + 1] = depths[i] + 1;
+			depths[bvh.nodes[i + 1].skipIndex(i + 1)] = depths[i] + 1;
+		}
+		return depths;
+	}
+
+	inline float percent(size_t count, size_t total)
+	{
+		return total > 0 ? 100.0f * float(count) / float(total) : 0.0f;
+	}
+}
+
+BVHStats BVHStats::compute(const BVH &bvh, float traversalCost)
+{
+	BVHStats stats;
+	if (bvh.nodes.empty()) return stats;
+
+	const std::vector<uint32_t> depths = nodeDepths(bvh);
+	const float rootArea = halfArea(bvh.nodes[0]);
+	const float invRootArea = rootArea > 0.0f ? 1.0f / rootArea : 0.0f;
+	double depthSum = 0.0;
+
+	stats.nodeCount = bvh.nodes.size();
+	for (uint32_t i = 0; i < uint32_t(bvh.nodes.size()); ++i)
+	{
+		const BVHNode &node = bvh.nodes[i];
+		const float relativeArea = halfArea(node) * invRootArea;
+		const size_t depth = depths[i];
+		stats.maxDepth = std::max(stats.maxDepth, depth);
+
+		if (node.isLeaf())
+		{
+			++stats.leafCount;
+			stats.referenceCount += node.count;
+			stats.sahCost += relativeArea * float(node.count);
+			depthSum += double(depth);
+			if (stats.leafSizes.size() <= node.count) stats.leafSizes.resize(node.count + 1, 0);
+			++stats.leafSizes[node.count];
+			if (stats.leafDepths.size() <= depth) stats.leafDepths.resize(depth + 1, 0);
+			++stats.leafDepths[depth];
+			continue;
+		}
+
+		stats.nodeCost += relativeArea * traversalCost;
+		const BVHNode &left = bvh.nodes[i + 1];
+		const BVHNode &right = bvh.nodes[left.skipIndex(i + 1)];
+		const float overlap = overlapArea(left, right);
+		if (overlap > 0.0f) ++stats.overlappingNodes;
+		stats.overlap += overlap * invRootArea;
+		if (!(halfArea(left) > 0.0f)) ++stats.degenerateChildren;
+		if (!(halfArea(right) > 0.0f)) ++stats.degenerateChildren;
+	}
+	stats.sahCost += stats.nodeCost;
+	stats.averageLeafDepth = stats.leafCount > 0 ? float(depthSum / double(stats.leafCount)) : 0.0f;
+
+	return stats;
+}
+
+std::string BVHStats::summary() const
+{
+	char line[256];
+	std::string str;
+	snprintf(line, sizeof(line), "%zu nodes, %zu leaves, %zu triangle references\n", nodeCount, leafCount, referenceCount);
+	str += line;
+	snprintf(line, sizeof(line), "SAH cost %.3f (nodes %.3f, triangles %.3f)\n", sahCost, nodeCost, sahCost - nodeCost);
+	str += line;
+	snprintf(line, sizeof(line), "Sibling overlap %.3f of the root area in %zu of %zu inner nodes, %zu degenerate children\n",
+		overlap, overlappingNodes, nodeCount - leafCount, degenerateChildren);
+	str += line;
+	snprintf(line, sizeof(line), "Leaf depth %.1f average, %zu max\n", averageLeafDepth, maxDepth);
+	str += line;
+
+	str += "Leaf sizes:";
+	for (size_t count = 0; count < leafSizes.size(); ++count)
+	{
+		if (leafSizes[count] == 0) continue;
+		snprintf(line, sizeof(line), " %zu:%zu (%.1f%%)", count, leafSizes[count], percent(leafSizes[count], leafCount));
+		str += line;
+	}
+	str += "\nLeaf depths:";
+	for (size_t depth = 0; depth < leafDepths.size(); ++depth)
+	{
+		if (leafDepths[depth] == 0) continue;
+		snprintf(line, sizeof(line), " %zu:%zu", depth, leafDepths[depth]);
+		str += line;
+	}
+	return str;
+}
+
+bool BVHStats::writeNodes(const BVH &bvh, float traversalCost, const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) return false;
+
+	const std::vector<uint32_t> depths = nodeDepths(bvh);
+	const float rootArea = bvh.nodes.empty() ? 0.0f : halfArea(bvh.nodes[0]);
+	const float invRootArea = rootArea > 0.0f ? 1.0f / rootArea : 0.0f;
+
+	fprintf(f, "node,depth,leaf,triangles,halfArea,relativeArea,childOverlap,cost\n");
+	for (uint32_t i = 0; i < uint32_t(bvh.nodes.size()); ++i)
+	{
+		const BVHNode &node = bvh.nodes[i];
+		const float area = halfArea(node);
+		const float relativeArea = area * invRootArea;
+		float childOverlap = 0.0f;
+		float cost = relativeArea * float(node.count);
+		if (!node.isLeaf())
+		{
+			const BVHNode &left = bvh.nodes[i + 1];
+			const BVHNode &right = bvh.nodes[left.skipIndex(i + 1)];
+			childOverlap = area > 0.0f ? overlapArea(left, right) / area : 0.0f;
+			cost = relativeArea * traversalCost;
+		}
+		fprintf(f, "%u,%u,%d,%u,%g,%g,%g,%g\n", i, depths[i], node.isLeaf() ? 1 : 0, node.isLeaf() ? node.count : 0, area, relativeArea, childOverlap, cost);
+	}
+
+	const bool ok = ferror(f) == 0;
+	return fclose(f) == 0 && ok;
+}
@@ -0,0 +1,59 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class BVH;
+
+/// Quality figures of a binary BVH, to compare builders and build settings
+struct BVHStats
+{
+	size_t nodeCount = 0;
+	size_t leafCount = 0;
+	size_t referenceCount = 0; // Triangle references in the leaves
+	float sahCost = 0.0f; // Expected cost of a ray through the root box, in triangle intersections
+	float nodeCost = 0.0f; // Part of sahCost spent visiting inner nodes
+	float overlap = 0.0f; // Area shared by sibling boxes, relative to the root area
+	size_t overlappingNodes = 0; // Inner nodes whose children overlap
+	size_t degenerateChildren = 0; // Children with a zero area box, as flat or empty triangles give
+	size_t maxDepth = 0;
+	float averageLeafDepth = 0.0f;
+	std::vector<size_t> leafSizes; // Leaf count by triangle count
+	std::vector<size_t> leafDepths; // Leaf count by depth
+
+	/// Walks the whole tree once
+	/// @param traversalCost Cost of visiting a node relative to intersecting a triangle, as in BVHBuildParams
+	static BVHStats compute(const BVH &bvh, float traversalCost);
+
+	/// Multi-line report of the figures and histograms
+	std::string summary() const;
+
+	/// Writes the statistics of every node as CSV, one line per node in tree order
+	/// Columns: node, depth, leaf, triangles, half area, area relative to the
+	/// root, overlap of the children relative to the node and SAH cost.
+	/// @return False if the file could not be written
+	static bool writeNodes(const BVH &bvh, float traversalCost, const char *path);
+};
@@ -0,0 +1,238 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../fornos.h"
+#include "../jobfile.h"
+#include "../logging.h"
+#include "../threadpool.h"
+#include "../timing.h"
+
+namespace
+{
+	struct TaskTiming
+	{
+		std::string name;
+		double seconds;
+	};
+
+	/// Command line settings applied on top of every job file
+	struct JobOverrides
+	{
+		int threadCount = -1;
+		const char *bvhStatsPath = nullptr;
+		int orderedTraversal = -1; // 0 or 1 when set
+	};
+
+	void printUsage()
+	{
+		printf(
+			"Usage: bakec-cli [options] job.json [job.json ...]\n"
+			"Bakes every job file without opening a window. The CPU backend is always used.\n"
+			"Options:\n"
+			"  --threads N   Number of CPU threads (default: job file value or all hardware threads)\n"
+			"  --quiet       Only print errors and the summary\n"
+			"  --bvh-stats F Writes the statistics of every high-poly BVH node to the CSV file F\n"
+			"  --traversal T BVH traversal of the binary tree: \"stackless\" or \"ordered\" (default: job file value)\n"
+			"                Only has an effect with \"cpuBVHWidth\": \"binary\", wide BVHs ignore it\n"
+			"  --build-pages Splits the high-poly mesh of every job in out-of-core pages instead of baking it\n"
+			"  --help        Shows this help\n");
+	}
+
+	/// Every solver runs on the CPU as there is no graphics device
+	void forceCPU(FornosParameters &params)
+	{
+		params.shared.mappingBackend = ComputeBackend::CPU;
+		params.height.backend = ComputeBackend::CPU;
+		params.positions.backend = ComputeBackend::CPU;
+		params.normals.backend = ComputeBackend::CPU;
+		params.ao.backend = ComputeBackend::CPU;
+		params.bentNormals.backend = ComputeBackend::CPU;
+		params.thickness.backend = ComputeBackend::CPU;
+	}
+
+	bool checkOutputs(FornosParameters &params, std::string &errors)
+	{
+		struct Solver { const char *name; bool enabled; bool ready; };
+		const Solver solvers[] =
+		{
+			{ "height", params.height.enabled, params.height.ready() },
+			{ "positions", params.positions.enabled, params.positions.ready() },
+			{ "normals", params.normals.enabled, params.normals.ready() },
+			{ "ao", params.ao.enabled, params.ao.ready() },
+			{ "bentNormals", params.bentNormals.enabled, params.bentNormals.ready() },
+			{ "thickness", params.thickness.enabled, params.thickness.ready() },
+		};
+		bool any = false;
+		for (const Solver &s : solvers)
+		{
+			if (s.enabled && !s.ready) errors += std::string("Missing ") + s.name + ".outputPath\n";
+			any = any || s.enabled;
+		}
+		if (!any) errors += "No solver is enabled\n";
+		return errors.empty();
+	}
+
+	/// Writes the out-of-core pages of the high-poly mesh of a job, see FornosRunner::buildPages()
+	bool buildJobPages(const char *path, const JobOverrides &overrides, std::string &errors)
+	{
+		FornosParameters params;
+		if (!loadJobFile(path, params, errors)) return false;
+		if (overrides.threadCount >= 0) params.shared.cpuThreads = overrides.threadCount;
+		return FornosRunner::buildPages(params, errors);
+	}
+
+	/// Runs a job to completion
+	/// @return False if the job could not be started or any of its outputs could not be written
+	bool runJob(const char *path, const JobOverrides &overrides, std::vector<TaskTiming> &o_timings, std::string &errors)
+	{
+		FornosParameters params;
+		if (!loadJobFile(path, params, errors)) return false;
+		if (!checkOutputs(params, errors)) return false;
+		forceCPU(params);
+		if (overrides.threadCount >= 0) params.shared.cpuThreads = overrides.threadCount;
+		if (overrides.bvhStatsPath) params.shared.bvhStatsPath = overrides.bvhStatsPath;
+		if (overrides.orderedTraversal >= 0) params.shared.bvhOrderedTraversal = overrides.orderedTraversal != 0;
+
+		Timing setupTiming;
+		setupTiming.begin();
+		FornosRunner runner;
+		if (!runner.start(params, errors)) return false;
+		setupTiming.end();
+		o_timings.push_back(TaskTiming{ "Setup", setupTiming.elapsedSeconds() });
+
+		// Tasks run from the back, each one finishes (and exports) before the next starts
+		while (runner.pending())
+		{
+			const std::string name = runner.currentTask()->name();
+			const size_t count = runner.pendingCount();
+			Timing timing;
+			timing.begin();
+			while (runner.pendingCount() == count) runner.run();
+			timing.end();
+			o_timings.push_back(TaskTiming{ name, timing.elapsedSeconds() });
+		}
+
+		errors += runner.errors();
+		return runner.errors().empty();
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<const char*> jobs;
+	JobOverrides overrides;
+	bool quiet = false;
+	bool buildPages = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0)
+		{
+			printUsage();
+			return 0;
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			overrides.threadCount = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--quiet") == 0)
+		{
+			quiet = true;
+		}
+		else if (strcmp(argv[i], "--build-pages") == 0)
+		{
+			buildPages = true;
+		}
+		else if (strcmp(argv[i], "--bvh-stats") == 0 && i + 1 < argc)
+		{
+			overrides.bvhStatsPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--traversal") == 0 && i + 1 < argc &&
+			(strcmp(argv[i + 1], "stackless") == 0 || strcmp(argv[i + 1], "ordered") == 0))
+		{
+			overrides.orderedTraversal = strcmp(argv[++i], "ordered") == 0 ? 1 : 0;
+		}
+		else if (argv[i][0] == '-')
+		{
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			printUsage();
+			return 2;
+		}
+		else
+		{
+			jobs.push_back(argv[i]);
+		}
+	}
+
+	if (jobs.empty())
+	{
+		printUsage();
+		return 2;
+	}
+
+	// The log buffer is only read by the UI, it would grow without limit here
+	disableLogBuffer();
+	if (quiet) disableLogDebug();
+
+	if (overrides.threadCount >= 0) ThreadPool::setGlobalThreadCount((size_t)overrides.threadCount);
+
+	size_t failedCount = 0;
+	Timing totalTiming;
+	totalTiming.begin();
+
+	for (const char *job : jobs)
+	{
+		std::vector<TaskTiming> timings;
+		std::string errors;
+		Timing jobTiming;
+		jobTiming.begin();
+		const bool ok = buildPages ?
+			buildJobPages(job, overrides, errors) :
+			runJob(job, overrides, timings, errors);
+		jobTiming.end();
+
+		if (!ok)
+		{
+			++failedCount;
+			logError("CLI", std::string(job) + " failed:\n" + errors);
+			continue;
+		}
+
+		printf("%s: %.3f s\n", job, jobTiming.elapsedSeconds());
+		for (const TaskTiming &t : timings)
+		{
+			printf("  %-20s %9.3f s\n", t.name.c_str(), t.seconds);
+		}
+	}
+
+	totalTiming.end();
+	printf("%zu/%zu jobs %s in %.3f s (%zu threads)\n",
+		jobs.size() - failedCount, jobs.size(), buildPages ? "paged" : "baked", totalTiming.elapsedSeconds(), ThreadPool::global().threadCount());
+
+	return failedCount == 0 ? 0 : 1;
+}
@@ -34,6 +34,10 @@ class FornosTask;
 
 enum NormalImport { Import = 0, ComputePerFace = 1, ComputePerVertex = 2 };
 enum MeshMappingMethod { Smooth = 0, LowPolyNormals = 1, Hybrid = 2 };
+enum ComputeBackend { GPU = 0, CPU = 1 };
+enum BVHWidth { Binary = 0, Wide4 = 1, Wide8 = 2 };
+enum CPUGeometry { Unindexed = 0, Indexed = 1, Quantized = 2 };
+enum BVHBuilder { SAH = 0, Linear = 1 };
 
 struct FornosParameters_Shared
 {
@@ -41,18 +45,38 @@ struct FornosParameters_Shared
 	std::string hiPolyMeshPath;
 	NormalImport loPolyMeshNormal = NormalImport::Import;
 	NormalImport hiPolyMeshNormal = NormalImport::Import;
+	bool meshCache = true; // Load meshes and the high-poly BVH through binary caches written next to them
+	float bvhRefitThreshold = 0.25f; // SAH cost increase up to which the cached BVH of a deformed mesh is refitted (0 always rebuilds)
+	BVHBuilder bvhBuilder = BVHBuilder::SAH; // Linear builds much faster for previews, the tree is slower to trace
 	int bvhTrisPerNode = 8;
+	int bvhBuckets = 16;
+	float bvhTraversalCost = 1.0f; // Relative to the cost of intersecting a triangle
+	float bvhSpatialSplits = 0.0f; // References spatial splits may add, relative to the triangle count (0 disables them)
+	int bvhOptimizationPasses = 0; // Treelet restructuring passes run after the build (0 disables them)
+	bool bvhOrderedTraversal = false; // Binary trees are traversed nearest child first with a stack, instead of the stackless walk
+	std::string bvhStatsPath; // CSV file the statistics of every high-poly BVH node are written to, empty skips it
 	int texWidth = 2048;
 	int texHeight = 2048;
 	int texDilation = 16;
 	bool ignoreBackfaces = true;
 	MeshMappingMethod mapping = MeshMappingMethod::Smooth;
 	float mappingEdge = 0.05f;
+	float mappingWeld = 0.0f; // Distance to weld low-poly positions at when smoothing mapping normals
+	float mappingFrontDistance = 0.0f; // Distance the mapping rays search along the mapping direction (0 is unlimited)
+	float mappingRearDistance = 0.0f; // Distance the mapping rays search against the mapping direction (0 is unlimited)
+	std::string mappingCagePath; // Mesh the mapping rays search up to along the mapping direction, empty uses mappingFrontDistance
+	ComputeBackend mappingBackend = ComputeBackend::GPU;
+	int cpuThreads = 0; // Zero uses all the hardware threads
+	BVHWidth cpuBVHWidth = BVHWidth::Wide4; // Tree traversed by the CPU backend
+	bool cpuBVHCompressed = false; // Wide trees keep their child bounds in 8 bits, half the node memory
+	CPUGeometry cpuGeometry = CPUGeometry::Unindexed; // High-poly triangles in memory, smaller ones are slower. The GPU gets quantized ones indexed
+	int outOfCoreBudget = 0; // MB of high-poly pages kept in memory, zero loads the whole high-poly mesh
 };
 
 struct FornosParameters_SolverHeight
 {
 	bool enabled = false;
+	ComputeBackend backend = ComputeBackend::GPU;
 	std::string outputPath;
 
 	bool ready() { return enabled && !outputPath.empty(); }
@@ -61,6 +85,7 @@ struct FornosParameters_SolverHeight
 struct FornosParameters_SolverPositions
 {
 	bool enabled = false;
+	ComputeBackend backend = ComputeBackend::GPU;
 	std::string outputPath;
 
 	bool ready() { return enabled && !outputPath.empty(); }
@@ -69,6 +94,7 @@ struct FornosParameters_SolverPositions
 struct FornosParameters_SolverNormals
 {
 	bool enabled = false;
+	ComputeBackend backend = ComputeBackend::GPU;
 	bool tangentSpace = true;
 	std::string outputPath;
 
@@ -78,6 +104,7 @@ struct FornosParameters_SolverNormals
 struct FornosParameters_SolverAO
 {
 	bool enabled = false;
+	ComputeBackend backend = ComputeBackend::GPU;
 	int sampleCount = 256;
 	float minDistance = 0.01f;
 	float maxDistance = 10.0f;
@@ -89,6 +116,7 @@ struct FornosParameters_SolverAO
 struct FornosParameters_SolverBentNormals
 {
 	bool enabled = false;
+	ComputeBackend backend = ComputeBackend::GPU;
 	int sampleCount = 256;
 	float minDistance = 0.01f;
 	float maxDistance = 10.0f;
@@ -101,6 +129,7 @@ struct FornosParameters_SolverBentNormals
 struct FornosParameters_SolverThickness
 {
 	bool enabled = false;
+	ComputeBackend backend = ComputeBackend::GPU;
 	int sampleCount = 256;
 	float minDistance = 0.01f;
 	float maxDistance = 10.0f;
@@ -129,7 +158,8 @@ class FornosTask
 public:
 	virtual ~FornosTask() {}
 	virtual bool runStep() = 0;
-	virtual void finish() = 0;
+	/// @return False if the results could not be exported
+	virtual bool finish() = 0;
 	virtual float progress() const = 0;
 	virtual const char* name() const = 0;
 };
@@ -138,10 +168,18 @@ class FornosRunner
 {
 public:
 	bool start(const FornosParameters &params, std::string &errors);
+	/// Splits the high-poly mesh of out-of-core bakes in pages on disk (see BVHPages)
+	/// The whole mesh is loaded once, so this is an offline step for a machine with
+	/// enough memory. Out-of-core bakes only read the pages and fail without them.
+	static bool buildPages(const FornosParameters &params, std::string &errors);
 	bool pending() const { return !_tasks.empty(); }
+	size_t pendingCount() const { return _tasks.size(); }
 	void run();
 	const FornosTask* currentTask() const { return _tasks.empty() ? nullptr : _tasks.back(); }
+	/// Tasks of the last bake that could not export their results, one per line
+	const std::string& errors() const { return _errors; }
 
 private:
 	std::vector<FornosTask*> _tasks;
+	std::string _errors;
 };
\ No newline at end of file
@@ -0,0 +1,429 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "fornos.h"
+#include "bvh.h"
+#include "bvhpages.h"
+#include "bvhstats.h"
+#include "compute.h"
+#include "instancedscene.h"
+#include "logging.h"
+#include "mesh.h"
+#include "meshmapping.h"
+#include "threadpool.h"
+
+#include "solver_ao.h"
+#include "solver_bentnormals.h"
+#include "solver_height.h"
+#include "solver_position.h"
+#include "solver_normals.h"
+#include "solver_thickness.h"
+#include <algorithm>
+#include <cfloat>
+
+namespace
+{
+	void importNormals(Mesh *mesh, NormalImport normal)
+	{
+		switch (normal)
+		{
+		case NormalImport::Import: break;
+		case NormalImport::ComputePerFace: mesh->computeFaceNormals(); break;
+		case NormalImport::ComputePerVertex: mesh->computeVertexNormals(); break;
+		}
+	}
+
+	BVHBuildParams bvhBuildParams(const FornosParameters &params)
+	{
+		BVHBuildParams bvhParams;
+		bvhParams.maxTrianglesPerNode = (size_t)std::max(params.shared.bvhTrisPerNode, 1);
+		bvhParams.bucketCount = (size_t)std::max(params.shared.bvhBuckets, 2);
+		bvhParams.traversalCost = params.shared.bvhTraversalCost;
+		bvhParams.spatialSplitBudget = params.shared.bvhSpatialSplits;
+		bvhParams.linear = params.shared.bvhBuilder == BVHBuilder::Linear;
+		bvhParams.optimizationPasses = (size_t)std::max(params.shared.bvhOptimizationPasses, 0);
+		bvhParams.refitThreshold = std::max(params.shared.bvhRefitThreshold, 0.0f);
+		return bvhParams;
+	}
+
+	/// The low-poly mesh is traced when no high-poly mesh is set
+	const std::string& hiPolyPath(const FornosParameters &params)
+	{
+		return params.shared.hiPolyMeshPath.empty() ? params.shared.loPolyMeshPath : params.shared.hiPolyMeshPath;
+	}
+
+	NormalImport hiPolyNormal(const FornosParameters &params)
+	{
+		return params.shared.hiPolyMeshPath.empty() ? params.shared.loPolyMeshNormal : params.shared.hiPolyMeshNormal;
+	}
+}
+
+bool FornosRunner::buildPages(const FornosParameters &params, std::string &errors)
+{
+	ThreadPool::setGlobalThreadCount(params.shared.cpuThreads > 0 ? (size_t)params.shared.cpuThreads : 0);
+
+	if (InstancedScene::isScenePath(params.shared.hiPolyMeshPath))
+	{
+		errors = "Out-of-core baking does not support instanced scenes";
+		return false;
+	}
+
+	const std::string &path = hiPolyPath(params);
+	FileStamp source;
+	std::unique_ptr<Mesh> mesh;
+	if (source.read(path.c_str()))
+	{
+		mesh.reset(params.shared.meshCache ? Mesh::loadFileCached(path.c_str()) : Mesh::loadFile(path.c_str()));
+	}
+	if (!mesh)
+	{
+		errors = "Missing high poly mesh";
+		return false;
+	}
+	importNormals(mesh.get(), hiPolyNormal(params));
+
+	const std::string pagesPath = BVHPages::pagesPath(path.c_str());
+	if (!BVHPages::build(mesh.get(), bvhBuildParams(params), (uint32_t)hiPolyNormal(params), source, pagesPath.c_str()))
+	{
+		errors = "Could not write the high poly pages " + pagesPath;
+		return false;
+	}
+	return true;
+}
+
+bool FornosRunner::start(const FornosParameters &params, std::string &errors)
+{
+	// TODO: Several of this steps can take long and they will freeze the UI
+	_errors.clear();
+
+	// The mesh loader and the BVH builder already use the global pool
+	ThreadPool::setGlobalThreadCount(params.shared.cpuThreads > 0 ? (size_t)params.shared.cpuThreads : 0);
+
+	auto loadMesh = [&](const std::string &path)
+	{
+		return params.shared.meshCache ? Mesh::loadFileCached(path.c_str()) : Mesh::loadFile(path.c_str());
+	};
+
+	std::shared_ptr<Mesh> lowPolyMesh(loadMesh(params.shared.loPolyMeshPath));
+	if (lowPolyMesh)
+	{
+		importNormals(lowPolyMesh.get(), params.shared.loPolyMeshNormal);
+	}
+	else
+	{
+		errors = "Missing low poly mesh";
+		return false;
+	}
+
+	// Out-of-core bakes never load the high-poly mesh, only the pages built by buildPages()
+	const bool outOfCore = params.shared.outOfCoreBudget > 0;
+	const bool instanced = InstancedScene::isScenePath(params.shared.hiPolyMeshPath);
+	if (outOfCore && instanced)
+	{
+		errors = "Out-of-core baking does not support instanced scenes";
+		return false;
+	}
+
+	std::shared_ptr<Mesh> hiPolyMesh;
+
+	// Instanced scenes load every part once
+	std::unique_ptr<InstancedScene> scene;
+	if (instanced)
+	{
+		scene.reset(InstancedScene::load(params.shared.hiPolyMeshPath.c_str(), [&](const std::string &path)
+		{
+			Mesh *mesh = loadMesh(path);
+			if (mesh) importNormals(mesh, params.shared.hiPolyMeshNormal);
+			return mesh;
+		}, errors));
+		if (!scene) return false;
+	}
+	else if (!outOfCore)
+	{
+		hiPolyMesh =
+			params.shared.hiPolyMeshPath.empty() ?
+			lowPolyMesh :
+			std::shared_ptr<Mesh>(loadMesh(params.shared.hiPolyMeshPath));
+		if (hiPolyMesh && hiPolyMesh != lowPolyMesh)
+		{
+			importNormals(hiPolyMesh.get(), params.shared.hiPolyMeshNormal);
+		}
+	}
+
+	const bool needsTangentSpace = 
+		params.normals.enabled && params.normals.tangentSpace||
+		params.bentNormals.enabled && params.bentNormals.tangentSpace;
+
+	if (needsTangentSpace)
+	{
+		lowPolyMesh->computeTangentSpace();
+	}
+
+	std::shared_ptr<MapUV> map;
+	
+	switch (params.shared.mapping)
+	{
+	case MeshMappingMethod::Smooth:
+	{
+		std::shared_ptr<Mesh> lowPolyMeshForMapping;
+		if (params.shared.loPolyMeshNormal != NormalImport::ComputePerVertex)
+		{
+			lowPolyMeshForMapping = std::shared_ptr<Mesh>(Mesh::createCopy(lowPolyMesh.get()));
+			lowPolyMeshForMapping->computeVertexNormalsAggressive(params.shared.mappingWeld);
+		}
+		else
+		{
+			lowPolyMeshForMapping = lowPolyMesh;
+		}
+
+		map = std::shared_ptr<MapUV>(MapUV::fromMeshes(
+			lowPolyMesh.get(),
+			lowPolyMeshForMapping.get(),
+			params.shared.texWidth,
+			params.shared.texHeight));
+	} break;
+
+	case MeshMappingMethod::LowPolyNormals:
+	{
+		map = std::shared_ptr<MapUV>(MapUV::fromMesh(
+			lowPolyMesh.get(),
+			params.shared.texWidth,
+			params.shared.texHeight));
+	} break;
+
+	case MeshMappingMethod::Hybrid:
+	{
+		std::shared_ptr<Mesh> lowPolyMeshForMapping;
+		if (params.shared.loPolyMeshNormal != NormalImport::ComputePerVertex)
+		{
+			lowPolyMeshForMapping = std::shared_ptr<Mesh>(Mesh::createCopy(lowPolyMesh.get()));
+			lowPolyMeshForMapping->computeVertexNormalsAggressive(params.shared.mappingWeld);
+		}
+		else
+		{
+			lowPolyMeshForMapping = lowPolyMesh;
+		}
+
+		map = std::shared_ptr<MapUV>(MapUV::fromMeshes_Hybrid(
+			lowPolyMesh.get(),
+			lowPolyMeshForMapping.get(),
+			params.shared.texWidth,
+			params.shared.texHeight,
+			params.shared.mappingEdge));
+	} break;
+	}
+	
+	if (!map)
+	{
+		errors = "Low poly mesh is missing texture coordinates or normals information";
+		return false;
+	}
+	std::shared_ptr<CompressedMapUV> compressedMap(new CompressedMapUV(map.get()));
+
+	const BVHBuildParams bvhParams = bvhBuildParams(params);
+
+	// CPU solvers read the mapping from memory, so any of them forces a CPU mapping.
+	// GPU solvers get the CPU mapping results uploaded when it finishes.
+	const bool anyCPUSolver =
+		params.height.enabled && params.height.backend == ComputeBackend::CPU ||
+		params.positions.enabled && params.positions.backend == ComputeBackend::CPU ||
+		params.normals.enabled && params.normals.backend == ComputeBackend::CPU ||
+		params.ao.enabled && params.ao.backend == ComputeBackend::CPU ||
+		params.bentNormals.enabled && params.bentNormals.backend == ComputeBackend::CPU ||
+		params.thickness.enabled && params.thickness.backend == ComputeBackend::CPU;
+	const bool anyGPUSolver =
+		params.height.enabled && params.height.backend == ComputeBackend::GPU ||
+		params.positions.enabled && params.positions.backend == ComputeBackend::GPU ||
+		params.normals.enabled && params.normals.backend == ComputeBackend::GPU ||
+		params.ao.enabled && params.ao.backend == ComputeBackend::GPU ||
+		params.bentNormals.enabled && params.bentNormals.backend == ComputeBackend::GPU ||
+		params.thickness.enabled && params.thickness.backend == ComputeBackend::GPU;
+	const ComputeBackend mappingBackend =
+		anyCPUSolver ? ComputeBackend::CPU : params.shared.mappingBackend;
+
+	std::shared_ptr<MeshMapping> meshMapping(new MeshMapping());
+	std::shared_ptr<Mesh> cageMesh;
+	if (!params.shared.mappingCagePath.empty())
+	{
+		cageMesh.reset(loadMesh(params.shared.mappingCagePath));
+		if (!cageMesh)
+		{
+			errors = "Missing cage mesh";
+			return false;
+		}
+	}
+	// Zero distances search the whole high-poly mesh
+	meshMapping->setRayLimits(
+		params.shared.mappingFrontDistance > 0.0f ? params.shared.mappingFrontDistance : FLT_MAX,
+		params.shared.mappingRearDistance > 0.0f ? params.shared.mappingRearDistance : FLT_MAX,
+		cageMesh);
+	const size_t cpuBVHWidth = params.shared.cpuBVHWidth == BVHWidth::Wide8 ? 8 : (params.shared.cpuBVHWidth == BVHWidth::Wide4 ? 4 : 2);
+	if (outOfCore)
+	{
+		// GPU solvers need the whole mesh uploaded
+		if (anyGPUSolver)
+		{
+			errors = "Out-of-core baking needs the CPU backend in all the solvers";
+			return false;
+		}
+
+		const std::string pagesPath = BVHPages::pagesPath(hiPolyPath(params).c_str());
+		const size_t budget = (size_t)params.shared.outOfCoreBudget << 20;
+		FileStamp source;
+		if (!source.read(hiPolyPath(params).c_str()))
+		{
+			errors = "Missing high poly mesh";
+			return false;
+		}
+
+		// Building the pages loads the whole mesh, which may not fit in the memory of the bake
+		std::shared_ptr<BVHPages> pages(BVHPages::open(pagesPath.c_str(), bvhParams, (uint32_t)hiPolyNormal(params), source, budget,
+			cpuBVHWidth, params.shared.cpuBVHCompressed));
+		if (!pages)
+		{
+			errors = "Missing or stale high poly pages " + pagesPath + ", build them with bakec-cli --build-pages";
+			return false;
+		}
+		meshMapping->initPaged(compressedMap, pages, params.shared.ignoreBackfaces);
+	}
+	else if (scene && mappingBackend == ComputeBackend::CPU && !anyGPUSolver)
+	{
+		meshMapping->initInstanced(compressedMap, *scene, bvhParams, params.shared.ignoreBackfaces, cpuBVHWidth,
+			params.shared.cpuGeometry, params.shared.bvhOrderedTraversal, params.shared.cpuBVHCompressed);
+	}
+	else
+	{
+		// The shaders trace a single tree, so GPU bakes flatten instanced scenes
+		if (scene)
+		{
+			hiPolyMesh.reset(scene->flatten());
+			scene.reset();
+		}
+		// Bakes of the same mesh with other solver settings reuse the tree
+		std::shared_ptr<BVH> rootBVH(params.shared.meshCache ?
+			BVH::createBinaryCached(hiPolyMesh.get(), bvhParams, hiPolyPath(params).c_str()) :
+			BVH::createBinary(hiPolyMesh.get(), bvhParams));
+		logDebug("BVH", BVHStats::compute(*rootBVH, bvhParams.traversalCost).summary());
+		if (!params.shared.bvhStatsPath.empty() &&
+			!BVHStats::writeNodes(*rootBVH, bvhParams.traversalCost, params.shared.bvhStatsPath.c_str()))
+		{
+			logWarning("BVH", "Could not write the node statistics to " + params.shared.bvhStatsPath);
+		}
+		meshMapping->init(compressedMap, hiPolyMesh, rootBVH, params.shared.ignoreBackfaces, mappingBackend, anyGPUSolver, cpuBVHWidth,
+			params.shared.cpuGeometry, params.shared.bvhOrderedTraversal, params.shared.cpuBVHCompressed);
+	}
+
+	if (params.thickness.enabled)
+	{
+		ThicknessSolver::Params solverParams;
+		solverParams.sampleCount = (uint32_t)params.thickness.sampleCount;
+		solverParams.minDistance = params.thickness.minDistance;
+		solverParams.maxDistance = params.thickness.maxDistance;
+		solverParams.backend = params.thickness.backend;
+		std::unique_ptr<ThicknessSolver> solver(new ThicknessSolver(solverParams));
+		solver->init(compressedMap, meshMapping);
+		_tasks.emplace_back(
+			new ThicknessTask(std::move(solver), params.thickness.outputPath.c_str(), params.shared.texDilation)
+		);
+	}
+
+	if (params.bentNormals.enabled)
+	{
+		BentNormalsSolver::Params solverParams;
+		solverParams.sampleCount = (uint32_t)params.bentNormals.sampleCount;
+		solverParams.minDistance = params.bentNormals.minDistance;
+		solverParams.maxDistance = params.bentNormals.maxDistance;
+		solverParams.tangentSpace = params.bentNormals.tangentSpace;
+		solverParams.backend = params.bentNormals.backend;
+		std::unique_ptr<BentNormalsSolver> solver(new BentNormalsSolver(solverParams));
+		solver->init(compressedMap, meshMapping);
+		_tasks.emplace_back(
+			new BentNormalsTask(std::move(solver), params.bentNormals.outputPath.c_str(), params.shared.texDilation)
+		);
+	}
+
+	if (params.ao.enabled)
+	{
+		AmbientOcclusionSolver::Params solverParams;
+		solverParams.sampleCount = (uint32_t)params.ao.sampleCount;
+		solverParams.minDistance = params.ao.minDistance;
+		solverParams.maxDistance = params.ao.maxDistance;
+		solverParams.backend = params.ao.backend;
+		std::unique_ptr<AmbientOcclusionSolver> solver(new AmbientOcclusionSolver(solverParams));
+		solver->init(compressedMap, meshMapping);
+		_tasks.emplace_back(
+			new AmbientOcclusionTask(std::move(solver), params.ao.outputPath.c_str(), params.shared.texDilation)
+		);
+	}
+
+	if (params.normals.enabled)
+	{
+		NormalsSolver::Params solverParams;
+		solverParams.tangentSpace = params.normals.tangentSpace;
+		solverParams.backend = params.normals.backend;
+		std::unique_ptr<NormalsSolver> normalsSolver(new NormalsSolver(solverParams));
+		normalsSolver->init(compressedMap, meshMapping);
+		_tasks.emplace_back(
+			new NormalsTask(std::move(normalsSolver), params.normals.outputPath.c_str(), params.shared.texDilation)
+		);
+	}
+
+	if (params.positions.enabled)
+	{
+		std::unique_ptr<PositionSolver> solver(new PositionSolver(params.positions.backend));
+		solver->init(compressedMap, meshMapping);
+		_tasks.emplace_back(
+			new PositionTask(std::move(solver), params.positions.outputPath.c_str())
+		);
+	}
+
+	if (params.height.enabled)
+	{
+		std::unique_ptr<HeightSolver> solver(new HeightSolver(params.height.backend));
+		solver->init(compressedMap, meshMapping);
+		_tasks.emplace_back(
+			new HeightTask(std::move(solver), params.height.outputPath.c_str(), params.shared.texDilation)
+		);
+	}
+
+	_tasks.emplace_back(new MeshMappingTask(meshMapping));
+
+	return true;
+}
+
+void FornosRunner::run()
+{
+	if (!_tasks.empty())
+	{
+		auto task = _tasks.back();
+		if (task->runStep())
+		{
+			// Exports map or any other after-compute work
+			if (!task->finish())
+			{
+				_errors += std::string(task->name()) + ": could not write the output\n";
+			}
+			delete task;
+			_tasks.pop_back();
+		}
+	}
+}
@@ -33,6 +33,10 @@ SOFTWARE.
 
 static const char* normalImportNames[3] = { "Import", "Compute per face", "Compute per vertex" };
 static const char* meshMappingMethodNames[3] = { "Smooth", "Low-poly normals", "Hybrid" };
+static const char* computeBackendNames[2] = { "GPU", "CPU" };
+static const char* bvhWidthNames[3] = { "Binary", "4-wide", "8-wide" };
+static const char* cpuGeometryNames[3] = { "Unindexed", "Indexed", "Quantized" };
+static const char* bvhBuilderNames[2] = { "SAH", "Linear" };
 
 inline void SetupImGuiStyle(bool bStyleDark_, float alpha_)
 {
@@ -320,6 +324,7 @@ public:
 		: data(data)
 		, hiPolyPath(&data->hiPolyMeshPath)
 		, loPolyPath(&data->loPolyMeshPath)
+		, cagePath(&data->mappingCagePath)
 	{
 	}
 
@@ -328,6 +333,7 @@ private:
 	FornosParameters_Shared *data;
 	PathField loPolyPath;
 	PathField hiPolyPath;
+	PathField cagePath;
 };
 
 void FornosParameters_Shared_View::render(int windowWidth, int windowHeight)
@@ -346,13 +352,25 @@ void FornosParameters_Shared_View::render(int windowWidth, int windowHeight)
 	parameter_openFile("High Mesh", &hiPolyPath, "##hi",
 		"Optional high resolution mesh file.\n"
 		"If not setup it will bake the low resolution mesh.\n"
-		"Wavefront OBJ files supported.",
-		"Select Hiigh-Poly Mesh", ".obj",
+		"Wavefront OBJ files supported.\n"
+		"JSON scene files place instances of part meshes,\n"
+		"traced without copying the parts on the CPU backend.",
+		"Select Hiigh-Poly Mesh", ".obj;.json",
 		windowWidth, windowHeight);
 
 	parameter<NormalImport>("Normals", &data->hiPolyMeshNormal, normalImportNames, 3, "#hiPolyNormal",
 		"How the model normals are imported or computed.");
 
+	parameter("Mesh cache", &data->meshCache, "##meshCache",
+		"If checked meshes are loaded through a binary cache written next to them (.bakecmesh).\n"
+		"Later loads of the same file skip parsing. The cache is rebuilt when the file changes.\n"
+		"The high-poly BVH is cached too (.bakecbvh), rebuilt when the geometry or the BVH settings change.");
+
+	parameter("BVH Refit Threshold", &data->bvhRefitThreshold, "##BvhRefitThreshold",
+		"When the high-poly mesh keeps its triangles but its vertices moved, the cached BVH is refitted\n"
+		"to them instead of rebuilt, as long as its SAH cost grows less than this fraction.\n"
+		"0.25 allows 25% more. Zero always rebuilds. Requires the mesh cache.");
+
 	parameter_texSize("Tex Size", &data->texWidth, &data->texHeight, "#texSize",
 		"Texture output size (width x height).\n"
 		"Control+click to edit the number.");
@@ -373,12 +391,91 @@ void FornosParameters_Shared_View::render(int windowWidth, int windowHeight)
 			"Distance to sharp edges to start auto smoothing for mesh mapping");
 	}
 
+	if (data->mapping != MeshMappingMethod::LowPolyNormals)
+	{
+		parameter("Mapping weld", &data->mappingWeld, "##mappingWeld",
+			"Low-poly positions closer than this distance share their normal when smoothing the mapping.\n"
+			"Zero only welds positions that are exactly the same.");
+	}
+
+	parameter("Front distance", &data->mappingFrontDistance, "##mappingFrontDistance",
+		"Distance the mesh-mapping rays look for the high-poly mesh in front of the low-poly surface.\n"
+		"Zero searches the whole mesh. Limited rays skip the parts out of reach.");
+
+	parameter("Rear distance", &data->mappingRearDistance, "##mappingRearDistance",
+		"Distance the mesh-mapping rays look for the high-poly mesh behind the low-poly surface.\n"
+		"Zero searches the whole mesh.");
+
+	parameter_openFile("Cage Mesh", &cagePath, "##cage",
+		"Optional mesh around the high-poly mesh.\n"
+		"The mesh-mapping rays look in front of the low-poly surface up to the cage\n"
+		"instead of up to the front distance.",
+		"Select Cage Mesh", ".obj",
+		windowWidth, windowHeight);
+
 	parameter("Ignore backfaces", &data->ignoreBackfaces, "##ignoreBackface",
 		"If checked faces on the oposite direction to the mesh-mapping rays will be ignored during mesh mapping.");
 
+	parameter<BVHBuilder>("BVH builder", &data->bvhBuilder, bvhBuilderNames, 2, "#bvhBuilder",
+		"How the high-poly BVH is built.\n"
+		"SAH builds the fastest tree to trace. Linear sorts the triangles along a Morton curve,\n"
+		"it builds several times faster but tracing is slower. Use it for quick previews.");
+
 	parameter("BVH Tri. Count", &data->bvhTrisPerNode, "##BvhTriCount",
 		"Maximum number of triangles per BVH leaf node.");
 
+	parameter("BVH Buckets", &data->bvhBuckets, "##BvhBuckets",
+		"Number of buckets per axis used to find the best BVH splits (2 to 64).\n"
+		"More buckets build a better tree but take longer.");
+
+	parameter("BVH Traversal Cost", &data->bvhTraversalCost, "##BvhTraversalCost",
+		"Cost of visiting a BVH node relative to intersecting a triangle.\n"
+		"Higher values produce shallower trees with more triangles per leaf.");
+
+	parameter("BVH Spatial Splits", &data->bvhSpatialSplits, "##BvhSpatialSplits",
+		"Extra triangle references the BVH may add by splitting triangles, relative to the triangle count.\n"
+		"0.3 allows 30% more. Builds tighter trees for long thin triangles (CAD, retopology cages).\n"
+		"Zero disables spatial splits.");
+
+	parameter("BVH Optimization Passes", &data->bvhOptimizationPasses, "##BvhOptimizationPasses",
+		"Passes that rearrange the BVH nodes into trees of lower SAH cost after the build.\n"
+		"Each pass takes about a quarter of an SAH build. Pays off most with the linear builder\n"
+		"and with long thin triangles. Zero disables them.");
+
+	parameter("BVH Ordered Traversal", &data->bvhOrderedTraversal, "##BvhOrderedTraversal",
+		"If checked rays descend into the BVH child they reach first and keep the other one in a stack,\n"
+		"instead of the stackless walk. Close hits then skip more nodes. The results are the same.\n"
+		"Used by the GPU mesh mapping and the CPU backend with the binary BVH.");
+
+	parameter<ComputeBackend>("Mapping backend", &data->mappingBackend, computeBackendNames, 2, "#mappingBackend",
+		"Where mesh mapping is computed.\n"
+		"Mesh mapping always runs on the CPU if any enabled solver uses the CPU backend.");
+
+	parameter("CPU threads", &data->cpuThreads, "##cpuThreads",
+		"Number of threads used by the CPU backend.\n"
+		"A value of zero uses all the hardware threads.");
+
+	parameter<BVHWidth>("CPU BVH", &data->cpuBVHWidth, bvhWidthNames, 3, "#cpuBVHWidth",
+		"Children per BVH node traversed by the CPU backend.\n"
+		"Wide trees test all the children of a node at once with SIMD instructions.\n"
+		"8-wide needs a build with AVX2 enabled to be faster than 4-wide.");
+
+	parameter("CPU BVH compressed", &data->cpuBVHCompressed, "##cpuBVHCompressed",
+		"If checked the wide BVH nodes keep the bounds of their children in 8 bits,\n"
+		"which halves the node memory (one cache line per 4-wide node). The results are the same.");
+
+	parameter<CPUGeometry>("CPU geometry", &data->cpuGeometry, cpuGeometryNames, 3, "#cpuGeometry",
+		"How the high-poly triangles are kept in memory and uploaded to the GPU.\n"
+		"Indexed shares the vertices of the triangles and takes about a quarter of the memory.\n"
+		"Quantized also compresses positions and normals for meshes that do not fit in memory otherwise,\n"
+		"on the CPU backend. The GPU gets them indexed. Smaller geometry is a bit slower to trace.");
+
+	parameter("Out-of-core budget", &data->outOfCoreBudget, "##outOfCoreBudget",
+		"Megabytes of high-poly mesh kept in memory, for meshes that do not fit in memory.\n"
+		"Bakes load pages of the high-poly mesh (.bakecpages next to it) as rays reach them.\n"
+		"The pages are built beforehand with bakec-cli --build-pages, which loads the whole mesh.\n"
+		"Needs the CPU backend in all the solvers. A value of zero loads the whole mesh.");
+
 	parameters_end();
 }
 
@@ -419,6 +516,9 @@ void FornosParameters_SolverHeight_View::render(int windowWidth, int windowHeigh
 			"Height Map", ".png;.tga;.exr",
 			windowWidth, windowHeight);
 
+		parameter<ComputeBackend>("Backend", &data->backend, computeBackendNames, 2, "#heightBackend",
+			"GPU runs on compute shaders.\nCPU runs on the number of CPU threads set in the shared parameters.");
+
 		parameters_end();
 
 		if (!data->enabled)
@@ -468,6 +568,9 @@ void FornosParameters_SolverPositions_View::render(int windowWidth, int windowHe
 			"Positions Map", ".png;.tga;.exr",
 			windowWidth, windowHeight);
 
+		parameter<ComputeBackend>("Backend", &data->backend, computeBackendNames, 2, "#posBackend",
+			"GPU runs on compute shaders.\nCPU runs on the number of CPU threads set in the shared parameters.");
+
 		parameters_end();
 
 		if (!data->enabled)
@@ -521,6 +624,9 @@ void FornosParameters_SolverNormals_View::render(int windowWidth, int windowHeig
 			"Computes tangent space normals if this is checked.\n"
 			"Otherwise it generates object space normals.");
 
+		parameter<ComputeBackend>("Backend", &data->backend, computeBackendNames, 2, "#normalsBackend",
+			"GPU runs on compute shaders.\nCPU runs on the number of CPU threads set in the shared parameters.");
+
 		parameters_end();
 
 		if (!data->enabled)
@@ -577,6 +683,9 @@ void FornosParameters_SolverAO_View::render(int windowWidth, int windowHeight)
 		parameter("Max distance", &data->maxDistance, "##aoMaxDistance",
 			"Max distance to consider occluders.");
 
+		parameter<ComputeBackend>("Backend", &data->backend, computeBackendNames, 2, "#aoBackend",
+			"GPU runs on compute shaders.\nCPU runs on the number of CPU threads set in the shared parameters.");
+
 		parameters_end();
 
 		if (!data->enabled)
@@ -635,6 +744,9 @@ void FornosParameters_SolverBentNormals_View::render(int windowWidth, int window
 		parameter("Tangent space", &data->tangentSpace, "##bnTanSpace",
 			"Compute normals in tangent space.");
 
+		parameter<ComputeBackend>("Backend", &data->backend, computeBackendNames, 2, "#bnBackend",
+			"GPU runs on compute shaders.\nCPU runs on the number of CPU threads set in the shared parameters.");
+
 		parameters_end();
 
 		if (!data->enabled)
@@ -691,6 +803,9 @@ void FornosParameters_SolverThickness_View::render(int windowWidth, int windowHe
 		parameter("Max distance", &data->maxDistance, "##thicknessMaxDistance",
 			"Full thickness at this distance.");
 
+		parameter<ComputeBackend>("Backend", &data->backend, computeBackendNames, 2, "#thicknessBackend",
+			"GPU runs on compute shaders.\nCPU runs on the number of CPU threads set in the shared parameters.");
+
 		parameters_end();
 
 		if (!data->enabled)
@@ -852,12 +967,14 @@ void FornosUI_Impl::renderWorkInProgress()
 		}
 	}
 
+	bool finished = false;
 	ImGui::SetNextWindowSizeConstraints(ImVec2(300, 40), ImVec2(500, 500));
 	if (ImGui::BeginPopupModal("TaskPopup", NULL, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoTitleBar))
 	{
 		if (!_runner->pending())
 		{
 			ImGui::CloseCurrentPopup();
+			finished = true;
 		}
 		else
 		{
@@ -869,6 +986,13 @@ void FornosUI_Impl::renderWorkInProgress()
 		}
 		ImGui::EndPopup();
 	}
+
+	// Outputs that could not be written are reported once the last task is done
+	if (finished && !_runner->errors().empty())
+	{
+		_bakeErrors = _runner->errors();
+		ImGui::OpenPopup("ErrorsPopup");
+	}
 }
 
 void FornosUI_Impl::renderErrors()
@@ -188,14 +188,14 @@ void dilateRGB(uint8_t *data, const CompressedMapUV *map, const std::vector<bool
 	logDebug("Image", "Image dilation took " + std::to_string(timing.elapsedSeconds()) + " seconds.");
 }
 
-void exportFloatImage(const float *data, const CompressedMapUV *map, const char *path, bool normalize, int dilate, Vector2 *o_minmax)
+bool exportFloatImage(const float *data, const CompressedMapUV *map, const char *path, bool normalize, int dilate, Vector2 *o_minmax)
 {
 	assert(data);
 	assert(map);
 	assert(path);
 
 	Extension ext = getExtension(path);
-	if (ext == Extension::Unknown) return; // TODO: Error handling
+	if (ext == Extension::Unknown) return false;
 
 	const size_t count = map->indices.size();
 	const size_t w = map->width;
@@ -238,7 +238,7 @@ void exportFloatImage(const float *data, const CompressedMapUV *map, const char
 			}
 
 			if (ext == Extension::Tga)
-				int32_t ret = bimg::imageWriteTga(
+				bimg::imageWriteTga(
 					&writer
 					, w
 					, h
@@ -250,7 +250,7 @@ void exportFloatImage(const float *data, const CompressedMapUV *map, const char
 					);
 
 			else if (ext == Extension::Png)
-				int32_t ret = bimg::imageWritePng(
+				bimg::imageWritePng(
 					&writer
 					, w
 					, h
@@ -278,7 +278,7 @@ void exportFloatImage(const float *data, const CompressedMapUV *map, const char
 				f[pixidx] = t;
 			}
 
-			int32_t ret = bimg::imageWriteExr(
+			bimg::imageWriteExr(
 				&writer
 				, w
 				, h
@@ -292,16 +292,17 @@ void exportFloatImage(const float *data, const CompressedMapUV *map, const char
 			delete[] f;
 		}
 	}
+	return err.isOk(); // Also set when the file could not be opened
 }
 
-void exportVectorImage(const Vector3 *data, const CompressedMapUV *map, const char *path)
+bool exportVectorImage(const Vector3 *data, const CompressedMapUV *map, const char *path)
 {
 	assert(data);
 	assert(map);
 	assert(path);
 
 	Extension ext = getExtension(path);
-	if (ext != Extension::Exr) return; // TODO: Error handling
+	if (ext != Extension::Exr) return false;
 
 	const size_t count = map->indices.size();
 	const size_t w = map->width;
@@ -351,24 +352,21 @@ void exportVectorImage(const Vector3 *data, const CompressedMapUV *map, const ch
 
 	const char *err;
 	int ret = SaveEXRImageToFile(&image, &header, path, &err);
-	if (ret != TINYEXR_SUCCESS)
-	{
-		// TODO: Error handling
-	}
 
 	delete[] header.channels;
 	delete[] header.pixel_types;
 	delete[] header.requested_pixel_types;
+	return ret == TINYEXR_SUCCESS;
 }
 
-void exportNormalImage(const Vector3 *data, const CompressedMapUV *map, const char *path, int dilate)
+bool exportNormalImage(const Vector3 *data, const CompressedMapUV *map, const char *path, int dilate)
 {
 	assert(data);
 	assert(map);
 	assert(path);
 
 	Extension ext = getExtension(path);
-	if (ext == Extension::Unknown) return; // TODO: Error handling
+	if (ext == Extension::Unknown) return false;
 
 	const size_t count = map->indices.size();
 	const size_t w = map->width;
@@ -396,13 +394,12 @@ void exportNormalImage(const Vector3 *data, const CompressedMapUV *map, const ch
 			dilateRGB(rgb, map, validPixels, dilate);
 		}
 
-		if (ext == Extension::Png) stbi_write_png(path, (int)w, (int)h, 3, rgb, (int)w * 3);
-		else stbi_write_tga(path, (int)w, (int)h, 3, rgb);
+		const int written = ext == Extension::Png ?
+			stbi_write_png(path, (int)w, (int)h, 3, rgb, (int)w * 3) :
+			stbi_write_tga(path, (int)w, (int)h, 3, rgb);
 
 		delete[] rgb;
+		return written != 0;
 	}
-	else if (ext == Extension::Exr)
-	{
-		exportVectorImage(data, map, path);
-	}
+	return exportVectorImage(data, map, path);
 }
\ No newline at end of file
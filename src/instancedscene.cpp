@@ -0,0 +1,184 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "instancedscene.h"
+#include "json.h"
+#include "mesh.h"
+#include <cctype>
+#include <cmath>
+
+namespace
+{
+	std::string sceneRelativePath(const std::string &scenePath, const std::string &path)
+	{
+		const bool absolute =
+			(!path.empty() && (path[0] == '/' || path[0] == '\\')) ||
+			(path.size() > 1 && path[1] == ':');
+		const size_t slash = scenePath.find_last_of("/\\");
+		if (absolute || slash == std::string::npos) return path;
+		return scenePath.substr(0, slash + 1) + path;
+	}
+
+	bool readTransform(const JsonValue &value, Transform &o_transform)
+	{
+		if (!value.isArray() || (value.size() != 12 && value.size() != 16)) return false;
+		float m[12];
+		for (size_t i = 0; i < 12; ++i)
+		{
+			if (!value[i].isNumber()) return false;
+			m[i] = (float)value[i].asNumber();
+		}
+		for (size_t r = 0; r < 3; ++r)
+		{
+			o_transform.rows[r] = Vector3(m[r * 4 + 0], m[r * 4 + 1], m[r * 4 + 2]);
+		}
+		o_transform.translation = Vector3(m[3], m[7], m[11]);
+		return true;
+	}
+
+	/// Missing texture coordinates and normals stay missing
+	inline uint32_t offsetIndex(uint32_t index, uint32_t offset)
+	{
+		return index == UINT32_MAX ? index : index + offset;
+	}
+
+	inline bool isMirror(const Transform &t)
+	{
+		return determinant(t) < 0.0f;
+	}
+}
+
+bool InstancedScene::isScenePath(const std::string &path)
+{
+	const size_t dot = path.find_last_of('.');
+	if (dot == std::string::npos) return false;
+	std::string ext = path.substr(dot + 1);
+	for (char &c : ext) c = (char)tolower(c);
+	return ext == "json";
+}
+
+InstancedScene* InstancedScene::load(const char *path, std::function<Mesh*(const std::string&)> loadMesh, std::string &o_error)
+{
+	JsonValue root;
+	if (!JsonValue::parseFile(path, root, o_error)) return nullptr;
+	const JsonValue *parts = root.isObject() ? root.find("parts") : nullptr;
+	const JsonValue *instances = root.isObject() ? root.find("instances") : nullptr;
+	if (!parts || !parts->isArray() || !instances || !instances->isArray())
+	{
+		o_error = std::string(path) + ": expected \"parts\" and \"instances\" arrays";
+		return nullptr;
+	}
+
+	std::unique_ptr<InstancedScene> scene(new InstancedScene());
+	for (size_t i = 0; i < parts->size(); ++i)
+	{
+		const JsonValue &part = (*parts)[i];
+		if (!part.isString())
+		{
+			o_error = std::string(path) + ": part " + std::to_string(i) + " is not a path";
+			return nullptr;
+		}
+		const std::string partPath = sceneRelativePath(path, part.asString());
+		std::shared_ptr<Mesh> mesh(loadMesh(partPath));
+		if (!mesh)
+		{
+			o_error = "Could not load the scene part " + partPath;
+			return nullptr;
+		}
+		scene->parts.push_back(mesh);
+	}
+
+	for (size_t i = 0; i < instances->size(); ++i)
+	{
+		const JsonValue &instance = (*instances)[i];
+		const JsonValue *part = instance.isObject() ? instance.find("part") : nullptr;
+		const JsonValue *transform = instance.isObject() ? instance.find("transform") : nullptr;
+		MeshInstance mi;
+		if (!part || !part->isNumber() || part->asNumber() < 0 || part->asNumber() >= (double)scene->parts.size())
+		{
+			o_error = std::string(path) + ": instance " + std::to_string(i) + " has no valid part";
+			return nullptr;
+		}
+		mi.part = (uint32_t)part->asNumber();
+		if (transform && !readTransform(*transform, mi.transform))
+		{
+			o_error = std::string(path) + ": instance " + std::to_string(i) + " has an invalid transform";
+			return nullptr;
+		}
+		if (std::fabs(determinant(mi.transform)) < 1e-12f)
+		{
+			o_error = std::string(path) + ": instance " + std::to_string(i) + " has a singular transform";
+			return nullptr;
+		}
+		scene->instances.push_back(mi);
+	}
+
+	return scene.release();
+}
+
+size_t InstancedScene::triangleCount() const
+{
+	size_t count = 0;
+	for (const MeshInstance &instance : instances)
+	{
+		count += parts[instance.part]->triangles.size();
+	}
+	return count;
+}
+
+Mesh* InstancedScene::flatten() const
+{
+	Mesh *mesh = new Mesh();
+	for (const MeshInstance &instance : instances)
+	{
+		const Mesh &part = *parts[instance.part];
+		const Transform worldToPart = inverse(instance.transform);
+		const uint32_t positionOffset = (uint32_t)mesh->positions.size();
+		const uint32_t texcoordOffset = (uint32_t)mesh->texcoords.size();
+		const uint32_t normalOffset = (uint32_t)mesh->normals.size();
+		const uint32_t vertexOffset = (uint32_t)mesh->vertices.size();
+
+		for (const Vector3 &p : part.positions) mesh->positions.push_back(instance.transform.point(p));
+		mesh->texcoords.insert(mesh->texcoords.end(), part.texcoords.begin(), part.texcoords.end());
+		for (const Vector3 &n : part.normals) mesh->normals.push_back(normalize(worldToPart.transposedVector(n)));
+		for (const Mesh::Vertex &v : part.vertices)
+		{
+			Mesh::Vertex fv;
+			fv.positionIndex = v.positionIndex + positionOffset;
+			fv.texcoordIndex = offsetIndex(v.texcoordIndex, texcoordOffset);
+			fv.normalIndex = offsetIndex(v.normalIndex, normalOffset);
+			mesh->vertices.push_back(fv);
+		}
+
+		// Mirrored instances keep their facing
+		const bool mirror = isMirror(instance.transform);
+		for (const Mesh::Triangle &tri : part.triangles)
+		{
+			Mesh::Triangle ft;
+			ft.vertexIndex0 = tri.vertexIndex0 + vertexOffset;
+			ft.vertexIndex1 = (mirror ? tri.vertexIndex2 : tri.vertexIndex1) + vertexOffset;
+			ft.vertexIndex2 = (mirror ? tri.vertexIndex1 : tri.vertexIndex2) + vertexOffset;
+			mesh->triangles.push_back(ft);
+		}
+	}
+	return mesh;
+}
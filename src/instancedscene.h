@@ -0,0 +1,69 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "math.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Mesh;
+
+/// A placement of a part of an instanced scene
+struct MeshInstance
+{
+	uint32_t part;
+	Transform transform; // Part to world
+};
+
+/// High-poly scene built from parts placed many times, as the bolts of a machine
+/// The parts are loaded once and traced through a two-level Raytracer.
+/// Scene files are JSON:
+///   {
+///     "parts": [ "bolt.obj", "panel.obj" ],
+///     "instances": [ { "part": 0, "transform": [ 1, 0, 0, 10,  0, 1, 0, 0,  0, 0, 1, 0 ] } ]
+///   }
+/// Transforms are row-major 3x4 (or 4x4, the last row is ignored) matrices
+/// and default to the identity. Part paths are relative to the scene file.
+class InstancedScene
+{
+public:
+	std::vector<std::shared_ptr<Mesh>> parts;
+	std::vector<MeshInstance> instances;
+
+	/// Whether a high-poly path is a scene file (".json") instead of a mesh
+	static bool isScenePath(const std::string &path);
+
+	/// @param loadMesh Loads a part, with its normals already set up
+	/// @param o_error Error message if the scene could not be loaded
+	static InstancedScene* load(const char *path, std::function<Mesh*(const std::string&)> loadMesh, std::string &o_error);
+
+	/// Triangles of all the instances
+	size_t triangleCount() const;
+
+	/// Whole scene as a single mesh, for the GPU backends
+	/// Triangles follow the instance order.
+	Mesh* flatten() const;
+};
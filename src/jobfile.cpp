@@ -0,0 +1,277 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "jobfile.h"
+#include "json.h"
+#include "logging.h"
+#include <cmath>
+#include <set>
+
+namespace
+{
+	const char* normalImportNames[] = { "import", "computePerFace", "computePerVertex" };
+	const char* meshMappingMethodNames[] = { "smooth", "lowPolyNormals", "hybrid" };
+	const char* computeBackendNames[] = { "gpu", "cpu" };
+	const char* bvhWidthNames[] = { "binary", "wide4", "wide8" };
+	const char* cpuGeometryNames[] = { "unindexed", "indexed", "quantized" };
+	const char* bvhBuilderNames[] = { "sah", "linear" };
+
+	/// Reads the members of an object, accumulating errors and
+	/// warning about the members that were never read
+	class SectionReader
+	{
+	public:
+		SectionReader(const JsonValue &object, const char *section, std::string &errors)
+			: _object(object), _section(section), _errors(errors)
+		{
+		}
+
+		~SectionReader()
+		{
+			for (const auto &member : _object.members())
+			{
+				if (_read.find(member.first) == _read.end())
+				{
+					logWarning("Job", "Unknown parameter " + _section + "." + member.first);
+				}
+			}
+		}
+
+		void read(const char *key, std::string &o_value)
+		{
+			const JsonValue *v = find(key);
+			if (!v) return;
+			if (v->isString()) o_value = v->asString();
+			else error(key, "expected a string");
+		}
+
+		void read(const char *key, bool &o_value)
+		{
+			const JsonValue *v = find(key);
+			if (!v) return;
+			if (v->isBool()) o_value = v->asBool();
+			else error(key, "expected true or false");
+		}
+
+		void read(const char *key, float &o_value)
+		{
+			const JsonValue *v = find(key);
+			if (!v) return;
+			if (v->isNumber()) o_value = (float)v->asNumber();
+			else error(key, "expected a number");
+		}
+
+		void read(const char *key, int &o_value)
+		{
+			const JsonValue *v = find(key);
+			if (!v) return;
+			if (v->isNumber() && std::floor(v->asNumber()) == v->asNumber()) o_value = (int)v->asNumber();
+			else error(key, "expected an integer");
+		}
+
+		template <typename T, size_t N>
+		void read(const char *key, T &o_value, const char *(&names)[N])
+		{
+			const JsonValue *v = find(key);
+			if (!v) return;
+			if (v->isString())
+			{
+				for (size_t i = 0; i < N; ++i)
+				{
+					if (v->asString() == names[i])
+					{
+						o_value = (T)i;
+						return;
+					}
+				}
+			}
+			std::string expected;
+			for (size_t i = 0; i < N; ++i)
+			{
+				expected += (i == 0 ? "" : ", ") + std::string("\"") + names[i] + "\"";
+			}
+			error(key, "expected one of " + expected);
+		}
+
+	private:
+		const JsonValue* find(const char *key)
+		{
+			_read.insert(key);
+			return _object.find(key);
+		}
+
+		void error(const char *key, const std::string &msg)
+		{
+			_errors += "Invalid parameter " + _section + "." + key + ": " + msg + "\n";
+		}
+
+		const JsonValue &_object;
+		std::string _section;
+		std::string &_errors;
+		std::set<std::string> _read;
+	};
+
+	/// Solver sections are optional, a present section enables the solver by default
+	const JsonValue* solverSection(const JsonValue &root, const char *name, bool &o_enabled, std::string &errors)
+	{
+		const JsonValue *section = root.find(name);
+		if (!section || section->isNull()) return nullptr;
+		if (!section->isObject())
+		{
+			errors += std::string("Invalid section ") + name + ": expected an object\n";
+			return nullptr;
+		}
+		o_enabled = true;
+		return section;
+	}
+}
+
+bool loadJobFile(const char *path, FornosParameters &o_params, std::string &errors)
+{
+	JsonValue root;
+	if (!JsonValue::parseFile(path, root, errors)) return false;
+	if (!root.isObject())
+	{
+		errors = std::string(path) + ": expected an object";
+		return false;
+	}
+
+	errors.clear();
+
+	for (const auto &member : root.members())
+	{
+		const std::string &name = member.first;
+		if (name != "shared" && name != "height" && name != "positions" && name != "normals" &&
+			name != "ao" && name != "bentNormals" && name != "thickness")
+		{
+			logWarning("Job", "Unknown section " + name);
+		}
+	}
+
+	const JsonValue *shared = root.find("shared");
+	if (!shared || !shared->isObject())
+	{
+		errors += "Missing \"shared\" section\n";
+	}
+	else
+	{
+		FornosParameters_Shared &p = o_params.shared;
+		SectionReader r(*shared, "shared", errors);
+		r.read("loPolyMeshPath", p.loPolyMeshPath);
+		r.read("hiPolyMeshPath", p.hiPolyMeshPath);
+		r.read("loPolyMeshNormal", p.loPolyMeshNormal, normalImportNames);
+		r.read("hiPolyMeshNormal", p.hiPolyMeshNormal, normalImportNames);
+		r.read("meshCache", p.meshCache);
+		r.read("bvhRefitThreshold", p.bvhRefitThreshold);
+		r.read("bvhBuilder", p.bvhBuilder, bvhBuilderNames);
+		r.read("bvhTrisPerNode", p.bvhTrisPerNode);
+		r.read("bvhBuckets", p.bvhBuckets);
+		r.read("bvhTraversalCost", p.bvhTraversalCost);
+		r.read("bvhSpatialSplits", p.bvhSpatialSplits);
+		r.read("bvhOptimizationPasses", p.bvhOptimizationPasses);
+		r.read("bvhOrderedTraversal", p.bvhOrderedTraversal);
+		r.read("bvhStatsPath", p.bvhStatsPath);
+		r.read("texWidth", p.texWidth);
+		r.read("texHeight", p.texHeight);
+		r.read("texDilation", p.texDilation);
+		r.read("ignoreBackfaces", p.ignoreBackfaces);
+		r.read("mapping", p.mapping, meshMappingMethodNames);
+		r.read("mappingEdge", p.mappingEdge);
+		r.read("mappingWeld", p.mappingWeld);
+		r.read("mappingFrontDistance", p.mappingFrontDistance);
+		r.read("mappingRearDistance", p.mappingRearDistance);
+		r.read("mappingCagePath", p.mappingCagePath);
+		r.read("mappingBackend", p.mappingBackend, computeBackendNames);
+		r.read("cpuThreads", p.cpuThreads);
+		r.read("cpuBVHWidth", p.cpuBVHWidth, bvhWidthNames);
+		r.read("cpuBVHCompressed", p.cpuBVHCompressed);
+		r.read("cpuGeometry", p.cpuGeometry, cpuGeometryNames);
+		r.read("outOfCoreBudget", p.outOfCoreBudget);
+	}
+
+	if (const JsonValue *section = solverSection(root, "height", o_params.height.enabled, errors))
+	{
+		FornosParameters_SolverHeight &p = o_params.height;
+		SectionReader r(*section, "height", errors);
+		r.read("enabled", p.enabled);
+		r.read("backend", p.backend, computeBackendNames);
+		r.read("outputPath", p.outputPath);
+	}
+
+	if (const JsonValue *section = solverSection(root, "positions", o_params.positions.enabled, errors))
+	{
+		FornosParameters_SolverPositions &p = o_params.positions;
+		SectionReader r(*section, "positions", errors);
+		r.read("enabled", p.enabled);
+		r.read("backend", p.backend, computeBackendNames);
+		r.read("outputPath", p.outputPath);
+	}
+
+	if (const JsonValue *section = solverSection(root, "normals", o_params.normals.enabled, errors))
+	{
+		FornosParameters_SolverNormals &p = o_params.normals;
+		SectionReader r(*section, "normals", errors);
+		r.read("enabled", p.enabled);
+		r.read("backend", p.backend, computeBackendNames);
+		r.read("tangentSpace", p.tangentSpace);
+		r.read("outputPath", p.outputPath);
+	}
+
+	if (const JsonValue *section = solverSection(root, "ao", o_params.ao.enabled, errors))
+	{
+		FornosParameters_SolverAO &p = o_params.ao;
+		SectionReader r(*section, "ao", errors);
+		r.read("enabled", p.enabled);
+		r.read("backend", p.backend, computeBackendNames);
+		r.read("sampleCount", p.sampleCount);
+		r.read("minDistance", p.minDistance);
+		r.read("maxDistance", p.maxDistance);
+		r.read("outputPath", p.outputPath);
+	}
+
+	if (const JsonValue *section = solverSection(root, "bentNormals", o_params.bentNormals.enabled, errors))
+	{
+		FornosParameters_SolverBentNormals &p = o_params.bentNormals;
+		SectionReader r(*section, "bentNormals", errors);
+		r.read("enabled", p.enabled);
+		r.read("backend", p.backend, computeBackendNames);
+		r.read("sampleCount", p.sampleCount);
+		r.read("minDistance", p.minDistance);
+		r.read("maxDistance", p.maxDistance);
+		r.read("tangentSpace", p.tangentSpace);
+		r.read("outputPath", p.outputPath);
+	}
+
+	if (const JsonValue *section = solverSection(root, "thickness", o_params.thickness.enabled, errors))
+	{
+		FornosParameters_SolverThickness &p = o_params.thickness;
+		SectionReader r(*section, "thickness", errors);
+		r.read("enabled", p.enabled);
+		r.read("backend", p.backend, computeBackendNames);
+		r.read("sampleCount", p.sampleCount);
+		r.read("minDistance", p.minDistance);
+		r.read("maxDistance", p.maxDistance);
+		r.read("outputPath", p.outputPath);
+	}
+
+	return errors.empty();
+}
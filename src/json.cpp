@@ -0,0 +1,281 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "json.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+class JsonParser
+{
+public:
+	JsonParser(const char *text) : _p(text), _line(1) {}
+
+	bool parseDocument(JsonValue &o_value, std::string &o_error)
+	{
+		skipSpaces();
+		if (!parseValue(o_value, 0)) { o_error = _error; return false; }
+		skipSpaces();
+		if (*_p != '\0') { o_error = makeError("Unexpected data after the document"); return false; }
+		return true;
+	}
+
+private:
+	static const int k_maxDepth = 256;
+
+	std::string makeError(const char *msg) const
+	{
+		return std::string(msg) + " at line " + std::to_string(_line);
+	}
+
+	bool fail(const char *msg)
+	{
+		_error = makeError(msg);
+		return false;
+	}
+
+	void skipSpaces()
+	{
+		for (;;)
+		{
+			const char c = *_p;
+			if (c == '\n') { ++_line; ++_p; }
+			else if (c == ' ' || c == '\t' || c == '\r') ++_p;
+			else break;
+		}
+	}
+
+	bool match(const char *word)
+	{
+		const size_t len = strlen(word);
+		if (strncmp(_p, word, len) != 0) return false;
+		_p += len;
+		return true;
+	}
+
+	bool parseValue(JsonValue &o_value, int depth)
+	{
+		if (depth > k_maxDepth) return fail("Document is nested too deep");
+
+		switch (*_p)
+		{
+		case '{': return parseObject(o_value, depth);
+		case '[': return parseArray(o_value, depth);
+		case '"': o_value._type = JsonValue::Type::String; return parseString(o_value._string);
+		case 't':
+			if (!match("true")) return fail("Invalid literal");
+			o_value._type = JsonValue::Type::Bool;
+			o_value._bool = true;
+			return true;
+		case 'f':
+			if (!match("false")) return fail("Invalid literal");
+			o_value._type = JsonValue::Type::Bool;
+			o_value._bool = false;
+			return true;
+		case 'n':
+			if (!match("null")) return fail("Invalid literal");
+			o_value._type = JsonValue::Type::Null;
+			return true;
+		default:
+			return parseNumber(o_value);
+		}
+	}
+
+	bool parseNumber(JsonValue &o_value)
+	{
+		if (*_p != '-' && (*_p < '0' || *_p > '9')) return fail("Unexpected character");
+		char *end = nullptr;
+		const double v = strtod(_p, &end);
+		if (end == _p) return fail("Invalid number");
+		_p = end;
+		o_value._type = JsonValue::Type::Number;
+		o_value._number = v;
+		return true;
+	}
+
+	static void appendUtf8(std::string &str, uint32_t cp)
+	{
+		if (cp < 0x80)
+		{
+			str += (char)cp;
+		}
+		else if (cp < 0x800)
+		{
+			str += (char)(0xc0 | (cp >> 6));
+			str += (char)(0x80 | (cp & 0x3f));
+		}
+		else if (cp < 0x10000)
+		{
+			str += (char)(0xe0 | (cp >> 12));
+			str += (char)(0x80 | ((cp >> 6) & 0x3f));
+			str += (char)(0x80 | (cp & 0x3f));
+		}
+		else
+		{
+			str += (char)(0xf0 | (cp >> 18));
+			str += (char)(0x80 | ((cp >> 12) & 0x3f));
+			str += (char)(0x80 | ((cp >> 6) & 0x3f));
+			str += (char)(0x80 | (cp & 0x3f));
+		}
+	}
+
+	bool parseHex4(uint32_t &o_v)
+	{
+		o_v = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			const char c = *_p++;
+			o_v <<= 4;
+			if (c >= '0' && c <= '9') o_v |= c - '0';
+			else if (c >= 'a' && c <= 'f') o_v |= c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F') o_v |= c - 'A' + 10;
+			else return fail("Invalid unicode escape");
+		}
+		return true;
+	}
+
+	bool parseString(std::string &o_str)
+	{
+		++_p; // "
+		o_str.clear();
+		for (;;)
+		{
+			const char c = *_p++;
+			if (c == '"') return true;
+			if (c == '\0' || c == '\n') return fail("Unterminated string");
+			if (c != '\\')
+			{
+				o_str += c;
+				continue;
+			}
+			const char e = *_p++;
+			switch (e)
+			{
+			case '"': o_str += '"'; break;
+			case '\\': o_str += '\\'; break;
+			case '/': o_str += '/'; break;
+			case 'b': o_str += '\b'; break;
+			case 'f': o_str += '\f'; break;
+			case 'n': o_str += '\n'; break;
+			case 'r': o_str += '\r'; break;
+			case 't': o_str += '\t'; break;
+			case 'u':
+			{
+				uint32_t cp;
+				if (!parseHex4(cp)) return false;
+				if (cp >= 0xd800 && cp < 0xdc00 && _p[0] == '\\' && _p[1] == 'u')
+				{
+					_p += 2;
+					uint32_t lo;
+					if (!parseHex4(lo)) return false;
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+				}
+				appendUtf8(o_str, cp);
+			} break;
+			default:
+				return fail("Invalid escape sequence");
+			}
+		}
+	}
+
+	bool parseArray(JsonValue &o_value, int depth)
+	{
+		++_p; // [
+		o_value._type = JsonValue::Type::Array;
+		skipSpaces();
+		if (*_p == ']') { ++_p; return true; }
+		for (;;)
+		{
+			o_value._array.emplace_back();
+			if (!parseValue(o_value._array.back(), depth + 1)) return false;
+			skipSpaces();
+			if (*_p == ',') { ++_p; skipSpaces(); continue; }
+			if (*_p == ']') { ++_p; return true; }
+			return fail("Expected ',' or ']'");
+		}
+	}
+
+	bool parseObject(JsonValue &o_value, int depth)
+	{
+		++_p; // {
+		o_value._type = JsonValue::Type::Object;
+		skipSpaces();
+		if (*_p == '}') { ++_p; return true; }
+		for (;;)
+		{
+			if (*_p != '"') return fail("Expected a member name");
+			o_value._members.emplace_back();
+			auto &member = o_value._members.back();
+			if (!parseString(member.first)) return false;
+			skipSpaces();
+			if (*_p != ':') return fail("Expected ':'");
+			++_p;
+			skipSpaces();
+			if (!parseValue(member.second, depth + 1)) return false;
+			skipSpaces();
+			if (*_p == ',') { ++_p; skipSpaces(); continue; }
+			if (*_p == '}') { ++_p; return true; }
+			return fail("Expected ',' or '}'");
+		}
+	}
+
+	const char *_p;
+	int _line;
+	std::string _error;
+};
+
+const JsonValue* JsonValue::find(const char *key) const
+{
+	for (const auto &member : _members)
+	{
+		if (member.first == key) return &member.second;
+	}
+	return nullptr;
+}
+
+bool JsonValue::parse(const char *text, JsonValue &o_value, std::string &o_error)
+{
+	o_value = JsonValue();
+	JsonParser parser(text);
+	return parser.parseDocument(o_value, o_error);
+}
+
+bool JsonValue::parseFile(const char *path, JsonValue &o_value, std::string &o_error)
+{
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	if (!file)
+	{
+		o_error = std::string("Cannot open ") + path;
+		return false;
+	}
+	std::stringstream buffer;
+	buffer << file.rdbuf();
+	const std::string text = buffer.str();
+	if (!parse(text.c_str(), o_value, o_error))
+	{
+		o_error = std::string(path) + ": " + o_error;
+		return false;
+	}
+	return true;
+}
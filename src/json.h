@@ -0,0 +1,76 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Minimal JSON document
+/// Only what is needed to read job and scene files: no serialization and
+/// numbers are always stored as doubles.
+class JsonValue
+{
+public:
+	enum Type { Null, Bool, Number, String, Array, Object };
+
+	JsonValue() : _type(Type::Null), _bool(false), _number(0) {}
+
+	inline Type type() const { return _type; }
+	inline bool isNull() const { return _type == Type::Null; }
+	inline bool isBool() const { return _type == Type::Bool; }
+	inline bool isNumber() const { return _type == Type::Number; }
+	inline bool isString() const { return _type == Type::String; }
+	inline bool isArray() const { return _type == Type::Array; }
+	inline bool isObject() const { return _type == Type::Object; }
+
+	inline bool asBool() const { return _bool; }
+	inline double asNumber() const { return _number; }
+	inline const std::string& asString() const { return _string; }
+
+	/// Array elements
+	inline size_t size() const { return _array.size(); }
+	inline const JsonValue& operator[](size_t i) const { return _array[i]; }
+
+	/// Object members in file order
+	inline const std::vector<std::pair<std::string, JsonValue> >& members() const { return _members; }
+
+	/// Object member or nullptr if missing
+	const JsonValue* find(const char *key) const;
+
+	/// Parses a JSON document
+	/// @param o_error Error message with the line of the error
+	/// @return False if the document is not valid JSON
+	static bool parse(const char *text, JsonValue &o_value, std::string &o_error);
+	static bool parseFile(const char *path, JsonValue &o_value, std::string &o_error);
+
+private:
+	friend class JsonParser;
+
+	Type _type;
+	bool _bool;
+	double _number;
+	std::string _string;
+	std::vector<JsonValue> _array;
+	std::vector<std::pair<std::string, JsonValue> > _members;
+};
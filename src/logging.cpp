@@ -25,6 +25,7 @@ SOFTWARE.
 
 static std::string logBuffer;
 static bool logBufferEnabled = true;
+static bool logDebugEnabled = true;
 
 #define DEBUG 0
 
@@ -42,6 +43,7 @@ namespace
 
 void logDebug(const std::string &module, const std::string &msg)
 {
+	if (!logDebugEnabled) return;
 	const auto str = makeString("DEBG", module, msg);
 #if _WIN32 && DEBUG
 	OutputDebugString(str.c_str());
@@ -92,4 +94,14 @@ void clearLogBuffer()
 const std::string& getLogBuffer()
 {
 	return logBuffer;
-}
\ No newline at end of file
+}
+
+void enableLogDebug()
+{
+	logDebugEnabled = true;
+}
+
+void disableLogDebug()
+{
+	logDebugEnabled = false;
+}
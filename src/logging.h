@@ -29,5 +29,7 @@ void logWarning(const std::string &module, const std::string &str);
 void logError(const std::string &module, const std::string &str);
 void enableLogBuffer();
 void disableLogBuffer();
+void enableLogDebug();
+void disableLogDebug();
 void clearLogBuffer();
 const std::string& getLogBuffer();
\ No newline at end of file
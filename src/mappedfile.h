@@ -0,0 +1,67 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	/// Maps the file, closing any file mapped before
+	/// @return false if the file cannot be opened or mapped
+	bool open(const char *path);
+	void close();
+
+	inline bool isOpen() const { return _data != nullptr; }
+	inline const uint8_t* data() const { return _data; }
+	inline size_t size() const { return _size; }
+
+private:
+	const uint8_t *_data;
+	size_t _size;
+#if _WIN32
+	void *_file;
+	void *_mapping;
+#endif
+};
+
+/// Size and modification time of a file, to detect stale caches
+struct FileStamp
+{
+	uint64_t size = 0;
+	int64_t modified = 0;
+
+	/// @return false if the file does not exist
+	bool read(const char *path);
+
+	inline bool operator==(const FileStamp &o) const { return size == o.size && modified == o.modified; }
+	inline bool operator!=(const FileStamp &o) const { return !(*this == o); }
+};
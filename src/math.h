@@ -132,9 +132,42 @@ struct Vector4
 {
 	float x, y, z, w;
 	Vector4() {}
+	Vector4(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
 	Vector4(const Vector3 &v) : x(v.x), y(v.y), z(v.z), w(0) {}
 };
 
+/// Affine transform, x' = rows * x + translation
+struct Transform
+{
+	Vector3 rows[3] = { Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1) };
+	Vector3 translation;
+
+	inline Vector3 point(const Vector3 &p) const { return vector(p) + translation; }
+	inline Vector3 vector(const Vector3 &v) const { return Vector3(dot(rows[0], v), dot(rows[1], v), dot(rows[2], v)); }
+	/// Multiplies by the transposed rows, the inverse transform of a normal when called on the inverse
+	inline Vector3 transposedVector(const Vector3 &v) const { return rows[0] * v.x + rows[1] * v.y + rows[2] * v.z; }
+};
+
+inline float determinant(const Transform &t)
+{
+	return dot(t.rows[0], cross(t.rows[1], t.rows[2]));
+}
+
+inline Transform inverse(const Transform &t)
+{
+	// The adjugate columns are the cross products of the rows
+	const Vector3 c0 = cross(t.rows[1], t.rows[2]);
+	const Vector3 c1 = cross(t.rows[2], t.rows[0]);
+	const Vector3 c2 = cross(t.rows[0], t.rows[1]);
+	const float invDet = 1.0f / dot(t.rows[0], c0);
+	Transform r;
+	r.rows[0] = Vector3(c0.x, c1.x, c2.x) * invDet;
+	r.rows[1] = Vector3(c0.y, c1.y, c2.y) * invDet;
+	r.rows[2] = Vector3(c0.z, c1.z, c2.z) * invDet;
+	r.translation = -r.vector(t.translation);
+	return r;
+}
+
 struct Ray
 {
 	Vector3 origin;
@@ -379,4 +412,20 @@ inline void computeSamplesImportanceCosDir(const size_t sampleCount, const size_
 			o_basis[i + j * sampleCount] = v;
 		}
 	}
-}
\ No newline at end of file
+}
+/// Tangent frame around a direction, as in the sampling shaders
+/// Sample directions are computed as tx * s.x + ty * s.y + d * s.z
+inline void computeTangentFrame(const Vector3 &d, Vector3 &o_tx, Vector3 &o_ty)
+{
+	o_ty = normalize(std::fabsf(d.x) > std::fabsf(d.y) ? Vector3(d.z, 0, -d.x) : Vector3(0, d.z, -d.y));
+	o_tx = cross(d, o_ty);
+}
+
+/// Transforms a normal to the tangent space (n, t, b), as tangentspace.comp
+inline Vector3 toTangentSpace(const Vector3 &normal, const Vector3 &n, const Vector3 &t, const Vector3 &b)
+{
+	const Vector3 d0(n.z*b.y - n.y*b.z, n.x*b.z - n.z*b.x, n.y*b.x - n.x*b.y);
+	const Vector3 d1(t.z*n.y - t.y*n.z, t.x*n.z - n.x*t.z, n.x*t.y - t.x*n.y);
+	const Vector3 d2(t.y*b.z - t.z*b.y, t.z*b.x - t.x*b.z, t.x*b.y - t.y*b.x);
+	return normalize(Vector3(dot(normal, d0), dot(normal, d1), dot(normal, d2)));
+}
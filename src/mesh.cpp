@@ -21,39 +21,30 @@ SOFTWARE.
 */
 
 #include "mesh.h"
+#include "logging.h"
+#include "mappedfile.h"
+#include "radixsort.h"
+#include "threadpool.h"
+#include "timing.h"
+#include "weld.h"
 #include <tinyply.h>
 #include <algorithm>
-#include <cctype>
+#include <atomic>
 #include <cerrno>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iterator>
 #include <fstream>
 #include <functional>
-#include <map>
+#include <memory>
 #include <string>
-#include <tuple>
 #include <vector>
 #include <cassert>
 
-bool operator <(const Vector3 &lhs, const Vector3 &rhs)
-{
-	return std::tie(lhs.x, lhs.y, lhs.z) < std::tie(rhs.x, rhs.y, rhs.z);
-}
-
 namespace
 {
-	enum class WavefrontWarning
-	{
-		UnknownToken = (1 << 0),
-		NotImplemented = (1 << 1),
-	};
-
-	enum class WavefrontError
-	{
-		Syntax = (1 << 0),
-		InvalidStatement = (1 << 1),
-	};
-
 	enum class WavefrontToken
 	{
 		Unknown,
@@ -67,7 +58,7 @@ namespace
 		PolygonFace,
 	};
 
-	WavefrontToken str2token(const std::string::const_iterator begin, const std::string::const_iterator end)
+	WavefrontToken str2token(const char *begin, const char *end)
 	{
 		const auto length = std::distance(begin, end);
 
@@ -104,39 +95,30 @@ namespace
 		return WavefrontToken::Unknown;
 	}
 
-	std::string::const_iterator findFirstNoEmpty(const std::string::const_iterator &begin, const std::string::const_iterator &end)
-	{
-		return std::find_if(begin, end, std::not1(std::ptr_fun<int, int>(std::isspace)));
-	}
+	// The file is memory-mapped, so nothing is null-terminated: every reader
+	// works on [strPtr, end), where end is the end of the current line.
 
-	std::string::const_iterator findFirstEmpty(const std::string::const_iterator &begin, const std::string::const_iterator &end)
+	inline bool isSpace(char c)
 	{
-		return std::find_if(begin, end, std::isspace);
+		return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
 	}
 
-	bool readFloat(const char *&strPtr, float &value, bool required = true)
+	inline bool isDigit(char c)
 	{
-		char *end;
-		errno = 0;
-		value = static_cast<float>(std::strtod(strPtr, &end));
-		if (required && strPtr == end) return false;
-		strPtr = end;
-		return errno == 0;
+		return c >= '0' && c <= '9';
 	}
 
-	bool readInt(const char *&strPtr, int &value, bool required = true)
+	void consumeSpaces(const char *&strPtr, const char *end)
 	{
-		char *end;
-		errno = 0;
-		value = static_cast<int>(std::strtol(strPtr, &end, 10));
-		if (required && strPtr == end) return false;
-		strPtr = end;
-		return errno == 0;
+		while (strPtr < end && isSpace(*strPtr))
+		{
+			++strPtr;
+		}
 	}
 
-	bool consumeCharacter(const char *&strPtr, char c)
+	bool consumeCharacter(const char *&strPtr, const char *end, char c)
 	{
-		if (*strPtr == c)
+		if (strPtr < end && *strPtr == c)
 		{
 			++strPtr;
 			return true;
@@ -144,319 +126,445 @@ namespace
 		return false;
 	}
 
-	void consumeSpaces(const char *&strPtr)
+	bool isEndOfLine(const char *strPtr, const char *end)
 	{
-		while (std::isspace(*strPtr))
-		{
-			++strPtr;
-		}
+		consumeSpaces(strPtr, end);
+		return strPtr == end;
 	}
 
-	bool isEndOfLine(const char *strPtr)
+	/// strtod() of a copy of the number, for the cases the fast path does not handle
+	bool readFloatSlow(const char *&strPtr, const char *end, float &value, bool required)
 	{
-		while (*strPtr)
+		char buffer[64];
+		const size_t length = std::min(size_t(end - strPtr), sizeof(buffer) - 1);
+		memcpy(buffer, strPtr, length);
+		buffer[length] = '\0';
+
+		char *numberEnd;
+		errno = 0;
+		value = static_cast<float>(std::strtod(buffer, &numberEnd));
+		if (required && numberEnd == buffer) return false;
+		strPtr += numberEnd - buffer;
+		return errno == 0;
+	}
+
+	/// Reads a decimal number as strtod() would
+	/// Mantissas of up to 2^53 with exponents of up to 22 are exact in double
+	/// precision, so the result only differs from strtod() by the final rounding
+	/// to float. Anything else (more digits, inf, nan, hex) goes to strtod().
+	bool readFloat(const char *&strPtr, const char *end, float &value, bool required = true)
+	{
+		static const double k_pow10[] =
 		{
-			if (!std::isspace(*strPtr)) return false;
-			++strPtr;
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+		};
+		const uint64_t k_maxMantissa = uint64_t(1) << 53;
+
+		consumeSpaces(strPtr, end);
+		const char *ptr = strPtr;
+
+		bool negative = false;
+		if (ptr < end && (*ptr == '-' || *ptr == '+'))
+		{
+			negative = *ptr == '-';
+			++ptr;
+		}
+
+		uint64_t mantissa = 0;
+		int exponent = 0;
+		bool hasDigits = false;
+		for (; ptr < end && isDigit(*ptr); ++ptr)
+		{
+			if (mantissa < k_maxMantissa) mantissa = mantissa * 10 + uint64_t(*ptr - '0');
+			else ++exponent;
+			hasDigits = true;
+		}
+		if (ptr < end && *ptr == '.')
+		{
+			for (++ptr; ptr < end && isDigit(*ptr); ++ptr)
+			{
+				if (mantissa < k_maxMantissa)
+				{
+					mantissa = mantissa * 10 + uint64_t(*ptr - '0');
+					--exponent;
+				}
+				hasDigits = true;
+			}
 		}
+		if (!hasDigits || (ptr < end && (*ptr | 0x20) == 'x'))
+		{
+			return readFloatSlow(strPtr, end, value, required);
+		}
+
+		if (ptr + 1 < end && (*ptr | 0x20) == 'e')
+		{
+			const char *expPtr = ptr + 1;
+			bool expNegative = false;
+			if (*expPtr == '-' || *expPtr == '+')
+			{
+				expNegative = *expPtr == '-';
+				++expPtr;
+			}
+			if (expPtr < end && isDigit(*expPtr))
+			{
+				int e = 0;
+				for (; expPtr < end && isDigit(*expPtr); ++expPtr)
+				{
+					if (e < 10000) e = e * 10 + (*expPtr - '0');
+				}
+				exponent += expNegative ? -e : e;
+				ptr = expPtr;
+			}
+		}
+
+		if (mantissa > k_maxMantissa || exponent < -22 || exponent > 22)
+		{
+			return readFloatSlow(strPtr, end, value, required);
+		}
+
+		double d = double(mantissa);
+		d = exponent < 0 ? d / k_pow10[-exponent] : d * k_pow10[exponent];
+		value = static_cast<float>(negative ? -d : d);
+		strPtr = ptr;
 		return true;
 	}
 
-	struct WavefrontVertex
+	bool readInt(const char *&strPtr, const char *end, int &value, bool required = true)
 	{
-		float x, y, z, w;
-	};
+		const char *ptr = strPtr;
+		consumeSpaces(ptr, end);
 
-	struct WavefrontTexcoord
-	{
-		float u, v, w;
-	};
+		bool negative = false;
+		if (ptr < end && (*ptr == '-' || *ptr == '+'))
+		{
+			negative = *ptr == '-';
+			++ptr;
+		}
 
-	struct WavefrontNormal
+		int64_t v = 0;
+		const char *digits = ptr;
+		for (; ptr < end && isDigit(*ptr); ++ptr)
+		{
+			v = v * 10 + (*ptr - '0');
+			if (v > INT32_MAX) return false;
+		}
+
+		if (ptr == digits)
+		{
+			value = 0;
+			return !required;
+		}
+		value = static_cast<int>(negative ? -v : v);
+		strPtr = ptr;
+		return true;
+	}
+
+	enum class WavefrontFaceOptions
 	{
-		float i, j, k;
+		HasTexcoord = (1 << 0),
+		HasNormal = (1 << 1),
 	};
 
+	/// Face vertex with 0-based indices
+	/// Negative OBJ indices are relative to the last element read. While parsing
+	/// a chunk they are stored relative to the first element of the chunk and
+	/// flagged, and the chunk offsets are added when the chunks are merged.
 	struct WavefrontFaceVertex
 	{
+		enum { RelativeVertex = 1 << 0, RelativeTexcoord = 1 << 1, RelativeNormal = 1 << 2 };
+
 		int vertexIndex;
 		int texcoordIndex;
 		int normalIndex;
+		uint32_t relative;
 	};
 
-	struct WavefrontFaceEntryPoint
+	/// Part of the file starting and ending at line boundaries, parsed on its own
+	struct WavefrontChunk
 	{
-		size_t start;
-		size_t vertexCount;
+		const char *begin;
+		const char *end;
+		std::vector<Vector3> positions;
+		std::vector<Vector2> texcoords;
+		std::vector<Vector3> normals;
+		std::vector<WavefrontFaceVertex> faceVertices;
+		std::vector<uint32_t> faceSizes;
+		size_t triangleCount = 0;
+		int faceOptions = -1; // WavefrontFaceOptions of the first face vertex, -1 if the chunk has no faces
+		bool failed = false;
 	};
 
-	enum class WavefrontFaceOptions
-	{
-		HasTexcoord = (1 << 0),
-		HasNormal = (1 << 1),
-	};
+	// 1 MB is enough to hide the scheduling cost, larger files are split a few times per thread
+	const size_t k_wavefrontMinChunkSize = 1 << 20;
+	const size_t k_wavefrontChunksPerThread = 8;
 
-	bool operator <(const WavefrontFaceVertex &lhs, const WavefrontFaceVertex &rhs)
+	/// Converts a 1-based (or negative relative) OBJ index read from a chunk
+	/// @param count Elements of this kind read so far in the chunk
+	inline int toChunkIndex(int index, size_t count, uint32_t relativeFlag, uint32_t &relative)
 	{
-		return std::tie(lhs.vertexIndex, lhs.texcoordIndex, lhs.normalIndex) < std::tie(rhs.vertexIndex, rhs.texcoordIndex, rhs.normalIndex);
+		if (index > 0) return index - 1;
+		relative |= relativeFlag;
+		return int(count) + index;
 	}
 
+#define exit_on_fail(x) if (!(x)) { chunk.failed = true; return; }
 
-	template <typename T, typename E>
-	class Bitmask
-	{
-	public:
-		Bitmask() : mask(0) {}
-		Bitmask(T m) : mask(m) {}
-		Bitmask(E e) : mask(static_cast<T>(e)) {}
-		Bitmask operator|(Bitmask b) { return Bitmask(mask | b.mask); }
-		Bitmask& operator|=(E e) { mask |= static_cast<T>(e); return *this; }
-		Bitmask& operator|=(Bitmask rhs) { mask |= rhs.mask; return *this; }
-		bool has(E e) { return mask & static_cast<T>(e); }
-
-	private:
-		T mask;
-	};
-
-#define DeclareBitmask(T,E) \
-	Bitmask<T,E> operator|(E a, E b) { return Bitmask<T,E>(a) | Bitmask<T,E>(b); } \
-	using Bitmask_ ## E = Bitmask<T, E>;
-
-	DeclareBitmask(uint32_t, WavefrontFaceOptions)
-}
-
-#if DEBUG
-#define exit_on_fail(x) if (!(x)) { errors |= static_cast<uint32_t>(WavefrontError::Syntax); return nullptr; }
-#else
-#define exit_on_fail(x) if (!(x)) { return nullptr; }
-#endif
-
-
-Mesh* Mesh::loadWavefrontObj(const char *path)
-{
-#if DEBUG
-	uint32_t warnings = 0u;
-	uint32_t errors = 0u;
-#endif
-
-	Bitmask_WavefrontFaceOptions faceOptions;
-	bool faceOptionsInitialzed = false;
-
-	std::vector<WavefrontVertex> vertices;
-	std::vector<WavefrontTexcoord> texcoords;
-	std::vector<WavefrontNormal> normals;
-	std::vector<WavefrontFaceEntryPoint> faces;
-	std::vector<WavefrontFaceVertex> faceVertices;
-
-	std::ifstream ifs;
-	ifs.open(path, std::ifstream::in);
-
-	std::string line;
-
-	while (std::getline(ifs, line))
+	void parseWavefrontChunk(WavefrontChunk &chunk)
 	{
-		if (line.size() == 0) continue; // Empty line
+		const char *linePtr = chunk.begin;
+		while (linePtr < chunk.end)
+		{
+			const char *lineEnd = static_cast<const char*>(memchr(linePtr, '\n', chunk.end - linePtr));
+			if (!lineEnd) lineEnd = chunk.end;
+			const char *ptr = linePtr;
+			linePtr = lineEnd + 1;
 
-		const auto firstTokenBegin = findFirstNoEmpty(line.begin(), line.end());
-		const auto firstTokenEnd = findFirstEmpty(firstTokenBegin, line.end());
+			consumeSpaces(ptr, lineEnd);
+			if (ptr == lineEnd) continue; // Empty line
 
-		if (firstTokenBegin == line.end()) continue; // Empty line
+			const char *firstTokenBegin = ptr;
+			while (ptr < lineEnd && !isSpace(*ptr)) ++ptr;
 
-		const WavefrontToken token = str2token(firstTokenBegin, firstTokenEnd);
-		switch (token)
-		{
-		case WavefrontToken::Comment:
-		{
-			continue;
-		} break;
-		case WavefrontToken::Vertex:
-		{
-			float x, y, z, w;
-			const char *ptr = &(*firstTokenEnd);
-			exit_on_fail(readFloat(ptr, x));
-			exit_on_fail(readFloat(ptr, y));
-			exit_on_fail(readFloat(ptr, z));
-			exit_on_fail(readFloat(ptr, w, false));
-			exit_on_fail(isEndOfLine(ptr));
-			vertices.emplace_back(WavefrontVertex{ x, y, z, w });
-		} break;
-		case WavefrontToken::VertexTexture:
-		{
-			float u, v, w;
-			const char *ptr = &(*firstTokenEnd);
-			exit_on_fail(readFloat(ptr, u));
-			exit_on_fail(readFloat(ptr, v));
-			exit_on_fail(readFloat(ptr, w, false));
-			exit_on_fail(isEndOfLine(ptr));
-			texcoords.emplace_back(WavefrontTexcoord{ u, v, w });
-		} break;
-		case WavefrontToken::VertexNormal:
-		{
-			float i, j, k;
-			const char *ptr = &(*firstTokenEnd);
-			exit_on_fail(readFloat(ptr, i));
-			exit_on_fail(readFloat(ptr, j));
-			exit_on_fail(readFloat(ptr, k));
-			exit_on_fail(isEndOfLine(ptr));
-			normals.emplace_back(WavefrontNormal{ i, j, k });
-		} break;
-		case WavefrontToken::PolygonFace:
-		{
-			WavefrontFaceEntryPoint entryPoint;
-			entryPoint.start = faceVertices.size();
-			entryPoint.vertexCount = 0;
-			const char *ptr = &(*firstTokenEnd);
-
-			while (!isEndOfLine(ptr))
+			const WavefrontToken token = str2token(firstTokenBegin, ptr);
+			switch (token)
 			{
-				WavefrontFaceVertex v;
-				v.texcoordIndex = 0;
-				v.normalIndex = 0;
-				exit_on_fail(readInt(ptr, v.vertexIndex));
-				if (consumeCharacter(ptr, '/')) exit_on_fail(readInt(ptr, v.texcoordIndex, false));
-				if (consumeCharacter(ptr, '/')) exit_on_fail(readInt(ptr, v.normalIndex));
-
-				if (!faceOptionsInitialzed)
-				{
-					if (v.texcoordIndex != 0) faceOptions |= WavefrontFaceOptions::HasTexcoord;
-					if (v.normalIndex != 0) faceOptions |= WavefrontFaceOptions::HasNormal;
-					faceOptionsInitialzed = true;
-				}
-				else
+			case WavefrontToken::Vertex:
+			{
+				float x, y, z, w;
+				exit_on_fail(readFloat(ptr, lineEnd, x));
+				exit_on_fail(readFloat(ptr, lineEnd, y));
+				exit_on_fail(readFloat(ptr, lineEnd, z));
+				exit_on_fail(readFloat(ptr, lineEnd, w, false));
+				exit_on_fail(isEndOfLine(ptr, lineEnd));
+				chunk.positions.push_back(Vector3(x, y, z));
+			} break;
+			case WavefrontToken::VertexTexture:
+			{
+				float u, v, w;
+				exit_on_fail(readFloat(ptr, lineEnd, u));
+				exit_on_fail(readFloat(ptr, lineEnd, v));
+				exit_on_fail(readFloat(ptr, lineEnd, w, false));
+				exit_on_fail(isEndOfLine(ptr, lineEnd));
+				chunk.texcoords.push_back(Vector2(u, v));
+			} break;
+			case WavefrontToken::VertexNormal:
+			{
+				float i, j, k;
+				exit_on_fail(readFloat(ptr, lineEnd, i));
+				exit_on_fail(readFloat(ptr, lineEnd, j));
+				exit_on_fail(readFloat(ptr, lineEnd, k));
+				exit_on_fail(isEndOfLine(ptr, lineEnd));
+				chunk.normals.push_back(Vector3(i, j, k));
+			} break;
+			case WavefrontToken::PolygonFace:
+			{
+				uint32_t vertexCount = 0;
+				while (!isEndOfLine(ptr, lineEnd))
 				{
-					exit_on_fail((v.texcoordIndex != 0) == faceOptions.has(WavefrontFaceOptions::HasTexcoord));
-					exit_on_fail((v.normalIndex != 0) == faceOptions.has(WavefrontFaceOptions::HasNormal));
+					int vertexIndex = 0;
+					int texcoordIndex = 0;
+					int normalIndex = 0;
+					exit_on_fail(readInt(ptr, lineEnd, vertexIndex));
+					if (consumeCharacter(ptr, lineEnd, '/')) exit_on_fail(readInt(ptr, lineEnd, texcoordIndex, false));
+					if (consumeCharacter(ptr, lineEnd, '/')) exit_on_fail(readInt(ptr, lineEnd, normalIndex));
+					exit_on_fail(vertexIndex != 0);
+
+					int options = 0;
+					if (texcoordIndex != 0) options |= static_cast<int>(WavefrontFaceOptions::HasTexcoord);
+					if (normalIndex != 0) options |= static_cast<int>(WavefrontFaceOptions::HasNormal);
+					if (chunk.faceOptions < 0) chunk.faceOptions = options;
+					exit_on_fail(options == chunk.faceOptions);
+
+					WavefrontFaceVertex v;
+					v.relative = 0;
+					v.vertexIndex = toChunkIndex(vertexIndex, chunk.positions.size(), WavefrontFaceVertex::RelativeVertex, v.relative);
+					v.texcoordIndex = toChunkIndex(texcoordIndex, chunk.texcoords.size(), WavefrontFaceVertex::RelativeTexcoord, v.relative);
+					v.normalIndex = toChunkIndex(normalIndex, chunk.normals.size(), WavefrontFaceVertex::RelativeNormal, v.relative);
+					chunk.faceVertices.push_back(v);
+					++vertexCount;
 				}
 
-				++entryPoint.vertexCount;
-				faceVertices.emplace_back(v);
-
-				consumeSpaces(ptr);
+				// Faces with less than three vertices keep their vertices but add no triangles
+				chunk.faceSizes.push_back(vertexCount);
+				if (vertexCount >= 3) chunk.triangleCount += vertexCount - 2;
+			} break;
+			case WavefrontToken::Comment:
+			case WavefrontToken::VertexParameter:
+			case WavefrontToken::PolygonPoint:
+			case WavefrontToken::PolygonLine:
+			case WavefrontToken::Unknown:
+			default:
+				break;
 			}
+		}
+	}
 
-			if (entryPoint.vertexCount < 3)
-			{
-#if DEBUG
-				errors |= static_cast<uint32_t>(WavefrontError::InvalidStatement);
-				return nullptr;
-#endif
-			}
+#undef exit_on_fail
 
-			faces.emplace_back(entryPoint);
-		} break;
-		case WavefrontToken::VertexParameter:
-		case WavefrontToken::PolygonPoint:
-		case WavefrontToken::PolygonLine:
+	/// Resolves a chunk index to an index in the merged arrays
+	/// @return false if the index is out of range
+	inline bool resolveIndex(int index, bool relative, size_t chunkOffset, size_t count, uint32_t &o_index)
+	{
+		const int64_t resolved = relative ? int64_t(chunkOffset) + index : int64_t(index);
+		if (resolved < 0 || resolved >= int64_t(count)) return false;
+		o_index = uint32_t(resolved);
+		return true;
+	}
+}
+
+Mesh* Mesh::loadWavefrontObj(const char *path)
+{
+	MappedFile file;
+	if (!file.open(path)) return nullptr;
+
+	Timing timing;
+	timing.begin();
+
+	// Chunks split at line boundaries
+	const char *fileBegin = reinterpret_cast<const char*>(file.data());
+	const char *fileEnd = fileBegin + file.size();
+	ThreadPool &pool = ThreadPool::global();
+	const size_t chunkSize = std::max(k_wavefrontMinChunkSize, file.size() / (pool.threadCount() * k_wavefrontChunksPerThread) + 1);
+	std::vector<WavefrontChunk> chunks;
+	for (const char *begin = fileBegin; begin < fileEnd; )
+	{
+		const char *end = begin + std::min(chunkSize, size_t(fileEnd - begin));
+		if (end < fileEnd)
 		{
-#if DEBUG
-			warnings |= static_cast<uint32_t>(WavefrontWarning::NotImplemented);
-#endif
+			const char *newline = static_cast<const char*>(memchr(end, '\n', fileEnd - end));
+			end = newline ? newline + 1 : fileEnd;
 		}
-		case WavefrontToken::Unknown:
-		default:
+		chunks.emplace_back();
+		chunks.back().begin = begin;
+		chunks.back().end = end;
+		begin = end;
+	}
+
+	pool.parallelFor(0, chunks.size(), 1, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
 		{
-#if DEBUG
-			warnings |= static_cast<uint32_t>(WavefrontWarning::UnknownToken);
-#endif
+			parseWavefrontChunk(chunks[i]);
 		}
+	});
+
+	// Offsets of every chunk in the merged arrays
+	struct ChunkOffsets
+	{
+		size_t position, texcoord, normal, vertex, triangle;
+	};
+	std::vector<ChunkOffsets> offsets(chunks.size());
+	ChunkOffsets total = {};
+	int faceOptions = -1;
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		const WavefrontChunk &chunk = chunks[i];
+		if (chunk.failed) return nullptr;
+		// Every face vertex of the file must have the same optional indices as the first one
+		if (chunk.faceOptions >= 0)
+		{
+			if (faceOptions >= 0 && faceOptions != chunk.faceOptions) return nullptr;
+			faceOptions = chunk.faceOptions;
 		}
+		offsets[i] = total;
+		total.position += chunk.positions.size();
+		total.texcoord += chunk.texcoords.size();
+		total.normal += chunk.normals.size();
+		total.vertex += chunk.faceVertices.size();
+		total.triangle += chunk.triangleCount;
 	}
+	if (total.vertex > UINT32_MAX) return nullptr;
 
-	ifs.close();
+	const bool hasTexcoords = faceOptions >= 0 && (faceOptions & static_cast<int>(WavefrontFaceOptions::HasTexcoord)) != 0;
+	const bool hasNormals = faceOptions >= 0 && (faceOptions & static_cast<int>(WavefrontFaceOptions::HasNormal)) != 0;
 
-	Mesh *mesh = new Mesh();
-	
-	mesh->positions.reserve(vertices.size());
-	for (const auto &v : vertices) mesh->positions.push_back(Vector3(v.x, v.y, v.z));
-	mesh->texcoords.reserve(texcoords.size());
-	for (const auto &t : texcoords) mesh->texcoords.push_back(Vector2(t.u, t.v));
-	mesh->normals.reserve(normals.size());
-	for (const auto &n : normals) mesh->normals.push_back(Vector3(n.i, n.j, n.k));
-
-#if 0
-	std::map<WavefrontFaceVertex, uint32_t> vertexIndices; // Shared vertices map
-	
-	for (const auto &face : faces)
-	{
-		uint32_t firstVertexIdx = UINT32_MAX;
-		uint32_t previousVertexIdx = UINT32_MAX;
+	std::unique_ptr<Mesh> mesh(new Mesh());
+	mesh->positions.resize(total.position);
+	mesh->texcoords.resize(total.texcoord);
+	mesh->normals.resize(total.normal);
+	mesh->vertices.resize(total.vertex);
+	mesh->triangles.resize(total.triangle);
 
-		for (size_t i = 0; i < face.vertexCount; ++i)
+	std::atomic<bool> failed(false);
+	pool.parallelFor(0, chunks.size(), 1, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
 		{
-			uint32_t vertexIdx = UINT32_MAX;
+			WavefrontChunk &chunk = chunks[i];
+			const ChunkOffsets &offset = offsets[i];
+			std::copy(chunk.positions.begin(), chunk.positions.end(), mesh->positions.begin() + offset.position);
+			std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), mesh->texcoords.begin() + offset.texcoord);
+			std::copy(chunk.normals.begin(), chunk.normals.end(), mesh->normals.begin() + offset.normal);
+
+			// Faces are triangulated as fans
+			uint32_t vertexIdx = (uint32_t)offset.vertex;
+			size_t triangleIdx = offset.triangle;
+			const WavefrontFaceVertex *faceVertex = chunk.faceVertices.data();
+			for (const uint32_t faceSize : chunk.faceSizes)
 			{
-				const auto &v = faceVertices[face.start + i];
-				auto it = vertexIndices.find(v);
-				if (it == vertexIndices.end())
-				{
-					const uint32_t pidx = (uint32_t)(v.vertexIndex - 1);
-					const uint32_t tidx = v.texcoordIndex != 0 ? (uint32_t)(v.texcoordIndex - 1) : UINT32_MAX;
-					const uint32_t nidx = v.normalIndex != 0 ? (uint32_t)(v.normalIndex - 1) : UINT32_MAX;
-					vertexIdx = (uint32_t)mesh->vertices.size();
-					vertexIndices[v] = vertexIdx;
-					mesh->vertices.emplace_back(Mesh::Vertex{ pidx, tidx, nidx });
-				}
-				else
+				const uint32_t firstVertexIdx = vertexIdx;
+				for (uint32_t k = 0; k < faceSize; ++k, ++faceVertex, ++vertexIdx)
 				{
-					vertexIdx = it->second;
+					const WavefrontFaceVertex &v = *faceVertex;
+					Mesh::Vertex &o = mesh->vertices[vertexIdx];
+					o.texcoordIndex = UINT32_MAX;
+					o.normalIndex = UINT32_MAX;
+					if (!resolveIndex(v.vertexIndex, (v.relative & WavefrontFaceVertex::RelativeVertex) != 0, offset.position, total.position, o.positionIndex) ||
+						(hasTexcoords && !resolveIndex(v.texcoordIndex, (v.relative & WavefrontFaceVertex::RelativeTexcoord) != 0, offset.texcoord, total.texcoord, o.texcoordIndex)) ||
+						(hasNormals && !resolveIndex(v.normalIndex, (v.relative & WavefrontFaceVertex::RelativeNormal) != 0, offset.normal, total.normal, o.normalIndex)))
+					{
+						failed = true;
+						return;
+					}
+
+					if (k >= 2)
+					{
+						mesh->triangles[triangleIdx++] = Mesh::Triangle{ firstVertexIdx, vertexIdx - 1, vertexIdx };
+					}
 				}
 			}
 
-			if (firstVertexIdx == UINT32_MAX)
-			{
-				firstVertexIdx = vertexIdx;
-			}
-			else if (previousVertexIdx == UINT32_MAX)
-			{
-				previousVertexIdx = vertexIdx;
-			}
-			else
-			{
-				mesh->triangles.emplace_back(Mesh::Triangle{ firstVertexIdx, previousVertexIdx, vertexIdx });
-				previousVertexIdx = vertexIdx;
-			}
+			// Parsed data is not needed anymore
+			chunk = WavefrontChunk();
 		}
-	}
-#else
-	for (const auto &face : faces)
-	{
-		uint32_t firstVertexIdx = UINT32_MAX;
-		uint32_t previousVertexIdx = UINT32_MAX;
-
-		for (size_t i = 0; i < face.vertexCount; ++i)
-		{
-			uint32_t vertexIdx = UINT32_MAX;
-			{
-				const auto &v = faceVertices[face.start + i];
-				const uint32_t pidx = (uint32_t)(v.vertexIndex - 1);
-				const uint32_t tidx = v.texcoordIndex != 0 ? (uint32_t)(v.texcoordIndex - 1) : UINT32_MAX;
-				const uint32_t nidx = v.normalIndex != 0 ? (uint32_t)(v.normalIndex - 1) : UINT32_MAX;
-				vertexIdx = (uint32_t)mesh->vertices.size();
-				mesh->vertices.emplace_back(Mesh::Vertex{ pidx, tidx, nidx });
-			}
+	});
+	if (failed) return nullptr;
 
-			if (firstVertexIdx == UINT32_MAX)
-			{
-				firstVertexIdx = vertexIdx;
-			}
-			else if (previousVertexIdx == UINT32_MAX)
-			{
-				previousVertexIdx = vertexIdx;
-			}
-			else
-			{
-				mesh->triangles.emplace_back(Mesh::Triangle{ firstVertexIdx, previousVertexIdx, vertexIdx });
-				previousVertexIdx = vertexIdx;
-			}
-		}
-	}
-#endif
+	timing.end();
+	logDebug("Mesh", "Parsed " + std::string(path) + " in " + std::to_string(timing.elapsedSeconds()) + " seconds with " +
+		std::to_string(chunks.size()) + " chunks.");
 
-	return mesh;
+	return mesh.release();
 }
 
 namespace
 {
+	const size_t k_normalsGrainSize = 4096;
+
+	/// Index of the vertex at a corner (triangle * 3 + corner in the triangle)
+	inline uint32_t cornerVertexIndex(const Mesh::Triangle &tri, size_t corner)
+	{
+		return (&tri.vertexIndex0)[corner % 3];
+	}
+
+	inline uint32_t cornerVertexIndex(const std::vector<Mesh::Triangle> &triangles, size_t corner)
+	{
+		return cornerVertexIndex(triangles[corner / 3], corner);
+	}
+
+	/// Normal of the triangle p0 p1 p2 scaled by its angle at p0
+	/// Degenerate triangles give a zero vector instead of NaNs.
+	inline Vector3 angleWeightedNormal(const Vector3 &p0, const Vector3 &p1, const Vector3 &p2)
+	{
+		const Vector3 e0 = p1 - p0;
+		const Vector3 e1 = p2 - p0;
+		const Vector3 n = cross(e0, e1);
+		const float nlen = length(n);
+		if (!(nlen > 0.0f)) return Vector3();
+		return n * (std::atan2(nlen, dot(e0, e1)) / nlen);
+	}
+
 	void copyPlyData(std::shared_ptr<tinyply::PlyData> src, std::vector<Vector3> &dst)
 	{
 		dst.clear();
@@ -616,6 +724,240 @@ Mesh * Mesh::loadFile(const char * path)
 	return nullptr;
 }
 
+namespace
+{
+	// Binary mesh cache layout:
+	// MeshCacheHeader, k_meshCacheSectionCount MeshCacheSection, then the data of
+	// every section at its offset, aligned to k_meshCacheAlignment.
+	// Data is stored as in memory, so a cache is only valid on the same endianness.
+
+	const char k_meshCacheMagic[8] = { 'B', 'A', 'K', 'E', 'C', 'M', 'S', 'H' };
+	// Bump whenever a loader changes the meshes it returns, caches written by
+	// older loaders are then rebuilt from the source
+	const uint32_t k_meshCacheVersion = 2;
+	const uint64_t k_meshCacheAlignment = 64;
+
+	enum MeshCacheSectionId
+	{
+		Positions, Texcoords, Normals, Tangents, Bitangents, Vertices, Triangles,
+		k_meshCacheSectionCount
+	};
+
+	struct MeshCacheHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t sectionCount;
+		uint64_t sourceSize; // FileStamp of the source mesh when the cache was written
+		int64_t sourceModified;
+	};
+
+	struct MeshCacheSection
+	{
+		uint32_t id;
+		uint32_t elementSize;
+		uint64_t offset;
+		uint64_t count;
+	};
+
+	static_assert(sizeof(MeshCacheHeader) == 32, "The mesh cache header must not have padding");
+	static_assert(sizeof(MeshCacheSection) == 24, "The mesh cache sections must not have padding");
+	static_assert(sizeof(Vector2) == 8 && sizeof(Vector3) == 12, "Mesh data is stored as in memory");
+	static_assert(sizeof(Mesh::Vertex) == 12 && sizeof(Mesh::Triangle) == 12, "Mesh data is stored as in memory");
+
+	struct MeshCacheData
+	{
+		const void *data;
+		uint32_t elementSize;
+		uint64_t count;
+	};
+
+	template <typename T>
+	MeshCacheData cacheData(const std::vector<T> &v)
+	{
+		return MeshCacheData{ v.data(), (uint32_t)sizeof(T), (uint64_t)v.size() };
+	}
+
+	template <typename T>
+	bool readSection(const MappedFile &file, const MeshCacheSection &section, uint32_t id, std::vector<T> &o_v)
+	{
+		if (section.id != id || section.elementSize != sizeof(T)) return false;
+		if (section.offset > file.size() || section.count > (file.size() - section.offset) / sizeof(T)) return false;
+		const T *begin = reinterpret_cast<const T*>(file.data() + section.offset);
+		o_v.assign(begin, begin + section.count);
+		return true;
+	}
+
+	/// Whether the indices of a cached mesh are in range, as the loaders ensure
+	/// Texcoord and normal indices may be UINT32_MAX for vertices without them.
+	bool validMeshCacheIndices(const Mesh &mesh)
+	{
+		if ((!mesh.tangents.empty() && mesh.tangents.size() != mesh.vertices.size()) ||
+			mesh.bitangents.size() != mesh.tangents.size())
+		{
+			return false;
+		}
+
+		std::atomic<bool> valid(true);
+		ThreadPool &pool = ThreadPool::global();
+		pool.parallelFor(0, mesh.vertices.size(), k_normalsGrainSize, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end && valid; ++i)
+			{
+				const Mesh::Vertex &v = mesh.vertices[i];
+				if (v.positionIndex >= mesh.positions.size() ||
+					(v.texcoordIndex != UINT32_MAX && v.texcoordIndex >= mesh.texcoords.size()) ||
+					(v.normalIndex != UINT32_MAX && v.normalIndex >= mesh.normals.size()))
+				{
+					valid = false;
+				}
+			}
+		});
+		pool.parallelFor(0, mesh.triangles.size(), k_normalsGrainSize, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end && valid; ++i)
+			{
+				const Mesh::Triangle &tri = mesh.triangles[i];
+				if (tri.vertexIndex0 >= mesh.vertices.size() ||
+					tri.vertexIndex1 >= mesh.vertices.size() ||
+					tri.vertexIndex2 >= mesh.vertices.size())
+				{
+					valid = false;
+				}
+			}
+		});
+		return valid;
+	}
+
+	std::string meshCachePath(const char *path)
+	{
+		return std::string(path) + ".bakecmesh";
+	}
+
+	Mesh* loadMeshCache(const char *cachePath, const FileStamp &source)
+	{
+		MappedFile file;
+		if (!file.open(cachePath)) return nullptr;
+
+		const size_t tableSize = sizeof(MeshCacheHeader) + sizeof(MeshCacheSection) * k_meshCacheSectionCount;
+		if (file.size() < tableSize) return nullptr;
+
+		MeshCacheHeader header;
+		memcpy(&header, file.data(), sizeof(header));
+		if (memcmp(header.magic, k_meshCacheMagic, sizeof(header.magic)) != 0 ||
+			header.version != k_meshCacheVersion ||
+			header.sectionCount != k_meshCacheSectionCount ||
+			header.sourceSize != source.size ||
+			header.sourceModified != source.modified)
+		{
+			return nullptr;
+		}
+
+		MeshCacheSection sections[k_meshCacheSectionCount];
+		memcpy(sections, file.data() + sizeof(header), sizeof(sections));
+
+		std::unique_ptr<Mesh> mesh(new Mesh());
+		const bool ok =
+			readSection(file, sections[Positions], Positions, mesh->positions) &&
+			readSection(file, sections[Texcoords], Texcoords, mesh->texcoords) &&
+			readSection(file, sections[Normals], Normals, mesh->normals) &&
+			readSection(file, sections[Tangents], Tangents, mesh->tangents) &&
+			readSection(file, sections[Bitangents], Bitangents, mesh->bitangents) &&
+			readSection(file, sections[Vertices], Vertices, mesh->vertices) &&
+			readSection(file, sections[Triangles], Triangles, mesh->triangles);
+		if (!ok) return nullptr;
+		if (!validMeshCacheIndices(*mesh))
+		{
+			logWarning("Mesh", "Indices out of range in the mesh cache " + std::string(cachePath) + ", rebuilding it");
+			return nullptr;
+		}
+		return mesh.release();
+	}
+
+	bool saveMeshCache(const Mesh &mesh, const char *cachePath, const FileStamp &source)
+	{
+		const MeshCacheData data[k_meshCacheSectionCount] =
+		{
+			cacheData(mesh.positions),
+			cacheData(mesh.texcoords),
+			cacheData(mesh.normals),
+			cacheData(mesh.tangents),
+			cacheData(mesh.bitangents),
+			cacheData(mesh.vertices),
+			cacheData(mesh.triangles),
+		};
+
+		MeshCacheHeader header;
+		memcpy(header.magic, k_meshCacheMagic, sizeof(header.magic));
+		header.version = k_meshCacheVersion;
+		header.sectionCount = k_meshCacheSectionCount;
+		header.sourceSize = source.size;
+		header.sourceModified = source.modified;
+
+		MeshCacheSection sections[k_meshCacheSectionCount];
+		uint64_t offset = sizeof(header) + sizeof(sections);
+		for (uint32_t i = 0; i < k_meshCacheSectionCount; ++i)
+		{
+			offset = (offset + k_meshCacheAlignment - 1) / k_meshCacheAlignment * k_meshCacheAlignment;
+			sections[i] = MeshCacheSection{ i, data[i].elementSize, offset, data[i].count };
+			offset += data[i].count * data[i].elementSize;
+		}
+
+		// Written next to the cache and renamed, so a bake never maps a half written file
+		const std::string tmpPath = std::string(cachePath) + ".tmp";
+		{
+			std::ofstream ofs(tmpPath, std::ios::binary | std::ios::trunc);
+			if (!ofs) return false;
+			ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			ofs.write(reinterpret_cast<const char*>(sections), sizeof(sections));
+			uint64_t pos = sizeof(header) + sizeof(sections);
+			const char padding[k_meshCacheAlignment] = {};
+			for (uint32_t i = 0; i < k_meshCacheSectionCount; ++i)
+			{
+				ofs.write(padding, (std::streamsize)(sections[i].offset - pos));
+				ofs.write(static_cast<const char*>(data[i].data), (std::streamsize)(data[i].count * data[i].elementSize));
+				pos = sections[i].offset + data[i].count * data[i].elementSize;
+			}
+			if (!ofs) 
+			{
+				ofs.close();
+				std::remove(tmpPath.c_str());
+				return false;
+			}
+		}
+		std::remove(cachePath);
+		if (std::rename(tmpPath.c_str(), cachePath) != 0)
+		{
+			std::remove(tmpPath.c_str());
+			return false;
+		}
+		return true;
+	}
+}
+
+Mesh* Mesh::loadFileCached(const char *path)
+{
+	FileStamp source;
+	if (!source.read(path)) return nullptr;
+
+	const std::string cachePath = meshCachePath(path);
+	Timing timing;
+	timing.begin();
+	if (Mesh *mesh = loadMeshCache(cachePath.c_str(), source))
+	{
+		timing.end();
+		logDebug("Mesh", "Loaded " + cachePath + " in " + std::to_string(timing.elapsedSeconds()) + " seconds.");
+		return mesh;
+	}
+
+	Mesh *mesh = loadFile(path);
+	if (mesh && !saveMeshCache(*mesh, cachePath.c_str(), source))
+	{
+		logWarning("Mesh", "Could not write the mesh cache " + cachePath);
+	}
+	return mesh;
+}
+
 Mesh* Mesh::createCopy(const Mesh *mesh)
 {
 	assert(mesh);
@@ -624,148 +966,260 @@ Mesh* Mesh::createCopy(const Mesh *mesh)
 	return r;
 }
 
-void Mesh::computeFaceNormals()
+void Mesh::updatePositionCorners()
 {
-	normals.clear();
+	const size_t cornerCount = triangles.size() * 3;
+
+	// Counting sort of the corners by position, a couple of integer passes
+	// that are cheaper than splitting the counts among threads
+	_positionCornerOffsets.assign(positions.size() + 1, 0);
+	for (size_t c = 0; c < cornerCount; ++c)
+	{
+		++_positionCornerOffsets[vertices[cornerVertexIndex(triangles, c)].positionIndex + 1];
+	}
+	for (size_t i = 0; i < positions.size(); ++i)
+	{
+		_positionCornerOffsets[i + 1] += _positionCornerOffsets[i];
+	}
 
-	for (const auto &tri : triangles)
-	{
-		auto &v0 = vertices[tri.vertexIndex0];
-		auto &v1 = vertices[tri.vertexIndex1];
-		auto &v2 = vertices[tri.vertexIndex2];
-		const Vector3 p0 = positions[v0.positionIndex];
-		const Vector3 p1 = positions[v1.positionIndex];
-		const Vector3 p2 = positions[v2.positionIndex];
-		const Vector3 n = normalize(cross(p1 - p0, p2 - p0));
-		const uint32_t nidx = (uint32_t)normals.size();
-		normals.emplace_back(n);
-		v0.normalIndex = nidx;
-		v1.normalIndex = nidx;
-		v2.normalIndex = nidx;
+	_positionCorners.resize(cornerCount);
+	std::vector<uint32_t> next(_positionCornerOffsets.begin(), _positionCornerOffsets.end() - 1);
+	for (size_t c = 0; c < cornerCount; ++c)
+	{
+		_positionCorners[next[vertices[cornerVertexIndex(triangles, c)].positionIndex]++] = uint32_t(c);
 	}
 }
 
-// TODO: Improve algorithm
-// Face weighting?
-void Mesh::computeVertexNormals()
+void Mesh::computeFaceNormals()
 {
-	normals.clear();
-	normals.resize(positions.size());
+	updatePositionCorners();
+	ThreadPool &pool = ThreadPool::global();
 
-	for (const auto &tri : triangles)
+	normals.resize(triangles.size());
+	pool.parallelFor(0, triangles.size(), k_normalsGrainSize, [&](size_t begin, size_t end)
 	{
-		auto &v0 = vertices[tri.vertexIndex0];
-		auto &v1 = vertices[tri.vertexIndex1];
-		auto &v2 = vertices[tri.vertexIndex2];
-		const Vector3 p0 = positions[v0.positionIndex];
-		const Vector3 p1 = positions[v1.positionIndex];
-		const Vector3 p2 = positions[v2.positionIndex];
-		const Vector3 n = normalize(cross(p1 - p0, p2 - p0));
-		normals[v0.positionIndex] += n;
-		normals[v1.positionIndex] += n;
-		normals[v2.positionIndex] += n;
-	}
+		for (size_t i = begin; i < end; ++i)
+		{
+			const Triangle &tri = triangles[i];
+			const Vector3 p0 = positions[vertices[tri.vertexIndex0].positionIndex];
+			const Vector3 p1 = positions[vertices[tri.vertexIndex1].positionIndex];
+			const Vector3 p2 = positions[vertices[tri.vertexIndex2].positionIndex];
+			normals[i] = normalize(cross(p1 - p0, p2 - p0));
+		}
+	});
 
-	for (auto &n : normals)
+	// Vertices shared by several triangles keep the normal of the last one
+	pool.parallelFor(0, positions.size(), k_normalsGrainSize, [&](size_t begin, size_t end)
 	{
-		n = normalize(n);
-	}
+		for (uint32_t k = _positionCornerOffsets[begin]; k < _positionCornerOffsets[end]; ++k)
+		{
+			const uint32_t c = _positionCorners[k];
+			vertices[cornerVertexIndex(triangles, c)].normalIndex = c / 3;
+		}
+	});
+}
 
-	for (auto &v : vertices)
+void Mesh::computeVertexNormals()
+{
+	updatePositionCorners();
+	ThreadPool &pool = ThreadPool::global();
+
+	normals.resize(positions.size());
+	pool.parallelFor(0, positions.size(), k_normalsGrainSize, [&](size_t begin, size_t end)
 	{
-		v.normalIndex = v.positionIndex;
-	}
+		for (size_t i = begin; i < end; ++i)
+		{
+			Vector3 n;
+			for (uint32_t k = _positionCornerOffsets[i]; k < _positionCornerOffsets[i + 1]; ++k)
+			{
+				const uint32_t c = _positionCorners[k];
+				const Triangle &tri = triangles[c / 3];
+				const Vector3 p0 = positions[vertices[cornerVertexIndex(tri, c)].positionIndex];
+				const Vector3 p1 = positions[vertices[cornerVertexIndex(tri, c + 1)].positionIndex];
+				const Vector3 p2 = positions[vertices[cornerVertexIndex(tri, c + 2)].positionIndex];
+				n += angleWeightedNormal(p0, p1, p2);
+			}
+			normals[i] = normalize(n);
+		}
+	});
+
+	pool.parallelFor(0, vertices.size(), k_normalsGrainSize, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i) vertices[i].normalIndex = vertices[i].positionIndex;
+	});
 }
 
-void Mesh::computeVertexNormalsAggressive()
+void Mesh::computeVertexNormalsAggressive(float weldDistance)
 {
-	struct NormalData { Vector3 normal = Vector3(); uint32_t index = 0; };
-	std::map<Vector3, NormalData> normalsMap;
+	ThreadPool &pool = ThreadPool::global();
+	const size_t cornerCount = triangles.size() * 3;
+	auto cornerVertex = [&](size_t corner) -> Vertex&
+	{
+		return vertices[cornerVertexIndex(triangles, corner)];
+	};
 
-	auto addNormal = [&](const Vector3 &p, const Vector3 &n)
+	std::vector<uint32_t> weldRemap;
+	weldPositions(positions.data(), positions.size(), weldDistance, weldRemap);
+
+	std::vector<Vector3> faceNormals(triangles.size());
+	pool.parallelFor(0, triangles.size(), k_normalsGrainSize, [&](size_t begin, size_t end)
 	{
-		auto it = normalsMap.find(p);
-		if (it != normalsMap.end())
+		for (size_t i = begin; i < end; ++i)
 		{
-			it->second.normal += n;
-			return it->second.index;
+			const Triangle &tri = triangles[i];
+			const Vector3 p0 = positions[vertices[tri.vertexIndex0].positionIndex];
+			const Vector3 p1 = positions[vertices[tri.vertexIndex1].positionIndex];
+			const Vector3 p2 = positions[vertices[tri.vertexIndex2].positionIndex];
+			faceNormals[i] = normalize(cross(p1 - p0, p2 - p0));
 		}
-		else
+	});
+
+	// Normals are numbered in the order their welded positions are first
+	// used by the triangles
+	std::unique_ptr<std::atomic<uint32_t>[]> firstCorner(new std::atomic<uint32_t>[positions.size()]);
+	pool.parallelFor(0, positions.size(), k_normalsGrainSize, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i) firstCorner[i].store(UINT32_MAX, std::memory_order_relaxed);
+	});
+	pool.parallelFor(0, cornerCount, k_normalsGrainSize, [&](size_t begin, size_t end)
+	{
+		for (size_t c = begin; c < end; ++c)
 		{
-			const uint32_t index = uint32_t(normalsMap.size());
-			normalsMap[p] = NormalData{ n, index };
-			return index;
+			std::atomic<uint32_t> &first = firstCorner[weldRemap[cornerVertex(c).positionIndex]];
+			uint32_t current = first.load(std::memory_order_relaxed);
+			while (c < current && !first.compare_exchange_weak(current, uint32_t(c), std::memory_order_relaxed)) {}
 		}
+	});
+
+	const size_t blockCount = (cornerCount + k_normalsGrainSize - 1) / k_normalsGrainSize;
+	std::vector<uint32_t> blockNormals(blockCount + 1, 0);
+	auto isFirstCorner = [&](size_t c)
+	{
+		return firstCorner[weldRemap[cornerVertex(c).positionIndex]].load(std::memory_order_relaxed) == c;
 	};
+	pool.parallelFor(0, blockCount, 1, [&](size_t begin, size_t end)
+	{
+		for (size_t b = begin; b < end; ++b)
+		{
+			const size_t last = std::min(cornerCount, (b + 1) * k_normalsGrainSize);
+			for (size_t c = b * k_normalsGrainSize; c < last; ++c) blockNormals[b + 1] += isFirstCorner(c) ? 1 : 0;
+		}
+	});
+	for (size_t b = 0; b < blockCount; ++b) blockNormals[b + 1] += blockNormals[b];
 
-	for (const auto &tri : triangles)
+	// Welded positions become normal indices in place
+	std::vector<uint32_t> &weldNormal = weldRemap;
+	std::vector<uint32_t> rootNormal(positions.size(), UINT32_MAX);
+	pool.parallelFor(0, blockCount, 1, [&](size_t begin, size_t end)
 	{
-		auto &v0 = vertices[tri.vertexIndex0];
-		auto &v1 = vertices[tri.vertexIndex1];
-		auto &v2 = vertices[tri.vertexIndex2];
-		const Vector3 p0 = positions[v0.positionIndex];
-		const Vector3 p1 = positions[v1.positionIndex];
-		const Vector3 p2 = positions[v2.positionIndex];
-		const Vector3 n = normalize(cross(p1 - p0, p2 - p0));
-		v0.normalIndex = addNormal(p0, n);
-		v1.normalIndex = addNormal(p1, n);
-		v2.normalIndex = addNormal(p2, n);
-	}
+		for (size_t b = begin; b < end; ++b)
+		{
+			uint32_t nidx = blockNormals[b];
+			const size_t last = std::min(cornerCount, (b + 1) * k_normalsGrainSize);
+			for (size_t c = b * k_normalsGrainSize; c < last; ++c)
+			{
+				if (isFirstCorner(c)) rootNormal[weldRemap[cornerVertex(c).positionIndex]] = nidx++;
+			}
+		}
+	});
+	pool.parallelFor(0, positions.size(), k_normalsGrainSize, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i) weldNormal[i] = rootNormal[weldRemap[i]];
+	});
+	pool.parallelFor(0, vertices.size(), k_normalsGrainSize, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			const uint32_t nidx = weldNormal[vertices[i].positionIndex];
+			if (nidx != UINT32_MAX) vertices[i].normalIndex = nidx;
+		}
+	});
+
+	// Corners grouped by normal in triangle order, so each normal is summed
+	// by a single thread in the same order as a serial loop would
+	std::vector<uint64_t> cornerNormals(cornerCount);
+	std::vector<uint32_t> corners(cornerCount);
+	pool.parallelFor(0, cornerCount, k_normalsGrainSize, [&](size_t begin, size_t end)
+	{
+		for (size_t c = begin; c < end; ++c)
+		{
+			cornerNormals[c] = cornerVertex(c).normalIndex;
+			corners[c] = uint32_t(c);
+		}
+	});
+	radixSort(cornerNormals, corners, 32);
 
 	normals.clear();
-	normals.resize(normalsMap.size());
-	for (auto &n : normalsMap)
+	normals.resize(blockNormals.back());
+	pool.parallelFor(0, cornerCount, k_normalsGrainSize, [&](size_t begin, size_t end)
 	{
-		normals[n.second.index] = normalize(n.second.normal);
-	}
+		size_t i = begin;
+		while (i > 0 && i < cornerCount && cornerNormals[i] == cornerNormals[i - 1]) ++i; // Normal owned by the previous range
+		while (i < end)
+		{
+			const uint64_t nidx = cornerNormals[i];
+			Vector3 n = faceNormals[corners[i] / 3];
+			for (++i; i < cornerCount && cornerNormals[i] == nidx; ++i) n += faceNormals[corners[i] / 3];
+			normals[nidx] = normalize(n);
+		}
+	});
 }
 
-// TODO: Improve algorithm
 void Mesh::computeTangentSpace()
 {
+	updatePositionCorners();
+	ThreadPool &pool = ThreadPool::global();
+
 	tangents.clear();
 	bitangents.clear();
 	tangents.resize(vertices.size());
 	bitangents.resize(vertices.size());
 
-	for (const auto &tri : triangles)
+	// Every vertex has a single position, so the thread walking the corners
+	// of a position is the only one writing to its vertices
+	pool.parallelFor(0, positions.size(), k_normalsGrainSize, [&](size_t begin, size_t end)
 	{
-		const auto &v0 = vertices[tri.vertexIndex0];
-		const auto &v1 = vertices[tri.vertexIndex1];
-		const auto &v2 = vertices[tri.vertexIndex2];
-		const Vector3 p0 = positions[v0.positionIndex];
-		const Vector3 p1 = positions[v1.positionIndex];
-		const Vector3 p2 = positions[v2.positionIndex];
-		const Vector2 u0 = texcoords[v0.texcoordIndex];
-		const Vector2 u1 = texcoords[v1.texcoordIndex];
-		const Vector2 u2 = texcoords[v2.texcoordIndex];
-
-		const Vector3 e0 = p1 - p0;
-		const Vector3 e1 = p2 - p0;
-		const Vector2 t0 = u1 - u0;
-		const Vector2 t1 = u2 - u0;
-
-		const float r = 1.0f / (t0.x * t1.y - t1.x * t0.y);
-		const Vector3 sdir = (e0 * t1.y - e1 * t0.y) * r;
-		const Vector3 tdir = (e1 * t0.x - e0 * t1.x) * r;
-
-		tangents[tri.vertexIndex0] += sdir;
-		tangents[tri.vertexIndex1] += sdir;
-		tangents[tri.vertexIndex2] += sdir;
-		bitangents[tri.vertexIndex0] += tdir;
-		bitangents[tri.vertexIndex1] += tdir;
-		bitangents[tri.vertexIndex2] += tdir;
-	}
+		for (uint32_t k = _positionCornerOffsets[begin]; k < _positionCornerOffsets[end]; ++k)
+		{
+			const uint32_t c = _positionCorners[k];
+			const Triangle &tri = triangles[c / 3];
+			const auto &v0 = vertices[tri.vertexIndex0];
+			const auto &v1 = vertices[tri.vertexIndex1];
+			const auto &v2 = vertices[tri.vertexIndex2];
+			const Vector3 p0 = positions[v0.positionIndex];
+			const Vector3 p1 = positions[v1.positionIndex];
+			const Vector3 p2 = positions[v2.positionIndex];
+			const Vector2 u0 = texcoords[v0.texcoordIndex];
+			const Vector2 u1 = texcoords[v1.texcoordIndex];
+			const Vector2 u2 = texcoords[v2.texcoordIndex];
+
+			const Vector3 e0 = p1 - p0;
+			const Vector3 e1 = p2 - p0;
+			const Vector2 t0 = u1 - u0;
+			const Vector2 t1 = u2 - u0;
+
+			const float r = 1.0f / (t0.x * t1.y - t1.x * t0.y);
+			const Vector3 sdir = (e0 * t1.y - e1 * t0.y) * r;
+			const Vector3 tdir = (e1 * t0.x - e0 * t1.x) * r;
+
+			const uint32_t vidx = cornerVertexIndex(tri, c);
+			tangents[vidx] += sdir;
+			bitangents[vidx] += tdir;
+		}
+	});
 
-	for (size_t i = 0; i < tangents.size(); ++i)
+	pool.parallelFor(0, tangents.size(), k_normalsGrainSize, [&](size_t begin, size_t end)
 	{
-		const Vector3 n = normals[vertices[i].normalIndex];
-		const Vector3 t1 = tangents[i];
-		const Vector3 t2 = bitangents[i];
-		tangents[i] = normalize(t1 - n * dot(n, t1));
-		bitangents[i] = cross(n, tangents[i]);
-		if (dot(cross(n, t1), t2) < 0.0f) bitangents[i] = -bitangents[i];
-	}
+		for (size_t i = begin; i < end; ++i)
+		{
+			const Vector3 n = normals[vertices[i].normalIndex];
+			const Vector3 t1 = tangents[i];
+			const Vector3 t2 = bitangents[i];
+			tangents[i] = normalize(t1 - n * dot(n, t1));
+			bitangents[i] = cross(n, tangents[i]);
+			if (dot(cross(n, t1), t2) < 0.0f) bitangents[i] = -bitangents[i];
+		}
+	});
 }
 
 bool Mesh::intersect(const Vector3 &o, const Vector3 &d, IntersectResult &o_result) const
@@ -62,11 +62,20 @@ public:
 	static Mesh* loadWavefrontObj(const char *path);
 	static Mesh* loadPly(const char *path);
 	static Mesh* loadFile(const char *path);
+	/// loadFile() through a binary cache next to the file (path + ".bakecmesh")
+	/// The cache is written after the first load and memory-mapped without any
+	/// parsing afterwards. It is rewritten when the size or modification time
+	/// of the source file change.
+	static Mesh* loadFileCached(const char *path);
 	static Mesh* createCopy(const Mesh *mesh);
 
 	void computeFaceNormals();
+	/// Computes a normal per position, averaging the normals of the triangles
+	/// around it weighted by their angle at the position
 	void computeVertexNormals();
-	void computeVertexNormalsAggressive();
+	/// Computes vertex normals shared by every vertex at the same position
+	/// @param weldDistance Positions closer than this share their normal too
+	void computeVertexNormalsAggressive(float weldDistance = 0.0f);
 	void computeTangentSpace();
 
 	bool intersect(const Vector3 &o, const Vector3 &d, IntersectResult &o_result) const;
@@ -74,5 +83,16 @@ public:
 
 private:
 	bool intersect(const Vector3 &o, const Vector3 &d, const uint32_t tidx, IntersectResult &o_result) const;
+
+	/// Builds the position to triangle adjacency
+	/// Rebuilt on every call since the triangles are public and may change
+	/// in between, the counting sort is cheap next to the normals it serves.
+	void updatePositionCorners();
+
+	// Corners (triangle * 3 + corner in the triangle) around every position,
+	// in triangle order, so normals and tangents are gathered per position
+	// without atomics and sum in the same order on any number of threads
+	std::vector<uint32_t> _positionCornerOffsets; // positions.size() + 1 offsets into _positionCorners
+	std::vector<uint32_t> _positionCorners;
 };
 
@@ -22,13 +22,21 @@ SOFTWARE.
 
 #include "meshmapping.h"
 #include "bvh.h"
+#include "bvhpages.h"
 #include "computeshaders.h"
+#include "instancedscene.h"
 #include "logging.h"
 #include "mesh.h"
+#include "radixsort.h"
+#include "raytracer.h"
+#include "threadpool.h"
+#include <atomic>
 #include <cassert>
+#include <cfloat>
 
 static const size_t k_groupSize = 64;
 static const size_t k_workPerFrame = 1024 * 128;
+static const size_t k_gpuStackSize = 64; // BVH_STACK_SIZE in shaders/common.sh
 
 namespace
 {
@@ -37,10 +45,10 @@ namespace
 		uint32_t workOffset;
 		uint32_t coordsSize;
 		uint32_t bvhSize;
-		float _pad;
+		uint32_t geometryFlags;
 	};
 
-	std::vector<Pix_GPUData> computePixels(const CompressedMapUV *map)
+	std::vector<Pix_GPUData> computePixels(const CompressedMapUV *map, float maxFront, float maxRear, const std::vector<float> &cageFront)
 	{
 		const size_t count = map->positions.size();
 		std::vector<Pix_GPUData> pixels(count);
@@ -48,7 +56,9 @@ namespace
 		{
 			auto &pix = pixels[i];
 			pix.p = map->positions[i];
+			pix.maxFront = cageFront.empty() ? maxFront : cageFront[i];
 			pix.d = map->directions[i];
+			pix.maxRear = maxRear;
 		}
 		return pixels;
 	}
@@ -67,83 +77,189 @@ namespace
 		return pixels;
 	}
 
+	/// Triangles in BVH leaf order, three entries per triangle
+	/// Positions are stored as v0, e1 = v1 - v0, e2 = v2 - v0 for the ray-triangle
+	/// intersection, normals as the three vertex normals.
+	/// @param withNormals False leaves the normals empty, for ray tracers only asked for distances
 	void fillMeshData(
 		const Mesh *mesh,
-		const BVH& bvh,
-		std::vector<BVHGPUData> &bvhs,
-		std::vector<Vector4> &positions,
-		std::vector<Vector4> &normals)
+		const BVH &bvh,
+		RaytracerGeometry &geometry,
+		bool withNormals = true)
 	{
-		if (bvh.children.empty() &&
-			bvh.triangles.empty())
+		const size_t count = bvh.triangles.size();
+		std::vector<Vector4> &triangles = geometry.triangles;
+		std::vector<Vector4> &normals = geometry.normals;
+		triangles.resize(count * 3);
+		normals.resize(withNormals ? count * 3 : 0);
+		ThreadPool::global().parallelFor(0, count, 0, [&](size_t begin, size_t end)
 		{
-			// Children node without triangles? Skip it
-			return;
+			for (size_t i = begin; i < end; ++i)
+			{
+				const auto &tri = mesh->triangles[bvh.triangles[i]];
+				const auto &v0 = mesh->vertices[tri.vertexIndex0];
+				const auto &v1 = mesh->vertices[tri.vertexIndex1];
+				const auto &v2 = mesh->vertices[tri.vertexIndex2];
+				const Vector3 &p0 = mesh->positions[v0.positionIndex];
+				triangles[i * 3 + 0] = p0;
+				triangles[i * 3 + 1] = mesh->positions[v1.positionIndex] - p0;
+				triangles[i * 3 + 2] = mesh->positions[v2.positionIndex] - p0;
+				if (!withNormals) continue;
+				normals[i * 3 + 0] = mesh->normals[v0.normalIndex];
+				normals[i * 3 + 1] = mesh->normals[v1.normalIndex];
+				normals[i * 3 + 2] = mesh->normals[v2.normalIndex];
+			}
+		});
+	}
+
+	/// Triangles in BVH leaf order as three indices to the vertices they share
+	/// Mesh vertices with the same position and normal (texcoords are not used)
+	/// are merged, and the shared vertices are numbered in the order the leaves
+	/// use them so the triangles of a leaf fetch nearby vertices.
+	void fillMeshDataIndexed(
+		const Mesh *mesh,
+		const BVH &bvh,
+		RaytracerGeometry &geometry)
+	{
+		ThreadPool &pool = ThreadPool::global();
+		const size_t vertexCount = mesh->vertices.size();
+
+		// Every mesh vertex points to the first one with its position and normal
+		std::vector<uint32_t> firstVertex(vertexCount);
+		{
+			std::vector<uint64_t> keys(vertexCount);
+			std::vector<uint32_t> order(vertexCount);
+			pool.parallelFor(0, vertexCount, 0, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; ++i)
+				{
+					const Mesh::Vertex &v = mesh->vertices[i];
+					keys[i] = (uint64_t(v.positionIndex) << 32) | v.normalIndex;
+					order[i] = uint32_t(i);
+				}
+			});
+			radixSort(keys, order);
+
+			pool.parallelFor(0, vertexCount, 0, [&](size_t begin, size_t end)
+			{
+				size_t i = begin;
+				while (i > 0 && i < vertexCount && keys[i] == keys[i - 1]) ++i; // Run owned by the previous range
+				while (i < end)
+				{
+					size_t runEnd = i + 1;
+					while (runEnd < vertexCount && keys[runEnd] == keys[i]) ++runEnd;
+					for (size_t j = i; j < runEnd; ++j) firstVertex[order[j]] = order[i];
+					i = runEnd;
+				}
+			});
+		}
+
+		const size_t count = bvh.triangles.size();
+		std::vector<uint32_t> sharedIndex(vertexCount, UINT32_MAX);
+		std::vector<uint32_t> sharedVertices; // Mesh vertex of every shared vertex
+		geometry.indices.resize(count * 3);
+		for (size_t i = 0; i < count; ++i)
+		{
+			const auto &tri = mesh->triangles[bvh.triangles[i]];
+			const uint32_t vidx[3] = { tri.vertexIndex0, tri.vertexIndex1, tri.vertexIndex2 };
+			for (size_t k = 0; k < 3; ++k)
+			{
+				const uint32_t v = firstVertex[vidx[k]];
+				if (sharedIndex[v] == UINT32_MAX)
+				{
+					sharedIndex[v] = uint32_t(sharedVertices.size());
+					sharedVertices.push_back(v);
+				}
+				geometry.indices[i * 3 + k] = sharedIndex[v];
+			}
 		}
 
-#if 1
-		if (!bvh.children.empty())
+		geometry.vertexPositions.resize(sharedVertices.size());
+		geometry.vertexNormals.resize(sharedVertices.size());
+		pool.parallelFor(0, sharedVertices.size(), 0, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				const Mesh::Vertex &v = mesh->vertices[sharedVertices[i]];
+				geometry.vertexPositions[i] = mesh->positions[v.positionIndex];
+				geometry.vertexNormals[i] = mesh->normals[v.normalIndex];
+			}
+		});
+	}
+
+	/// Fills the layout kept for the CPU ray tracer
+	/// Unindexed or indexed triangles already filled for the GPU are kept.
+	/// Quantized geometry gets a copy of the tree refitted to its decoded vertices.
+	void fillRaytracerGeometry(const Mesh *mesh, std::shared_ptr<const BVH> &bvh, CPUGeometry cpuGeometry, RaytracerGeometry &geometry)
+	{
+		if (cpuGeometry == CPUGeometry::Quantized)
 		{
-			// If one of the children does not contain any triangles
-			// we can skip this node completely as it is an extry AABB test
-			// for nothing
-			if (bvh.children[0].subtreeTriangleCount > 0 && bvh.children[1].subtreeTriangleCount == 0)
+			geometry = RaytracerGeometry();
+			if (!geometry.quantized.build(mesh, *bvh))
 			{
-				fillMeshData(mesh, bvh.children[0], bvhs, positions, normals);
-				return;
+				logWarning("MeshMap", "A BVH leaf has too many vertices to quantize the geometry, using indexed geometry.");
+				cpuGeometry = CPUGeometry::Indexed;
 			}
-			if (bvh.children[1].subtreeTriangleCount > 0 && bvh.children[0].subtreeTriangleCount == 0)
+			else
 			{
-				fillMeshData(mesh, bvh.children[1], bvhs, positions, normals);
-				return;
+				logDebug("MeshMap", "Quantized geometry uses a " + std::to_string(geometry.quantized.gridBits()) + "-bit grid.");
+
+				// Snapped vertices may leave the node bounds, rays would miss those parts of the triangles
+				std::shared_ptr<BVH> refitted(new BVH(*bvh));
+				refitted->refit(geometry.quantized);
+				bvh = refitted;
 			}
 		}
-#endif
-
-		bvhs.emplace_back(BVHGPUData());
-		BVHGPUData &d = bvhs.back();
-		d.aabbMin = bvh.aabb.center - bvh.aabb.size;
-		d.aabbMax = bvh.aabb.center + bvh.aabb.size;
-		d.start = (uint32_t)positions.size();
-		for (uint32_t tidx : bvh.triangles)
+		if (cpuGeometry == CPUGeometry::Indexed && !geometry.indexed())
 		{
-			const auto &tri = mesh->triangles[tidx];
-			const auto &v0 = mesh->vertices[tri.vertexIndex0];
-			const auto &v1 = mesh->vertices[tri.vertexIndex1];
-			const auto &v2 = mesh->vertices[tri.vertexIndex2];
-			const auto p0 = mesh->positions[v0.positionIndex];
-			const auto p1 = mesh->positions[v1.positionIndex];
-			const auto p2 = mesh->positions[v2.positionIndex];
-			positions.push_back(p0);
-			positions.push_back(p1);
-			positions.push_back(p2);
-			normals.push_back(mesh->normals[v0.normalIndex]);
-			normals.push_back(mesh->normals[v1.normalIndex]);
-			normals.push_back(mesh->normals[v2.normalIndex]);
+			geometry = RaytracerGeometry();
+			fillMeshDataIndexed(mesh, *bvh, geometry);
 		}
-		d.end = (uint32_t)positions.size();
-
-		const size_t index = bvhs.size() - 1; // Because d gets invalidated by fillMeshData!
-		if (bvh.children.size() > 0)
+		if (cpuGeometry == CPUGeometry::Unindexed && geometry.triangles.empty())
 		{
-			fillMeshData(mesh, bvh.children[0], bvhs, positions, normals);
-			fillMeshData(mesh, bvh.children[1], bvhs, positions, normals);
+			fillMeshData(mesh, *bvh, geometry);
 		}
-		bvhs[index].jump = (uint32_t)bvhs.size();
 	}
 }
 
+MeshMapping::MeshMapping()
+{
+}
+
+MeshMapping::~MeshMapping()
+{
+}
+
+void MeshMapping::setRayLimits(float maxFront, float maxRear, std::shared_ptr<const Mesh> cage)
+{
+	_maxFront = maxFront;
+	_maxRear = maxRear;
+	_cage = cage;
+}
+
 void MeshMapping::init
 (
 	std::shared_ptr<const CompressedMapUV> map,
 	std::shared_ptr<const Mesh> mesh,
 	std::shared_ptr<const BVH> rootBVH,
-	bool cullBackfaces
+	bool cullBackfaces,
+	ComputeBackend backend,
+	bool uploadToGPU,
+	size_t cpuBVHWidth,
+	CPUGeometry cpuGeometry,
+	bool orderedTraversal,
+	bool compressedNodes
 )
 {
+	_backend = backend;
+	_uploadToGPU = uploadToGPU || backend == ComputeBackend::GPU;
+	_uvMap = map;
+	initRayLimits();
+
 	// Pixels data
+	if (_uploadToGPU)
 	{
-		auto pixels = computePixels(map.get());
+		auto pixels = computePixels(map.get(), _maxFront, _maxRear, _cageFront);
 		_pixels = VBHandle(
 			bgfx::createVertexBuffer(bgfx::copy(&pixels[0], sizeof(Pix_GPUData) * pixels.size()), computeDecl(sizeof(Pix_GPUData)), BGFX_BUFFER_COMPUTE_READ)
 			, pixels.size());
@@ -160,24 +276,158 @@ void MeshMapping::init
 
 	// Mesh data
 	{
-		std::vector<BVHGPUData> bvhs;
-		std::vector<Vector4> positions;
-		std::vector<Vector4> normals;
-		fillMeshData(mesh.get(), *rootBVH, bvhs, positions, normals);
-		_meshPositions = VBHandle(
-			bgfx::createVertexBuffer(bgfx::copy(&positions[0], sizeof(Vector4) * positions.size()), computeDecl(sizeof(Vector4)), BGFX_BUFFER_COMPUTE_READ)
-			, positions.size());
-		_meshNormals = VBHandle(
-			bgfx::createVertexBuffer(bgfx::copy(&normals[0], sizeof(Vector4) * normals.size()), computeDecl(sizeof(Vector4)), BGFX_BUFFER_COMPUTE_READ)
-			, normals.size());
-		_bvh = VBHandle(
-			bgfx::createVertexBuffer(bgfx::copy(&bvhs[0], sizeof(BVHGPUData) * bvhs.size()), computeDecl(sizeof(BVHGPUData)), BGFX_BUFFER_COMPUTE_READ)
-			, bvhs.size());
+		// The shaders read unindexed triangles, or shared vertices through an index
+		// buffer for smaller layouts (quantized geometry is only kept for the CPU)
+		RaytracerGeometry geometry;
+		if (_uploadToGPU)
+		{
+			_gpuIndexed = cpuGeometry != CPUGeometry::Unindexed;
+			if (_gpuIndexed)
+			{
+				fillMeshDataIndexed(mesh.get(), *rootBVH, geometry);
+				const std::vector<Vector4> positions(geometry.vertexPositions.begin(), geometry.vertexPositions.end());
+				const std::vector<Vector4> normals(geometry.vertexNormals.begin(), geometry.vertexNormals.end());
+				const std::vector<uint32_t> &indices = geometry.indices;
+				_meshPositions = VBHandle(
+					bgfx::createVertexBuffer(bgfx::copy(&positions[0], sizeof(Vector4) * positions.size()), computeDecl(sizeof(Vector4)), BGFX_BUFFER_COMPUTE_READ)
+					, positions.size());
+				_meshNormals = VBHandle(
+					bgfx::createVertexBuffer(bgfx::copy(&normals[0], sizeof(Vector4) * normals.size()), computeDecl(sizeof(Vector4)), BGFX_BUFFER_COMPUTE_READ)
+					, normals.size());
+				_meshIndices = VBHandle(
+					bgfx::createVertexBuffer(bgfx::copy(&indices[0], sizeof(uint32_t) * indices.size()), computeDecl(sizeof(uint32_t)), BGFX_BUFFER_COMPUTE_READ)
+					, indices.size());
+			}
+			else
+			{
+				fillMeshData(mesh.get(), *rootBVH, geometry);
+				const std::vector<Vector4> &triangles = geometry.triangles;
+				const std::vector<Vector4> &normals = geometry.normals;
+				_meshPositions = VBHandle(
+					bgfx::createVertexBuffer(bgfx::copy(&triangles[0], sizeof(Vector4) * triangles.size()), computeDecl(sizeof(Vector4)), BGFX_BUFFER_COMPUTE_READ)
+					, triangles.size());
+				_meshNormals = VBHandle(
+					bgfx::createVertexBuffer(bgfx::copy(&normals[0], sizeof(Vector4) * normals.size()), computeDecl(sizeof(Vector4)), BGFX_BUFFER_COMPUTE_READ)
+					, normals.size());
+			}
+			_bvh = VBHandle(
+				bgfx::createVertexBuffer(bgfx::copy(&rootBVH->nodes[0], sizeof(BVHNode) * rootBVH->nodes.size()), computeDecl(sizeof(BVHNode)), BGFX_BUFFER_COMPUTE_READ)
+				, rootBVH->nodes.size());
+
+			// The shader stack holds one node per level
+			_orderedTraversal = orderedTraversal && rootBVH->depth() <= k_gpuStackSize;
+			if (orderedTraversal && !_orderedTraversal)
+			{
+				logWarning("MeshMap", "The BVH is too deep for the ordered traversal in the shaders, using the stackless one.");
+			}
+		}
+
+		// The runner maps on the CPU whenever a CPU solver is enabled, so GPU bakes never
+		// trace rays on the CPU and free the host copy of the geometry once it is uploaded
+		if (_backend == ComputeBackend::CPU)
+		{
+			fillRaytracerGeometry(mesh.get(), rootBVH, cpuGeometry, geometry);
+			logDebug("MeshMap", "Ray tracer geometry takes " + std::to_string(geometry.memorySize() >> 20) + " MB.");
+			_raytracer.reset(new Raytracer(rootBVH, std::move(geometry), cpuBVHWidth, orderedTraversal, compressedNodes));
+		}
+	}
+
+	_cullBackfaces = cullBackfaces;
+	initResults();
+}
+
+void MeshMapping::initPaged
+(
+	std::shared_ptr<const CompressedMapUV> map,
+	std::shared_ptr<const BVHPages> pages,
+	bool cullBackfaces
+)
+{
+	_backend = ComputeBackend::CPU;
+	_uploadToGPU = false;
+	_uvMap = map;
+	initRayLimits();
+	_raytracer.reset(new Raytracer(pages));
+	_cullBackfaces = cullBackfaces;
+	initResults();
+}
+
+void MeshMapping::initInstanced
+(
+	std::shared_ptr<const CompressedMapUV> map,
+	const InstancedScene &scene,
+	const BVHBuildParams &bvhParams,
+	bool cullBackfaces,
+	size_t cpuBVHWidth,
+	CPUGeometry cpuGeometry,
+	bool orderedTraversal,
+	bool compressedNodes
+)
+{
+	_backend = ComputeBackend::CPU;
+	_uploadToGPU = false;
+	_uvMap = map;
+	initRayLimits();
+
+	std::vector<std::shared_ptr<const Raytracer>> parts;
+	size_t geometrySize = 0;
+	for (const std::shared_ptr<Mesh> &mesh : scene.parts)
+	{
+		std::shared_ptr<const BVH> bvh(BVH::createBinary(mesh.get(), bvhParams));
+		RaytracerGeometry geometry;
+		fillRaytracerGeometry(mesh.get(), bvh, cpuGeometry, geometry);
+		geometrySize += geometry.memorySize();
+		parts.emplace_back(new Raytracer(bvh, std::move(geometry), cpuBVHWidth, orderedTraversal, compressedNodes));
+	}
+	logDebug("MeshMap",
+		std::to_string(scene.instances.size()) + " instances of " + std::to_string(scene.parts.size()) + " parts, " +
+		std::to_string(scene.triangleCount()) + " triangles. Ray tracer geometry takes " + std::to_string(geometrySize >> 20) + " MB.");
+
+	_raytracer.reset(new Raytracer(std::move(parts), scene.instances, bvhParams));
+	_cullBackfaces = cullBackfaces;
+	initResults();
+}
+
+void MeshMapping::initRayLimits()
+{
+	_cageFront.clear();
+	if (!_cage) return;
+
+	// Distance to the cage along the mapping direction of every texel
+	// Only distances are traced, so cages exported without normals work too
+	std::shared_ptr<const BVH> bvh(BVH::createBinary(_cage.get(), BVHBuildParams()));
+	RaytracerGeometry geometry;
+	fillMeshData(_cage.get(), *bvh, geometry, false);
+	const Raytracer cage(bvh, std::move(geometry), 4);
+
+	const CompressedMapUV &map = *_uvMap;
+	const size_t pixelCount = map.positions.size();
+	const float maxFront = _maxFront;
+	_cageFront.resize(pixelCount);
+	std::atomic<size_t> misses(0);
+	ThreadPool::global().parallelFor(0, pixelCount, k_groupSize, [&](size_t begin, size_t end)
+	{
+		size_t localMisses = 0;
+		for (size_t i = begin; i < end; ++i)
+		{
+			const float t = cage.raycastDist(map.positions[i], map.directions[i], 0.0f, FLT_MAX);
+			if (t == FLT_MAX) ++localMisses;
+			_cageFront[i] = t < FLT_MAX ? t : maxFront;
+		}
+		misses += localMisses;
+	});
+	if (misses > 0)
+	{
+		logWarning("MeshMap", std::to_string(misses) + " texels do not reach the cage, their rays use the front distance.");
 	}
+}
 
-	_workCount = ((map->positions.size() + k_groupSize - 1) / k_groupSize) * k_groupSize;
+void MeshMapping::initResults()
+{
+	_workCount = ((_uvMap->positions.size() + k_groupSize - 1) / k_groupSize) * k_groupSize;
 
 	// Results data
+	if (_backend == ComputeBackend::GPU)
 	{
 		_coords = VBHandle(
 			bgfx::createVertexBuffer(bgfx::alloc(_workCount), computeDecl(sizeof(Vector4)), BGFX_BUFFER_COMPUTE_WRITE)
@@ -185,21 +435,20 @@ void MeshMapping::init
 		_tidx = VBHandle(
 			bgfx::createVertexBuffer(bgfx::alloc(_workCount), computeDecl(sizeof(uint32_t)), BGFX_BUFFER_COMPUTE_WRITE)
 			, _workCount);
-	}
 
-	// Shader
-	{
+		// Shader
 		_program = ProgramHandle(LoadComputeShader_MeshMapping());
 		_programCullBackfaces = ProgramHandle(LoadComputeShader_MeshMappingCullBackfaces());
-	}
 
-	// Uniforms
-	{
+		// Uniforms
 		_uniforms = UniformHandle(
 			bgfx::createUniform("u_params", bgfx::UniformType::Vec4, 1));
 	}
-
-	_cullBackfaces = cullBackfaces;
+	else
+	{
+		_coordsData.assign(_workCount, Vector4(FLT_MAX, 0, 0, 0));
+		_tidxData.assign(_workCount, UINT32_MAX);
+	}
 
 	_workOffset = 0;
 }
@@ -213,23 +462,32 @@ bool MeshMapping::runStep()
 
 	if (_workOffset == 0) _timing.begin();
 
-	bgfx::ProgramHandle program;
-	if (_cullBackfaces) program = _programCullBackfaces.handle;
-	else program = _program.handle;
-
-	UniformsData uniformsData;
-	uniformsData.workOffset = _workOffset;
-	uniformsData.coordsSize = _coords.size;
-	uniformsData.bvhSize = _bvh.size;
-
-	bgfx::setUniform(_uniforms.handle, &uniformsData, 1);
-	bgfx::setBuffer(4, _pixels.handle, bgfx::Access::Read);
-	bgfx::setBuffer(5, _meshPositions.handle, bgfx::Access::Read);
-	bgfx::setBuffer(6, _bvh.handle, bgfx::Access::Read);
-	bgfx::setBuffer(7, _coords.handle, bgfx::Access::Write);
-	bgfx::setBuffer(8, _tidx.handle, bgfx::Access::Write);
-
-	bgfx::dispatch(0, program, work / k_groupSize, 1, 1);
+	if (_backend == ComputeBackend::CPU)
+	{
+		runStepCPU(_workOffset, work);
+	}
+	else
+	{
+		bgfx::ProgramHandle program;
+		if (_cullBackfaces) program = _programCullBackfaces.handle;
+		else program = _program.handle;
+
+		UniformsData uniformsData;
+		uniformsData.workOffset = _workOffset;
+		uniformsData.coordsSize = _coords.size;
+		uniformsData.bvhSize = _bvh.size;
+		uniformsData.geometryFlags = gpuGeometryFlags() | (_orderedTraversal ? k_gpuBVHOrdered : 0);
+
+		bgfx::setUniform(_uniforms.handle, &uniformsData, 1);
+		bgfx::setBuffer(4, _pixels.handle, bgfx::Access::Read);
+		bgfx::setBuffer(5, _meshPositions.handle, bgfx::Access::Read);
+		bgfx::setBuffer(6, _bvh.handle, bgfx::Access::Read);
+		bgfx::setBuffer(7, _coords.handle, bgfx::Access::Write);
+		bgfx::setBuffer(8, _tidx.handle, bgfx::Access::Write);
+		if (_gpuIndexed) bgfx::setBuffer(9, _meshIndices.handle, bgfx::Access::Read);
+
+		bgfx::dispatch(0, program, work / k_groupSize, 1, 1);
+	}
 
 	_workOffset += work;
 
@@ -242,6 +500,81 @@ bool MeshMapping::runStep()
 	return _workOffset >= _workCount;
 }
 
+void MeshMapping::runStepCPU(size_t workOffset, size_t work)
+{
+	const size_t pixelCount = _uvMap->positions.size();
+	const size_t workEnd = workOffset + work < pixelCount ? workOffset + work : pixelCount;
+	if (workOffset >= workEnd) return;
+
+	ThreadPool &pool = ThreadPool::global();
+	const Raytracer &rt = *_raytracer;
+	const CompressedMapUV &map = *_uvMap;
+	const bool cullBackfaces = _cullBackfaces;
+	const float maxFront = _maxFront;
+	const float maxRear = _maxRear;
+	const std::vector<float> &cageFront = _cageFront;
+
+	auto mapTexel = [&](size_t i)
+	{
+		const Vector3 p = map.positions[i];
+		const Vector3 d = map.directions[i];
+
+		uint32_t tidx = UINT32_MAX;
+		Vector3 bcoord(0, 0, 0);
+
+		// Same hits as the forward and backward rays of meshmapping.comp and
+		// meshmapping_nobackfaces.comp, in a single traversal
+		const float t = rt.raycastLine(p, d, cageFront.empty() ? maxFront : cageFront[i], maxRear, cullBackfaces, tidx, bcoord);
+
+		_coordsData[i] = Vector4(t, bcoord.x, bcoord.y, bcoord.z);
+		_tidxData[i] = tidx;
+	};
+
+	if (!rt.paged())
+	{
+		pool.parallelFor(workOffset, workEnd, k_groupSize, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i) mapTexel(i);
+		});
+		return;
+	}
+
+	// Texels starting in the same page are traced together, so the pages
+	// in use change slowly and each is loaded about once per step
+	const size_t count = workEnd - workOffset;
+	std::vector<uint64_t> pageKeys(count);
+	std::vector<uint32_t> texels(count);
+	pool.parallelFor(0, count, k_groupSize, [&](size_t begin, size_t end)
+	{
+		for (size_t k = begin; k < end; ++k)
+		{
+			const size_t i = workOffset + k;
+			pageKeys[k] = rt.nearestPage(map.positions[i], map.directions[i]);
+			texels[k] = uint32_t(i);
+		}
+	});
+	radixSort(pageKeys, texels, 32);
+
+	pool.parallelFor(0, count, k_groupSize, [&](size_t begin, size_t end)
+	{
+		for (size_t k = begin; k < end; ++k) mapTexel(texels[k]);
+	});
+}
+
+void MeshMapping::finish()
+{
+	if (_backend == ComputeBackend::CPU && _uploadToGPU)
+	{
+		// GPU solvers read the mapping from the same buffers as if it was computed there
+		_coords = VBHandle(
+			bgfx::createVertexBuffer(bgfx::copy(&_coordsData[0], sizeof(Vector4) * _coordsData.size()), computeDecl(sizeof(Vector4)), BGFX_BUFFER_COMPUTE_READ)
+			, _coordsData.size());
+		_tidx = VBHandle(
+			bgfx::createVertexBuffer(bgfx::copy(&_tidxData[0], sizeof(uint32_t) * _tidxData.size()), computeDecl(sizeof(uint32_t)), BGFX_BUFFER_COMPUTE_READ)
+			, _tidxData.size());
+	}
+}
+
 MeshMappingTask::MeshMappingTask(std::shared_ptr<MeshMapping> meshmapping)
 	: _meshMapping(meshmapping)
 {
@@ -257,10 +590,16 @@ bool MeshMappingTask::runStep()
 	return _meshMapping->runStep();
 }
 
-void MeshMappingTask::finish()
+bool MeshMappingTask::finish()
 {
-	//glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-	uint32_t frame = bgfx::frame();
+	assert(_meshMapping);
+	_meshMapping->finish();
+	if (_meshMapping->backend() == ComputeBackend::GPU)
+	{
+		//glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		uint32_t frame = bgfx::frame();
+	}
+	return true;
 }
 
 float MeshMappingTask::progress() const
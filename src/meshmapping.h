@@ -4,19 +4,25 @@
 #include "fornos.h"
 #include "math.h"
 #include "timing.h"
+#include <cfloat>
 #include <cstdint>
 #include <memory>
+#include <vector>
 
 struct CompressedMapUV;
 class Mesh;
 class BVH;
+struct BVHBuildParams;
+class BVHPages;
+class InstancedScene;
+class Raytracer;
 
 struct Pix_GPUData
 {
 	Vector3 p;
-	float _pad0;
+	float maxFront; // Mapping ray limits, see MeshMapping::setRayLimits()
 	Vector3 d;
-	float _pad1;
+	float maxRear;
 };
 
 struct PixT_GPUData
@@ -29,20 +35,59 @@ struct PixT_GPUData
 	float _pad2;
 };
 
-struct BVHGPUData
-{
-	Vector3 aabbMin;
-	Vector3 aabbMax;
-	uint32_t start, end;
-	uint32_t jump;
-	BVHGPUData() : aabbMin(), aabbMax(), start(0), end(0), jump(0) {}
-};
-
 class MeshMapping
 {
 public:
-	void init(std::shared_ptr<const CompressedMapUV> map, std::shared_ptr<const Mesh> mesh, std::shared_ptr<const BVH> rootBVH, bool cullBackfaces = false);
+	MeshMapping();
+	~MeshMapping();
+
+	/// Bounds the mapping rays, call before init()
+	/// @param maxFront, maxRear Distance the rays search the high-poly mesh along
+	/// and against the mapping direction, FLT_MAX searches it all
+	/// @param cage Mesh around the high-poly one: the rays search along the mapping
+	/// direction up to it instead of up to maxFront. Texels whose ray misses the
+	/// cage keep maxFront.
+	void setRayLimits(float maxFront, float maxRear, std::shared_ptr<const Mesh> cage = nullptr);
+
+	/// @param backend Where the mapping is computed. Only the CPU backend builds the
+	/// ray tracer that CPU solvers share, so they need it (FornosRunner picks it for them).
+	/// @param uploadToGPU Keeps the mesh and (for the CPU backend) the results on the GPU for GPU solvers
+	/// @param cpuBVHWidth Children per node of the tree traversed by the CPU ray tracer (2, 4 or 8)
+	/// @param cpuGeometry Layout of the triangles kept for the CPU ray tracer, see RaytracerGeometry.
+	/// Geometry uploaded to the GPU is indexed unless this is unindexed, quantized ones are not decoded there.
+	/// @param orderedTraversal Traverses binary trees nearest child first, on the CPU and in the shaders
+	/// @param compressedNodes Quantizes the child bounds of the CPU wide tree to 8 bits, see CompressedWideBVHNode
+	void init(
+		std::shared_ptr<const CompressedMapUV> map, 
+		std::shared_ptr<const Mesh> mesh, 
+		std::shared_ptr<const BVH> rootBVH, 
+		bool cullBackfaces = false, 
+		ComputeBackend backend = ComputeBackend::GPU, 
+		bool uploadToGPU = true,
+		size_t cpuBVHWidth = 2,
+		CPUGeometry cpuGeometry = CPUGeometry::Unindexed,
+		bool orderedTraversal = false,
+		bool compressedNodes = false);
+	/// Out-of-core mapping on the CPU, the high-poly mesh is traced from its pages
+	/// Texels are traced grouped by the page their ray starts in.
+	void initPaged(
+		std::shared_ptr<const CompressedMapUV> map,
+		std::shared_ptr<const BVHPages> pages,
+		bool cullBackfaces = false);
+	/// Mapping on the CPU against an instanced scene, through a two-level ray tracer
+	/// Every part gets its own BVH and geometry, shared by its instances.
+	/// @param bvhParams Build settings of the part trees and the tree over the instances
+	void initInstanced(
+		std::shared_ptr<const CompressedMapUV> map,
+		const InstancedScene &scene,
+		const BVHBuildParams &bvhParams,
+		bool cullBackfaces = false,
+		size_t cpuBVHWidth = 2,
+		CPUGeometry cpuGeometry = CPUGeometry::Unindexed,
+		bool orderedTraversal = false,
+		bool compressedNodes = false);
 	bool runStep();
+	void finish();
 
 	inline float progress() const { return (float)_workOffset / (float)_workCount; }
 
@@ -50,15 +95,43 @@ public:
 	inline const VBHandle coords_tidx() const { return _tidx; }
 	inline const VBHandle pixels() const { return _pixels; }
 	inline const VBHandle pixelst() const { return _pixelst; }
+	/// Triangles in BVH leaf order as v0, e1 = v1 - v0, e2 = v2 - v0, or the
+	/// shared vertices of indexed geometry (see gpuGeometryFlags())
 	inline const VBHandle meshPositions() const { return _meshPositions; }
 	inline const VBHandle meshNormals() const { return _meshNormals; }
+	/// Three vertex indices per triangle in BVH leaf order, invalid for unindexed geometry
+	inline const VBHandle meshIndices() const { return _meshIndices; }
 	inline const VBHandle meshBVH() const { return _bvh; }
 
+	/// geometryFlags bits of the shaders, see shaders/common.sh
+	static const uint32_t k_gpuBVHOrdered = 1;
+	static const uint32_t k_gpuGeometryIndexed = 2;
+	/// geometryFlags for the shaders reading the uploaded mesh
+	inline uint32_t gpuGeometryFlags() const { return _gpuIndexed ? k_gpuGeometryIndexed : 0; }
+
+	inline ComputeBackend backend() const { return _backend; }
+	/// CPU backend data
+	/// The ray tracer is only built for the CPU backend, GPU mapping returns null.
+	inline const Raytracer* raytracer() const { return _raytracer.get(); }
+	inline const std::vector<Vector4>& coordsData() const { return _coordsData; }
+	inline const std::vector<uint32_t>& coordsTidxData() const { return _tidxData; }
 
 private:
+	void initResults();
+	void initRayLimits();
+	void runStepCPU(size_t workOffset, size_t work);
+
 	size_t _workOffset;
 	size_t _workCount;
 	bool _cullBackfaces = false;
+	ComputeBackend _backend = ComputeBackend::GPU;
+	bool _uploadToGPU = true;
+	bool _orderedTraversal = false; // GPU mapping
+	bool _gpuIndexed = false;
+	float _maxFront = FLT_MAX;
+	float _maxRear = FLT_MAX;
+	std::shared_ptr<const Mesh> _cage;
+	std::vector<float> _cageFront; // maxFront of every texel, empty without a cage
 
 	VBHandle _coords;
 	VBHandle _tidx;
@@ -66,11 +139,17 @@ private:
 	VBHandle _pixelst;
 	VBHandle _meshPositions;
 	VBHandle _meshNormals;
+	VBHandle _meshIndices;
 	VBHandle _bvh;
 	ProgramHandle _program;
 	ProgramHandle _programCullBackfaces;
 	UniformHandle _uniforms;
 
+	std::shared_ptr<const CompressedMapUV> _uvMap;
+	std::unique_ptr<Raytracer> _raytracer;
+	std::vector<Vector4> _coordsData;
+	std::vector<uint32_t> _tidxData;
+
 	Timing _timing;
 };
 
@@ -81,7 +160,7 @@ public:
 	~MeshMappingTask();
 
 	bool runStep();
-	void finish();
+	bool finish();
 	float progress() const;
 	const char* name() const { return "Mesh mapping"; }
 
@@ -0,0 +1,260 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "quantizedgeometry.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+namespace
+{
+	const uint32_t k_maxBlockVertices = 1u << 16;
+	const size_t k_wideBlocksPercent = 1; // The finest grid that keeps most blocks 16 bits wide is used
+
+	inline uint32_t quantize(float v, float origin, float invStep, uint32_t gridMax)
+	{
+		const float q = std::floor((v - origin) * invStep + 0.5f);
+		return uint32_t(std::min(std::max(q, 0.0f), float(gridMax)));
+	}
+
+	inline int16_t toSnorm16(float v)
+	{
+		return int16_t(std::floor(std::min(std::max(v, -1.0f), 1.0f) * 32767.0f + 0.5f));
+	}
+}
+
+uint32_t QuantizedGeometry::encodeOctNormal(const Vector3 &n)
+{
+	const float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+	if (!(l1 > 0.0f)) return 0;
+
+	float u = n.x / l1;
+	float v = n.y / l1;
+	if (n.z < 0.0f)
+	{
+		// The lower hemisphere is folded over the diagonals
+		const float fu = (1.0f - std::fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+		const float fv = (1.0f - std::fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+		u = fu;
+		v = fv;
+	}
+	return uint32_t(uint16_t(toSnorm16(u))) | (uint32_t(uint16_t(toSnorm16(v))) << 16);
+}
+
+bool QuantizedGeometry::build(const Mesh *mesh, const BVH &bvh)
+{
+	ThreadPool &pool = ThreadPool::global();
+	*this = QuantizedGeometry();
+	if (bvh.nodes.empty()) return true;
+
+	// Leaf starts in triangle order, grouped greedily in blocks
+	std::vector<uint32_t> leafOffsets;
+	for (const BVHNode &node : bvh.nodes)
+	{
+		if (node.isLeaf() && node.count > 0) leafOffsets.push_back(node.offset);
+	}
+	std::sort(leafOffsets.begin(), leafOffsets.end());
+
+	const size_t triangleCount = bvh.triangles.size();
+	std::vector<uint32_t> blockOffsets;
+	for (size_t l = 0; l < leafOffsets.size(); ++l)
+	{
+		const uint32_t leafEnd = l + 1 < leafOffsets.size() ? leafOffsets[l + 1] : uint32_t(triangleCount);
+		if (blockOffsets.empty() || leafEnd - blockOffsets.back() > k_blockTriangles)
+		{
+			blockOffsets.push_back(leafOffsets[l]);
+		}
+	}
+	const size_t blockCount = blockOffsets.size();
+	blockOffsets.push_back(uint32_t(triangleCount));
+
+	const size_t wordCount = (triangleCount + 63) / 64;
+	_blockStarts.assign(wordCount, 0);
+	_blockRanks.resize(wordCount);
+	for (size_t b = 0; b < blockCount; ++b)
+	{
+		_blockStarts[blockOffsets[b] >> 6] |= 1ull << (blockOffsets[b] & 63);
+	}
+	uint32_t rank = 0;
+	for (size_t w = 0; w < wordCount; ++w)
+	{
+		_blockRanks[w] = rank;
+		rank += popCount(_blockStarts[w]);
+	}
+
+	// Vertices of a block are the distinct position and normal pairs of its triangles
+	auto blockVertices = [&](size_t b, std::vector<uint64_t> &o_vertices, uint16_t *o_indices)
+	{
+		o_vertices.clear();
+		for (size_t t = blockOffsets[b]; t < blockOffsets[b + 1]; ++t)
+		{
+			const Mesh::Triangle &tri = mesh->triangles[bvh.triangles[t]];
+			for (size_t k = 0; k < 3; ++k)
+			{
+				const Mesh::Vertex &v = mesh->vertices[(&tri.vertexIndex0)[k]];
+				const uint64_t key = (uint64_t(v.positionIndex) << 32) | v.normalIndex;
+				size_t local = std::find(o_vertices.begin(), o_vertices.end(), key) - o_vertices.begin();
+				if (local == o_vertices.size()) o_vertices.push_back(key);
+				if (o_indices) o_indices[(t - blockOffsets[b]) * 3 + k] = uint16_t(local);
+			}
+		}
+	};
+
+	// Largest extent of every block
+	std::vector<float> blockSpans(blockCount);
+	std::atomic<bool> tooManyVertices(false);
+	pool.parallelFor(0, blockCount, 0, [&](size_t begin, size_t end)
+	{
+		std::vector<uint64_t> vertices;
+		for (size_t b = begin; b < end; ++b)
+		{
+			blockVertices(b, vertices, nullptr);
+			if (vertices.size() > k_maxBlockVertices)
+			{
+				tooManyVertices = true;
+				continue;
+			}
+
+			Vector3 mins = mesh->positions[uint32_t(vertices[0] >> 32)];
+			Vector3 maxs = mins;
+			for (uint64_t key : vertices)
+			{
+				mins = min(mins, mesh->positions[uint32_t(key >> 32)]);
+				maxs = max(maxs, mesh->positions[uint32_t(key >> 32)]);
+			}
+			const Vector3 span = maxs - mins;
+			blockSpans[b] = std::max(std::max(span.x, span.y), span.z);
+		}
+	});
+	if (tooManyVertices)
+	{
+		*this = QuantizedGeometry();
+		return false;
+	}
+
+	// Cubic cells, so flat meshes are not over-resolved along their thin axis
+	_origin = bvh.nodes[0].aabbMin;
+	const Vector3 extent = bvh.nodes[0].aabbMax - bvh.nodes[0].aabbMin;
+	const float maxExtent = std::max(std::max(extent.x, extent.y), extent.z);
+	std::sort(blockSpans.begin(), blockSpans.end());
+	const float coverSpan = blockSpans.empty() ? 0.0f : blockSpans[blockCount - 1 - blockCount * k_wideBlocksPercent / 100];
+	_gridBits = k_maxGridBits;
+	while (_gridBits > k_minGridBits && coverSpan / maxExtent * float((1u << _gridBits) - 1) + 1.0f > float(0xffff))
+	{
+		--_gridBits;
+	}
+	const uint32_t gridMax = (1u << _gridBits) - 1;
+	_step = maxExtent / float(gridMax);
+	const float invStep = _step > 0.0f ? 1.0f / _step : 0.0f;
+
+	auto gridPosition = [&](const Vector3 &p, uint32_t *o_grid)
+	{
+		o_grid[0] = quantize(p.x, _origin.x, invStep, gridMax);
+		o_grid[1] = quantize(p.y, _origin.y, invStep, gridMax);
+		o_grid[2] = quantize(p.z, _origin.z, invStep, gridMax);
+	};
+
+	// Block corners and slot counts
+	_blocks.resize(blockCount);
+	std::vector<uint32_t> blockSlots(blockCount + 1, 0);
+	pool.parallelFor(0, blockCount, 0, [&](size_t begin, size_t end)
+	{
+		std::vector<uint64_t> vertices;
+		for (size_t b = begin; b < end; ++b)
+		{
+			blockVertices(b, vertices, nullptr);
+
+			uint32_t mins[3] = { gridMax, gridMax, gridMax };
+			uint32_t maxs[3] = { 0, 0, 0 };
+			for (uint64_t key : vertices)
+			{
+				uint32_t grid[3];
+				gridPosition(mesh->positions[uint32_t(key >> 32)], grid);
+				for (size_t a = 0; a < 3; ++a)
+				{
+					mins[a] = std::min(mins[a], grid[a]);
+					maxs[a] = std::max(maxs[a], grid[a]);
+				}
+			}
+
+			Block &block = _blocks[b];
+			bool wide = false;
+			for (size_t a = 0; a < 3; ++a)
+			{
+				block.base[a] = mins[a];
+				wide = wide || maxs[a] - mins[a] > 0xffff;
+			}
+			block.firstSlot = wide ? k_wideBlock : 0;
+			blockSlots[b + 1] = uint32_t(vertices.size()) * (wide ? 2 : 1);
+		}
+	});
+	for (size_t b = 0; b < blockCount; ++b)
+	{
+		blockSlots[b + 1] += blockSlots[b];
+		_blocks[b].firstSlot |= blockSlots[b];
+	}
+
+	_indices.resize(triangleCount * 3);
+	_positions.resize(size_t(blockSlots.back()) * 3);
+	_normals.resize(blockSlots.back());
+	pool.parallelFor(0, blockCount, 0, [&](size_t begin, size_t end)
+	{
+		std::vector<uint64_t> vertices;
+		for (size_t b = begin; b < end; ++b)
+		{
+			const Block &block = _blocks[b];
+			blockVertices(b, vertices, &_indices[size_t(blockOffsets[b]) * 3]);
+
+			const bool wide = (block.firstSlot & k_wideBlock) != 0;
+			for (uint32_t local = 0; local < uint32_t(vertices.size()); ++local)
+			{
+				const uint32_t s = slot(block, local);
+				uint32_t grid[3];
+				gridPosition(mesh->positions[uint32_t(vertices[local] >> 32)], grid);
+				for (size_t a = 0; a < 3; ++a)
+				{
+					const uint32_t offset = grid[a] - block.base[a];
+					_positions[s * 3 + a] = uint16_t(offset & 0xffff);
+					if (wide) _positions[(s + 1) * 3 + a] = uint16_t(offset >> 16);
+				}
+				_normals[s] = encodeOctNormal(mesh->normals[uint32_t(vertices[local])]);
+				if (wide) _normals[s + 1] = 0;
+			}
+		}
+	});
+
+	return true;
+}
+
+size_t QuantizedGeometry::memorySize() const
+{
+	return
+		_blocks.size() * sizeof(Block) +
+		_blockStarts.size() * sizeof(uint64_t) +
+		_blockRanks.size() * sizeof(uint32_t) +
+		_indices.size() * sizeof(uint16_t) +
+		_positions.size() * sizeof(uint16_t) +
+		_normals.size() * sizeof(uint32_t);
+}
@@ -0,0 +1,170 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "math.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+class BVH;
+class Mesh;
+
+/// High-poly triangles in BVH leaf order, compressed for very large meshes
+/// Positions are snapped to a grid of cubic cells over the mesh bounds, as
+/// fine as the block sizes allow (up to k_maxGridBits along the longest axis).
+/// Consecutive BVH leaves are grouped in blocks of about k_blockTriangles,
+/// which store their vertices as 16-bit offsets from the grid corner of the
+/// block. Normals are octahedron-encoded
+/// in 32 bits and triangles are three 16-bit indices to the vertices of their
+/// block. A vertex decodes to the same grid point from any block, so neighbour
+/// triangles still share their edges exactly.
+class QuantizedGeometry
+{
+public:
+	static const uint32_t k_minGridBits = 16;
+	static const uint32_t k_maxGridBits = 21; // Grid coordinates are exact as floats
+	static const uint32_t k_blockTriangles = 64; // Leaves are not split, larger ones are a block on their own
+
+	/// @return false if a block has too many vertices for 16-bit indices
+	bool build(const Mesh *mesh, const BVH &bvh);
+
+	inline bool empty() const { return _indices.empty(); }
+	inline size_t triangleCount() const { return _indices.size() / 3; }
+	/// Resolution of the position grid along the longest axis
+	inline uint32_t gridBits() const { return _gridBits; }
+	/// Bytes used by the arrays
+	size_t memorySize() const;
+
+	/// Triangle tidx (three entries per triangle) as v0, e1 = v1 - v0, e2 = v2 - v0
+	inline void triangle(uint32_t tidx, Vector4 *o_tri) const
+	{
+		const Block &block = _blocks[blockIndex(tidx / 3)];
+		const Vector3 p0 = position(block, _indices[tidx + 0]);
+		o_tri[0] = p0;
+		o_tri[1] = position(block, _indices[tidx + 1]) - p0;
+		o_tri[2] = position(block, _indices[tidx + 2]) - p0;
+	}
+
+	/// The three decoded vertex positions of triangle tidx
+	inline void positions(uint32_t tidx, Vector3 *o_positions) const
+	{
+		const Block &block = _blocks[blockIndex(tidx / 3)];
+		for (uint32_t k = 0; k < 3; ++k)
+		{
+			o_positions[k] = position(block, _indices[tidx + k]);
+		}
+	}
+
+	/// The three vertex normals of triangle tidx
+	inline void normals(uint32_t tidx, Vector3 *o_normals) const
+	{
+		const Block &block = _blocks[blockIndex(tidx / 3)];
+		for (uint32_t k = 0; k < 3; ++k)
+		{
+			o_normals[k] = decodeOctNormal(_normals[slot(block, _indices[tidx + k])]);
+		}
+	}
+
+	static uint32_t encodeOctNormal(const Vector3 &n);
+	static inline Vector3 decodeOctNormal(uint32_t encoded)
+	{
+		float u = float(int16_t(encoded & 0xffff)) / 32767.0f;
+		float v = float(int16_t(encoded >> 16)) / 32767.0f;
+		const float z = 1.0f - std::fabsf(u) - std::fabsf(v);
+		if (z < 0.0f)
+		{
+			const float fu = (1.0f - std::fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+			const float fv = (1.0f - std::fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+			u = fu;
+			v = fv;
+		}
+		return normalize(Vector3(u, v, z));
+	}
+
+private:
+	static const uint32_t k_wideBlock = 0x80000000u;
+
+	struct Block
+	{
+		uint32_t base[3]; // Grid coordinates of the block corner
+		uint32_t firstSlot; // k_wideBlock is set for blocks wider than 16 bits, their vertices take two slots
+	};
+
+	static inline uint32_t popCount(uint64_t v)
+	{
+#if defined(_MSC_VER)
+		return uint32_t(__popcnt64(v));
+#else
+		return uint32_t(__builtin_popcountll(v));
+#endif
+	}
+
+	/// Block holding a triangle, by ranking the block starts up to it
+	inline uint32_t blockIndex(uint32_t triangle) const
+	{
+		const uint32_t word = triangle >> 6;
+		const uint64_t upTo = ~0ull >> (63 - (triangle & 63));
+		return _blockRanks[word] + popCount(_blockStarts[word] & upTo) - 1;
+	}
+
+	static inline uint32_t slot(const Block &block, uint32_t local)
+	{
+		return (block.firstSlot & k_wideBlock) ?
+			(block.firstSlot & ~k_wideBlock) + local * 2 :
+			block.firstSlot + local;
+	}
+
+	inline Vector3 position(const Block &block, uint32_t local) const
+	{
+		const uint32_t s = slot(block, local);
+		const uint16_t *q = &_positions[s * 3];
+		uint32_t x = block.base[0] + q[0];
+		uint32_t y = block.base[1] + q[1];
+		uint32_t z = block.base[2] + q[2];
+		if (block.firstSlot & k_wideBlock)
+		{
+			x += uint32_t(q[3]) << 16;
+			y += uint32_t(q[4]) << 16;
+			z += uint32_t(q[5]) << 16;
+		}
+		return Vector3(
+			_origin.x + float(x) * _step,
+			_origin.y + float(y) * _step,
+			_origin.z + float(z) * _step);
+	}
+
+	Vector3 _origin;
+	float _step = 0.0f;
+	uint32_t _gridBits = 0;
+	std::vector<Block> _blocks;
+	std::vector<uint64_t> _blockStarts; // Bit set for the first triangle of every block
+	std::vector<uint32_t> _blockRanks; // Blocks starting before every word of _blockStarts
+	std::vector<uint16_t> _indices; // Three per triangle, relative to the first slot of the block
+	std::vector<uint16_t> _positions; // Three per slot
+	std::vector<uint32_t> _normals; // One per slot
+};
@@ -0,0 +1,100 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "radixsort.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <cassert>
+
+namespace
+{
+	const unsigned k_digitBits = 8;
+	const size_t k_digitCount = size_t(1) << k_digitBits;
+	const size_t k_minBlockSize = 16 * 1024; // Smaller blocks spend more time in the histograms than sorting
+}
+
+void radixSort(std::vector<uint64_t> &keys, std::vector<uint32_t> &values, unsigned keyBits)
+{
+	assert(keys.size() == values.size());
+	const size_t count = keys.size();
+	if (count < 2) return;
+
+	ThreadPool &pool = ThreadPool::global();
+	const size_t blockCount = std::max(size_t(1), std::min(pool.threadCount() * 4, count / k_minBlockSize));
+	const size_t blockSize = (count + blockCount - 1) / blockCount;
+
+	std::vector<uint64_t> tmpKeys(count);
+	std::vector<uint32_t> tmpValues(count);
+	// Digit counts of every block, then the output offset of every digit in every block
+	std::vector<size_t> histograms(blockCount * k_digitCount);
+
+	for (unsigned shift = 0; shift < keyBits; shift += k_digitBits)
+	{
+		pool.parallelFor(0, blockCount, 1, [&](size_t begin, size_t end)
+		{
+			for (size_t b = begin; b < end; ++b)
+			{
+				size_t *histogram = &histograms[b * k_digitCount];
+				std::fill(histogram, histogram + k_digitCount, 0);
+				const size_t last = std::min(count, (b + 1) * blockSize);
+				for (size_t i = b * blockSize; i < last; ++i)
+				{
+					++histogram[(keys[i] >> shift) & (k_digitCount - 1)];
+				}
+			}
+		});
+
+		size_t offset = 0;
+		bool sameDigit = false;
+		for (size_t d = 0; d < k_digitCount; ++d)
+		{
+			size_t digitTotal = 0;
+			for (size_t b = 0; b < blockCount; ++b)
+			{
+				size_t &h = histograms[b * k_digitCount + d];
+				const size_t n = h;
+				h = offset;
+				offset += n;
+				digitTotal += n;
+			}
+			if (digitTotal == count) sameDigit = true;
+		}
+		if (sameDigit) continue;
+
+		pool.parallelFor(0, blockCount, 1, [&](size_t begin, size_t end)
+		{
+			for (size_t b = begin; b < end; ++b)
+			{
+				size_t *offsets = &histograms[b * k_digitCount];
+				const size_t last = std::min(count, (b + 1) * blockSize);
+				for (size_t i = b * blockSize; i < last; ++i)
+				{
+					const size_t dst = offsets[(keys[i] >> shift) & (k_digitCount - 1)]++;
+					tmpKeys[dst] = keys[i];
+					tmpValues[dst] = values[i];
+				}
+			}
+		});
+		keys.swap(tmpKeys);
+		values.swap(tmpValues);
+	}
+}
@@ -0,0 +1,1398 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "raytracer.h"
+#include "bvhpages.h"
+#include "instancedscene.h"
+#include "logging.h"
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAYTRACER_SSE 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX__)
+#define RAYTRACER_AVX 1
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace
+{
+	const float k_baryMin = -1e-5f;
+	const float k_baryMax = 1.0f;
+
+	inline Vector3 toVector3(const Vector4 &v)
+	{
+		return Vector3(v.x, v.y, v.z);
+	}
+
+	/// RayAABB() in the shaders, boxes exited before mindist are missed
+	inline float rayAABB(const Vector3 &o, const Vector3 &invd, const Vector3 &mins, const Vector3 &maxs, const float mindist = 0.0f)
+	{
+		const Vector3 t1 = (mins - o) * invd;
+		const Vector3 t2 = (maxs - o) * invd;
+		const float a = std::fmaxf(std::fmaxf(std::fminf(t1.x, t2.x), std::fminf(t1.y, t2.y)), std::fminf(t1.z, t2.z));
+		const float b = std::fminf(std::fminf(std::fmaxf(t1.x, t2.x), std::fmaxf(t1.y, t2.y)), std::fmaxf(t1.z, t2.z));
+		return (b >= mindist && a <= b) ? a : FLT_MAX;
+	}
+
+	/// Ray data for the wide node tests, broadcast to the SIMD lanes
+	struct WideRay
+	{
+		Vector3 o;
+		Vector3 invd;
+#if defined(RAYTRACER_SSE)
+		__m128 o4[3];
+		__m128 invd4[3];
+#endif
+#if defined(RAYTRACER_AVX)
+		__m256 o8[3];
+		__m256 invd8[3];
+#endif
+
+		WideRay(const Vector3 &o, const Vector3 &invd)
+			: o(o)
+			, invd(invd)
+		{
+#if defined(RAYTRACER_SSE)
+			o4[0] = _mm_set1_ps(o.x); o4[1] = _mm_set1_ps(o.y); o4[2] = _mm_set1_ps(o.z);
+			invd4[0] = _mm_set1_ps(invd.x); invd4[1] = _mm_set1_ps(invd.y); invd4[2] = _mm_set1_ps(invd.z);
+#endif
+#if defined(RAYTRACER_AVX)
+			o8[0] = _mm256_set1_ps(o.x); o8[1] = _mm256_set1_ps(o.y); o8[2] = _mm256_set1_ps(o.z);
+			invd8[0] = _mm256_set1_ps(invd.x); invd8[1] = _mm256_set1_ps(invd.y); invd8[2] = _mm256_set1_ps(invd.z);
+#endif
+		}
+	};
+
+#if defined(RAYTRACER_SSE)
+	/// rayAABB() for four boxes
+	inline uint32_t rayBoxes4(const __m128 minX, const __m128 minY, const __m128 minZ, const __m128 maxX, const __m128 maxY, const __m128 maxZ,
+		const WideRay &ray, const __m128 mindist, const __m128 maxdist, float *o_dist)
+	{
+		const __m128 t1x = _mm_mul_ps(_mm_sub_ps(minX, ray.o4[0]), ray.invd4[0]);
+		const __m128 t1y = _mm_mul_ps(_mm_sub_ps(minY, ray.o4[1]), ray.invd4[1]);
+		const __m128 t1z = _mm_mul_ps(_mm_sub_ps(minZ, ray.o4[2]), ray.invd4[2]);
+		const __m128 t2x = _mm_mul_ps(_mm_sub_ps(maxX, ray.o4[0]), ray.invd4[0]);
+		const __m128 t2y = _mm_mul_ps(_mm_sub_ps(maxY, ray.o4[1]), ray.invd4[1]);
+		const __m128 t2z = _mm_mul_ps(_mm_sub_ps(maxZ, ray.o4[2]), ray.invd4[2]);
+		const __m128 a = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1x, t2x), _mm_min_ps(t1y, t2y)), _mm_min_ps(t1z, t2z));
+		const __m128 b = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1x, t2x), _mm_max_ps(t1y, t2y)), _mm_max_ps(t1z, t2z));
+		const __m128 hit = _mm_and_ps(
+			_mm_and_ps(_mm_cmpge_ps(b, mindist), _mm_cmple_ps(a, b)),
+			_mm_cmplt_ps(a, maxdist));
+		_mm_storeu_ps(o_dist, a);
+		return uint32_t(_mm_movemask_ps(hit));
+	}
+
+	/// rayAABB() for the four children starting at slot k
+	template <size_t Width>
+	inline uint32_t rayChildren4(const WideBVHNode<Width> &node, const size_t k, const WideRay &ray, const __m128 mindist, const __m128 maxdist, float *o_dist)
+	{
+		return rayBoxes4(
+			_mm_load_ps(node.minX + k), _mm_load_ps(node.minY + k), _mm_load_ps(node.minZ + k),
+			_mm_load_ps(node.maxX + k), _mm_load_ps(node.maxY + k), _mm_load_ps(node.maxZ + k),
+			ray, mindist, maxdist, o_dist + k) << k;
+	}
+
+	/// Four grid coordinates of a compressed node, decoded to positions
+	inline __m128 decodeQuantized4(const uint8_t *q, const __m128 origin, const __m128 cell)
+	{
+		int32_t bytes;
+		memcpy(&bytes, q, sizeof(bytes));
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+		const __m128 values = _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+		return _mm_add_ps(origin, _mm_mul_ps(values, cell));
+	}
+
+	/// rayAABB() for the four children of a compressed node starting at slot k
+	template <size_t Width>
+	inline uint32_t rayCompressedChildren4(const CompressedWideBVHNode<Width> &node, const size_t k, const __m128 *origin, const __m128 *cell,
+		const WideRay &ray, const __m128 mindist, const __m128 maxdist, float *o_dist)
+	{
+		return rayBoxes4(
+			decodeQuantized4(node.qMinX + k, origin[0], cell[0]),
+			decodeQuantized4(node.qMinY + k, origin[1], cell[1]),
+			decodeQuantized4(node.qMinZ + k, origin[2], cell[2]),
+			decodeQuantized4(node.qMaxX + k, origin[0], cell[0]),
+			decodeQuantized4(node.qMaxY + k, origin[1], cell[1]),
+			decodeQuantized4(node.qMaxZ + k, origin[2], cell[2]),
+			ray, mindist, maxdist, o_dist + k) << k;
+	}
+#endif
+
+#if defined(RAYTRACER_AVX)
+	/// rayAABB() for the eight children starting at slot k
+	template <size_t Width>
+	inline uint32_t rayChildren8(const WideBVHNode<Width> &node, const size_t k, const WideRay &ray, const __m256 mindist, const __m256 maxdist, float *o_dist)
+	{
+		const __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.minX + k), ray.o8[0]), ray.invd8[0]);
+		const __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.minY + k), ray.o8[1]), ray.invd8[1]);
+		const __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.minZ + k), ray.o8[2]), ray.invd8[2]);
+		const __m256 t2x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.maxX + k), ray.o8[0]), ray.invd8[0]);
+		const __m256 t2y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.maxY + k), ray.o8[1]), ray.invd8[1]);
+		const __m256 t2z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.maxZ + k), ray.o8[2]), ray.invd8[2]);
+		const __m256 a = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t1x, t2x), _mm256_min_ps(t1y, t2y)), _mm256_min_ps(t1z, t2z));
+		const __m256 b = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t1x, t2x), _mm256_max_ps(t1y, t2y)), _mm256_max_ps(t1z, t2z));
+		const __m256 hit = _mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(b, mindist, _CMP_GE_OQ), _mm256_cmp_ps(a, b, _CMP_LE_OQ)),
+			_mm256_cmp_ps(a, maxdist, _CMP_LT_OQ));
+		_mm256_storeu_ps(o_dist + k, a);
+		return uint32_t(_mm256_movemask_ps(hit)) << k;
+	}
+#endif
+
+	/// Tests the ray against all the children of a wide node
+	/// NaNs (axis parallel rays starting on a slab plane) follow the SIMD
+	/// min/max rules, so those rays may differ from rayAABB().
+	/// @param o_dist Entry distance to every child
+	/// @return Mask with a bit set for every child overlapping [mindist, maxdist)
+	template <size_t Width>
+	inline uint32_t rayChildren(const WideBVHNode<Width> &node, const WideRay &ray, const float mindist, const float maxdist, float *o_dist)
+	{
+		uint32_t mask = 0;
+		size_t k = 0;
+#if defined(RAYTRACER_AVX)
+		const __m256 mindist8 = _mm256_set1_ps(mindist);
+		const __m256 maxdist8 = _mm256_set1_ps(maxdist);
+		for (; k + 8 <= Width; k += 8)
+		{
+			mask |= rayChildren8(node, k, ray, mindist8, maxdist8, o_dist);
+		}
+#endif
+#if defined(RAYTRACER_SSE)
+		const __m128 mindist4 = _mm_set1_ps(mindist);
+		const __m128 maxdist4 = _mm_set1_ps(maxdist);
+		for (; k + 4 <= Width; k += 4)
+		{
+			mask |= rayChildren4(node, k, ray, mindist4, maxdist4, o_dist);
+		}
+#endif
+		for (; k < Width; ++k)
+		{
+			o_dist[k] = rayAABB(ray.o, ray.invd,
+				Vector3(node.minX[k], node.minY[k], node.minZ[k]),
+				Vector3(node.maxX[k], node.maxY[k], node.maxZ[k]), mindist);
+			if (o_dist[k] < maxdist) mask |= 1u << k;
+		}
+		return mask;
+	}
+
+	/// rayChildren() for a compressed node, against its decoded child bounds
+	template <size_t Width>
+	inline uint32_t rayChildren(const CompressedWideBVHNode<Width> &node, const WideRay &ray, const float mindist, const float maxdist, float *o_dist)
+	{
+		uint32_t mask = 0;
+		size_t k = 0;
+#if defined(RAYTRACER_SSE)
+		const __m128 origin[3] = { _mm_set1_ps(node.origin[0]), _mm_set1_ps(node.origin[1]), _mm_set1_ps(node.origin[2]) };
+		const __m128 cell[3] = { _mm_set1_ps(node.cellSize(0)), _mm_set1_ps(node.cellSize(1)), _mm_set1_ps(node.cellSize(2)) };
+		const __m128 mindist4 = _mm_set1_ps(mindist);
+		const __m128 maxdist4 = _mm_set1_ps(maxdist);
+		for (; k + 4 <= Width; k += 4)
+		{
+			mask |= rayCompressedChildren4(node, k, origin, cell, ray, mindist4, maxdist4, o_dist);
+		}
+#endif
+		for (; k < Width; ++k)
+		{
+			Vector3 mins, maxs;
+			node.bounds(k, mins, maxs);
+			o_dist[k] = rayAABB(ray.o, ray.invd, mins, maxs, mindist);
+			if (o_dist[k] < maxdist) mask |= 1u << k;
+		}
+		return mask & node.slotMask;
+	}
+
+	struct StackEntry
+	{
+		uint32_t node;
+		float dist;
+	};
+
+	// Wide traversal stack of every thread, grown to the deepest tree traversed
+	thread_local std::vector<StackEntry> t_stack;
+	// Ordered binary traversal stack of every thread
+	thread_local std::vector<uint32_t> t_orderedStack;
+
+	/// Hit test of the Moller-Trumbore intersection, shared by the single ray and packet kernels
+	/// @param det dot(e1, cross(d, e2))
+	/// @param su, sv, st Barycentric coordinates and distance scaled by det
+	/// @return Distance or FLT_MAX
+	inline float triangleHit(const float det, const float su, const float sv, const float st, const float baryMin, Vector3 &o_bcoord)
+	{
+		const float f = 1.0f / det;
+		const float u = su * f;
+		const float v = sv * f;
+		const float t = st * f;
+		const float w = 1.0f - u - v;
+		if (det != 0 && t >= 0 &&
+			w >= baryMin &&
+			u >= baryMin && u <= k_baryMax &&
+			v >= baryMin && v <= k_baryMax)
+		{
+			o_bcoord = Vector3(w, u, v);
+			return t;
+		}
+		return FLT_MAX;
+	}
+
+	enum class Facing { Any, Away, Towards };
+
+	/// Ray-triangle intersection as raycast(), raycast_nobackfaces() and raycastBack() in the shaders
+	/// The triangle is stored as v0, e1 = v1 - v0, e2 = v2 - v0 so only float math is needed and
+	/// the facing is the sign of the determinant (negative when the triangle faces away).
+	/// @return Distance or FLT_MAX
+	template <Facing facing>
+	inline float raycastTriangle(const Vector3 &o, const Vector3 &d, const Vector4 *tri, const float baryMin, Vector3 &o_bcoord)
+	{
+		const Vector3 e1 = toVector3(tri[1]);
+		const Vector3 e2 = toVector3(tri[2]);
+		const Vector3 h = cross(d, e2);
+		const float det = dot(e1, h);
+		const bool facingOk =
+			(facing == Facing::Any && det != 0) ||
+			(facing == Facing::Away && det < 0) ||
+			(facing == Facing::Towards && det > 0);
+		if (!facingOk) return FLT_MAX;
+
+		const Vector3 s = o - toVector3(tri[0]);
+		const Vector3 q = cross(s, e1);
+		return triangleHit(det, dot(s, h), dot(d, q), dot(e2, q), baryMin, o_bcoord);
+	}
+
+	/// Ray-triangle intersection as raycast_dist() in the shaders
+	inline float raycastTriangleDist(const Vector3 &o, const Vector3 &d, const Vector4 *tri)
+	{
+		Vector3 bcoord;
+		return raycastTriangle<Facing::Any>(o, d, tri, 0.0f, bcoord);
+	}
+
+	/// raycastTriangle() along d and -d at once
+	/// Flipping d only flips the signs of det and the scaled terms, so the barycentric
+	/// coordinates are the same and the distance along -d is minus the one along d.
+	/// Facing::Away keeps the triangles facing away from d, as Facing::Away along d
+	/// and Facing::Towards along -d.
+	/// @return Distance along d (negative behind o) or FLT_MAX
+	template <Facing facing>
+	inline float raycastTriangleLine(const Vector3 &o, const Vector3 &d, const Vector4 *tri, const float baryMin, Vector3 &o_bcoord)
+	{
+		const Vector3 e1 = toVector3(tri[1]);
+		const Vector3 e2 = toVector3(tri[2]);
+		const Vector3 h = cross(d, e2);
+		const float det = dot(e1, h);
+		if (facing == Facing::Away ? !(det < 0) : det == 0) return FLT_MAX;
+
+		const Vector3 s = o - toVector3(tri[0]);
+		const Vector3 q = cross(s, e1);
+		const float f = 1.0f / det;
+		const float u = dot(s, h) * f;
+		const float v = dot(d, q) * f;
+		const float w = 1.0f - u - v;
+		if (w >= baryMin &&
+			u >= baryMin && u <= k_baryMax &&
+			v >= baryMin && v <= k_baryMax)
+		{
+			o_bcoord = Vector3(w, u, v);
+			return dot(e2, q) * f;
+		}
+		return FLT_MAX;
+	}
+
+	/// Terms of the intersection that only depend on the origin, shared by the rays of a packet
+	struct PacketTriangle
+	{
+		Vector3 e1;
+		Vector3 e2;
+		Vector3 s;
+		Vector3 q;
+		float st;
+
+		inline PacketTriangle(const Vector4 *tri, const Vector3 &o)
+			: e1(toVector3(tri[1]))
+			, e2(toVector3(tri[2]))
+			, s(o - toVector3(tri[0]))
+			, q(cross(s, e1))
+			, st(dot(e2, q))
+		{
+		}
+
+		/// raycastTriangleDist() of one ray of the packet
+		inline float dist(const Vector3 &d) const
+		{
+			const Vector3 h = cross(d, e2);
+			Vector3 bcoord;
+			return triangleHit(dot(e1, h), dot(s, h), dot(d, q), st, 0.0f, bcoord);
+		}
+	};
+
+	/// Rays sharing an origin, traversed together
+	struct RayPacket
+	{
+		static const size_t k_size = 16;
+
+		Vector3 o;
+		size_t count;
+		float mindist; // Boxes exited before mindist are skipped
+		uint32_t active; // Rays still being traced
+		alignas(32) float dx[k_size];
+		alignas(32) float dy[k_size];
+		alignas(32) float dz[k_size];
+		alignas(32) float invdx[k_size];
+		alignas(32) float invdy[k_size];
+		alignas(32) float invdz[k_size];
+		alignas(32) float curdist[k_size]; // min(mint, maxdist), as in raycastDist()
+		alignas(32) float mint[k_size];
+
+		inline uint32_t fullMask() const { return count == 32 ? 0xffffffffu : (1u << count) - 1; }
+	};
+
+	static_assert(RayPacket::k_size % 8 == 0 && RayPacket::k_size <= 32, "Packets are tested in groups of 8 and masked with 32 bits");
+
+	inline uint32_t countTrailingZeros(uint32_t v)
+	{
+#if defined(_MSC_VER)
+		unsigned long idx;
+		_BitScanForward(&idx, v);
+		return uint32_t(idx);
+#else
+		return uint32_t(__builtin_ctz(v));
+#endif
+	}
+
+	/// Interleaves the lower 10 bits of v with two zero bits between them
+	inline uint32_t expandBits(uint32_t v)
+	{
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		return v;
+	}
+
+	/// Morton code of a unit direction
+	inline uint32_t directionKey(const Vector3 &d)
+	{
+		const uint32_t x = uint32_t(std::min(std::max((d.x + 1.0f) * 512.0f, 0.0f), 1023.0f));
+		const uint32_t y = uint32_t(std::min(std::max((d.y + 1.0f) * 512.0f, 0.0f), 1023.0f));
+		const uint32_t z = uint32_t(std::min(std::max((d.z + 1.0f) * 512.0f, 0.0f), 1023.0f));
+		return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+	}
+
+	struct PacketStackEntry
+	{
+		uint32_t node;
+		uint32_t mask; // Rays that hit the node
+	};
+
+	thread_local std::vector<PacketStackEntry> t_packetStack;
+
+	/// Two-level packets, split by child
+	thread_local std::vector<uint64_t> t_childRays; // Child index << 32 | ray index
+	thread_local std::vector<Vector3> t_childDirs;
+	thread_local std::vector<uint32_t> t_childRayIndices;
+	thread_local std::vector<float> t_childDists;
+	thread_local std::vector<uint8_t> t_childOccluded;
+
+	/// rayAABB() of the rays in activeMask against one box
+	/// The box is moved to the shared origin once for all the rays.
+	/// @return Mask of the rays that hit the box in [p.mindist, curdist)
+	inline uint32_t packetAABB(const RayPacket &p, const uint32_t activeMask, const Vector3 &mins, const Vector3 &maxs)
+	{
+		const Vector3 lo = mins - p.o;
+		const Vector3 hi = maxs - p.o;
+#if defined(RAYTRACER_AVX)
+		const __m256 mindist8 = _mm256_set1_ps(p.mindist);
+#elif defined(RAYTRACER_SSE)
+		const __m128 mindist4 = _mm_set1_ps(p.mindist);
+#endif
+		uint32_t mask = 0;
+		for (size_t k = 0; k < p.count; k += 8)
+		{
+			if (!((activeMask >> k) & 0xff)) continue;
+#if defined(RAYTRACER_AVX)
+			const __m256 ix = _mm256_load_ps(p.invdx + k);
+			const __m256 iy = _mm256_load_ps(p.invdy + k);
+			const __m256 iz = _mm256_load_ps(p.invdz + k);
+			const __m256 t1x = _mm256_mul_ps(_mm256_set1_ps(lo.x), ix);
+			const __m256 t1y = _mm256_mul_ps(_mm256_set1_ps(lo.y), iy);
+			const __m256 t1z = _mm256_mul_ps(_mm256_set1_ps(lo.z), iz);
+			const __m256 t2x = _mm256_mul_ps(_mm256_set1_ps(hi.x), ix);
+			const __m256 t2y = _mm256_mul_ps(_mm256_set1_ps(hi.y), iy);
+			const __m256 t2z = _mm256_mul_ps(_mm256_set1_ps(hi.z), iz);
+			const __m256 a = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t1x, t2x), _mm256_min_ps(t1y, t2y)), _mm256_min_ps(t1z, t2z));
+			const __m256 b = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t1x, t2x), _mm256_max_ps(t1y, t2y)), _mm256_max_ps(t1z, t2z));
+			const __m256 hit = _mm256_and_ps(
+				_mm256_and_ps(_mm256_cmp_ps(b, mindist8, _CMP_GE_OQ), _mm256_cmp_ps(a, b, _CMP_LE_OQ)),
+				_mm256_cmp_ps(a, _mm256_load_ps(p.curdist + k), _CMP_LT_OQ));
+			mask |= uint32_t(_mm256_movemask_ps(hit)) << k;
+#elif defined(RAYTRACER_SSE)
+			for (size_t j = k; j < k + 8; j += 4)
+			{
+				const __m128 ix = _mm_load_ps(p.invdx + j);
+				const __m128 iy = _mm_load_ps(p.invdy + j);
+				const __m128 iz = _mm_load_ps(p.invdz + j);
+				const __m128 t1x = _mm_mul_ps(_mm_set1_ps(lo.x), ix);
+				const __m128 t1y = _mm_mul_ps(_mm_set1_ps(lo.y), iy);
+				const __m128 t1z = _mm_mul_ps(_mm_set1_ps(lo.z), iz);
+				const __m128 t2x = _mm_mul_ps(_mm_set1_ps(hi.x), ix);
+				const __m128 t2y = _mm_mul_ps(_mm_set1_ps(hi.y), iy);
+				const __m128 t2z = _mm_mul_ps(_mm_set1_ps(hi.z), iz);
+				const __m128 a = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1x, t2x), _mm_min_ps(t1y, t2y)), _mm_min_ps(t1z, t2z));
+				const __m128 b = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1x, t2x), _mm_max_ps(t1y, t2y)), _mm_max_ps(t1z, t2z));
+				const __m128 hit = _mm_and_ps(
+					_mm_and_ps(_mm_cmpge_ps(b, mindist4), _mm_cmple_ps(a, b)),
+					_mm_cmplt_ps(a, _mm_load_ps(p.curdist + j)));
+				mask |= uint32_t(_mm_movemask_ps(hit)) << j;
+			}
+#else
+			for (size_t j = k; j < k + 8; ++j)
+			{
+				const float dist = rayAABB(p.o, Vector3(p.invdx[j], p.invdy[j], p.invdz[j]), mins, maxs, p.mindist);
+				if (dist < p.curdist[j]) mask |= 1u << j;
+			}
+#endif
+		}
+		return mask & activeMask;
+	}
+
+	/// raycastTriangleDist() of the rays in mask against the triangles in [start, end)
+	/// The terms depending on the shared origin are computed once per triangle.
+	/// triangleFunc(tidx, scratch) returns the triangle as Raytracer::triangle().
+	template <typename TriangleFunc>
+	inline void packetTriangles(RayPacket &p, const uint32_t mask, TriangleFunc triangleFunc, const uint32_t start, const uint32_t end,
+		const float mindist, const float maxdist)
+	{
+		Vector4 scratch[3];
+		for (uint32_t tidx = start; tidx < end; tidx += 3)
+		{
+			const PacketTriangle tri(triangleFunc(tidx, scratch), p.o);
+			for (uint32_t rays = mask; rays; rays &= rays - 1)
+			{
+				const size_t r = (size_t)countTrailingZeros(rays);
+				const float t = tri.dist(Vector3(p.dx[r], p.dy[r], p.dz[r]));
+				if (t >= mindist && t < p.mint[r])
+				{
+					p.mint[r] = t;
+					p.curdist[r] = std::fminf(t, maxdist);
+				}
+			}
+		}
+	}
+
+	/// Fills a packet with count rays, all of them active
+	inline void loadPacket(RayPacket &p, const Vector3 *dirs, const size_t count, const float maxdist)
+	{
+		p.count = count;
+		p.active = p.fullMask();
+		for (size_t r = 0; r < RayPacket::k_size; ++r)
+		{
+			// Unused lanes repeat the last ray, they are masked out
+			const Vector3 &d = dirs[std::min(r, count - 1)];
+			p.dx[r] = d.x;
+			p.dy[r] = d.y;
+			p.dz[r] = d.z;
+			p.invdx[r] = 1.0f / d.x;
+			p.invdy[r] = 1.0f / d.y;
+			p.invdz[r] = 1.0f / d.z;
+			p.curdist[r] = maxdist;
+			p.mint[r] = FLT_MAX;
+		}
+	}
+
+	/// Any hit in [mindist, curdist) of the rays in mask against the triangles in [start, end)
+	/// Rays that hit something are removed from the active rays.
+	template <typename TriangleFunc>
+	inline void packetTrianglesOcclusion(RayPacket &p, const uint32_t mask, TriangleFunc triangleFunc, const uint32_t start, const uint32_t end,
+		const float mindist)
+	{
+		Vector4 scratch[3];
+		for (uint32_t tidx = start; tidx < end && (mask & p.active); tidx += 3)
+		{
+			const PacketTriangle tri(triangleFunc(tidx, scratch), p.o);
+			for (uint32_t rays = mask & p.active; rays; rays &= rays - 1)
+			{
+				const size_t r = (size_t)countTrailingZeros(rays);
+				const float t = tri.dist(Vector3(p.dx[r], p.dy[r], p.dz[r]));
+				if (t >= mindist && t < p.curdist[r])
+				{
+					p.mint[r] = t;
+					p.active &= ~(1u << r);
+				}
+			}
+		}
+	}
+
+	/// Traverses the wide tree once for all the active rays in a packet
+	/// leafFunc(mask, start, end) is called with the rays that hit each leaf.
+	/// The traversal ends when no ray is active.
+	template <typename Tree, typename LeafFunc>
+	void traversePacket(const Tree &bvh, RayPacket &p, LeafFunc leafFunc)
+	{
+		typedef typename Tree::Node Node;
+		const size_t Width = Node::k_width;
+
+		if (bvh.nodes.empty()) return;
+
+		if (t_packetStack.size() < bvh.stackSize()) t_packetStack.resize(bvh.stackSize());
+		PacketStackEntry *stack = t_packetStack.data();
+		size_t stackCount = 0;
+		stack[stackCount++] = PacketStackEntry{ 0, p.active };
+
+		while (stackCount > 0 && p.active)
+		{
+			const PacketStackEntry entry = stack[--stackCount];
+			const uint32_t entryMask = entry.mask & p.active;
+			if (!entryMask) continue;
+			const Node &node = bvh.nodes[entry.node];
+
+			uint32_t innerMasks[Width];
+			for (size_t s = 0; s < Width; ++s)
+			{
+				innerMasks[s] = 0;
+				if (node.isEmpty(s)) continue;
+
+				Vector3 mins, maxs;
+				node.bounds(s, mins, maxs);
+				const uint32_t mask = packetAABB(p, entryMask & p.active, mins, maxs);
+				if (!mask) continue;
+
+				if (node.isLeaf(s))
+				{
+					leafFunc(mask, node.child[s] * 3, (node.child[s] + node.count[s]) * 3);
+				}
+				else
+				{
+					innerMasks[s] = mask;
+				}
+			}
+
+			// The first slot is popped first
+			for (size_t s = Width; s-- > 0;)
+			{
+				if (innerMasks[s]) stack[stackCount++] = PacketStackEntry{ node.child[s], innerMasks[s] };
+			}
+		}
+	}
+}
+
+size_t RaytracerGeometry::memorySize() const
+{
+	return
+		triangles.size() * sizeof(Vector4) +
+		normals.size() * sizeof(Vector4) +
+		indices.size() * sizeof(uint32_t) +
+		vertexPositions.size() * sizeof(Vector3) +
+		vertexNormals.size() * sizeof(Vector3) +
+		quantized.memorySize();
+}
+
+size_t Raytracer::memorySize() const
+{
+	size_t size = _geometry.memorySize();
+	if (_bvh) size += _bvh->nodes.size() * sizeof(BVHNode) + _bvh->triangles.size() * sizeof(uint32_t);
+	if (_bvh4) size += _bvh4->nodes.size() * sizeof(BVH4::Node);
+	if (_bvh8) size += _bvh8->nodes.size() * sizeof(BVH8::Node);
+	if (_cbvh4) size += _cbvh4->nodes.size() * sizeof(CompressedBVH4::Node);
+	if (_cbvh8) size += _cbvh8->nodes.size() * sizeof(CompressedBVH8::Node);
+	return size;
+}
+
+Raytracer::Raytracer(std::shared_ptr<const BVH> bvh, RaytracerGeometry &&geometry, size_t bvhWidth, bool orderedTraversal,
+	bool compressedNodes)
+	: _bvh(bvh)
+	, _geometry(std::move(geometry))
+{
+	if (bvhWidth == 8)
+	{
+		_bvh8.reset(BVH8::collapse(*bvh));
+		if (compressedNodes) _cbvh8.reset(CompressedBVH8::compress(*_bvh8));
+		if (_cbvh8) _bvh8.reset();
+	}
+	else if (bvhWidth == 4)
+	{
+		_bvh4.reset(BVH4::collapse(*bvh));
+		if (compressedNodes) _cbvh4.reset(CompressedBVH4::compress(*_bvh4));
+		if (_cbvh4) _bvh4.reset();
+	}
+	if (compressedNodes && (_bvh4 || _bvh8))
+	{
+		logWarning("Raytracer", "BVH leaves with more than 255 triangles can not be compressed, using full nodes.");
+	}
+	if (orderedTraversal && wide())
+	{
+		logWarning("Raytracer", "The ordered traversal only applies to the binary BVH, ignored with the wide BVH.");
+	}
+	else if (orderedTraversal)
+	{
+		_orderedStackSize = bvh->depth() + 1;
+	}
+}
+
+Raytracer::Raytracer(std::shared_ptr<const BVHPages> pages)
+	: _bvh(pages->tree())
+	, _pages(pages)
+{
+}
+
+Raytracer::Raytracer(std::vector<std::shared_ptr<const Raytracer>> parts, const std::vector<MeshInstance> &instances, const BVHBuildParams &params)
+	: _parts(std::move(parts))
+{
+	const size_t count = instances.size();
+	std::vector<Vector3> mins(count);
+	std::vector<Vector3> maxs(count);
+	_instances.resize(count);
+	uint32_t firstTriangle = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		Instance &instance = _instances[i];
+		instance.part = instances[i].part;
+		instance.firstTriangle = firstTriangle;
+		instance.partToWorld = instances[i].transform;
+		instance.worldToPart = inverse(instance.partToWorld);
+
+		const Raytracer &part = *_parts[instance.part];
+		firstTriangle += uint32_t(part._bvh->triangles.size());
+
+		// World bounds of the corners of the part bounds
+		mins[i] = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+		maxs[i] = Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		if (part._bvh->nodes.empty()) continue;
+		const BVHNode &root = part._bvh->nodes[0];
+		for (uint32_t c = 0; c < 8; ++c)
+		{
+			const Vector3 corner(
+				c & 1 ? root.aabbMax.x : root.aabbMin.x,
+				c & 2 ? root.aabbMax.y : root.aabbMin.y,
+				c & 4 ? root.aabbMax.z : root.aabbMin.z);
+			const Vector3 p = instance.partToWorld.point(corner);
+			mins[i] = min(mins[i], p);
+			maxs[i] = max(maxs[i], p);
+		}
+	}
+
+	BVHBuildParams treeParams = params;
+	treeParams.maxTrianglesPerNode = 1;
+	_bvh.reset(BVH::createFromBounds(mins.data(), maxs.data(), count, treeParams));
+}
+
+inline const Vector4* Raytracer::triangle(uint32_t tidx, Vector4 *o_scratch) const
+{
+	if (_geometry.isQuantized())
+	{
+		_geometry.quantized.triangle(tidx, o_scratch);
+		return o_scratch;
+	}
+	if (!_geometry.indexed()) return &_geometry.triangles[tidx];
+
+	// Same float operations as the unindexed edges, so the hits are the same
+	const Vector3 &p0 = _geometry.vertexPositions[_geometry.indices[tidx + 0]];
+	o_scratch[0] = p0;
+	o_scratch[1] = _geometry.vertexPositions[_geometry.indices[tidx + 1]] - p0;
+	o_scratch[2] = _geometry.vertexPositions[_geometry.indices[tidx + 2]] - p0;
+	return o_scratch;
+}
+
+template <typename LeafFunc>
+inline void Raytracer::traverse(const Vector3 &o, const Vector3 &d, const float &mindist, const float &curdist, LeafFunc leafFunc) const
+{
+	if (_cbvh8)
+	{
+		traverseWide(*_cbvh8, o, d, mindist, curdist, leafFunc);
+	}
+	else if (_cbvh4)
+	{
+		traverseWide(*_cbvh4, o, d, mindist, curdist, leafFunc);
+	}
+	else if (_bvh8)
+	{
+		traverseWide(*_bvh8, o, d, mindist, curdist, leafFunc);
+	}
+	else if (_bvh4)
+	{
+		traverseWide(*_bvh4, o, d, mindist, curdist, leafFunc);
+	}
+	else
+	{
+		traverseBinary(o, d, mindist, curdist, leafFunc);
+	}
+}
+
+template <typename Tree, typename LeafFunc>
+void Raytracer::traverseWide(const Tree &bvh, const Vector3 &o, const Vector3 &d, const float &mindist, const float &curdist, LeafFunc leafFunc) const
+{
+	typedef typename Tree::Node Node;
+	const size_t Width = Node::k_width;
+
+	if (bvh.nodes.empty()) return;
+
+	if (t_stack.size() < bvh.stackSize()) t_stack.resize(bvh.stackSize());
+	StackEntry *stack = t_stack.data();
+	size_t stackCount = 0;
+	stack[stackCount++] = StackEntry{ 0, -FLT_MAX };
+
+	const WideRay ray(o, Vector3(1.0f / d.x, 1.0f / d.y, 1.0f / d.z));
+	while (stackCount > 0)
+	{
+		const StackEntry entry = stack[--stackCount];
+		if (entry.dist >= curdist) continue;
+
+		const Node &node = bvh.nodes[entry.node];
+		float dist[Width];
+		const uint32_t mask = rayChildren(node, ray, mindist, curdist, dist);
+
+		// Leaves are intersected right away, inner nodes are pushed so the first slot is popped first
+		uint32_t innerMask = 0;
+		for (size_t s = 0; s < Width; ++s)
+		{
+			if (!(mask & (1u << s))) continue;
+			if (node.isLeaf(s))
+			{
+				if (dist[s] < curdist && leafFunc(node.child[s] * 3, (node.child[s] + node.count[s]) * 3)) return;
+			}
+			else
+			{
+				innerMask |= 1u << s;
+			}
+		}
+		for (size_t s = Width; s-- > 0;)
+		{
+			if (innerMask & (1u << s)) stack[stackCount++] = StackEntry{ node.child[s], dist[s] };
+		}
+	}
+}
+
+template <typename LeafFunc>
+void Raytracer::traverseBinary(const Vector3 &o, const Vector3 &d, const float &mindist, const float &curdist, LeafFunc leafFunc) const
+{
+	if (_orderedStackSize > 0)
+	{
+		traverseOrdered(o, d, mindist, curdist, leafFunc);
+		return;
+	}
+
+	const Vector3 invd(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+	const BVHNode *nodes = _bvh->nodes.data();
+	const uint32_t nodeCount = uint32_t(_bvh->nodes.size());
+	uint32_t i = 0;
+	while (i < nodeCount)
+	{
+		const BVHNode &node = nodes[i];
+		const float distAABB = rayAABB(o, invd, node.aabbMin, node.aabbMax, mindist);
+		if (distAABB < curdist)
+		{
+			if (node.isLeaf() && leafFunc(node.offset * 3, (node.offset + node.count) * 3)) return;
+			++i;
+		}
+		else
+		{
+			i = node.skipIndex(i);
+		}
+	}
+}
+
+template <typename LeafFunc>
+void Raytracer::traverseOrdered(const Vector3 &o, const Vector3 &d, const float &mindist, const float &curdist, LeafFunc leafFunc) const
+{
+	if (_bvh->nodes.empty()) return;
+
+	if (t_orderedStack.size() < _orderedStackSize) t_orderedStack.resize(_orderedStackSize);
+	uint32_t *stack = t_orderedStack.data();
+	size_t stackCount = 0;
+
+	// The far child is pushed and its box tested when popped, against the closest hit so far
+	const Vector3 invd(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+	const BVHNode *nodes = _bvh->nodes.data();
+	uint32_t i = 0;
+	for (;;)
+	{
+		const BVHNode &node = nodes[i];
+		if (rayAABB(o, invd, node.aabbMin, node.aabbMax, mindist) < curdist)
+		{
+			if (!node.isLeaf())
+			{
+				const uint32_t first = i + 1;
+				const uint32_t second = nodes[first].skipIndex(first);
+				const bool secondFirst = node.secondChildFirst(d);
+				stack[stackCount++] = secondFirst ? first : second;
+				i = secondFirst ? second : first;
+				continue;
+			}
+			if (leafFunc(node.offset * 3, (node.offset + node.count) * 3)) return;
+		}
+		if (stackCount == 0) return;
+		i = stack[--stackCount];
+	}
+}
+
+template <typename ChildFunc>
+inline bool Raytracer::visitChild(uint32_t index, const Vector3 &o, const Vector3 &d, ChildFunc childFunc) const
+{
+	if (_pages)
+	{
+		const BVHPages::PageRef page = _pages->page(index);
+		return childFunc(ChildRay{ page.get(), o, d, _pages->firstTriangle(index) * 3 });
+	}
+	const Instance &instance = _instances[index];
+	return childFunc(ChildRay{
+		_parts[instance.part].get(),
+		instance.worldToPart.point(o),
+		instance.worldToPart.vector(d),
+		instance.firstTriangle * 3 });
+}
+
+const Raytracer::Instance& Raytracer::instanceOfTriangle(uint32_t triangle) const
+{
+	auto it = std::upper_bound(_instances.begin(), _instances.end(), triangle, [](uint32_t t, const Instance &instance)
+	{
+		return t < instance.firstTriangle;
+	});
+	assert(it != _instances.begin());
+	return *(it - 1);
+}
+
+template <typename ChildFunc>
+void Raytracer::traverseChildren(const Vector3 &o, const Vector3 &d, const float &mindist, const float &curdist, ChildFunc childFunc) const
+{
+	traverseBinary(o, d, mindist, curdist, [&](uint32_t start, uint32_t end)
+	{
+		for (uint32_t k = start / 3; k < end / 3; ++k)
+		{
+			if (visitChild(_bvh->triangles[k], o, d, childFunc)) return true;
+		}
+		return false;
+	});
+}
+
+template <typename ActiveFunc, typename ChildFunc>
+void Raytracer::packetChildren(const Vector3 &o, const Vector3 *dirs, size_t count, float mindist, float maxdist,
+	ActiveFunc active, ChildFunc childFunc) const
+{
+	std::vector<uint64_t> &childRays = t_childRays;
+	childRays.clear();
+	for (size_t r = 0; r < count; ++r)
+	{
+		traverseBinary(o, dirs[r], mindist, maxdist, [&](uint32_t start, uint32_t end)
+		{
+			for (uint32_t k = start / 3; k < end / 3; ++k)
+			{
+				childRays.push_back((uint64_t(_bvh->triangles[k]) << 32) | r);
+			}
+			return false;
+		});
+	}
+
+	// Rays keep their order within a child, so they stay coherent
+	std::sort(childRays.begin(), childRays.end());
+	std::vector<Vector3> &childDirs = t_childDirs;
+	std::vector<uint32_t> &rayIndices = t_childRayIndices;
+	for (size_t first = 0; first < childRays.size();)
+	{
+		const uint32_t index = uint32_t(childRays[first] >> 32);
+		rayIndices.clear();
+		size_t end = first;
+		for (; end < childRays.size() && uint32_t(childRays[end] >> 32) == index; ++end)
+		{
+			const uint32_t r = uint32_t(childRays[end]);
+			if (active(r)) rayIndices.push_back(r);
+		}
+		first = end;
+		if (rayIndices.empty()) continue;
+
+		// Only the origin goes through visitChild, the directions are transformed here
+		visitChild(index, o, Vector3(0, 0, 0), [&](const ChildRay &child)
+		{
+			childDirs.clear();
+			for (const uint32_t r : rayIndices)
+			{
+				childDirs.push_back(_pages ? dirs[r] : _instances[index].worldToPart.vector(dirs[r]));
+			}
+			childFunc(child, childDirs.data(), rayIndices.data(), rayIndices.size());
+			return false;
+		});
+	}
+}
+
+uint32_t Raytracer::nearestPage(const Vector3 &o, const Vector3 &d) const
+{
+	assert(_pages);
+	const BVHNode *nodes = _bvh->nodes.data();
+	const uint32_t nodeCount = uint32_t(_bvh->nodes.size());
+	uint32_t nearest = UINT32_MAX;
+	float nearestDist = FLT_MAX;
+
+	// Both ways, as the mesh mapping rays
+	for (const float sign : { 1.0f, -1.0f })
+	{
+		const Vector3 invd(sign / d.x, sign / d.y, sign / d.z);
+		uint32_t i = 0;
+		while (i < nodeCount)
+		{
+			const BVHNode &node = nodes[i];
+			const float dist = std::fmaxf(rayAABB(o, invd, node.aabbMin, node.aabbMax), 0.0f);
+			if (dist < nearestDist)
+			{
+				if (node.isLeaf())
+				{
+					nearest = node.offset;
+					nearestDist = dist;
+				}
+				++i;
+			}
+			else
+			{
+				i = node.skipIndex(i);
+			}
+		}
+	}
+	return nearest;
+}
+
+float Raytracer::raycast(const Vector3 &o, const Vector3 &d, float mint, uint32_t &o_idx, Vector3 &o_bcoord) const
+{
+	if (twoLevel())
+	{
+		traverseChildren(o, d, 0.0f, mint, [&](const ChildRay &child)
+		{
+			uint32_t idx;
+			const float t = child.raytracer->raycast(child.o, child.d, mint, idx, o_bcoord);
+			if (t < mint)
+			{
+				mint = t;
+				o_idx = child.firstTidx + idx;
+			}
+			return false;
+		});
+		return mint;
+	}
+
+	traverse(o, d, 0.0f, mint, [&](uint32_t start, uint32_t end)
+	{
+		Vector4 scratch[3];
+		for (uint32_t tidx = start; tidx < end; tidx += 3)
+		{
+			Vector3 bcoord;
+			const float t = raycastTriangle<Facing::Any>(o, d, triangle(tidx, scratch), k_baryMin, bcoord);
+			if (t < mint)
+			{
+				mint = t;
+				o_idx = tidx;
+				o_bcoord = bcoord;
+			}
+		}
+		return false;
+	});
+	return mint;
+}
+
+void Raytracer::raycastNoBackfaces(const Vector3 &o, const Vector3 &d, float &curdist, uint32_t &o_idx, Vector3 &o_bcoord) const
+{
+	if (twoLevel())
+	{
+		traverseChildren(o, d, 0.0f, curdist, [&](const ChildRay &child)
+		{
+			const float before = curdist;
+			uint32_t idx;
+			child.raytracer->raycastNoBackfaces(child.o, child.d, curdist, idx, o_bcoord);
+			if (curdist < before) o_idx = child.firstTidx + idx;
+			return false;
+		});
+		return;
+	}
+
+	traverse(o, d, 0.0f, curdist, [&](uint32_t start, uint32_t end)
+	{
+		Vector4 scratch[3];
+		for (uint32_t tidx = start; tidx < end; tidx += 3)
+		{
+			Vector3 bcoord;
+			const float t = raycastTriangle<Facing::Away>(o, d, triangle(tidx, scratch), k_baryMin, bcoord);
+			if (t < curdist)
+			{
+				curdist = t;
+				o_idx = tidx;
+				o_bcoord = bcoord;
+			}
+		}
+		return false;
+	});
+}
+
+void Raytracer::raycastBack(const Vector3 &o, const Vector3 &d, float &curdist, uint32_t &o_idx, Vector3 &o_bcoord) const
+{
+	if (twoLevel())
+	{
+		traverseChildren(o, d, 0.0f, curdist, [&](const ChildRay &child)
+		{
+			const float before = curdist;
+			uint32_t idx;
+			child.raytracer->raycastBack(child.o, child.d, curdist, idx, o_bcoord);
+			if (curdist < before) o_idx = child.firstTidx + idx;
+			return false;
+		});
+		return;
+	}
+
+	traverse(o, d, 0.0f, curdist, [&](uint32_t start, uint32_t end)
+	{
+		Vector4 scratch[3];
+		for (uint32_t tidx = start; tidx < end; tidx += 3)
+		{
+			Vector3 bcoord;
+			const float t = raycastTriangle<Facing::Towards>(o, d, triangle(tidx, scratch), k_baryMin, bcoord);
+			if (t < curdist)
+			{
+				curdist = t;
+				o_idx = tidx;
+				o_bcoord = bcoord;
+			}
+		}
+		return false;
+	});
+}
+
+float Raytracer::raycastLine(const Vector3 &o, const Vector3 &d, float maxFront, float maxRear, bool cullBackfaces,
+	uint32_t &o_idx, Vector3 &o_bcoord) const
+{
+	LineQuery query{ -maxRear, maxFront, cullBackfaces, false, FLT_MAX, 0, Vector3(0, 0, 0) };
+	raycastLine(o, d, query);
+	if (query.hit)
+	{
+		o_idx = query.idx;
+		o_bcoord = query.bcoord;
+	}
+	return query.t;
+}
+
+void Raytracer::raycastLine(const Vector3 &o, const Vector3 &d, LineQuery &query) const
+{
+	if (twoLevel())
+	{
+		traverseChildren(o, d, query.mins, query.maxs, [&](const ChildRay &child)
+		{
+			LineQuery childQuery = query;
+			childQuery.hit = false;
+			child.raytracer->raycastLine(child.o, child.d, childQuery);
+			if (childQuery.hit)
+			{
+				query = childQuery;
+				query.idx += child.firstTidx;
+			}
+			return false;
+		});
+		return;
+	}
+
+	// A hit along d bounds the next ones along -d to be closer, and one along -d
+	// bounds the next ones along d to be as close, so ties go to d
+	auto hitLine = [&](uint32_t tidx, float s, const Vector3 &bcoord)
+	{
+		if (!(s >= 0 ? s < query.maxs : s > query.mins)) return;
+		query.t = std::fabs(s);
+		query.maxs = s >= 0 ? s : std::fminf(query.maxs, std::nextafterf(query.t, FLT_MAX));
+		query.mins = s >= 0 ? std::fmaxf(query.mins, -s) : s;
+		query.hit = true;
+		query.idx = tidx;
+		query.bcoord = bcoord;
+	};
+
+	traverse(o, d, query.mins, query.maxs, [&](uint32_t start, uint32_t end)
+	{
+		Vector4 scratch[3];
+		for (uint32_t tidx = start; tidx < end; tidx += 3)
+		{
+			Vector3 bcoord;
+			const float s = query.cullBackfaces ?
+				raycastTriangleLine<Facing::Away>(o, d, triangle(tidx, scratch), k_baryMin, bcoord) :
+				raycastTriangleLine<Facing::Any>(o, d, triangle(tidx, scratch), k_baryMin, bcoord);
+			if (s != FLT_MAX) hitLine(tidx, s, bcoord);
+		}
+		return false;
+	});
+}
+
+float Raytracer::raycastDist(const Vector3 &o, const Vector3 &d, float mindist, float maxdist) const
+{
+	float mint = FLT_MAX;
+	float curdist = maxdist; // min(mint, maxdist)
+	if (twoLevel())
+	{
+		traverseChildren(o, d, 0.0f, curdist, [&](const ChildRay &child)
+		{
+			const float t = child.raytracer->raycastDist(child.o, child.d, mindist, curdist);
+			if (t < mint)
+			{
+				mint = t;
+				curdist = t;
+			}
+			return false;
+		});
+		return mint;
+	}
+
+	traverse(o, d, 0.0f, curdist, [&](uint32_t start, uint32_t end)
+	{
+		Vector4 scratch[3];
+		for (uint32_t tidx = start; tidx < end; tidx += 3)
+		{
+			const float t = raycastTriangleDist(o, d, triangle(tidx, scratch));
+			if (t >= mindist && t < mint)
+			{
+				mint = t;
+				curdist = std::fminf(mint, maxdist);
+			}
+		}
+		return false;
+	});
+	// Hits past maxdist depend on the traversal order, they are misses
+	return mint < maxdist ? mint : FLT_MAX;
+}
+
+void Raytracer::raycastDistPacket(const Vector3 &o, const Vector3 *dirs, size_t count, float mindist, float maxdist, float *o_t) const
+{
+	if (twoLevel())
+	{
+		std::fill(o_t, o_t + count, FLT_MAX);
+		packetChildren(o, dirs, count, 0.0f, maxdist, [](uint32_t) { return true; },
+			[&](const ChildRay &child, const Vector3 *childDirs, const uint32_t *rays, size_t childCount)
+		{
+			std::vector<float> &dists = t_childDists;
+			dists.resize(childCount);
+			child.raytracer->raycastDistPacket(child.o, childDirs, childCount, mindist, maxdist, dists.data());
+			for (size_t k = 0; k < childCount; ++k)
+			{
+				o_t[rays[k]] = std::fminf(o_t[rays[k]], dists[k]);
+			}
+		});
+		return;
+	}
+
+	if (!wide())
+	{
+		for (size_t r = 0; r < count; ++r)
+		{
+			o_t[r] = raycastDist(o, dirs[r], mindist, maxdist);
+		}
+		return;
+	}
+
+	auto triangleFunc = [this](uint32_t tidx, Vector4 *scratch) { return triangle(tidx, scratch); };
+	RayPacket p;
+	p.o = o;
+	p.mindist = 0.0f;
+	for (size_t first = 0; first < count; first += RayPacket::k_size)
+	{
+		loadPacket(p, dirs + first, std::min(count - first, RayPacket::k_size), maxdist);
+		auto leafFunc = [&](uint32_t mask, uint32_t start, uint32_t end)
+		{
+			packetTriangles(p, mask, triangleFunc, start, end, mindist, maxdist);
+		};
+
+		if (_cbvh8)
+		{
+			traversePacket(*_cbvh8, p, leafFunc);
+		}
+		else if (_cbvh4)
+		{
+			traversePacket(*_cbvh4, p, leafFunc);
+		}
+		else if (_bvh8)
+		{
+			traversePacket(*_bvh8, p, leafFunc);
+		}
+		else
+		{
+			traversePacket(*_bvh4, p, leafFunc);
+		}
+
+		for (size_t r = 0; r < p.count; ++r)
+		{
+			o_t[first + r] = p.mint[r] < maxdist ? p.mint[r] : FLT_MAX;
+		}
+	}
+}
+
+bool Raytracer::occluded(const Vector3 &o, const Vector3 &d, float mindist, float maxdist) const
+{
+	bool hit = false;
+	if (twoLevel())
+	{
+		traverseChildren(o, d, mindist, maxdist, [&](const ChildRay &child)
+		{
+			hit = child.raytracer->occluded(child.o, child.d, mindist, maxdist);
+			return hit;
+		});
+		return hit;
+	}
+
+	traverse(o, d, mindist, maxdist, [&](uint32_t start, uint32_t end)
+	{
+		Vector4 scratch[3];
+		for (uint32_t tidx = start; tidx < end; tidx += 3)
+		{
+			const float t = raycastTriangleDist(o, d, triangle(tidx, scratch));
+			if (t >= mindist && t < maxdist)
+			{
+				hit = true;
+				return true;
+			}
+		}
+		return false;
+	});
+	return hit;
+}
+
+void Raytracer::occludedPacket(const Vector3 &o, const Vector3 *dirs, size_t count, float mindist, float maxdist, uint8_t *o_occluded) const
+{
+	if (twoLevel())
+	{
+		std::fill(o_occluded, o_occluded + count, uint8_t(0));
+		packetChildren(o, dirs, count, mindist, maxdist, [&](uint32_t r) { return o_occluded[r] == 0; },
+			[&](const ChildRay &child, const Vector3 *childDirs, const uint32_t *rays, size_t childCount)
+		{
+			std::vector<uint8_t> &occluded = t_childOccluded;
+			occluded.resize(childCount);
+			child.raytracer->occludedPacket(child.o, childDirs, childCount, mindist, maxdist, occluded.data());
+			for (size_t k = 0; k < childCount; ++k)
+			{
+				o_occluded[rays[k]] |= occluded[k];
+			}
+		});
+		return;
+	}
+
+	if (!wide())
+	{
+		for (size_t r = 0; r < count; ++r)
+		{
+			o_occluded[r] = occluded(o, dirs[r], mindist, maxdist) ? 1 : 0;
+		}
+		return;
+	}
+
+	auto triangleFunc = [this](uint32_t tidx, Vector4 *scratch) { return triangle(tidx, scratch); };
+	RayPacket p;
+	p.o = o;
+	p.mindist = mindist;
+	for (size_t first = 0; first < count; first += RayPacket::k_size)
+	{
+		loadPacket(p, dirs + first, std::min(count - first, RayPacket::k_size), maxdist);
+		auto leafFunc = [&](uint32_t mask, uint32_t start, uint32_t end)
+		{
+			packetTrianglesOcclusion(p, mask, triangleFunc, start, end, mindist);
+		};
+
+		if (_cbvh8)
+		{
+			traversePacket(*_cbvh8, p, leafFunc);
+		}
+		else if (_cbvh4)
+		{
+			traversePacket(*_cbvh4, p, leafFunc);
+		}
+		else if (_bvh8)
+		{
+			traversePacket(*_bvh8, p, leafFunc);
+		}
+		else
+		{
+			traversePacket(*_bvh4, p, leafFunc);
+		}
+
+		for (size_t r = 0; r < p.count; ++r)
+		{
+			o_occluded[first + r] = (p.active >> r) & 1 ? 0 : 1;
+		}
+	}
+}
+
+void Raytracer::sortCoherent(Vector3 *dirs, size_t count)
+{
+	std::sort(dirs, dirs + count, [](const Vector3 &a, const Vector3 &b)
+	{
+		return directionKey(a) < directionKey(b);
+	});
+}
+
+Vector3 Raytracer::position(uint32_t tidx, const Vector3 &bcoord) const
+{
+	if (_pages)
+	{
+		const uint32_t index = _pages->pageOfTriangle(tidx / 3);
+		return _pages->page(index)->position(tidx - _pages->firstTriangle(index) * 3, bcoord);
+	}
+	if (!_instances.empty())
+	{
+		const Instance &instance = instanceOfTriangle(tidx / 3);
+		return instance.partToWorld.point(_parts[instance.part]->position(tidx - instance.firstTriangle * 3, bcoord));
+	}
+	assert(tidx / 3 < _geometry.triangleCount());
+	Vector4 scratch[3];
+	const Vector4 *tri = triangle(tidx, scratch);
+	return
+		toVector3(tri[0]) +
+		toVector3(tri[1]) * bcoord.y +
+		toVector3(tri[2]) * bcoord.z;
+}
+
+Vector3 Raytracer::normal(uint32_t tidx, const Vector3 &bcoord) const
+{
+	if (_pages)
+	{
+		const uint32_t index = _pages->pageOfTriangle(tidx / 3);
+		return _pages->page(index)->normal(tidx - _pages->firstTriangle(index) * 3, bcoord);
+	}
+	if (!_instances.empty())
+	{
+		const Instance &instance = instanceOfTriangle(tidx / 3);
+		const Vector3 n = _parts[instance.part]->normal(tidx - instance.firstTriangle * 3, bcoord);
+		return normalize(instance.worldToPart.transposedVector(n));
+	}
+	assert(tidx / 3 < _geometry.triangleCount());
+	if (_geometry.isQuantized())
+	{
+		Vector3 normals[3];
+		_geometry.quantized.normals(tidx, normals);
+		return normalize(normals[0] * bcoord.x + normals[1] * bcoord.y + normals[2] * bcoord.z);
+	}
+	if (_geometry.indexed())
+	{
+		return normalize(
+			_geometry.vertexNormals[_geometry.indices[tidx + 0]] * bcoord.x +
+			_geometry.vertexNormals[_geometry.indices[tidx + 1]] * bcoord.y +
+			_geometry.vertexNormals[_geometry.indices[tidx + 2]] * bcoord.z);
+	}
+	return normalize(
+		toVector3(_geometry.normals[tidx + 0]) * bcoord.x +
+		toVector3(_geometry.normals[tidx + 1]) * bcoord.y +
+		toVector3(_geometry.normals[tidx + 2]) * bcoord.z);
+}
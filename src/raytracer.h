@@ -0,0 +1,244 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "bvh.h"
+#include "math.h"
+#include "quantizedgeometry.h"
+#include "widebvh.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class BVHPages;
+struct MeshInstance;
+
+/// High-poly triangles in BVH leaf order
+/// Unindexed geometry has three entries per triangle in triangles
+/// (v0, e1 = v1 - v0, e2 = v2 - v0) and normals, the layout uploaded to the GPU.
+/// Indexed geometry has three entries per triangle in indices, pointing to
+/// vertices shared by the triangles. It takes about a quarter of the memory and
+/// the edges are computed while tracing.
+/// Quantized geometry is smaller still and decoded while tracing, see
+/// QuantizedGeometry. Only one of the representations is filled.
+struct RaytracerGeometry
+{
+	std::vector<Vector4> triangles;
+	std::vector<Vector4> normals;
+	std::vector<uint32_t> indices;
+	std::vector<Vector3> vertexPositions;
+	std::vector<Vector3> vertexNormals;
+	QuantizedGeometry quantized;
+
+	inline bool indexed() const { return !indices.empty(); }
+	inline bool isQuantized() const { return !quantized.empty(); }
+	inline size_t triangleCount() const
+	{
+		if (isQuantized()) return quantized.triangleCount();
+		return (indexed() ? indices.size() : triangles.size()) / 3;
+	}
+	/// Bytes used by the arrays
+	size_t memorySize() const;
+};
+
+/// CPU ray tracer for the high-poly mesh
+/// Works on the same BVH nodes and triangle data uploaded to the GPU and
+/// mirrors the traversal and intersection routines in shaders/common.sh, so the
+/// CPU backend produces the same results as the compute shaders.
+/// Triangle indices (tidx) are indices to the first entry of the triangle in
+/// the triangle data (in BVH leaf order), as in the shaders. They are the same
+/// for indexed and unindexed geometry.
+/// An out-of-core ray tracer traces the pages of a BVHPages file instead,
+/// loading them as rays reach them. An instanced ray tracer traces the
+/// ray tracers of the parts of an InstancedScene through a tree over the
+/// instances. Both are two-level ray tracers, which trace their children.
+class Raytracer
+{
+public:
+	/// @param bvhWidth Children per node of the tree traversed (2, 4 or 8)
+	/// Wider trees are collapsed from the binary BVH and their nodes are
+	/// tested with SIMD, the results are the same.
+	/// @param orderedTraversal Binary trees: descend into the child the ray
+	/// reaches first and keep the other one in a stack, instead of the
+	/// stackless walk of the shaders. Closest hits found early cull more
+	/// nodes. The results are the same. Ignored with a warning for wide trees.
+	/// @param compressedNodes Wide trees: quantize the child bounds to 8 bits
+	/// (CompressedWideBVHNode), half the node memory. Falls back to full
+	/// nodes when a leaf has more than 255 triangles.
+	Raytracer(std::shared_ptr<const BVH> bvh, RaytracerGeometry &&geometry, size_t bvhWidth = 2, bool orderedTraversal = false,
+		bool compressedNodes = false);
+
+	/// Out-of-core ray tracer over the pages of a high-poly mesh
+	/// The results are the same as tracing the whole mesh. Packet queries
+	/// are split in a packet per page reached by their rays.
+	explicit Raytracer(std::shared_ptr<const BVHPages> pages);
+
+	/// Two-level ray tracer over instances of parts
+	/// Rays are transformed to the space of every instance they reach, the
+	/// distances are the same. Triangle indices count the leaf references of
+	/// the instances one after another.
+	/// @param parts Ray tracer of every part
+	/// @param params Build settings of the tree over the instances
+	Raytracer(std::vector<std::shared_ptr<const Raytracer>> parts, const std::vector<MeshInstance> &instances, const BVHBuildParams &params);
+
+	/// Closest hit in any facing (raycastBVH in the shaders)
+	/// @param mint Only hits closer than this are considered
+	/// @return Distance to the closest hit or mint if nothing was hit
+	float raycast(const Vector3 &o, const Vector3 &d, float mint, uint32_t &o_idx, Vector3 &o_bcoord) const;
+
+	/// Closest hit against triangles facing away from the ray (raycastBVH_nobackfaces)
+	/// @param curdist In: max distance. Out: distance to the closest hit
+	void raycastNoBackfaces(const Vector3 &o, const Vector3 &d, float &curdist, uint32_t &o_idx, Vector3 &o_bcoord) const;
+
+	/// Closest hit against triangles facing the ray (raycastBackBVH)
+	/// @param curdist In: max distance. Out: distance to the closest hit
+	void raycastBack(const Vector3 &o, const Vector3 &d, float &curdist, uint32_t &o_idx, Vector3 &o_bcoord) const;
+
+	/// Closest hit on the line through o, up to maxFront along d and maxRear along -d
+	/// The same hit as raycast() along d and then along -d up to the first hit (or
+	/// raycastNoBackfaces() and raycastBack() when culling), in a single traversal
+	/// of the boxes the segment crosses. Hits along d win ties.
+	/// @return Distance to the closest hit or FLT_MAX if nothing was hit
+	float raycastLine(const Vector3 &o, const Vector3 &d, float maxFront, float maxRear, bool cullBackfaces,
+		uint32_t &o_idx, Vector3 &o_bcoord) const;
+
+	/// Distance to the closest hit further than mindist (raycastBVH_dist)
+	/// @return Distance or FLT_MAX if nothing was hit closer than maxdist
+	float raycastDist(const Vector3 &o, const Vector3 &d, float mindist, float maxdist) const;
+
+	/// raycastDist() for rays sharing an origin, as the hemisphere samples of a texel
+	/// With a wide tree the rays are traversed in packets that share node
+	/// fetches and box tests, so coherent directions should be consecutive.
+	/// @param o_t Distance for every ray or FLT_MAX if nothing was hit closer than maxdist
+	void raycastDistPacket(const Vector3 &o, const Vector3 *dirs, size_t count, float mindist, float maxdist, float *o_t) const;
+
+	/// Whether anything is hit in [mindist, maxdist) (occludedBVH)
+	/// Boxes outside the range are skipped and the traversal stops at the first hit.
+	bool occluded(const Vector3 &o, const Vector3 &d, float mindist, float maxdist) const;
+
+	/// occluded() for rays sharing an origin, traversed in packets as raycastDistPacket()
+	/// Rays leave the packet as soon as they hit something.
+	/// @param o_occluded 1 for every occluded ray, 0 otherwise
+	void occludedPacket(const Vector3 &o, const Vector3 *dirs, size_t count, float mindist, float maxdist, uint8_t *o_occluded) const;
+
+	/// Sorts directions so nearby ones are consecutive, for the packet queries
+	static void sortCoherent(Vector3 *dirs, size_t count);
+
+	/// Interpolated position on a triangle
+	Vector3 position(uint32_t tidx, const Vector3 &bcoord) const;
+
+	/// Interpolated and normalized normal on a triangle
+	Vector3 normal(uint32_t tidx, const Vector3 &bcoord) const;
+
+	/// Empty for two-level ray tracers
+	inline const RaytracerGeometry& geometry() const { return _geometry; }
+
+	/// Bytes of the tree, the wide trees collapsed from it and the geometry
+	/// The children of two-level ray tracers are not counted.
+	size_t memorySize() const;
+
+	inline bool paged() const { return _pages != nullptr; }
+	/// Out-of-core ray tracers: page whose bounds the line through o enters closest to o
+	/// @return Page index or UINT32_MAX if the line misses all the pages
+	uint32_t nearestPage(const Vector3 &o, const Vector3 &d) const;
+
+private:
+	/// Triangle tidx as v0, e1, e2
+	/// Indexed and quantized triangles are decoded into o_scratch, which is returned.
+	const Vector4* triangle(uint32_t tidx, Vector4 *o_scratch) const;
+
+	/// Search state of raycastLine(), hits are looked for at o + s * d with s in (mins, maxs)
+	struct LineQuery
+	{
+		float mins; // Minus the distance along -d hits have to be closer than
+		float maxs; // Distance along d hits have to be closer than
+		bool cullBackfaces;
+		bool hit;
+		float t;
+		uint32_t idx;
+		Vector3 bcoord;
+	};
+	void raycastLine(const Vector3 &o, const Vector3 &d, LineQuery &query) const;
+
+	/// Calls leafFunc(start, end) for the leaves whose bounds overlap [mindist, curdist)
+	/// Both bounds are read as the traversal goes, so leafFunc can narrow them.
+	/// mindist is negative for the lines of raycastLine().
+	/// The traversal stops when leafFunc returns true.
+	template <typename LeafFunc>
+	void traverse(const Vector3 &o, const Vector3 &d, const float &mindist, const float &curdist, LeafFunc leafFunc) const;
+	template <typename LeafFunc>
+	void traverseBinary(const Vector3 &o, const Vector3 &d, const float &mindist, const float &curdist, LeafFunc leafFunc) const;
+	template <typename LeafFunc>
+	void traverseOrdered(const Vector3 &o, const Vector3 &d, const float &mindist, const float &curdist, LeafFunc leafFunc) const;
+	/// Tree: WideBVH or CompressedWideBVH
+	template <typename Tree, typename LeafFunc>
+	void traverseWide(const Tree &bvh, const Vector3 &o, const Vector3 &d, const float &mindist, const float &curdist, LeafFunc leafFunc) const;
+
+	/// Placement of a part in an instanced ray tracer
+	struct Instance
+	{
+		uint32_t part;
+		uint32_t firstTriangle;
+		Transform partToWorld;
+		Transform worldToPart;
+	};
+
+	/// Child of a two-level ray tracer, with the ray in its space
+	struct ChildRay
+	{
+		const Raytracer *raytracer;
+		Vector3 o;
+		Vector3 d;
+		uint32_t firstTidx; // Added to the triangle indices of the child
+	};
+
+	inline bool twoLevel() const { return _pages || !_instances.empty(); }
+	inline bool wide() const { return _bvh4 || _bvh8 || _cbvh4 || _cbvh8; }
+	/// Calls childFunc(child) with child 'index' of a two-level ray tracer
+	template <typename ChildFunc>
+	bool visitChild(uint32_t index, const Vector3 &o, const Vector3 &d, ChildFunc childFunc) const;
+	/// Instance of a triangle of an instanced ray tracer
+	const Instance& instanceOfTriangle(uint32_t triangle) const;
+
+	/// Calls childFunc(child) for the children whose bounds overlap [mindist, curdist)
+	/// The traversal stops when childFunc returns true.
+	template <typename ChildFunc>
+	void traverseChildren(const Vector3 &o, const Vector3 &d, const float &mindist, const float &curdist, ChildFunc childFunc) const;
+	/// Calls childFunc(child, dirs, rays, count) for every child reached by the rays of a packet
+	/// with the directions and indices of the rays that reach it and are still active(ray).
+	/// The directions are in the space of the child, as child.o.
+	template <typename ActiveFunc, typename ChildFunc>
+	void packetChildren(const Vector3 &o, const Vector3 *dirs, size_t count, float mindist, float maxdist,
+		ActiveFunc active, ChildFunc childFunc) const;
+
+	std::shared_ptr<const BVH> _bvh;
+	std::unique_ptr<BVH4> _bvh4;
+	std::unique_ptr<BVH8> _bvh8;
+	std::unique_ptr<CompressedBVH4> _cbvh4; // Replace _bvh4 and _bvh8 when compressed
+	std::unique_ptr<CompressedBVH8> _cbvh8;
+	size_t _orderedStackSize = 0; // Binary trees traversed in order, zero for the stackless walk
+	RaytracerGeometry _geometry;
+	std::shared_ptr<const BVHPages> _pages; // Out-of-core ray tracers, _bvh is the tree over the pages
+	std::vector<std::shared_ptr<const Raytracer>> _parts; // Instanced ray tracers, _bvh is the tree over _instances
+	std::vector<Instance> _instances;
+};
@@ -25,7 +25,11 @@ SOFTWARE.
 #include "computeshaders.h"
 #include "logging.h"
 #include "meshmapping.h"
+#include "raytracer.h"
+#include "threadpool.h"
+#include <algorithm>
 #include <cassert>
+#include <cfloat>
 
 #include "image.h"
 
@@ -40,7 +44,7 @@ namespace
 		uint32_t workOffset;
 		float _pad0;
 		uint32_t bvhSize;
-		float _pad1;
+		uint32_t geometryFlags;
 	};
 
 	std::vector<Vector3> computeSamples(size_t sampleCount, size_t permutationCount)
@@ -54,12 +58,26 @@ namespace
 
 void AmbientOcclusionSolver::init(std::shared_ptr<const CompressedMapUV> map, std::shared_ptr<MeshMapping> meshMapping)
 {
-	_rayProgram = LoadComputeShader_AO_GenData();
-	_aoProgram = LoadComputeShader_AO_Sampling();
-	_avgProgram = LoadComputeShader_AO_Aggregate();
 	_uvMap = map;
 	_meshMapping = meshMapping;
 	_workCount = ((map->positions.size() + k_groupSize - 1) / k_groupSize) * k_groupSize;
+	_workOffset = 0;
+
+	if (_params.backend == ComputeBackend::CPU)
+	{
+		_samples = computeSamples(_params.sampleCount, k_samplePermCount);
+		// Coherent consecutive samples are traversed together as ray packets
+		for (size_t p = 0; p < k_samplePermCount; ++p)
+		{
+			Raytracer::sortCoherent(&_samples[p * _params.sampleCount], _params.sampleCount);
+		}
+		_results.assign(_workCount, 1.0f);
+		return;
+	}
+
+	_rayProgram = LoadComputeShader_AO_GenData();
+	_aoProgram = LoadComputeShader_AO_Sampling();
+	_avgProgram = LoadComputeShader_AO_Aggregate();
 
 	{
 		ShaderParams params;
@@ -99,8 +117,6 @@ void AmbientOcclusionSolver::init(std::shared_ptr<const CompressedMapUV> map, st
 		, BGFX_TEXTURE_NONE|BGFX_SAMPLER_NONE
 		, bgfx::alloc(sizeof(float) * _workCount)
 		));
-
-	_workOffset = 0;
 }
 
 bool AmbientOcclusionSolver::runStep()
@@ -113,42 +129,53 @@ bool AmbientOcclusionSolver::runStep()
 
 	if (_workOffset == 0) _timing.begin();
 
-	UniformsData uniformsData;
-	uniformsData.workOffset = uint32_t(_workOffset / _params.sampleCount);
-	uniformsData.bvhSize = _meshMapping->meshBVH().size;
-
-	// Ray
-	bgfx::setUniform(_uniforms.handle, &uniformsData, 1);
-
-	bgfx::setBuffer(2, _meshMapping->meshPositions().handle, bgfx::Access::Read);
-	bgfx::setBuffer(3, _meshMapping->meshNormals().handle, bgfx::Access::Read);
-	bgfx::setBuffer(4, _meshMapping->coords().handle, bgfx::Access::Read);
-	bgfx::setBuffer(5, _meshMapping->coords_tidx().handle, bgfx::Access::Read);
-	bgfx::setBuffer(6, _rayDataCB.handle, bgfx::Access::Write);
-
-	bgfx::dispatch(0, _rayProgram.handle, work / k_groupSize, 1, 1);
-
-	// AO
-	bgfx::setUniform(_uniforms.handle, &uniformsData, 1);
-
-	bgfx::setBuffer(3, _paramsCB.handle, bgfx::Access::Read);
-	bgfx::setBuffer(4, _meshMapping->meshPositions().handle, bgfx::Access::Read);
-	bgfx::setBuffer(5, _meshMapping->meshBVH().handle, bgfx::Access::Read);
-	bgfx::setBuffer(6, _samplesCB.handle, bgfx::Access::Read);
-	bgfx::setBuffer(7, _rayDataCB.handle, bgfx::Access::Read);
-	bgfx::setBuffer(8, _resultsMiddleCB.handle, bgfx::Access::Write);
-
-	bgfx::dispatch(1, _aoProgram.handle, work / k_groupSize, 1, 1);
-
-	// Avg
-	bgfx::setUniform(_uniforms.handle, &uniformsData, 1);
-
-	bgfx::setBuffer(2, _paramsCB.handle, bgfx::Access::Read);
-	bgfx::setBuffer(3, _resultsMiddleCB.handle, bgfx::Access::Read);
-	//bgfx::setBuffer(4, _resultsFinalCB.handle, bgfx::Access::Write);
-	bgfx::setImage(4, _resultsFinalCB.handle, 0, bgfx::Access::Write, bgfx::TextureFormat::RGBA32F);
-
-	bgfx::dispatch(2, _avgProgram.handle, work / k_groupSize, 1, 1);
+	if (_params.backend == ComputeBackend::CPU)
+	{
+		runStepCPU(_workOffset, work);
+	}
+	else
+	{
+		UniformsData uniformsData;
+		uniformsData.workOffset = uint32_t(_workOffset / _params.sampleCount);
+		uniformsData.bvhSize = _meshMapping->meshBVH().size;
+		uniformsData.geometryFlags = _meshMapping->gpuGeometryFlags();
+		const bool indexed = (uniformsData.geometryFlags & MeshMapping::k_gpuGeometryIndexed) != 0;
+
+		// Ray
+		bgfx::setUniform(_uniforms.handle, &uniformsData, 1);
+
+		bgfx::setBuffer(2, _meshMapping->meshPositions().handle, bgfx::Access::Read);
+		bgfx::setBuffer(3, _meshMapping->meshNormals().handle, bgfx::Access::Read);
+		bgfx::setBuffer(4, _meshMapping->coords().handle, bgfx::Access::Read);
+		bgfx::setBuffer(5, _meshMapping->coords_tidx().handle, bgfx::Access::Read);
+		bgfx::setBuffer(6, _rayDataCB.handle, bgfx::Access::Write);
+		if (indexed) bgfx::setBuffer(7, _meshMapping->meshIndices().handle, bgfx::Access::Read);
+
+		bgfx::dispatch(0, _rayProgram.handle, work / k_groupSize, 1, 1);
+
+		// AO
+		bgfx::setUniform(_uniforms.handle, &uniformsData, 1);
+
+		bgfx::setBuffer(3, _paramsCB.handle, bgfx::Access::Read);
+		bgfx::setBuffer(4, _meshMapping->meshPositions().handle, bgfx::Access::Read);
+		bgfx::setBuffer(5, _meshMapping->meshBVH().handle, bgfx::Access::Read);
+		bgfx::setBuffer(6, _samplesCB.handle, bgfx::Access::Read);
+		bgfx::setBuffer(7, _rayDataCB.handle, bgfx::Access::Read);
+		bgfx::setBuffer(8, _resultsMiddleCB.handle, bgfx::Access::Write);
+		if (indexed) bgfx::setBuffer(9, _meshMapping->meshIndices().handle, bgfx::Access::Read);
+
+		bgfx::dispatch(1, _aoProgram.handle, work / k_groupSize, 1, 1);
+
+		// Avg
+		bgfx::setUniform(_uniforms.handle, &uniformsData, 1);
+
+		bgfx::setBuffer(2, _paramsCB.handle, bgfx::Access::Read);
+		bgfx::setBuffer(3, _resultsMiddleCB.handle, bgfx::Access::Read);
+		//bgfx::setBuffer(4, _resultsFinalCB.handle, bgfx::Access::Write);
+		bgfx::setImage(4, _resultsFinalCB.handle, 0, bgfx::Access::Write, bgfx::TextureFormat::RGBA32F);
+
+		bgfx::dispatch(2, _avgProgram.handle, work / k_groupSize, 1, 1);
+	}
 
 	_workOffset += work;
 
@@ -163,8 +190,68 @@ bool AmbientOcclusionSolver::runStep()
 	return _workOffset >= totalWork;
 }
 
+void AmbientOcclusionSolver::runStepCPU(size_t workOffset, size_t work)
+{
+	const size_t sampleCount = _params.sampleCount;
+	const size_t pixelCount = _uvMap->positions.size();
+	const size_t pixBegin = workOffset / sampleCount;
+	const size_t pixEnd = std::min((workOffset + work) / sampleCount, pixelCount);
+	if (pixBegin >= pixEnd) return;
+
+	const Raytracer &rt = *_meshMapping->raytracer();
+	const std::vector<Vector4> &coords = _meshMapping->coordsData();
+	const std::vector<uint32_t> &coordsTidx = _meshMapping->coordsTidxData();
+	const float minDistance = _params.minDistance;
+	const float maxDistance = _params.maxDistance;
+
+	ThreadPool::global().parallelFor(pixBegin, pixEnd, k_groupSize, [&](size_t begin, size_t end)
+	{
+		std::vector<Vector3> sampleDirs(sampleCount);
+		std::vector<uint8_t> sampleOccluded(sampleCount);
+		for (size_t i = begin; i < end; ++i)
+		{
+			const uint32_t tidx = coordsTidx[i];
+			if (tidx == UINT32_MAX)
+			{
+				// Nothing was mapped, nothing can occlude
+				_results[i] = 1.0f;
+				continue;
+			}
+
+			const Vector4 &coord = coords[i];
+			const Vector3 bcoord(coord.y, coord.z, coord.w);
+			const Vector3 o = rt.position(tidx, bcoord);
+			const Vector3 d = rt.normal(tidx, bcoord);
+			Vector3 tx, ty;
+			computeTangentFrame(d, tx, ty);
+
+			const Vector3 *samples = &_samples[(i % k_samplePermCount) * sampleCount];
+			for (size_t s = 0; s < sampleCount; ++s)
+			{
+				const Vector3 &rs = samples[s];
+				sampleDirs[s] = normalize(tx * rs.x + ty * rs.y + d * rs.z);
+			}
+			rt.occludedPacket(o, sampleDirs.data(), sampleCount, minDistance, maxDistance, sampleOccluded.data());
+
+			size_t occluded = 0;
+			for (size_t s = 0; s < sampleCount; ++s)
+			{
+				occluded += sampleOccluded[s];
+			}
+			_results[i] = 1.0f - float(occluded) / float(sampleCount);
+		}
+	});
+}
+
 float* AmbientOcclusionSolver::getResults()
 {
+	if (_params.backend == ComputeBackend::CPU)
+	{
+		float *data = new float[_results.size()];
+		std::copy(_results.begin(), _results.end(), data);
+		return data;
+	}
+
 	//assert(_sampleIndex >= _params.sampleCount);
 	//glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 	float* data = new float[_uvMap->width*_uvMap->height];
@@ -200,12 +287,13 @@ bool AmbientOcclusionTask::runStep()
 	return _solver->runStep();
 }
 
-void AmbientOcclusionTask::finish()
+bool AmbientOcclusionTask::finish()
 {
 	assert(_solver);
 	float *results = _solver->getResults();
-	exportFloatImage(results, _solver->uvMap().get(), _outputPath.c_str(), true, _dilation); // TODO: Normalize
+	const bool exported = exportFloatImage(results, _solver->uvMap().get(), _outputPath.c_str(), true, _dilation); // TODO: Normalize
 	delete[] results;
+	return exported;
 }
 
 float AmbientOcclusionTask::progress() const
@@ -40,6 +40,7 @@ public:
 		size_t sampleCount;
 		float minDistance;
 		float maxDistance;
+		ComputeBackend backend;
 	};
 
 public:
@@ -57,6 +58,8 @@ public:
 	inline std::shared_ptr<const CompressedMapUV> uvMap() const { return _uvMap; }
 
 private:
+	void runStepCPU(size_t workOffset, size_t work);
+
 	Params _params;
 	size_t _workOffset;
 	size_t _workCount;
@@ -95,6 +98,10 @@ private:
 	//VBHandle _resultsFinalCB;
 	TextureHandle _resultsFinalCB;
 
+	// CPU backend
+	std::vector<Vector3> _samples;
+	std::vector<float> _results;
+
 	std::shared_ptr<const CompressedMapUV> _uvMap;
 	std::shared_ptr<MeshMapping> _meshMapping;
 
@@ -108,7 +115,7 @@ public:
 	~AmbientOcclusionTask();
 
 	bool runStep();
-	void finish();
+	bool finish();
 	float progress() const;
 	const char* name() const { return "Ambient Occlusion"; }
 
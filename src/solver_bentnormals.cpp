@@ -26,7 +26,11 @@ SOFTWARE.
 #include "image.h"
 #include "logging.h"
 #include "meshmapping.h"
+#include "raytracer.h"
+#include "threadpool.h"
+#include <algorithm>
 #include <cassert>
+#include <cfloat>
 
 static const size_t k_groupSize = 64;
 static const size_t k_workPerFrame = 1024 * 128;
@@ -45,15 +49,28 @@ namespace
 
 void BentNormalsSolver::init(std::shared_ptr<const CompressedMapUV> map, std::shared_ptr<MeshMapping> meshMapping)
 {
+	_uvMap = map;
+	_meshMapping = meshMapping;
+	_workCount = ((map->positions.size() + k_groupSize - 1) / k_groupSize) * k_groupSize;
+	_workOffset = 0;
+
+	if (_params.backend == ComputeBackend::CPU)
+	{
+		_samples = computeSamples(_params.sampleCount, k_samplePermCount);
+		// Coherent consecutive samples are traversed together as ray packets
+		for (size_t p = 0; p < k_samplePermCount; ++p)
+		{
+			Raytracer::sortCoherent(&_samples[p * _params.sampleCount], _params.sampleCount);
+		}
+		_results.assign(_workCount, Vector3(0, 0, 0));
+		return;
+	}
+
 	_rayProgram = LoadComputeShader_BN_GenData();
 	_bentnormalsProgram = LoadComputeShader_BN_Sampling();
 	_avgProgram = LoadComputeShader_BN_Aggregate();
 	_tanspaceProgram = LoadComputeShader_ToTangentSpace();
 
-	_uvMap = map;
-	_meshMapping = meshMapping;
-	_workCount = ((map->positions.size() + k_groupSize - 1) / k_groupSize) * k_groupSize;
-
 	{
 		ShaderParams params;
 		params.sampleCount = (uint32_t)_params.sampleCount;
@@ -75,8 +92,6 @@ void BentNormalsSolver::init(std::shared_ptr<const CompressedMapUV> map, std::sh
 		new ComputeBuffer<Vector4>(k_workPerFrame, GL_STATIC_READ)); // TODO: static read?
 	_resultsFinalCB = std::unique_ptr<ComputeBuffer<Vector3> >(
 		new ComputeBuffer<Vector3>(_workCount, GL_STATIC_READ));
-
-	_workOffset = 0;
 }
 
 bool BentNormalsSolver::runStep()
@@ -89,43 +104,50 @@ bool BentNormalsSolver::runStep()
 
 	if (_workOffset == 0) _timing.begin();
 
-	glUseProgram(_rayProgram);
-	glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->meshPositions()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _meshMapping->meshNormals()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _meshMapping->coords()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _meshMapping->coords_tidx()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, _rayDataCB->bo());
-	glDispatchCompute((GLuint)(work / _params.sampleCount / k_groupSize), 1, 1);
+	if (_params.backend == ComputeBackend::CPU)
+	{
+		runStepCPU(_workOffset, work);
+	}
+	else
+	{
+		glUseProgram(_rayProgram);
+		glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->meshPositions()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _meshMapping->meshNormals()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _meshMapping->coords()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _meshMapping->coords_tidx()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, _rayDataCB->bo());
+		glDispatchCompute((GLuint)(work / _params.sampleCount / k_groupSize), 1, 1);
 
-	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-	glUseProgram(_bentnormalsProgram);
-	glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
-	glUniform1ui(2, (GLuint)_meshMapping->meshBVH()->size());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _paramsCB->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _meshMapping->meshPositions()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _meshMapping->meshBVH()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, _samplesCB->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, _rayDataCB->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, _resultsMiddleCB->bo());
-	glDispatchCompute((GLuint)(work / k_groupSize), 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		glUseProgram(_bentnormalsProgram);
+		glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
+		glUniform1ui(2, (GLuint)_meshMapping->meshBVH()->size());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _paramsCB->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _meshMapping->meshPositions()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _meshMapping->meshBVH()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, _samplesCB->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, _rayDataCB->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, _resultsMiddleCB->bo());
+		glDispatchCompute((GLuint)(work / k_groupSize), 1, 1);
 
-	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-	glUseProgram(_avgProgram);
-	glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _paramsCB->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _resultsMiddleCB->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _resultsFinalCB->bo());
-	glDispatchCompute((GLuint)(work / _params.sampleCount / k_groupSize), 1, 1);
-
-	if (_params.tangentSpace)
-	{
 		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-		glUseProgram(_tanspaceProgram);
+		glUseProgram(_avgProgram);
 		glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
-		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->pixelst()->bo());
-		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _resultsFinalCB->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _paramsCB->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _resultsMiddleCB->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _resultsFinalCB->bo());
 		glDispatchCompute((GLuint)(work / _params.sampleCount / k_groupSize), 1, 1);
+
+		if (_params.tangentSpace)
+		{
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+			glUseProgram(_tanspaceProgram);
+			glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->pixelst()->bo());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _resultsFinalCB->bo());
+			glDispatchCompute((GLuint)(work / _params.sampleCount / k_groupSize), 1, 1);
+		}
 	}
 
 	_workOffset += work;
@@ -141,8 +163,74 @@ bool BentNormalsSolver::runStep()
 	return _workOffset >= totalWork;
 }
 
+void BentNormalsSolver::runStepCPU(size_t workOffset, size_t work)
+{
+	const size_t sampleCount = _params.sampleCount;
+	const size_t pixelCount = _uvMap->positions.size();
+	const size_t pixBegin = workOffset / sampleCount;
+	const size_t pixEnd = std::min((workOffset + work) / sampleCount, pixelCount);
+	if (pixBegin >= pixEnd) return;
+
+	const Raytracer &rt = *_meshMapping->raytracer();
+	const std::vector<Vector4> &coords = _meshMapping->coordsData();
+	const std::vector<uint32_t> &coordsTidx = _meshMapping->coordsTidxData();
+	const float minDistance = _params.minDistance;
+	const float maxDistance = _params.maxDistance;
+	const bool tangentSpace = _params.tangentSpace;
+
+	ThreadPool::global().parallelFor(pixBegin, pixEnd, k_groupSize, [&](size_t begin, size_t end)
+	{
+		std::vector<Vector3> sampleDirs(sampleCount);
+		std::vector<uint8_t> sampleOccluded(sampleCount);
+		for (size_t i = begin; i < end; ++i)
+		{
+			const uint32_t tidx = coordsTidx[i];
+			if (tidx == UINT32_MAX)
+			{
+				// Nothing was mapped, keep the surface normal
+				_results[i] = tangentSpace ? Vector3(0, 0, 1) : _uvMap->normals[i];
+				continue;
+			}
+
+			const Vector4 &coord = coords[i];
+			const Vector3 bcoord(coord.y, coord.z, coord.w);
+			const Vector3 o = rt.position(tidx, bcoord);
+			const Vector3 d = rt.normal(tidx, bcoord);
+			Vector3 tx, ty;
+			computeTangentFrame(d, tx, ty);
+
+			const Vector3 *samples = &_samples[(i % k_samplePermCount) * sampleCount];
+			for (size_t s = 0; s < sampleCount; ++s)
+			{
+				const Vector3 &rs = samples[s];
+				sampleDirs[s] = normalize(tx * rs.x + ty * rs.y + d * rs.z);
+			}
+			rt.occludedPacket(o, sampleDirs.data(), sampleCount, minDistance, maxDistance, sampleOccluded.data());
+
+			Vector3 acc(0, 0, 0);
+			for (size_t s = 0; s < sampleCount; ++s)
+			{
+				if (!sampleOccluded[s]) acc += sampleDirs[s];
+			}
+			Vector3 normal = normalize(acc);
+			if (tangentSpace)
+			{
+				normal = toTangentSpace(normal, _uvMap->normals[i], _uvMap->tangents[i], _uvMap->bitangents[i]);
+			}
+			_results[i] = normal;
+		}
+	});
+}
+
 Vector3* BentNormalsSolver::getResults()
 {
+	if (_params.backend == ComputeBackend::CPU)
+	{
+		Vector3 *data = new Vector3[_results.size()];
+		std::copy(_results.begin(), _results.end(), data);
+		return data;
+	}
+
 	//assert(_sampleIndex >= _params.sampleCount);
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 	return _resultsFinalCB->readData();
@@ -165,12 +253,13 @@ bool BentNormalsTask::runStep()
 	return _solver->runStep();
 }
 
-void BentNormalsTask::finish()
+bool BentNormalsTask::finish()
 {
 	assert(_solver);
 	Vector3 *results = _solver->getResults();
-	exportNormalImage(results, _solver->uvMap().get(), _outputPath.c_str(), _dilation);
+	const bool exported = exportNormalImage(results, _solver->uvMap().get(), _outputPath.c_str(), _dilation);
 	delete[] results;
+	return exported;
 }
 
 float BentNormalsTask::progress() const
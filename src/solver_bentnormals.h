@@ -42,6 +42,7 @@ public:
 		float minDistance;
 		float maxDistance;
 		bool tangentSpace;
+		ComputeBackend backend;
 	};
 
 public:
@@ -59,6 +60,8 @@ public:
 	inline std::shared_ptr<const CompressedMapUV> uvMap() const { return _uvMap; }
 
 private:
+	void runStepCPU(size_t workOffset, size_t work);
+
 	Params _params;
 	size_t _workOffset;
 	size_t _workCount;
@@ -91,6 +94,10 @@ private:
 	std::unique_ptr<ComputeBuffer<Vector4> > _resultsMiddleCB;
 	std::unique_ptr<ComputeBuffer<Vector3> > _resultsFinalCB;
 
+	// CPU backend
+	std::vector<Vector3> _samples;
+	std::vector<Vector3> _results;
+
 	std::shared_ptr<const CompressedMapUV> _uvMap;
 	std::shared_ptr<MeshMapping> _meshMapping;
 
@@ -104,7 +111,7 @@ public:
 	~BentNormalsTask();
 
 	bool runStep();
-	void finish();
+	bool finish();
 	float progress() const;
 	const char* name() const { return "Bent normals"; }
 
@@ -29,20 +29,31 @@ SOFTWARE.
 #include "math.h"
 #include "mesh.h"
 #include "meshmapping.h"
+#include "raytracer.h"
+#include "threadpool.h"
+#include <algorithm>
 #include <cassert>
+#include <cfloat>
 
 static const size_t k_groupSize = 64;
 static const size_t k_workPerFrame = 1024 * 128;
 
 void HeightSolver::init(std::shared_ptr<const CompressedMapUV> map, std::shared_ptr<MeshMapping> meshMapping)
 {
-	_heightProgram = LoadComputeShader_Height();
 	_uvMap = map;
 	_meshMapping = meshMapping;
 	_workCount = ((map->positions.size() + k_groupSize - 1) / k_groupSize) * k_groupSize;
+	_workOffset = 0;
+
+	if (_backend == ComputeBackend::CPU)
+	{
+		_results.assign(_workCount, 0.0f);
+		return;
+	}
+
+	_heightProgram = LoadComputeShader_Height();
 	_resultsCB = std::unique_ptr<ComputeBuffer<float> >(
 		new ComputeBuffer<float>(3 * _workCount, GL_STATIC_READ));
-	_workOffset = 0;
 }
 
 bool HeightSolver::runStep()
@@ -54,11 +65,18 @@ bool HeightSolver::runStep()
 
 	if (_workOffset == 0) _timing.begin();
 
-	glUseProgram(_heightProgram);
-	glUniform1ui(1, (GLuint)_workOffset);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->coords()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _resultsCB->bo());
-	glDispatchCompute((GLuint)(work / k_groupSize), 1, 1);
+	if (_backend == ComputeBackend::CPU)
+	{
+		runStepCPU(_workOffset, work);
+	}
+	else
+	{
+		glUseProgram(_heightProgram);
+		glUniform1ui(1, (GLuint)_workOffset);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->coords()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _resultsCB->bo());
+		glDispatchCompute((GLuint)(work / k_groupSize), 1, 1);
+	}
 
 	_workOffset += work;
 
@@ -73,9 +91,35 @@ bool HeightSolver::runStep()
 	return _workOffset >= _workCount;
 }
 
+void HeightSolver::runStepCPU(size_t workOffset, size_t work)
+{
+	const size_t pixelCount = _uvMap->positions.size();
+	const size_t workEnd = std::min(workOffset + work, pixelCount);
+	if (workOffset >= workEnd) return;
+
+	const std::vector<Vector4> &coords = _meshMapping->coordsData();
+
+	ThreadPool::global().parallelFor(workOffset, workEnd, k_groupSize, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			// Same as heights.comp
+			const float height = coords[i].x;
+			_results[i] = height != FLT_MAX ? height : 0;
+		}
+	});
+}
+
 float* HeightSolver::getResults()
 {
 	assert(_workOffset == _workCount);
+	if (_backend == ComputeBackend::CPU)
+	{
+		float *results = new float[_results.size()];
+		std::copy(_results.begin(), _results.end(), results);
+		return results;
+	}
+
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 	float *results = new float[_workCount];
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, _resultsCB->bo());
@@ -100,15 +144,16 @@ bool HeightTask::runStep()
 	return _solver->runStep();
 }
 
-void HeightTask::finish()
+bool HeightTask::finish()
 {
 	assert(_solver);
 	float *results = _solver->getResults();
 	auto map = _solver->uvMap();
 	Vector2 minmax;
-	exportFloatImage(results, _solver->uvMap().get(), _outputPath.c_str(), true, _dilation, &minmax);
+	const bool exported = exportFloatImage(results, _solver->uvMap().get(), _outputPath.c_str(), true, _dilation, &minmax);
 	delete[] results;
 	logDebug("Height", "Height map range: " + std::to_string(minmax.x) + " to " + std::to_string(minmax.y));
+	return exported;
 }
 
 float HeightTask::progress() const
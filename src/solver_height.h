@@ -27,6 +27,7 @@ SOFTWARE.
 #include "fornos.h"
 #include "timing.h"
 #include <memory>
+#include <vector>
 
 struct CompressedMapUV;
 class MeshMapping;
@@ -34,7 +35,7 @@ class MeshMapping;
 class HeightSolver
 {
 public:
-	HeightSolver() {}
+	HeightSolver(ComputeBackend backend = ComputeBackend::GPU) : _backend(backend) {}
 
 	void init(std::shared_ptr<const CompressedMapUV> map, std::shared_ptr<MeshMapping> mesh);
 	bool runStep();
@@ -45,12 +46,17 @@ public:
 	inline std::shared_ptr<const CompressedMapUV> uvMap() const { return _uvMap; }
 
 private:
+	void runStepCPU(size_t workOffset, size_t work);
+
+	ComputeBackend _backend;
 	size_t _workOffset;
 	size_t _workCount;
 
 	GLuint _heightProgram;
 	std::unique_ptr<ComputeBuffer<float> > _resultsCB;
 
+	std::vector<float> _results; // CPU backend
+
 	std::shared_ptr<const CompressedMapUV> _uvMap;
 	std::shared_ptr<MeshMapping> _meshMapping;
 
@@ -64,7 +70,7 @@ public:
 	~HeightTask();
 
 	bool runStep();
-	void finish();
+	bool finish();
 	float progress() const;
 	const char* name() const { return "Height"; }
 
@@ -29,21 +29,32 @@ SOFTWARE.
 #include "math.h"
 #include "mesh.h"
 #include "meshmapping.h"
+#include "raytracer.h"
+#include "threadpool.h"
+#include <algorithm>
 #include <cassert>
+#include <cfloat>
 
 static const size_t k_groupSize = 64;
 static const size_t k_workPerFrame = 1024 * 128;
 
 void NormalsSolver::init(std::shared_ptr<const CompressedMapUV> map, std::shared_ptr<MeshMapping> meshMapping)
 {
-	_normalsProgram = LoadComputeShader_Normal();
-	_tanspaceProgram = LoadComputeShader_ToTangentSpace();
 	_uvMap = map;
 	_meshMapping = meshMapping;
 	_workCount = ((map->positions.size() + k_groupSize - 1) / k_groupSize) * k_groupSize;
+	_workOffset = 0;
+
+	if (_params.backend == ComputeBackend::CPU)
+	{
+		_results.assign(_workCount, Vector3(0, 0, 0));
+		return;
+	}
+
+	_normalsProgram = LoadComputeShader_Normal();
+	_tanspaceProgram = LoadComputeShader_ToTangentSpace();
 	_resultsCB = std::unique_ptr<ComputeBuffer<float> >(
 		new ComputeBuffer<float>(3 * _workCount, GL_STATIC_READ));
-	_workOffset = 0;
 }
 
 bool NormalsSolver::runStep()
@@ -55,22 +66,29 @@ bool NormalsSolver::runStep()
 
 	if (_workOffset == 0) _timing.begin();
 
-	glUseProgram(_normalsProgram);
-	glUniform1ui(1, (GLuint)_workOffset);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->meshNormals()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _meshMapping->coords()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _meshMapping->coords_tidx()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _resultsCB->bo());
-	glDispatchCompute((GLuint)(work / k_groupSize), 1, 1);
-
-	if (_params.tangentSpace)
+	if (_params.backend == ComputeBackend::CPU)
 	{
-		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-		glUseProgram(_tanspaceProgram);
-		glUniform1ui(1, GLuint(_workOffset));
-		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->pixelst()->bo());
-		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _resultsCB->bo());
+		runStepCPU(_workOffset, work);
+	}
+	else
+	{
+		glUseProgram(_normalsProgram);
+		glUniform1ui(1, (GLuint)_workOffset);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->meshNormals()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _meshMapping->coords()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _meshMapping->coords_tidx()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _resultsCB->bo());
 		glDispatchCompute((GLuint)(work / k_groupSize), 1, 1);
+
+		if (_params.tangentSpace)
+		{
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+			glUseProgram(_tanspaceProgram);
+			glUniform1ui(1, GLuint(_workOffset));
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->pixelst()->bo());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _resultsCB->bo());
+			glDispatchCompute((GLuint)(work / k_groupSize), 1, 1);
+		}
 	}
 
 	_workOffset += work;
@@ -86,9 +104,54 @@ bool NormalsSolver::runStep()
 	return _workOffset >= _workCount;
 }
 
+void NormalsSolver::runStepCPU(size_t workOffset, size_t work)
+{
+	const size_t pixelCount = _uvMap->positions.size();
+	const size_t workEnd = std::min(workOffset + work, pixelCount);
+	if (workOffset >= workEnd) return;
+
+	const Raytracer &rt = *_meshMapping->raytracer();
+	const std::vector<Vector4> &coords = _meshMapping->coordsData();
+	const std::vector<uint32_t> &coordsTidx = _meshMapping->coordsTidxData();
+	const bool tangentSpace = _params.tangentSpace;
+
+	ThreadPool::global().parallelFor(workOffset, workEnd, k_groupSize, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			const uint32_t tidx = coordsTidx[i];
+			if (tidx == UINT32_MAX)
+			{
+				// Nothing was mapped, keep the surface normal
+				_results[i] = tangentSpace ? Vector3(0, 0, 1) : _uvMap->normals[i];
+				continue;
+			}
+			const Vector4 &coord = coords[i];
+			Vector3 normal = rt.normal(tidx, Vector3(coord.y, coord.z, coord.w));
+			if (tangentSpace)
+			{
+				normal = toTangentSpace(normal, _uvMap->normals[i], _uvMap->tangents[i], _uvMap->bitangents[i]);
+			}
+			_results[i] = normal;
+		}
+	});
+}
+
 float* NormalsSolver::getResults()
 {
 	assert(_workOffset == _workCount);
+	if (_params.backend == ComputeBackend::CPU)
+	{
+		float *results = new float[_results.size() * 3];
+		for (size_t i = 0; i < _results.size(); ++i)
+		{
+			results[i * 3 + 0] = _results[i].x;
+			results[i * 3 + 1] = _results[i].y;
+			results[i * 3 + 2] = _results[i].z;
+		}
+		return results;
+	}
+
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 	float *results = new float[_workCount * 3];
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, _resultsCB->bo());
@@ -113,13 +176,14 @@ bool NormalsTask::runStep()
 	return _solver->runStep();
 }
 
-void NormalsTask::finish()
+bool NormalsTask::finish()
 {
 	assert(_solver);
 	Vector3 *results = (Vector3*)_solver->getResults();
 	auto map = _solver->uvMap();
-	exportNormalImage(results, _solver->uvMap().get(), _outputPath.c_str(), _dilation);
+	const bool exported = exportNormalImage(results, _solver->uvMap().get(), _outputPath.c_str(), _dilation);
 	delete[] results;
+	return exported;
 }
 
 float NormalsTask::progress() const
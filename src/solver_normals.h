@@ -27,6 +27,7 @@ SOFTWARE.
 #include "fornos.h"
 #include "timing.h"
 #include <memory>
+#include <vector>
 
 struct CompressedMapUV;
 class MeshMapping;
@@ -37,6 +38,7 @@ public:
 	struct Params
 	{
 		bool tangentSpace;
+		ComputeBackend backend;
 	};
 
 	NormalsSolver(const Params &params) : _params(params) {}
@@ -51,6 +53,8 @@ public:
 	inline std::shared_ptr<const CompressedMapUV> uvMap() const { return _uvMap; }
 
 private:
+	void runStepCPU(size_t workOffset, size_t work);
+
 	Params _params;
 	size_t _workOffset;
 	size_t _workCount;
@@ -59,6 +63,8 @@ private:
 	GLuint _tanspaceProgram;
 	std::unique_ptr<ComputeBuffer<float> > _resultsCB;
 
+	std::vector<Vector3> _results; // CPU backend
+
 	std::shared_ptr<const CompressedMapUV> _uvMap;
 	std::shared_ptr<MeshMapping> _meshMapping;
 
@@ -72,7 +78,7 @@ public:
 	~NormalsTask();
 
 	bool runStep();
-	void finish();
+	bool finish();
 	float progress() const;
 	const char* name() const { return "Normals"; }
 
@@ -29,20 +29,31 @@ SOFTWARE.
 #include "math.h"
 #include "mesh.h"
 #include "meshmapping.h"
+#include "raytracer.h"
+#include "threadpool.h"
+#include <algorithm>
 #include <cassert>
+#include <cfloat>
 
 static const size_t k_groupSize = 64;
 static const size_t k_workPerFrame = 1024 * 128;
 
 void PositionSolver::init(std::shared_ptr<const CompressedMapUV> map, std::shared_ptr<MeshMapping> meshMapping)
 {
-	_positionProgram = LoadComputeShader_Position();
 	_uvMap = map;
 	_meshMapping = meshMapping;
 	_workCount = ((map->positions.size() + k_groupSize - 1) / k_groupSize) * k_groupSize;
+	_workOffset = 0;
+
+	if (_backend == ComputeBackend::CPU)
+	{
+		_results.assign(_workCount, Vector3(0, 0, 0));
+		return;
+	}
+
+	_positionProgram = LoadComputeShader_Position();
 	_resultsCB = std::unique_ptr<ComputeBuffer<Vector3> >(
 		new ComputeBuffer<Vector3>(_workCount, GL_STATIC_READ));
-	_workOffset = 0;
 }
 
 bool PositionSolver::runStep()
@@ -54,13 +65,20 @@ bool PositionSolver::runStep()
 
 	if (_workOffset == 0) _timing.begin();
 
-	glUseProgram(_positionProgram);
-	glUniform1ui(1, (GLuint)_workOffset);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->meshPositions()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _meshMapping->coords()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _meshMapping->coords_tidx()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _resultsCB->bo());
-	glDispatchCompute((GLuint)(work / k_groupSize), 1, 1);
+	if (_backend == ComputeBackend::CPU)
+	{
+		runStepCPU(_workOffset, work);
+	}
+	else
+	{
+		glUseProgram(_positionProgram);
+		glUniform1ui(1, (GLuint)_workOffset);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->meshPositions()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _meshMapping->coords()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _meshMapping->coords_tidx()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _resultsCB->bo());
+		glDispatchCompute((GLuint)(work / k_groupSize), 1, 1);
+	}
 
 	_workOffset += work;
 
@@ -75,9 +93,42 @@ bool PositionSolver::runStep()
 	return _workOffset >= _workCount;
 }
 
+void PositionSolver::runStepCPU(size_t workOffset, size_t work)
+{
+	const size_t pixelCount = _uvMap->positions.size();
+	const size_t workEnd = std::min(workOffset + work, pixelCount);
+	if (workOffset >= workEnd) return;
+
+	const Raytracer &rt = *_meshMapping->raytracer();
+	const std::vector<Vector4> &coords = _meshMapping->coordsData();
+	const std::vector<uint32_t> &coordsTidx = _meshMapping->coordsTidxData();
+
+	ThreadPool::global().parallelFor(workOffset, workEnd, k_groupSize, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			const uint32_t tidx = coordsTidx[i];
+			if (tidx == UINT32_MAX)
+			{
+				_results[i] = Vector3(0, 0, 0);
+				continue;
+			}
+			const Vector4 &coord = coords[i];
+			_results[i] = rt.position(tidx, Vector3(coord.y, coord.z, coord.w));
+		}
+	});
+}
+
 Vector3* PositionSolver::getResults()
 {
 	assert(_workOffset == _workCount);
+	if (_backend == ComputeBackend::CPU)
+	{
+		Vector3 *results = new Vector3[_results.size()];
+		std::copy(_results.begin(), _results.end(), results);
+		return results;
+	}
+
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 	Vector3 *results = new Vector3[_workCount];
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, _resultsCB->bo());
@@ -101,13 +152,14 @@ bool PositionTask::runStep()
 	return _solver->runStep();
 }
 
-void PositionTask::finish()
+bool PositionTask::finish()
 {
 	assert(_solver);
 	Vector3 *results = _solver->getResults();
 	auto map = _solver->uvMap();
-	exportVectorImage(results, _solver->uvMap().get(), _outputPath.c_str());
+	const bool exported = exportVectorImage(results, _solver->uvMap().get(), _outputPath.c_str());
 	delete[] results;
+	return exported;
 }
 
 float PositionTask::progress() const
@@ -25,8 +25,12 @@ SOFTWARE.
 #include "computeshaders.h"
 #include "logging.h"
 #include "meshmapping.h"
+#include "raytracer.h"
+#include "threadpool.h"
 #include "image.h"
+#include <algorithm>
 #include <cassert>
+#include <cfloat>
 
 static const size_t k_groupSize = 64;
 static const size_t k_workPerFrame = 1024 * 128;
@@ -45,13 +49,26 @@ namespace
 
 void ThicknessSolver::init(std::shared_ptr<const CompressedMapUV> map, std::shared_ptr<MeshMapping> meshMapping)
 {
-	_rayProgram = LoadComputeShader_Thick_GenData();
-	_thicknessProgram = LoadComputeShader_Thick_Sampling();
-	_avgProgram = LoadComputeShader_Thick_Aggregate();
-
 	_uvMap = map;
 	_meshMapping = meshMapping;
 	_workCount = ((map->positions.size() + k_groupSize - 1) / k_groupSize) * k_groupSize;
+	_workOffset = 0;
+
+	if (_params.backend == ComputeBackend::CPU)
+	{
+		_samples = computeSamples(_params.sampleCount, k_samplePermCount);
+		// Coherent consecutive samples are traversed together as ray packets
+		for (size_t p = 0; p < k_samplePermCount; ++p)
+		{
+			Raytracer::sortCoherent(&_samples[p * _params.sampleCount], _params.sampleCount);
+		}
+		_results.assign(_workCount, 0.0f);
+		return;
+	}
+
+	_rayProgram = LoadComputeShader_Thick_GenData();
+	_thicknessProgram = LoadComputeShader_Thick_Sampling();
+	_avgProgram = LoadComputeShader_Thick_Aggregate();
 
 	{
 		ShaderParams params;
@@ -74,8 +91,6 @@ void ThicknessSolver::init(std::shared_ptr<const CompressedMapUV> map, std::shar
 		new ComputeBuffer<float>(k_workPerFrame, GL_STATIC_READ)); // TODO: static read?
 	_resultsFinalCB = std::unique_ptr<ComputeBuffer<float> >(
 		new ComputeBuffer<float>(_workCount, GL_STATIC_READ));
-
-	_workOffset = 0;
 }
 
 bool ThicknessSolver::runStep()
@@ -88,34 +103,41 @@ bool ThicknessSolver::runStep()
 
 	if (_workOffset == 0) _timing.begin();
 
-	glUseProgram(_rayProgram);
-	glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->meshPositions()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _meshMapping->meshNormals()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _meshMapping->coords()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _meshMapping->coords_tidx()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, _rayDataCB->bo());
-	glDispatchCompute((GLuint)(work / _params.sampleCount / k_groupSize), 1, 1);
-
-	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-	glUseProgram(_thicknessProgram);
-	glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
-	glUniform1ui(2, (GLuint)_meshMapping->meshBVH()->size());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _paramsCB->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _meshMapping->meshPositions()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _meshMapping->meshBVH()->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, _samplesCB->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, _rayDataCB->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, _resultsMiddleCB->bo());
-	glDispatchCompute((GLuint)(work / k_groupSize), 1, 1);
-
-	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-	glUseProgram(_avgProgram);
-	glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _paramsCB->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _resultsMiddleCB->bo());
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _resultsFinalCB->bo());
-	glDispatchCompute((GLuint)(work / _params.sampleCount / k_groupSize), 1, 1);
+	if (_params.backend == ComputeBackend::CPU)
+	{
+		runStepCPU(_workOffset, work);
+	}
+	else
+	{
+		glUseProgram(_rayProgram);
+		glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _meshMapping->meshPositions()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _meshMapping->meshNormals()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _meshMapping->coords()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _meshMapping->coords_tidx()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, _rayDataCB->bo());
+		glDispatchCompute((GLuint)(work / _params.sampleCount / k_groupSize), 1, 1);
+
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		glUseProgram(_thicknessProgram);
+		glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
+		glUniform1ui(2, (GLuint)_meshMapping->meshBVH()->size());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _paramsCB->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _meshMapping->meshPositions()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _meshMapping->meshBVH()->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, _samplesCB->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, _rayDataCB->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, _resultsMiddleCB->bo());
+		glDispatchCompute((GLuint)(work / k_groupSize), 1, 1);
+
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		glUseProgram(_avgProgram);
+		glUniform1ui(1, GLuint(_workOffset / _params.sampleCount));
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _paramsCB->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _resultsMiddleCB->bo());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _resultsFinalCB->bo());
+		glDispatchCompute((GLuint)(work / _params.sampleCount / k_groupSize), 1, 1);
+	}
 
 	_workOffset += work;
 
@@ -130,8 +152,69 @@ bool ThicknessSolver::runStep()
 	return _workOffset >= totalWork;
 }
 
+void ThicknessSolver::runStepCPU(size_t workOffset, size_t work)
+{
+	const size_t sampleCount = _params.sampleCount;
+	const size_t pixelCount = _uvMap->positions.size();
+	const size_t pixBegin = workOffset / sampleCount;
+	const size_t pixEnd = std::min((workOffset + work) / sampleCount, pixelCount);
+	if (pixBegin >= pixEnd) return;
+
+	const Raytracer &rt = *_meshMapping->raytracer();
+	const std::vector<Vector4> &coords = _meshMapping->coordsData();
+	const std::vector<uint32_t> &coordsTidx = _meshMapping->coordsTidxData();
+	const float minDistance = _params.minDistance;
+	const float maxDistance = _params.maxDistance;
+
+	ThreadPool::global().parallelFor(pixBegin, pixEnd, k_groupSize, [&](size_t begin, size_t end)
+	{
+		std::vector<Vector3> sampleDirs(sampleCount);
+		std::vector<float> sampleDists(sampleCount);
+		for (size_t i = begin; i < end; ++i)
+		{
+			const uint32_t tidx = coordsTidx[i];
+			if (tidx == UINT32_MAX)
+			{
+				// Nothing was mapped, there is no volume
+				_results[i] = 0.0f;
+				continue;
+			}
+
+			const Vector4 &coord = coords[i];
+			const Vector3 bcoord(coord.y, coord.z, coord.w);
+			const Vector3 o = rt.position(tidx, bcoord);
+			const Vector3 d = -rt.normal(tidx, bcoord);
+			Vector3 tx, ty;
+			computeTangentFrame(d, tx, ty);
+
+			const Vector3 *samples = &_samples[(i % k_samplePermCount) * sampleCount];
+			for (size_t s = 0; s < sampleCount; ++s)
+			{
+				const Vector3 &rs = samples[s];
+				sampleDirs[s] = normalize(tx * rs.x + ty * rs.y + d * rs.z);
+			}
+			rt.raycastDistPacket(o, sampleDirs.data(), sampleCount, minDistance, maxDistance, sampleDists.data());
+
+			float acc = 0;
+			for (size_t s = 0; s < sampleCount; ++s)
+			{
+				const float t = sampleDists[s];
+				acc += (t != FLT_MAX) ? t : maxDistance;
+			}
+			_results[i] = acc / float(sampleCount);
+		}
+	});
+}
+
 float* ThicknessSolver::getResults()
 {
+	if (_params.backend == ComputeBackend::CPU)
+	{
+		float *data = new float[_results.size()];
+		std::copy(_results.begin(), _results.end(), data);
+		return data;
+	}
+
 	//assert(_sampleIndex >= _params.sampleCount);
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 	return _resultsFinalCB->readData();
@@ -154,14 +237,15 @@ bool ThicknessTask::runStep()
 	return _solver->runStep();
 }
 
-void ThicknessTask::finish()
+bool ThicknessTask::finish()
 {
 	assert(_solver);
 	float *results = _solver->getResults();
 	Vector2 minmax;
-	exportFloatImage(results, _solver->uvMap().get(), _outputPath.c_str(), true, _dilation, &minmax);
+	const bool exported = exportFloatImage(results, _solver->uvMap().get(), _outputPath.c_str(), true, _dilation, &minmax);
 	delete[] results;
 	logDebug("Thickness", "Thickness map range: " + std::to_string(minmax.x) + " to " + std::to_string(minmax.y));
+	return exported;
 }
 
 float ThicknessTask::progress() const
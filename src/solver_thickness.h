@@ -41,6 +41,7 @@ public:
 		size_t sampleCount;
 		float minDistance;
 		float maxDistance;
+		ComputeBackend backend;
 	};
 
 public:
@@ -58,6 +59,8 @@ public:
 	inline std::shared_ptr<const CompressedMapUV> uvMap() const { return _uvMap; }
 
 private:
+	void runStepCPU(size_t workOffset, size_t work);
+
 	Params _params;
 	size_t _workOffset;
 	size_t _workCount;
@@ -89,6 +92,10 @@ private:
 	std::unique_ptr<ComputeBuffer<float> > _resultsMiddleCB;
 	std::unique_ptr<ComputeBuffer<float> > _resultsFinalCB;
 
+	// CPU backend
+	std::vector<Vector3> _samples;
+	std::vector<float> _results;
+
 	std::shared_ptr<const CompressedMapUV> _uvMap;
 	std::shared_ptr<MeshMapping> _meshMapping;
 
@@ -102,7 +109,7 @@ public:
 	~ThicknessTask();
 
 	bool runStep();
-	void finish();
+	bool finish();
 	float progress() const;
 	const char* name() const { return "Thickness"; }
 
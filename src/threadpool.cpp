@@ -0,0 +1,239 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "threadpool.h"
+#include <algorithm>
+#include <cassert>
+
+namespace
+{
+	size_t s_globalThreadCount = 0;
+	std::mutex s_globalMutex;
+	std::unique_ptr<ThreadPool> s_globalPool;
+	std::atomic<ThreadPool*> s_globalPoolPtr(nullptr); // s_globalPool, read without the lock
+
+	size_t resolveThreadCount(size_t threadCount)
+	{
+		return threadCount > 0 ? threadCount : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+
+	// Pool and queue owned by the current thread (if it is a worker)
+	thread_local const ThreadPool *t_pool = nullptr;
+	thread_local size_t t_queueIdx = 0;
+}
+
+ThreadPool::ThreadPool(size_t threadCount)
+	: _queuedCount(0)
+	, _stop(false)
+{
+	threadCount = resolveThreadCount(threadCount);
+
+	const size_t workerCount = threadCount - 1;
+	for (size_t i = 0; i < workerCount + 1; ++i)
+	{
+		_queues.emplace_back(new Queue());
+	}
+	for (size_t i = 0; i < workerCount; ++i)
+	{
+		_workers.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_sleepMutex);
+		_stop = true;
+	}
+	_sleepCondition.notify_all();
+	for (auto &worker : _workers)
+	{
+		worker.join();
+	}
+}
+
+ThreadPool& ThreadPool::global()
+{
+	ThreadPool *pool = s_globalPoolPtr.load(std::memory_order_acquire);
+	if (pool) return *pool;
+
+	std::lock_guard<std::mutex> lock(s_globalMutex);
+	if (!s_globalPool)
+	{
+		s_globalPool.reset(new ThreadPool(s_globalThreadCount));
+		s_globalPoolPtr.store(s_globalPool.get(), std::memory_order_release);
+	}
+	return *s_globalPool;
+}
+
+void ThreadPool::setGlobalThreadCount(size_t threadCount)
+{
+	std::lock_guard<std::mutex> lock(s_globalMutex);
+	s_globalThreadCount = threadCount;
+
+	// Created again with the new count by the next call to global()
+	if (s_globalPool && s_globalPool->threadCount() != resolveThreadCount(threadCount))
+	{
+		s_globalPoolPtr.store(nullptr, std::memory_order_release);
+		s_globalPool.reset();
+	}
+}
+
+void ThreadPool::parallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)> &fn)
+{
+	if (begin >= end) return;
+
+	const size_t count = end - begin;
+	if (grainSize == 0)
+	{
+		const size_t chunkCount = threadCount() * 4;
+		grainSize = std::max<size_t>((count + chunkCount - 1) / chunkCount, 1);
+	}
+
+	if (count <= grainSize || _workers.empty())
+	{
+		fn(begin, end);
+		return;
+	}
+
+	TaskGroup group(*this);
+	for (size_t i = begin; i < end; i += grainSize)
+	{
+		const size_t chunkEnd = std::min(i + grainSize, end);
+		group.run([&fn, i, chunkEnd]() { fn(i, chunkEnd); });
+	}
+	group.wait();
+}
+
+size_t ThreadPool::currentQueueIndex() const
+{
+	// Threads outside the pool share the last queue
+	return t_pool == this ? t_queueIdx : _workers.size();
+}
+
+void ThreadPool::push(Task &&task)
+{
+	Queue &queue = *_queues[currentQueueIndex()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.emplace_back(std::move(task));
+	}
+	++_queuedCount;
+
+	// Lock to avoid missing the wake-up of a worker about to sleep
+	{
+		std::lock_guard<std::mutex> lock(_sleepMutex);
+	}
+	_sleepCondition.notify_one();
+}
+
+bool ThreadPool::popTask(size_t queueIdx, Task &o_task)
+{
+	Queue &queue = *_queues[queueIdx];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.tasks.empty()) return false;
+	o_task = std::move(queue.tasks.back());
+	queue.tasks.pop_back();
+	--_queuedCount;
+	return true;
+}
+
+bool ThreadPool::stealTask(size_t thiefIdx, Task &o_task)
+{
+	const size_t queueCount = _queues.size();
+	for (size_t i = 1; i < queueCount; ++i)
+	{
+		Queue &queue = *_queues[(thiefIdx + i) % queueCount];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty())
+		{
+			o_task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+			--_queuedCount;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::execute(Task &task)
+{
+	task.fn();
+	if (task.group)
+	{
+		--task.group->_pendingCount;
+	}
+}
+
+bool ThreadPool::runPendingTask()
+{
+	const size_t queueIdx = currentQueueIndex();
+	Task task;
+	if (popTask(queueIdx, task) || stealTask(queueIdx, task))
+	{
+		execute(task);
+		return true;
+	}
+	return false;
+}
+
+void ThreadPool::workerLoop(size_t workerIdx)
+{
+	t_pool = this;
+	t_queueIdx = workerIdx;
+
+	while (!_stop)
+	{
+		if (runPendingTask()) continue;
+
+		std::unique_lock<std::mutex> lock(_sleepMutex);
+		_sleepCondition.wait(lock, [this]() { return _stop || _queuedCount > 0; });
+	}
+}
+
+TaskGroup::TaskGroup(ThreadPool &pool)
+	: _pool(pool)
+	, _pendingCount(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+	wait();
+}
+
+void TaskGroup::run(std::function<void()> fn)
+{
+	++_pendingCount;
+	_pool.push(ThreadPool::Task{ std::move(fn), this });
+}
+
+void TaskGroup::wait()
+{
+	while (_pendingCount > 0)
+	{
+		if (!_pool.runPendingTask())
+		{
+			std::this_thread::yield();
+		}
+	}
+}
@@ -0,0 +1,116 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGroup;
+
+/// Work-stealing thread pool used by the CPU backend
+/// Every worker owns a queue: it pops its own tasks in LIFO order and steals
+/// from the other queues in FIFO order when it runs out of work.
+/// Threads waiting on a TaskGroup run pending tasks instead of blocking, so
+/// tasks can spawn and wait for other tasks (recursive fork-join).
+class ThreadPool
+{
+public:
+	/// @param threadCount Number of threads doing work, including the thread
+	/// that waits for the results. Zero uses all the hardware threads.
+	explicit ThreadPool(size_t threadCount = 0);
+	~ThreadPool();
+
+	/// Number of threads doing work (workers plus the waiting thread)
+	inline size_t threadCount() const { return _workers.size() + 1; }
+
+	/// Pool shared by all the CPU solvers
+	static ThreadPool& global();
+
+	/// Sets the thread count of the global pool
+	/// A pool with another thread count is replaced, so it must not be called
+	/// while the global pool runs tasks (as between bakes).
+	static void setGlobalThreadCount(size_t threadCount);
+
+	/// Runs fn(rangeBegin, rangeEnd) over consecutive chunks of [begin, end)
+	/// and waits for all of them to finish.
+	/// @param grainSize Chunk size. Zero splits the range in a few chunks per thread.
+	void parallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)> &fn);
+
+private:
+	friend class TaskGroup;
+
+	struct Task
+	{
+		std::function<void()> fn;
+		TaskGroup *group;
+	};
+
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	void push(Task &&task);
+	bool runPendingTask();
+	bool popTask(size_t queueIdx, Task &o_task);
+	bool stealTask(size_t thiefIdx, Task &o_task);
+	void execute(Task &task);
+	void workerLoop(size_t workerIdx);
+	size_t currentQueueIndex() const;
+
+	std::vector<std::thread> _workers;
+	std::vector<std::unique_ptr<Queue> > _queues; // One per worker plus a shared one for other threads
+	std::atomic<size_t> _queuedCount;
+	std::atomic<bool> _stop;
+	std::mutex _sleepMutex;
+	std::condition_variable _sleepCondition;
+};
+
+/// Set of tasks that can be waited for as a whole
+class TaskGroup
+{
+public:
+	explicit TaskGroup(ThreadPool &pool = ThreadPool::global());
+	~TaskGroup();
+
+	/// Queues a task in the pool
+	void run(std::function<void()> fn);
+
+	/// Waits until every task in the group is finished
+	/// The calling thread runs pending tasks of the pool meanwhile.
+	void wait();
+
+private:
+	friend class ThreadPool;
+
+	ThreadPool &_pool;
+	std::atomic<size_t> _pendingCount;
+};
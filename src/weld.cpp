@@ -0,0 +1,262 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "weld.h"
+#include "radixsort.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+	const size_t k_weldGrainSize = 4096;
+
+	inline uint64_t mixHash(uint64_t h)
+	{
+		// Finalizer of MurmurHash3
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	inline uint64_t hashCombine(uint64_t h, uint64_t v)
+	{
+		return mixHash(h ^ (v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2)));
+	}
+
+	inline uint32_t floatBits(float f)
+	{
+		if (f == 0.0f) f = 0.0f; // -0 compares equal to 0
+		uint32_t bits;
+		memcpy(&bits, &f, sizeof(bits));
+		return bits;
+	}
+
+	inline bool samePosition(const Vector3 &a, const Vector3 &b)
+	{
+		return a.x == b.x && a.y == b.y && a.z == b.z;
+	}
+
+	inline uint64_t positionKey(const Vector3 &p)
+	{
+		uint64_t h = mixHash(floatBits(p.x));
+		h = hashCombine(h, floatBits(p.y));
+		return hashCombine(h, floatBits(p.z));
+	}
+
+	inline uint64_t cellKey(int64_t x, int64_t y, int64_t z)
+	{
+		uint64_t h = mixHash(uint64_t(x));
+		h = hashCombine(h, uint64_t(y));
+		return hashCombine(h, uint64_t(z));
+	}
+
+	inline int64_t cellCoord(float v, float invCellSize)
+	{
+		return int64_t(std::floor(double(v) * invCellSize));
+	}
+
+	/// Lock-free union-find where the root of a set is always its smallest element
+	class DisjointSets
+	{
+	public:
+		explicit DisjointSets(size_t count) : _parents(new std::atomic<uint32_t>[count])
+		{
+			ThreadPool::global().parallelFor(0, count, k_weldGrainSize, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; ++i) _parents[i].store(uint32_t(i), std::memory_order_relaxed);
+			});
+		}
+		~DisjointSets() { delete[] _parents; }
+
+		uint32_t find(uint32_t i)
+		{
+			uint32_t parent = _parents[i].load(std::memory_order_relaxed);
+			while (parent != i)
+			{
+				// Path halving, losing the race just leaves a longer path
+				const uint32_t grandParent = _parents[parent].load(std::memory_order_relaxed);
+				_parents[i].compare_exchange_weak(parent, grandParent, std::memory_order_relaxed);
+				i = parent;
+				parent = _parents[i].load(std::memory_order_relaxed);
+			}
+			return i;
+		}
+
+		void unite(uint32_t a, uint32_t b)
+		{
+			for (;;)
+			{
+				a = find(a);
+				b = find(b);
+				if (a == b) return;
+				if (a < b) std::swap(a, b);
+				// Only roots are linked, if a stopped being one try again
+				uint32_t expected = a;
+				if (_parents[a].compare_exchange_strong(expected, b, std::memory_order_relaxed)) return;
+			}
+		}
+
+	private:
+		DisjointSets(const DisjointSets &) = delete;
+		DisjointSets& operator=(const DisjointSets &) = delete;
+
+		std::atomic<uint32_t> *_parents;
+	};
+
+	void weldExact(const Vector3 *positions, size_t count, std::vector<uint32_t> &o_remap)
+	{
+		std::vector<uint64_t> keys(count);
+		std::vector<uint32_t> indices(count);
+		ThreadPool::global().parallelFor(0, count, k_weldGrainSize, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				keys[i] = positionKey(positions[i]);
+				indices[i] = uint32_t(i);
+			}
+		});
+		radixSort(keys, indices);
+
+		// The sort is stable so every run of equal keys is in increasing index
+		// order and the first equal position of a run is the smallest index.
+		// Runs only hold different positions on hash collisions.
+		ThreadPool::global().parallelFor(0, count, k_weldGrainSize, [&](size_t begin, size_t end)
+		{
+			size_t i = begin;
+			while (i > 0 && i < count && keys[i] == keys[i - 1]) ++i; // Run owned by the previous range
+			while (i < end)
+			{
+				size_t runEnd = i + 1;
+				while (runEnd < count && keys[runEnd] == keys[i]) ++runEnd;
+				for (size_t j = i; j < runEnd; ++j)
+				{
+					const Vector3 &p = positions[indices[j]];
+					size_t first = i;
+					while (first < j && !samePosition(positions[indices[first]], p)) ++first;
+					o_remap[indices[j]] = indices[first];
+				}
+				i = runEnd;
+			}
+		});
+	}
+
+	void weldEpsilon(const Vector3 *positions, size_t count, float epsilon, std::vector<uint32_t> &o_remap)
+	{
+		// Cells twice as big as epsilon, so the positions welded with a position
+		// are in the 8 cells around the cell corner closest to it
+		const double invCellSize = 0.5 / double(epsilon);
+		const float epsilon2 = epsilon * epsilon;
+
+		std::vector<uint64_t> keys(count);
+		std::vector<uint32_t> indices(count);
+		ThreadPool::global().parallelFor(0, count, k_weldGrainSize, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				const Vector3 &p = positions[i];
+				keys[i] = cellKey(cellCoord(p.x, invCellSize), cellCoord(p.y, invCellSize), cellCoord(p.z, invCellSize));
+				indices[i] = uint32_t(i);
+			}
+		});
+		radixSort(keys, indices);
+
+		// Open addressing table from cell keys to the start of their runs,
+		// the keys are already hashed so their low bits are the slots
+		size_t tableSize = 16;
+		while (tableSize < count * 2) tableSize *= 2;
+		const size_t tableMask = tableSize - 1;
+		std::vector<uint32_t> cellRuns(tableSize, UINT32_MAX);
+		for (size_t k = 0; k < count; ++k)
+		{
+			if (k > 0 && keys[k] == keys[k - 1]) continue;
+			size_t slot = size_t(keys[k]) & tableMask;
+			while (cellRuns[slot] != UINT32_MAX) slot = (slot + 1) & tableMask;
+			cellRuns[slot] = uint32_t(k);
+		}
+		auto findCell = [&](uint64_t key) -> size_t
+		{
+			for (size_t slot = size_t(key) & tableMask; cellRuns[slot] != UINT32_MAX; slot = (slot + 1) & tableMask)
+			{
+				if (keys[cellRuns[slot]] == key) return cellRuns[slot];
+			}
+			return count;
+		};
+
+		// Walked in sorted order so the positions of neighbour cells are likely cached
+		DisjointSets sets(count);
+		ThreadPool::global().parallelFor(0, count, k_weldGrainSize, [&](size_t begin, size_t end)
+		{
+			for (size_t s = begin; s < end; ++s)
+			{
+				const uint32_t i = indices[s];
+				const Vector3 &p = positions[i];
+				int64_t cell[3], side[3];
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					const double v = double((&p.x)[axis]) * invCellSize;
+					cell[axis] = int64_t(std::floor(v));
+					side[axis] = v - double(cell[axis]) < 0.5 ? -1 : 1;
+				}
+				for (int corner = 0; corner < 8; ++corner)
+				{
+					const uint64_t key = cellKey(
+						cell[0] + ((corner & 1) ? side[0] : 0),
+						cell[1] + ((corner & 2) ? side[1] : 0),
+						cell[2] + ((corner & 4) ? side[2] : 0));
+					for (size_t k = findCell(key); k < count && keys[k] == key; ++k)
+					{
+						// Every pair is found from both sides, test it once
+						const uint32_t j = indices[k];
+						if (j < i && dot(positions[j] - p, positions[j] - p) <= epsilon2)
+						{
+							sets.unite(i, j);
+						}
+					}
+				}
+			}
+		});
+
+		ThreadPool::global().parallelFor(0, count, k_weldGrainSize, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; ++i) o_remap[i] = sets.find(uint32_t(i));
+		});
+	}
+}
+
+void weldPositions(const Vector3 *positions, size_t count, float epsilon, std::vector<uint32_t> &o_remap)
+{
+	o_remap.resize(count);
+	if (epsilon > 0.0f)
+	{
+		weldEpsilon(positions, count, epsilon, o_remap);
+	}
+	else
+	{
+		weldExact(positions, count, o_remap);
+	}
+}
@@ -0,0 +1,39 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "math.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// Finds the positions that should be treated as the same point
+/// Positions are keyed by their bits (or by their grid cell when epsilon is
+/// not zero) and sorted with a parallel radix sort, so no tree or hash map is
+/// built and the work is split among the global thread pool.
+/// @param epsilon Maximum distance between welded positions. With zero only
+///	positions that compare equal are welded. Welding is transitive, so chains
+///	of positions closer than epsilon are welded together.
+/// @param o_remap For every position, the smallest index of the positions
+///	welded with it
+void weldPositions(const Vector3 *positions, size_t count, float epsilon, std::vector<uint32_t> &o_remap);
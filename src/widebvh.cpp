@@ -0,0 +1,248 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "widebvh.h"
+#include "logging.h"
+#include "threadpool.h"
+#include "timing.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <string>
+
+namespace
+{
+	inline float halfArea(const BVHNode &node)
+	{
+		const Vector3 size = node.aabbMax - node.aabbMin;
+		return size.x * size.y + size.y * size.z + size.z * size.x;
+	}
+
+	/// Emits the wide node for the binary inner node at binaryIdx and its subtree
+	/// @return Index of the wide node
+	template <size_t Width>
+	uint32_t collapseNode(const BVH &bvh, const uint32_t binaryIdx, const size_t depth, WideBVH<Width> &o_wide)
+	{
+		const BVH::NodeArray &binary = bvh.nodes;
+
+		// Binary nodes becoming the children of this node
+		uint32_t slots[Width];
+		size_t slotCount = 0;
+		if (binary[binaryIdx].isLeaf())
+		{
+			slots[slotCount++] = binaryIdx;
+		}
+		else
+		{
+			slots[slotCount++] = binaryIdx + 1;
+			slots[slotCount++] = binary[binaryIdx + 1].skipIndex(binaryIdx + 1);
+		}
+
+		while (slotCount < Width)
+		{
+			size_t best = Width;
+			float bestArea = -1.0f;
+			for (size_t s = 0; s < slotCount; ++s)
+			{
+				const BVHNode &node = binary[slots[s]];
+				if (!node.isLeaf() && halfArea(node) > bestArea)
+				{
+					best = s;
+					bestArea = halfArea(node);
+				}
+			}
+			if (best == Width) break;
+
+			const uint32_t opened = slots[best];
+			slots[best] = opened + 1;
+			slots[slotCount++] = binary[opened + 1].skipIndex(opened + 1);
+		}
+
+		const uint32_t nodeIdx = (uint32_t)o_wide.nodes.size();
+		o_wide.nodes.emplace_back();
+		o_wide.maxDepth = std::max(o_wide.maxDepth, depth + 1);
+
+		const float inf = std::numeric_limits<float>::infinity();
+		for (size_t s = 0; s < Width; ++s)
+		{
+			typename WideBVH<Width>::Node &node = o_wide.nodes[nodeIdx];
+			if (s >= slotCount)
+			{
+				node.minX[s] = node.minY[s] = node.minZ[s] = inf;
+				node.maxX[s] = node.maxY[s] = node.maxZ[s] = inf;
+				node.child[s] = 0;
+				node.count[s] = 0;
+				continue;
+			}
+
+			const BVHNode &child = binary[slots[s]];
+			node.minX[s] = child.aabbMin.x;
+			node.minY[s] = child.aabbMin.y;
+			node.minZ[s] = child.aabbMin.z;
+			node.maxX[s] = child.aabbMax.x;
+			node.maxY[s] = child.aabbMax.y;
+			node.maxZ[s] = child.aabbMax.z;
+			if (child.isLeaf())
+			{
+				node.child[s] = child.offset;
+				node.count[s] = child.count;
+			}
+			else
+			{
+				// The recursion may reallocate the nodes
+				const uint32_t childIdx = collapseNode(bvh, slots[s], depth + 1, o_wide);
+				o_wide.nodes[nodeIdx].child[s] = childIdx;
+				o_wide.nodes[nodeIdx].count[s] = 0;
+			}
+		}
+
+		return nodeIdx;
+	}
+
+	const int k_minCellExponent = 1; // Biased exponents of normal floats
+	const int k_maxCellExponent = 254;
+
+	inline float cellSize(int exponent)
+	{
+		return std::ldexp(1.0f, exponent - 127);
+	}
+
+	/// Biased exponent of the smallest power of two cell that spans [origin, maxv] in 255 cells
+	int cellExponent(const float origin, const float maxv)
+	{
+		int exponent = k_minCellExponent;
+		if (maxv - origin > 0.0f)
+		{
+			int e;
+			std::frexp((maxv - origin) / 255.0f, &e);
+			exponent = std::min(std::max(e + 127, k_minCellExponent), k_maxCellExponent);
+		}
+		while (exponent > k_minCellExponent && origin + 255.0f * cellSize(exponent - 1) >= maxv) --exponent;
+		while (exponent < k_maxCellExponent && origin + 255.0f * cellSize(exponent) < maxv) ++exponent;
+		return exponent;
+	}
+
+	/// Grid coordinates of [minv, maxv], rounded outwards
+	/// The products of the coordinates with power of two cells are exact, so
+	/// decoding them rounds once, as here.
+	inline void quantizeRange(const float minv, const float maxv, const float origin, const float cell, uint8_t &o_min, uint8_t &o_max)
+	{
+		int qmin = std::min(std::max(int(std::floor((minv - origin) / cell)), 0), 255);
+		while (qmin > 0 && origin + float(qmin) * cell > minv) --qmin;
+		int qmax = std::min(std::max(int(std::ceil((maxv - origin) / cell)), qmin), 255);
+		while (qmax < 255 && origin + float(qmax) * cell < maxv) ++qmax;
+		o_min = uint8_t(qmin);
+		o_max = uint8_t(qmax);
+	}
+}
+
+template <size_t Width>
+WideBVH<Width>* WideBVH<Width>::collapse(const BVH &bvh)
+{
+	Timing timing;
+	timing.begin();
+
+	WideBVH *wide = new WideBVH();
+	if (!bvh.nodes.empty())
+	{
+		// A wide tree has at most as many nodes as the binary inner nodes
+		wide->nodes.reserve(bvh.nodes.size() / 2 + 1);
+		collapseNode(bvh, 0, 0, *wide);
+	}
+
+	timing.end();
+	logDebug("BVH", "BVH" + std::to_string(Width) + " collapse took " + std::to_string(timing.elapsedSeconds()) + 
+		" seconds for " + std::to_string(wide->nodes.size()) + " nodes.");
+
+	return wide;
+}
+
+template <size_t Width>
+CompressedWideBVH<Width>* CompressedWideBVH<Width>::compress(const WideBVH<Width> &wide)
+{
+	Timing timing;
+	timing.begin();
+
+	std::unique_ptr<CompressedWideBVH> compressed(new CompressedWideBVH());
+	compressed->nodes.resize(wide.nodes.size());
+	compressed->maxDepth = wide.maxDepth;
+
+	std::atomic<bool> largeLeaf(false);
+	ThreadPool::global().parallelFor(0, wide.nodes.size(), 0, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			const WideBVHNode<Width> &src = wide.nodes[i];
+			Node &node = compressed->nodes[i];
+			memset(&node, 0, sizeof(node));
+
+			Vector3 nodeMin(FLT_MAX);
+			Vector3 nodeMax(-FLT_MAX);
+			for (size_t s = 0; s < Width; ++s)
+			{
+				if (src.isEmpty(s)) continue;
+				Vector3 mins, maxs;
+				src.bounds(s, mins, maxs);
+				nodeMin = min(nodeMin, mins);
+				nodeMax = max(nodeMax, maxs);
+				node.slotMask |= uint8_t(1u << s);
+			}
+			if (!node.slotMask) continue;
+
+			const float origin[3] = { nodeMin.x, nodeMin.y, nodeMin.z };
+			const float maxs[3] = { nodeMax.x, nodeMax.y, nodeMax.z };
+			float cell[3];
+			for (size_t a = 0; a < 3; ++a)
+			{
+				const int exponent = cellExponent(origin[a], maxs[a]);
+				node.origin[a] = origin[a];
+				node.exponent[a] = uint8_t(exponent);
+				cell[a] = cellSize(exponent);
+			}
+
+			for (size_t s = 0; s < Width; ++s)
+			{
+				if (src.isEmpty(s)) continue;
+				quantizeRange(src.minX[s], src.maxX[s], origin[0], cell[0], node.qMinX[s], node.qMaxX[s]);
+				quantizeRange(src.minY[s], src.maxY[s], origin[1], cell[1], node.qMinY[s], node.qMaxY[s]);
+				quantizeRange(src.minZ[s], src.maxZ[s], origin[2], cell[2], node.qMinZ[s], node.qMaxZ[s]);
+				node.child[s] = src.child[s];
+				if (src.count[s] > 255) largeLeaf = true;
+				node.count[s] = uint8_t(std::min<uint32_t>(src.count[s], 255));
+			}
+		}
+	});
+	if (largeLeaf) return nullptr;
+
+	timing.end();
+	logDebug("BVH", "BVH" + std::to_string(Width) + " compression took " + std::to_string(timing.elapsedSeconds()) +
+		" seconds, " + std::to_string(compressed->nodes.size() * sizeof(Node) / 1024) + " KB of nodes.");
+
+	return compressed.release();
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
+template class CompressedWideBVH<4>;
+template class CompressedWideBVH<8>;
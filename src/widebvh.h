@@ -0,0 +1,152 @@
+/*
+Copyright 2018 Oscar Sebio Cajaraville
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include "alignedallocator.h"
+#include "bvh.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/// Node of a wide BVH, the bounds of its children are stored in SoA layout
+/// so a ray is tested against all of them with a few SIMD instructions.
+/// Empty slots have all their bounds at +infinity, which no ray can hit
+/// closer than FLT_MAX.
+template <size_t Width>
+struct WideBVHNode
+{
+	static const size_t k_width = Width;
+
+	float minX[Width];
+	float minY[Width];
+	float minZ[Width];
+	float maxX[Width];
+	float maxY[Width];
+	float maxZ[Width];
+	uint32_t child[Width]; // Leaf: first triangle in BVH::triangles. Inner node: node index
+	uint32_t count[Width]; // Leaf: number of triangles. Inner node or empty slot: zero
+
+	inline bool isLeaf(size_t slot) const { return count[slot] > 0; }
+	/// Empty slot, the root is never a child
+	inline bool isEmpty(size_t slot) const { return count[slot] == 0 && child[slot] == 0; }
+
+	inline void bounds(size_t slot, Vector3 &o_min, Vector3 &o_max) const
+	{
+		o_min = Vector3(minX[slot], minY[slot], minZ[slot]);
+		o_max = Vector3(maxX[slot], maxY[slot], maxZ[slot]);
+	}
+};
+
+static_assert(sizeof(WideBVHNode<4>) == 128, "WideBVHNode<4> must be two cache lines");
+static_assert(sizeof(WideBVHNode<8>) == 256, "WideBVHNode<8> must be four cache lines");
+
+/// BVH with up to Width children per node, collapsed from a binary BVH
+/// Leaves reference the same triangle ranges as the binary BVH leaves, so
+/// the triangle data in BVH leaf order is shared by both.
+template <size_t Width>
+class WideBVH
+{
+public:
+	typedef WideBVHNode<Width> Node;
+	typedef std::vector<Node, AlignedAllocator<Node, 64> > NodeArray;
+
+	NodeArray nodes; // Depth-first order, root first
+	size_t maxDepth = 0; // Levels of inner nodes, the root included
+
+	/// Stack entries needed to traverse the tree pushing the inner children of every visited node
+	inline size_t stackSize() const { return maxDepth * (Width - 1) + 1; }
+
+	/// Collapses a binary BVH opening the inner children with the largest
+	/// surface area until every node has Width children or only leaves
+	static WideBVH* collapse(const BVH &bvh);
+};
+
+typedef WideBVH<4> BVH4;
+typedef WideBVH<8> BVH8;
+
+/// Wide BVH node with the bounds of its children quantized to 8 bits
+/// Child bounds are stored on a grid over the node bounds, with a power of
+/// two cell size per axis, rounded outwards so they enclose the real bounds.
+/// Rays then visit the same nodes and a few more, and find the same hits.
+/// Nodes take half the memory of WideBVHNode: one cache line when 4-wide.
+template <size_t Width>
+struct CompressedWideBVHNode
+{
+	static const size_t k_width = Width;
+
+	float origin[3]; // Minimum corner of the node bounds
+	uint8_t exponent[3]; // Exponent of the cell size along every axis, biased as in floats
+	uint8_t slotMask; // Slots with a child
+	uint8_t qMinX[Width];
+	uint8_t qMinY[Width];
+	uint8_t qMinZ[Width];
+	uint8_t qMaxX[Width];
+	uint8_t qMaxY[Width];
+	uint8_t qMaxZ[Width];
+	uint32_t child[Width]; // Leaf: first triangle in BVH::triangles. Inner node: node index
+	uint8_t count[Width]; // Leaf: number of triangles. Inner node or empty slot: zero
+	uint8_t padding[(64 - (16 + 11 * Width) % 64) % 64];
+
+	inline bool isLeaf(size_t slot) const { return count[slot] > 0; }
+	inline bool isEmpty(size_t slot) const { return !(slotMask & (1u << slot)); }
+
+	/// Size of the grid cells along an axis
+	inline float cellSize(size_t axis) const
+	{
+		const uint32_t bits = uint32_t(exponent[axis]) << 23;
+		float size;
+		memcpy(&size, &bits, sizeof(size));
+		return size;
+	}
+
+	inline void bounds(size_t slot, Vector3 &o_min, Vector3 &o_max) const
+	{
+		const Vector3 cell(cellSize(0), cellSize(1), cellSize(2));
+		o_min = Vector3(origin[0] + float(qMinX[slot]) * cell.x, origin[1] + float(qMinY[slot]) * cell.y, origin[2] + float(qMinZ[slot]) * cell.z);
+		o_max = Vector3(origin[0] + float(qMaxX[slot]) * cell.x, origin[1] + float(qMaxY[slot]) * cell.y, origin[2] + float(qMaxZ[slot]) * cell.z);
+	}
+};
+
+static_assert(sizeof(CompressedWideBVHNode<4>) == 64, "CompressedWideBVHNode<4> must be one cache line");
+static_assert(sizeof(CompressedWideBVHNode<8>) == 128, "CompressedWideBVHNode<8> must be two cache lines");
+
+/// Wide BVH with compressed nodes, same tree as the WideBVH it is made from
+template <size_t Width>
+class CompressedWideBVH
+{
+public:
+	typedef CompressedWideBVHNode<Width> Node;
+	typedef std::vector<Node, AlignedAllocator<Node, 64> > NodeArray;
+
+	NodeArray nodes; // Same order as the WideBVH nodes
+	size_t maxDepth = 0;
+
+	inline size_t stackSize() const { return maxDepth * (Width - 1) + 1; }
+
+	/// Quantizes the child bounds of a wide BVH
+	/// @return nullptr if a leaf has more than 255 triangles
+	static CompressedWideBVH* compress(const WideBVH<Width> &wide);
+};
+
+typedef CompressedWideBVH<4> CompressedBVH4;
+typedef CompressedWideBVH<8> CompressedBVH8;